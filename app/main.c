@@ -3,7 +3,6 @@
 #include <string.h>
 #include <stdlib.h>
 #include <readline/readline.h>
-#include <readline/history.h>
 #include <signal.h>
 #include <pwd.h>
 #include <sys/stat.h>
@@ -11,90 +10,44 @@
 #include <fcntl.h>
 #include "../src/lab.h"
 
-static void explain_waitpid(int status)
+int main(int argc, char *argv[])
 {
-    if (!WIFEXITED(status))
-    {
-        fprintf(stderr, "Child exited with status %d\n", WEXITSTATUS(status));
-    }
-
-    if (WIFSIGNALED(status))
-    {
-        fprintf(stderr, "Child exited via signal %d\n", WTERMSIG(status));
-    }
+    parse_args(argc, argv);
+    struct shell sh;
+    sh_init(&sh);
 
-    if (WIFSTOPPED(status))
+    // scripts and piped input skip readline and history entirely
+    if (sh.script || !sh.shell_is_interactive)
     {
-        fprintf(stderr, "Child stopped by %d\n", WSTOPSIG(status));
+        int status = sh_run_script(&sh, sh.script);
+        sh_destroy(&sh);
+        return status;
     }
 
-    if (WIFCONTINUED(status))
+    // the event loop reads the terminal, plain readline is the fallback
+    if (sh.loop && loop_interact(&sh) == 0)
     {
-        fprintf(stderr, "Child was resumed by delivery of SIGCONT\n");
+        sh_destroy(&sh);
+        return 0;
     }
-}
 
-int main(int argc, char *argv[])
-{
-    parse_args(argc, argv);
-    struct shell sh;
-    sh_init(&sh);
     char *line = (char *)NULL;
-    while ((line = readline(sh.prompt)))
+    for (;;)
     {
-        // do nothing on blank lines don't save history or attempt to exec
-        line = trim_white(line);
-        if (!*line)
+        // report background jobs that finished while the last command ran
+        jobs_notify(&sh);
+        if (!(line = readline(prompt_render(&sh))))
         {
-            free(line);
-            continue;
+            break;
         }
-        add_history(line);
-        // check to see if we are launching a built in command
-        char **cmd = cmd_parse(line);
-        if (!do_builtin(&sh, cmd))
+        // do nothing on blank lines don't save history or attempt to exec
+        line = trim_white(line);
+        if (*line)
         {
-            pid_t pid = fork();
-            if (pid == 0)
-            {
-                /*This is the child process*/
-                pid_t child = getpid();
-                setpgid(child, child);
-                tcsetpgrp(sh.shell_terminal, child);
-                signal(SIGINT, SIG_DFL);
-                signal(SIGQUIT, SIG_DFL);
-                signal(SIGTSTP, SIG_DFL);
-                signal(SIGTTIN, SIG_DFL);
-                signal(SIGTTOU, SIG_DFL);
-                execvp(cmd[0], cmd);
-                exit(EXIT_FAILURE);
-            }
-            else if (pid < 0)
-            {
-                // If fork failed we are in trouble!
-                perror("fork return < 0 Process creation failed!");
-                abort();
-            }
-
-            /*
-            This is in the parent put the child process into its own
-            process group and give it control of the terminal
-            to avoid a race condition
-            */
-            // printf("shell:%d , child%d\n",sh.shell_pgid, pid);
-            setpgid(pid, pid);
-            tcsetpgrp(sh.shell_terminal, pid);
-            int status;
-            int rval = waitpid(pid, &status, 0);
-            if (rval == -1)
-            {
-                fprintf(stderr, "Wait pid failed with -1\n");
-		        explain_waitpid(status);
-            }
-            cmd_free(cmd);
-            // get control of the shell
-            tcsetpgrp(sh.shell_terminal, sh.shell_pgid);
+            hist_add(&sh.history, line);
+            sh_run_line(&sh, line);
         }
+        free(line);
     }
     sh_destroy(&sh);
 }
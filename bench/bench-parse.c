@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/lab.h"
+
+/*
+ * Microbenchmark for cmd_parse. The legacy parser below is the original
+ * strdup + strtok + strdup-per-token implementation, kept here so the
+ * single pass arena tokenizer can be compared against it on the same lines.
+ */
+
+static char **legacy_parse(const char *line) {
+    char *input = strdup(line);
+    if (!input) {
+        return NULL;
+    }
+
+    long arg_max = sysconf(_SC_ARG_MAX);
+    char **args = malloc(arg_max * sizeof(char *));
+    if (!args) {
+        free(input);
+        return NULL;
+    }
+
+    int position = 0;
+    char *token = strtok(input, " ");
+    while (token != NULL) {
+        args[position++] = strdup(token);
+        token = strtok(NULL, " ");
+    }
+    args[position] = NULL;
+    free(input);
+    return args;
+}
+
+static void legacy_free(char **args) {
+    for (int i = 0; args[i]; i++) {
+        free(args[i]);
+    }
+    free(args);
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// build a line of nargs tokens that look like typical flags and paths
+static char *make_line(int nargs) {
+    static const char *words[] = { "-l", "--verbose", "src/lab.c", "/usr/local/bin", "x" };
+    size_t cap = 16 + (size_t)nargs * 16;
+    char *line = malloc(cap);
+    if (!line) {
+        return NULL;
+    }
+
+    size_t len = (size_t)snprintf(line, cap, "cmd");
+    for (int i = 0; i < nargs; i++) {
+        len += (size_t)snprintf(line + len, cap - len, " %s", words[i % 5]);
+    }
+    return line;
+}
+
+int main(int argc, char **argv) {
+    int iters = argc > 1 ? atoi(argv[1]) : 20000;
+    static const int sizes[] = { 4, 64, 1024, 16384 };
+
+    printf("%-8s %-8s %14s %14s %8s\n", "args", "iters", "legacy ns/op", "arena ns/op", "speedup");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        char *line = make_line(sizes[s]);
+        if (!line) {
+            return 1;
+        }
+
+        // keep the total work roughly constant as the lines get longer
+        int n = iters / (1 + sizes[s] / 64);
+        if (n < 10) n = 10;
+
+        double t0 = now_ns();
+        for (int i = 0; i < n; i++) {
+            legacy_free(legacy_parse(line));
+        }
+        double legacy = (now_ns() - t0) / n;
+
+        t0 = now_ns();
+        for (int i = 0; i < n; i++) {
+            cmd_free(cmd_parse(line));
+        }
+        double arena = (now_ns() - t0) / n;
+
+        printf("%-8d %-8d %14.0f %14.0f %7.1fx\n", sizes[s], n, legacy, arena, legacy / arena);
+        free(line);
+    }
+    return 0;
+}
@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../src/lab.h"
+
+/*
+ * Parser regression check behind make check-perf. Every line of a corpus
+ * of captured command lines, plus a few adversarial lines, huge ones,
+ * ones with a token count close to ARG_MAX and long runs of whitespace,
+ * is run through cmd_parse, pipeline_parse and trim_white. Results are one
+ * JSON object per line like bench-shell:
+ *
+ *   {"bench":"corpus_pipeline_parse","mb_per_s":412.3,"allocs_per_line":1.00}
+ *
+ * Two things fail the run. Allocations are counted by wrapping malloc, so
+ * they are exact and each parser has a fixed budget per line. Throughput
+ * is compared with a baseline recorded on the same machine, the first run
+ * writes it, and a run more than the tolerance slower fails.
+ *
+ * usage: bench-regress [-b baseline] [-t tolerance_pct] [-u] corpus
+ */
+
+#define ROUNDS 7               // the fastest round is what counts
+#define MIN_ROUND_S 0.1        // each round parses the corpus for at least this long
+
+// the parsers' allocation budgets per line of the corpus
+#define ALLOCS_CMD_PARSE 1.0
+#define ALLOCS_PIPELINE_PARSE 1.0
+#define ALLOCS_TRIM_WHITE 0.0
+
+#ifdef __GLIBC__
+// every allocation in the process goes through here, only the ones made
+// while counting is set are counted
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static int counting = 0;
+static unsigned long allocs = 0;
+
+void *malloc(size_t size) {
+    allocs += counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+    allocs += counting;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    allocs += counting;
+    return __libc_realloc(ptr, size);
+}
+#define HAVE_ALLOC_COUNT 1
+#endif
+
+enum entry { CMD_PARSE, PIPELINE_PARSE, TRIM_WHITE };
+
+static const char *entry_names[] = { "cmd_parse", "pipeline_parse", "trim_white" };
+
+// lines are kept back to back, each NUL terminated
+struct corpus {
+    char *lines;
+    size_t bytes;
+    size_t count;
+    char *scratch;             // a copy of the longest line for trim_white
+};
+
+struct baseline {
+    char name[64];
+    double mb_per_s;
+};
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int corpus_add(struct corpus *c, const char *line, size_t len, size_t *cap) {
+    while (c->bytes + len + 1 > *cap) {
+        *cap = *cap ? *cap * 2 : 4096;
+        char *lines = realloc(c->lines, *cap);
+        if (!lines) {
+            return -1;
+        }
+        c->lines = lines;
+    }
+    memcpy(c->lines + c->bytes, line, len);
+    c->lines[c->bytes + len] = '\0';
+    c->bytes += len + 1;
+    c->count++;
+    return 0;
+}
+
+static int corpus_load(struct corpus *c, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    char *line = NULL;
+    size_t n = 0, cap = 0;
+    ssize_t len;
+    int rval = 0;
+    while (rval == 0 && (len = getline(&line, &n, f)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n') {
+            len--;
+        }
+        if (len > 0) {
+            rval = corpus_add(c, line, (size_t)len, &cap);
+        }
+    }
+    free(line);
+    fclose(f);
+    return c->count ? rval : -1;
+}
+
+// one line of count copies of word joined with sep
+static int corpus_repeat(struct corpus *c, const char *word, const char *sep, size_t count) {
+    size_t wlen = strlen(word), slen = strlen(sep);
+    size_t len = count * (wlen + slen);
+    char *line = malloc(len + 1);
+    if (!line) {
+        return -1;
+    }
+    char *p = line;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(p, word, wlen);
+        memcpy(p + wlen, sep, slen);
+        p += wlen + slen;
+    }
+    size_t cap = c->bytes;
+    int rval = corpus_add(c, line, len, &cap);
+    free(line);
+    return rval;
+}
+
+// parse every line of c once, returning how many words were found so the
+// work can't be optimized away
+static size_t run_once(struct corpus *c, enum entry e) {
+    size_t words = 0;
+    for (char *line = c->lines; line < c->lines + c->bytes; line += strlen(line) + 1) {
+        if (e == CMD_PARSE) {
+            char **argv = cmd_parse(line);
+            for (char **w = argv; w && *w; w++) {
+                words++;
+            }
+            cmd_free(argv);
+        } else if (e == PIPELINE_PARSE) {
+            struct pipeline *pl = pipeline_parse(line);
+            words += pl ? pl->nstages : 0;
+            pipeline_free(pl);
+        } else {
+            size_t len = strlen(line);
+            memcpy(c->scratch, line, len + 1);
+            words += strlen(trim_white(c->scratch));
+        }
+    }
+    return words;
+}
+
+// the fastest of ROUNDS rounds in MB/s and the allocations per line
+static double measure(struct corpus *c, enum entry e, double *allocs_per_line) {
+#ifdef HAVE_ALLOC_COUNT
+    allocs = 0;
+    counting = 1;
+    run_once(c, e);
+    counting = 0;
+    *allocs_per_line = (double)allocs / c->count;
+#else
+    *allocs_per_line = 0;
+#endif
+
+    double best = 0;
+    volatile size_t sink = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        size_t reps = 0;
+        double t0 = now_s(), t;
+        do {
+            sink += run_once(c, e);
+            reps++;
+        } while ((t = now_s() - t0) < MIN_ROUND_S);
+        double rate = c->bytes * reps / t / 1e6;
+        best = rate > best ? rate : best;
+    }
+    return best;
+}
+
+static size_t baseline_load(const char *path, struct baseline *out, size_t max) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        return 0;
+    }
+    char line[256];
+    size_t n = 0;
+    while (n < max && fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "{\"bench\":\"%63[^\"]\",\"mb_per_s\":%lf", out[n].name, &out[n].mb_per_s) == 2) {
+            n++;
+        }
+    }
+    fclose(f);
+    return n;
+}
+
+static int usage(void) {
+    fprintf(stderr, "usage: bench-regress [-b baseline] [-t tolerance_pct] [-u] corpus\n");
+    return 2;
+}
+
+int main(int argc, char **argv) {
+    const char *baseline_path = "bench-baseline.json";
+    double tolerance = 25;
+    int update = 0;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-u") == 0) {
+            update = 1;
+        } else {
+            return usage();
+        }
+    }
+    if (i + 1 != argc) {
+        return usage();
+    }
+
+    // the captured commands, then one line each that is hard in its own way
+    long arg_max = sysconf(_SC_ARG_MAX);
+    struct corpus corpora[4] = { 0 };
+    const char *names[4] = { "corpus", "huge_line", "near_arg_max", "whitespace" };
+    if (corpus_load(&corpora[0], argv[i]) < 0 ||
+        corpus_repeat(&corpora[1], "--flag=value", " ", (1 << 20) / 13) < 0 ||
+        corpus_repeat(&corpora[2], "a", " ", (size_t)arg_max - 2) < 0) {
+        fprintf(stderr, "bench-regress: could not build the corpora\n");
+        return 1;
+    }
+    // a word between a MiB of blanks on either side
+    size_t pad = 1 << 20;
+    char *blank = malloc(2 * pad + 5);
+    if (!blank) {
+        return 1;
+    }
+    for (size_t j = 0; j < 2 * pad + 4; j++) {
+        blank[j] = " \t\n"[j % 3];
+    }
+    memcpy(blank + pad, "echo", 4);
+    size_t cap = 0;
+    int rval = corpus_add(&corpora[3], blank, 2 * pad + 4, &cap);
+    free(blank);
+    if (rval < 0) {
+        return 1;
+    }
+
+    struct baseline base[32];
+    size_t nbase = update ? 0 : baseline_load(baseline_path, base, 32);
+    FILE *record = nbase ? NULL : fopen(baseline_path, "w");
+    if (!nbase && !record) {
+        perror(baseline_path);
+    }
+
+    static const double budgets[] = { ALLOCS_CMD_PARSE, ALLOCS_PIPELINE_PARSE, ALLOCS_TRIM_WHITE };
+    int failures = 0;
+    for (size_t c = 0; c < 4; c++) {
+        size_t longest = 0;
+        for (char *line = corpora[c].lines; line < corpora[c].lines + corpora[c].bytes; line += strlen(line) + 1) {
+            size_t len = strlen(line);
+            longest = len > longest ? len : longest;
+        }
+        corpora[c].scratch = malloc(longest + 1);
+        if (!corpora[c].scratch) {
+            return 1;
+        }
+
+        for (enum entry e = CMD_PARSE; e <= TRIM_WHITE; e++) {
+            char name[64];
+            snprintf(name, sizeof(name), "%s_%s", names[c], entry_names[e]);
+            double allocs_per_line;
+            double mb_per_s = measure(&corpora[c], e, &allocs_per_line);
+            char result[256];
+            snprintf(result, sizeof(result), "{\"bench\":\"%s\",\"mb_per_s\":%.1f,\"allocs_per_line\":%.2f,\"lines\":%zu}\n",
+                     name, mb_per_s, allocs_per_line, corpora[c].count);
+            fputs(result, stdout);
+            fflush(stdout);
+            if (record) {
+                fputs(result, record);
+            }
+
+            if (allocs_per_line > budgets[e] + 1e-9) {
+                fprintf(stderr, "bench-regress: %s makes %.2f allocations per line, the budget is %.2f\n", name,
+                        allocs_per_line, budgets[e]);
+                failures++;
+            }
+            for (size_t b = 0; b < nbase; b++) {
+                if (strcmp(base[b].name, name) != 0) {
+                    continue;
+                }
+                // a slow run is measured again before it counts, so another
+                // process taking the CPU for a moment doesn't fail the check
+                double floor = base[b].mb_per_s * (1 - tolerance / 100);
+                if (mb_per_s < floor) {
+                    double again = measure(&corpora[c], e, &allocs_per_line);
+                    mb_per_s = again > mb_per_s ? again : mb_per_s;
+                }
+                if (mb_per_s < floor) {
+                    fprintf(stderr, "bench-regress: %s runs at %.1f MB/s, %.0f%% below the baseline of %.1f\n", name,
+                            mb_per_s, 100 * (1 - mb_per_s / base[b].mb_per_s), base[b].mb_per_s);
+                    failures++;
+                }
+            }
+        }
+        free(corpora[c].scratch);
+        free(corpora[c].lines);
+    }
+    if (record) {
+        fclose(record);
+        fprintf(stderr, "bench-regress: baseline written to %s\n", baseline_path);
+    }
+    return failures ? 1 : 0;
+}
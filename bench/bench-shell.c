@@ -0,0 +1,294 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "../src/lab.h"
+
+/*
+ * Startup and launch latency harness behind make bench. Every result is
+ * one JSON object per line on stdout so runs can be diffed or loaded into
+ * a spreadsheet to track regressions:
+ *
+ *   {"bench":"startup_to_prompt","unit":"us","runs":20,"min":812.3,"median":901.4}
+ *
+ * usage: bench-shell [-n runs] [-m ballast_mb] path/to/myprogram
+ */
+
+#define PROMPT_MARK "bench-ready>"
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double min_of(const double *samples, int n) {
+    double min = samples[0];
+    for (int i = 1; i < n; i++) {
+        if (samples[i] < min) min = samples[i];
+    }
+    return min;
+}
+
+// sort the samples and print the min and median as one result line
+static void report(const char *bench, const char *extra, double *samples, int n) {
+    qsort(samples, n, sizeof(double), cmp_double);
+    printf("{\"bench\":\"%s\"%s%s,\"unit\":\"us\",\"runs\":%d,\"min\":%.3f,\"median\":%.3f}\n",
+           bench, extra ? "," : "", extra ? extra : "", n, samples[0], samples[n / 2]);
+    fflush(stdout);
+}
+
+// start the shell on a fresh pty as the foreground group of its own session
+static pid_t start_on_pty(const char *shell, int *master_out) {
+    int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0 || grantpt(master) < 0 || unlockpt(master) < 0) {
+        perror("posix_openpt");
+        return -1;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the session leader can't change its process group so the shell is a grandchild
+        setsid();
+        int slave = open(ptsname(master), O_RDWR);
+        if (slave < 0) {
+            _exit(1);
+        }
+        pid_t child = fork();
+        if (child == 0) {
+            signal(SIGTTOU, SIG_IGN);
+            setpgid(0, 0);
+            tcsetpgrp(slave, getpid());
+            signal(SIGTTOU, SIG_DFL);
+            dup2(slave, 0);
+            dup2(slave, 1);
+            dup2(slave, 2);
+            setenv("MY_PROMPT", PROMPT_MARK, 1);
+            setenv("MY_HISTFILE", "", 1);
+            execl(shell, shell, (char *)NULL);
+            _exit(127);
+        }
+        int status = 0;
+        waitpid(child, &status, 0);
+        _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+    }
+    *master_out = master;
+    return pid;
+}
+
+// wait until the prompt shows up on the pty, returns false on timeout or EOF
+static bool wait_for_prompt(int master) {
+    char buf[4096];
+    size_t have = 0;
+    for (;;) {
+        struct pollfd pfd = { .fd = master, .events = POLLIN };
+        if (poll(&pfd, 1, 5000) <= 0) {
+            return false;
+        }
+        ssize_t n = read(master, buf + have, sizeof(buf) - have - 1);
+        if (n <= 0) {
+            return false;
+        }
+        have += (size_t)n;
+        buf[have] = '\0';
+        if (strstr(buf, PROMPT_MARK)) {
+            return true;
+        }
+        if (have > sizeof(buf) / 2) {
+            // keep the tail in case the mark straddles two reads
+            memmove(buf, buf + have - 64, 64);
+            have = 64;
+        }
+    }
+}
+
+static void bench_startup(const char *shell, int runs) {
+    double *samples = calloc(runs, sizeof(double));
+    int ok = 0;
+    for (int i = 0; i < runs; i++) {
+        int master;
+        double t0 = now_us();
+        pid_t pid = start_on_pty(shell, &master);
+        if (pid < 0) {
+            break;
+        }
+        if (wait_for_prompt(master)) {
+            samples[ok++] = now_us() - t0;
+        }
+        if (write(master, "exit\n", 5) != 5) {
+            kill(pid, SIGKILL);
+        }
+        waitpid(pid, NULL, 0);
+        close(master);
+    }
+    if (ok > 0) {
+        report("startup_to_prompt", NULL, samples, ok);
+    } else {
+        fprintf(stderr, "bench-shell: %s never showed a prompt\n", shell);
+    }
+    free(samples);
+}
+
+// fork/exec/wait of /bin/true through sh_spawn with each backend
+static void bench_spawn(int runs, long ballast_mb) {
+    static const char *names[] = { "spawn", "fork" };
+    char *argv[] = { "/bin/true", NULL };
+    double *samples = calloc(runs, sizeof(double));
+
+    for (size_t b = 0; b < 2; b++) {
+        struct shell sh;
+        memset(&sh, 0, sizeof(sh));
+        spawn_backend_parse(names[b], &sh.backend);
+
+        int ok = 0;
+        for (int i = 0; i < runs; i++) {
+            double t0 = now_us();
+            pid_t pid = sh_spawn(&sh, argv, NULL);
+            if (pid > 0 && waitpid(pid, NULL, 0) == pid) {
+                samples[ok++] = now_us() - t0;
+            }
+        }
+        char extra[64];
+        snprintf(extra, sizeof(extra), "\"backend\":\"%s\",\"ballast_mb\":%ld", names[b], ballast_mb);
+        if (ok > 0) {
+            report("spawn_true_roundtrip", extra, samples, ok);
+        }
+        path_cache_destroy(&sh.path_cache);
+    }
+    free(samples);
+}
+
+// end to end cost per line of the shell running a script of /bin/true
+static void bench_script(const char *shell, int runs) {
+    char path[] = "/tmp/bench-shell-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        perror("mkstemp");
+        return;
+    }
+    FILE *out = fdopen(fd, "w");
+    for (int i = 0; i < runs; i++) {
+        fputs("/bin/true\n", out);
+    }
+    fclose(out);
+
+    double samples[5];
+    for (int i = 0; i < 5; i++) {
+        double t0 = now_us();
+        pid_t pid = fork();
+        if (pid == 0) {
+            execl(shell, shell, "-f", path, (char *)NULL);
+            _exit(127);
+        }
+        waitpid(pid, NULL, 0);
+        samples[i] = (now_us() - t0) / runs;
+    }
+    char extra[64];
+    snprintf(extra, sizeof(extra), "\"lines\":%d", runs);
+    report("script_true_per_line", extra, samples, 5);
+    unlink(path);
+}
+
+static char *make_line(size_t len, bool padded) {
+    char *line = malloc(len + 1);
+    for (size_t i = 0; i < len; i++) {
+        line[i] = (i % 8 == 7) ? ' ' : 'a' + (char)(i % 26);
+    }
+    if (padded && len >= 16) {
+        memset(line, ' ', 4);
+        memset(line + len - 4, '\t', 4);
+    }
+    line[len] = '\0';
+    return line;
+}
+
+// cmd_parse and trim_white throughput, reported per call and per byte
+static void bench_parse(void) {
+    static const size_t lens[] = { 16, 256, 4096, 65536 };
+
+    for (size_t l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+        size_t len = lens[l];
+        int iters = (int)(4000000 / len) + 10;
+        double samples[5];
+        char extra[96];
+
+        char *line = make_line(len, false);
+        for (int r = 0; r < 5; r++) {
+            double t0 = now_us();
+            for (int i = 0; i < iters; i++) {
+                cmd_free(cmd_parse(line));
+            }
+            samples[r] = (now_us() - t0) / iters;
+        }
+        snprintf(extra, sizeof(extra), "\"line_len\":%zu,\"mb_per_s\":%.1f", len, len / min_of(samples, 5));
+        report("cmd_parse", extra, samples, 5);
+        free(line);
+
+        // trim_white works in place so every call gets a fresh copy
+        char *padded = make_line(len, true);
+        char *work = malloc(len + 1);
+        for (int r = 0; r < 5; r++) {
+            double t0 = now_us();
+            for (int i = 0; i < iters; i++) {
+                memcpy(work, padded, len + 1);
+                trim_white(work);
+            }
+            samples[r] = (now_us() - t0) / iters;
+        }
+        snprintf(extra, sizeof(extra), "\"line_len\":%zu,\"mb_per_s\":%.1f", len, len / min_of(samples, 5));
+        report("trim_white", extra, samples, 5);
+        free(padded);
+        free(work);
+    }
+}
+
+int main(int argc, char **argv) {
+    int runs = 20;
+    long ballast_mb = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:m:")) != -1) {
+        switch (opt) {
+            case 'n':
+                runs = atoi(optarg);
+                break;
+            case 'm':
+                ballast_mb = atol(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: bench-shell [-n runs] [-m ballast_mb] myprogram\n");
+                return 1;
+        }
+    }
+    if (optind >= argc || runs < 1) {
+        fprintf(stderr, "usage: bench-shell [-n runs] [-m ballast_mb] myprogram\n");
+        return 1;
+    }
+    const char *shell = argv[optind];
+
+    bench_startup(shell, runs);
+    bench_script(shell, runs * 50);
+    bench_parse();
+
+    // a large resident set shows what fork costs a shell embedded in a big parent
+    if (ballast_mb > 0) {
+        size_t size = (size_t)ballast_mb << 20;
+        char *ballast = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ballast != MAP_FAILED) {
+            memset(ballast, 1, size);
+        }
+    }
+    bench_spawn(runs * 50, ballast_mb);
+    return 0;
+}
@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stddef.h>
+#include "../src/lab.h"
+
+/*
+ * Fuzz target for the parser entry points: cmd_parse, pipeline_parse and
+ * trim_white. Built by make fuzz with clang -fsanitize=fuzzer it is a
+ * libFuzzer target. Built without FUZZ_LIBFUZZER, by make fuzz-replay or
+ * with afl-cc, main runs each file named on the command line once, or
+ * stdin when there are none, which is what AFL and replaying a corpus
+ * under ASAN need.
+ *
+ * Besides the sanitizers every result is checked against what the parser
+ * promises, and the two parsers against each other on lines they should
+ * agree on, so a wrong answer aborts like a crash does.
+ */
+
+#define CHECK(cond)                                                          \
+    do {                                                                     \
+        if (!(cond)) {                                                       \
+            fprintf(stderr, "fuzz-parse: %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            abort();                                                         \
+        }                                                                    \
+    } while (0)
+
+static struct cmd_arena *arena_of(char **argv) {
+    return (struct cmd_arena *)((char *)argv - offsetof(struct cmd_arena, argv));
+}
+
+// every word is a NUL terminated string inside the arena's buffer
+static void check_words(const struct cmd_arena *arena, char **argv, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        CHECK(argv[i]);
+        CHECK(argv[i] >= arena->buf && argv[i] < arena->buf + arena->size);
+        CHECK(argv[i] + strlen(argv[i]) < arena->buf + arena->size);
+    }
+    CHECK(!argv[n]);
+}
+
+static void check_cmd(char **argv) {
+    struct cmd_arena *arena = arena_of(argv);
+    CHECK(arena->argc > 0 && arena->argc < arena->cap);
+    check_words(arena, argv, arena->argc);
+}
+
+static void check_pipeline(const struct pipeline *pl) {
+    CHECK(pl->nstages > 0);
+    for (size_t i = 0; i < pl->nstages; i++) {
+        const struct stage *st = &pl->stages[i];
+        size_t n = 0;
+        while (st->argv[n]) {
+            n++;
+        }
+        CHECK(n > 0);
+        check_words(pl->arena, st->argv, n);
+        for (size_t r = 0; r < st->nredirs; r++) {
+            const struct redirect *rd = &st->redirs[r];
+            CHECK(rd->fd >= 0 && rd->fd <= 9);
+            if (rd->kind == REDIR_DUP) {
+                CHECK(rd->from >= 0 && rd->from <= 9);
+            } else {
+                CHECK(rd->path);
+            }
+        }
+    }
+}
+
+// without operators or a time prefix a line is one stage with the same
+// words cmd_parse finds
+static void check_agree(const char *line, char **argv, const struct pipeline *pl) {
+    if (strpbrk(line, "|&<>") || !argv || !pl || strcmp(argv[0], "time") == 0) {
+        return;
+    }
+    CHECK(pl->nstages == 1 && pl->stages[0].nredirs == 0);
+    size_t i = 0;
+    for (; argv[i]; i++) {
+        CHECK(pl->stages[0].argv[i] && strcmp(argv[i], pl->stages[0].argv[i]) == 0);
+    }
+    CHECK(!pl->stages[0].argv[i]);
+}
+
+static void check_trim(const char *line) {
+    char *copy = strdup(line);
+    if (!copy) {
+        return;
+    }
+    const char *start = line;
+    while (isspace((unsigned char)*start)) {
+        start++;
+    }
+    size_t len = strlen(start);
+    while (len > 0 && isspace((unsigned char)start[len - 1])) {
+        len--;
+    }
+    CHECK(trim_white(copy) == copy);
+    CHECK(strlen(copy) == len && memcmp(copy, start, len) == 0);
+    free(copy);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    // the parsers take C strings, so the input ends at its first NUL
+    char *line = malloc(size + 1);
+    if (!line) {
+        return 0;
+    }
+    memcpy(line, data, size);
+    line[size] = '\0';
+
+    char **argv = cmd_parse(line);
+    if (argv) {
+        check_cmd(argv);
+    }
+    struct pipeline *pl = pipeline_parse(line);
+    if (pl) {
+        check_pipeline(pl);
+    }
+    check_agree(line, argv, pl);
+    cmd_free(argv);
+    pipeline_free(pl);
+    check_trim(line);
+
+    free(line);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+static int run_file(FILE *f) {
+    size_t cap = 4096, len = 0;
+    uint8_t *buf = malloc(cap);
+    size_t n;
+    while (buf && (n = fread(buf + len, 1, cap - len, f)) > 0) {
+        len += n;
+        if (len == cap) {
+            uint8_t *bigger = realloc(buf, cap *= 2);
+            if (!bigger) {
+                free(buf);
+                return -1;
+            }
+            buf = bigger;
+        }
+    }
+    if (!buf) {
+        return -1;
+    }
+    LLVMFuzzerTestOneInput(buf, len);
+    free(buf);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        return run_file(stdin) < 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        int rval = f ? run_file(f) : -1;
+        if (f) {
+            fclose(f);
+        }
+        if (rval < 0) {
+            perror(argv[i]);
+            return 1;
+        }
+    }
+    printf("fuzz-parse: %d inputs ok\n", argc - 1);
+    return 0;
+}
+#endif
@@ -0,0 +1,222 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lab.h"
+#include "builtins-hash.h"
+
+static int builtin_exit(struct shell *sh, char **argv) {
+    int status = argv[1] ? atoi(argv[1]) & 0xff : 0;
+
+    // in a forked stage or $(...) only that child goes, like a subshell, and
+    // what sh_destroy frees and joins belongs to the shell
+    if (sh->forked) {
+        fflush(stdout);
+        _exit(status);
+    }
+    printf("Exiting shell normally.\n");
+
+    //free resources then exit
+    sh_destroy(sh);
+    exit(status);    // dont need to return anything since program terminated
+}
+
+static int builtin_cd(struct shell *sh, char **argv) {
+    if (dirs_cd(sh, argv[1]) != 0) {
+        perror("cd");
+        return 1;
+    }
+    return 0;
+}
+
+static int builtin_pushd(struct shell *sh, char **argv) {
+    if (dirs_push(sh, argv[1]) != 0) {
+        return 1;
+    }
+    dirs_print(sh, false);
+    return 0;
+}
+
+static int builtin_popd(struct shell *sh, char **argv) {
+    UNUSED(argv);
+    if (dirs_pop(sh) != 0) {
+        return 1;
+    }
+    dirs_print(sh, false);
+    return 0;
+}
+
+static int builtin_dirs(struct shell *sh, char **argv) {
+    if (argv[1] && strcmp(argv[1], "-c") == 0) {
+        dirs_clear(sh);
+        return 0;
+    }
+    if (argv[1] && strcmp(argv[1], "-l") != 0) {
+        fprintf(stderr, "dirs: usage: dirs [-c | -l]\n");
+        return 2;
+    }
+    dirs_print(sh, argv[1] != NULL);
+    return 0;
+}
+
+static int builtin_history(struct shell *sh, char **argv) {
+    UNUSED(argv);
+    hist_print(&sh->history);
+    return 0;
+}
+
+static int builtin_parallel(struct shell *sh, char **argv) {
+    int failures = parallel_run(sh, argv);
+    if (failures < 0) {
+        return 2;   // usage error
+    }
+    if (failures >= 128) {
+        return failures;    // the pool was killed or stopped
+    }
+    return failures > 0 ? 1 : 0;
+}
+
+static int builtin_on(struct shell *sh, char **argv) {
+    return peer_run(sh, argv);
+}
+
+static int builtin_memo(struct shell *sh, char **argv) {
+    return memo_run(sh, argv);
+}
+
+static int builtin_limit(struct shell *sh, char **argv) {
+    return limit_run(sh, argv);
+}
+
+static int builtin_jobs(struct shell *sh, char **argv) {
+    // jobs -o N shows what a background job printed
+    if (argv[1] && strcmp(argv[1], "-o") == 0) {
+        struct job *job = job_find(sh, argv[2]);
+        if (!job) {
+            fprintf(stderr, "jobs: %s: no such job\n", argv[2] ? argv[2] : "current");
+            return 1;
+        }
+        job_output_print(sh, job);
+        return 0;
+    }
+    jobs_print(sh);
+    return 0;
+}
+
+static struct job *find_job_or_complain(struct shell *sh, char **argv) {
+    struct job *job = job_find(sh, argv[1]);
+    if (!job) {
+        fprintf(stderr, "%s: %s: no such job\n", argv[0], argv[1] ? argv[1] : "current");
+    }
+    return job;
+}
+
+static int builtin_fg(struct shell *sh, char **argv) {
+    struct job *job = find_job_or_complain(sh, argv);
+    return job ? job_foreground(sh, job, true) : 1;
+}
+
+static int builtin_bg(struct shell *sh, char **argv) {
+    struct job *job = find_job_or_complain(sh, argv);
+    if (!job) {
+        return 1;
+    }
+    job_background(sh, job);
+    return 0;
+}
+
+static int builtin_hash_cmd(struct shell *sh, char **argv) {
+    if (argv[1] && strcmp(argv[1], "-r") == 0) {
+        path_cache_clear(&sh->path_cache);      // forget every remembered command
+        return 0;
+    }
+
+    if (argv[1]) {
+        // resolve the named commands now so later runs hit the cache
+        int status = 0;
+        for (int i = 1; argv[i]; i++) {
+            if (!path_lookup(&sh->path_cache, argv[i])) {
+                fprintf(stderr, "hash: %s: not found\n", argv[i]);
+                status = 1;
+            }
+        }
+        return status;
+    }
+
+    if (sh->path_cache.count == 0) {
+        printf("hash: hash table empty\n");
+    }
+    for (size_t i = 0; i < sh->path_cache.cap; i++) {
+        if (sh->path_cache.slots[i].name) {
+            printf("%s\t%s\n", sh->path_cache.slots[i].name, sh->path_cache.slots[i].path);
+        }
+    }
+    return 0;
+}
+
+// in the same order as the names the generator hashed
+static const struct builtin builtins[] = {
+#define BUILTIN(name, fn, flags) { #name, sizeof(#name) - 1, fn, flags },
+#include "builtins.def"
+#undef BUILTIN
+};
+
+/**
+* @brief The table of built in commands, for completion.
+*
+* @param count Set to the number of entries
+* @return The first entry
+*/
+const struct builtin *builtin_list(size_t *count) {
+    *count = sizeof(builtins) / sizeof(builtins[0]);
+    return builtins;
+}
+
+/**
+* @brief Find a built in command by name. This is a single probe of a
+* perfect hash table so names that are not built in, which is most of
+* them, are turned away after one hash and at most one compare.
+*
+* @param name The command name
+* @return The table entry or NULL if name is not a built in command
+*/
+const struct builtin *builtin_find(const char *name) {
+    // anything longer than the longest built in can't be one
+    size_t len = strnlen(name, BUILTIN_MAXLEN + 1);
+    if (len == 0 || len > BUILTIN_MAXLEN) {
+        return NULL;
+    }
+
+    unsigned i = builtin_slots[builtin_hash(name, len, BUILTIN_SEED) & (BUILTIN_SLOTS - 1)];
+    if (i == 0) {
+        return NULL;
+    }
+    const struct builtin *b = &builtins[i - 1];
+    return b->len == len && memcmp(b->name, name, len) == 0 ? b : NULL;
+}
+
+/**
+* @brief Takes an argument list and checks if the first argument is a
+* built in command such as exit, cd, pushd, hash, jobs, parallel, etc. If the command is a
+* built in command this function will handle the command, store its exit
+* status in sh->last_status and then return true. If the first argument
+* is NOT a built in command this function will return false.
+*
+* @param sh The shell
+* @param argv The command to check
+* @return True if the command was a built in command
+*/
+bool do_builtin(struct shell *sh, char **argv) {
+
+    if (!argv || !argv[0]) {
+        cmd_free(argv);
+        return false;
+    }
+
+    const struct builtin *b = builtin_find(argv[0]);
+    if (!b) {
+        return false;  // Always return false if not built in
+    }
+    sh->last_status = b->fn(sh, argv);
+    return true;
+}
@@ -0,0 +1,411 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <readline/readline.h>
+#include "lab.h"
+
+#define INOTIFY_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | \
+                      IN_MOVE_SELF | IN_ONLYDIR)
+
+// readline's completion hook takes no argument so the shell it completes for lives here
+static struct shell *complete_shell = NULL;
+
+// the matches being gathered for one word
+struct match_list {
+    char **items;
+    size_t count;
+    size_t cap;
+    const char *lead;     // typed before the part being matched, kept in every match
+    size_t lead_len;
+    bool failed;
+};
+
+static void match_add(struct match_list *m, const char *name) {
+    if (m->failed) {
+        return;
+    }
+    if (m->count + 2 > m->cap) {
+        size_t cap = m->cap ? m->cap * 2 : 16;
+        char **items = realloc(m->items, cap * sizeof(*items));
+        if (!items) {
+            m->failed = true;
+            return;
+        }
+        m->items = items;
+        m->cap = cap;
+    }
+    char *item;
+    if (asprintf(&item, "%.*s%s", (int)m->lead_len, m->lead, name) < 0) {
+        m->failed = true;
+        return;
+    }
+    m->items[m->count++] = item;
+    m->items[m->count] = NULL;
+}
+
+static void match_free(struct match_list *m) {
+    for (size_t i = 0; i < m->count; i++) {
+        free(m->items[i]);
+    }
+    free(m->items);
+    m->items = NULL;
+    m->count = 0;
+}
+
+// the child of node for c, added in character order if create is set
+static uint32_t trie_child(struct cmd_index *ix, uint32_t node, char c, bool create) {
+    uint32_t *link = &ix->nodes[node].child;
+    while (*link && (unsigned char)ix->nodes[*link].c < (unsigned char)c) {
+        link = &ix->nodes[*link].sibling;
+    }
+    if (*link && ix->nodes[*link].c == c) {
+        return *link;
+    }
+    if (!create) {
+        return 0;
+    }
+    if (ix->count == ix->cap) {
+        // link points into nodes, so remember where it was
+        size_t at = (size_t)((char *)link - (char *)ix->nodes);
+        size_t cap = ix->cap ? ix->cap * 2 : 1024;
+        struct trie_node *nodes = realloc(ix->nodes, cap * sizeof(*nodes));
+        if (!nodes) {
+            return 0;
+        }
+        ix->nodes = nodes;
+        ix->cap = cap;
+        link = (uint32_t *)((char *)nodes + at);
+    }
+    uint32_t n = (uint32_t)ix->count++;
+    ix->nodes[n] = (struct trie_node){ .child = 0, .sibling = *link, .dirs = 0, .c = c };
+    *link = n;
+    return n;
+}
+
+// the node where name ends, 0 if it isn't in the trie and create is not set
+static uint32_t trie_find(struct cmd_index *ix, const char *name, bool create) {
+    uint32_t node = 0;
+    for (const char *p = name; *p; p++) {
+        node = trie_child(ix, node, *p, create);
+        if (!node) {
+            return 0;
+        }
+    }
+    return node;
+}
+
+static void trie_set(struct cmd_index *ix, const char *name, uint64_t bit, bool present) {
+    uint32_t node = trie_find(ix, name, present);
+    if (!node) {
+        return;
+    }
+    if (present) {
+        ix->nodes[node].dirs |= bit;
+    } else {
+        ix->nodes[node].dirs &= ~bit;
+    }
+}
+
+// every name below node, in order, buf holds the len characters on the way down
+static void trie_walk(const struct cmd_index *ix, uint32_t node, char *buf, size_t len,
+                      struct match_list *m) {
+    if (ix->nodes[node].dirs) {
+        buf[len] = '\0';
+        match_add(m, buf);
+    }
+    if (len == NAME_MAX) {
+        return;
+    }
+    for (uint32_t c = ix->nodes[node].child; c; c = ix->nodes[c].sibling) {
+        buf[len] = ix->nodes[c].c;
+        trie_walk(ix, c, buf, len + 1, m);
+    }
+}
+
+static uint64_t dir_bit(size_t i) {
+    // any past the last share it, removing one of them may then hide a name
+    return 1ULL << (i < CMD_INDEX_DIRS ? i : CMD_INDEX_DIRS - 1);
+}
+
+// apply what changed in the PATH directories since the last call
+static void index_events(struct shell *sh) {
+    struct cmd_index *ix = &sh->commands;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    for (;;) {
+        ssize_t n = read(ix->inotify_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            return;
+        }
+        for (char *p = buf; p < buf + n;) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(*ev) + ev->len;
+            if (ev->mask & (IN_Q_OVERFLOW | IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                ix->stale = true;
+                continue;
+            }
+            if (!ev->len || (ev->mask & IN_ISDIR)) {
+                continue;
+            }
+            for (size_t i = 0; i < ix->ndirs; i++) {
+                if (ix->wds[i] == ev->wd) {
+                    trie_set(ix, ev->name, dir_bit(i), ev->mask & (IN_CREATE | IN_MOVED_TO));
+                }
+            }
+            // a name that appeared may now shadow one further down PATH
+            path_forget(&sh->path_cache, ev->name);
+        }
+    }
+}
+
+static void on_index_event(struct shell *sh, void *data) {
+    UNUSED(data)
+    index_events(sh);
+}
+
+static void index_free(struct shell *sh) {
+    struct cmd_index *ix = &sh->commands;
+    if (ix->watch) {
+        loop_remove(sh, ix->watch);
+    }
+    if (ix->inotify_fd >= 0) {
+        close(ix->inotify_fd);
+    }
+    free(ix->nodes);
+    free(ix->wds);
+    free(ix->path_env);
+    *ix = (struct cmd_index){ .inotify_fd = -1 };
+}
+
+struct index_fill {
+    struct cmd_index *ix;
+    uint64_t bit;
+};
+
+static void index_add(const char *name, unsigned char type, void *data) {
+    struct index_fill *f = data;
+    // no stat per name, on a network file system that is what makes Tab slow
+    if (type != DT_DIR) {
+        trie_set(f->ix, name, f->bit, true);
+    }
+}
+
+// watch every PATH directory and then read it, so nothing changes unseen in between
+static void index_build(struct shell *sh, const char *path_env) {
+    index_free(sh);
+    struct cmd_index *ix = &sh->commands;
+    ix->path_env = strdup(path_env);
+    ix->nodes = calloc(1024, sizeof(*ix->nodes));
+    if (!ix->path_env || !ix->nodes) {
+        return;
+    }
+    ix->cap = 1024;
+    ix->count = 1;
+
+    size_t builtins;
+    const struct builtin *b = builtin_list(&builtins);
+    for (size_t i = 0; i < builtins; i++) {
+        trie_set(ix, b[i].name, CMD_INDEX_BUILTIN, true);
+    }
+
+    size_t ndirs = 1;
+    for (const char *p = path_env; *p; p++) {
+        ndirs += *p == ':';
+    }
+    ix->wds = malloc(ndirs * sizeof(*ix->wds));
+    ix->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (!ix->wds) {
+        return;
+    }
+
+    const char *dir = path_env;
+    for (size_t i = 0; i < ndirs; i++) {
+        const char *end = strchrnul(dir, ':');
+        // an empty PATH element means the current directory
+        char *name = end == dir ? strdup(".") : strndup(dir, (size_t)(end - dir));
+        if (!name) {
+            break;
+        }
+        ix->wds[i] = ix->inotify_fd >= 0 ? inotify_add_watch(ix->inotify_fd, name, INOTIFY_MASK) : -1;
+        ix->ndirs++;
+        struct index_fill fill = { ix, dir_bit(i) };
+        glob_list(name, "", index_add, &fill);
+        free(name);
+        dir = end + 1;
+    }
+    if (ix->inotify_fd >= 0 && sh->loop) {
+        ix->watch = loop_add(sh, ix->inotify_fd, on_index_event, NULL);
+    }
+}
+
+// bring the index up to date with PATH and the directories in it
+static struct cmd_index *index_get(struct shell *sh) {
+    struct cmd_index *ix = &sh->commands;
+    const char *path_env = getenv("PATH");
+    if (!path_env) {
+        path_env = "/bin:/usr/bin";
+    }
+    if (ix->inotify_fd >= 0) {
+        index_events(sh);
+    }
+    if (ix->stale || !ix->path_env || strcmp(ix->path_env, path_env) != 0) {
+        index_build(sh, path_env);
+    }
+    return ix->count ? ix : NULL;
+}
+
+static void file_add(const char *name, unsigned char type, void *data) {
+    UNUSED(type)
+    match_add(data, name);
+}
+
+// names in the directory part of text that start with the rest of it
+static void complete_files(struct shell *sh, const char *text, struct match_list *m) {
+    const char *slash = strrchr(text, '/');
+    const char *base = slash ? slash + 1 : text;
+    m->lead = text;
+    m->lead_len = (size_t)(base - text);
+
+    char dir[PATH_MAX];
+    int n;
+    if (!slash) {
+        n = snprintf(dir, sizeof(dir), "%s", "");
+    } else if (text[0] == '~' && (text[1] == '/' || text[1] == '\0') && dirs_home(sh)) {
+        n = snprintf(dir, sizeof(dir), "%s%.*s", dirs_home(sh), (int)(base - text - 1), text + 1);
+    } else {
+        n = snprintf(dir, sizeof(dir), "%.*s", (int)m->lead_len, text);
+    }
+    if (n >= 0 && (size_t)n < sizeof(dir)) {
+        glob_list(dir, base, file_add, m);
+    }
+}
+
+/**
+* @brief Set up tab completion: the index of command names starts empty
+* and the completion hook is handed to readline. Called by sh_init.
+*
+* @param sh The shell
+*/
+void complete_init(struct shell *sh) {
+    sh->commands = (struct cmd_index){ .inotify_fd = -1 };
+    complete_shell = sh;
+    rl_attempted_completion_function = complete_hook;
+}
+
+/**
+* @brief Everything a word could complete to, sorted. In command position
+* that is the built in commands and the names in every PATH directory,
+* from an index kept current with inotify, unless the word has a slash
+* in it. Anywhere else, or with a slash, it is the files named by the
+* word so far, read through the glob directory cache.
+*
+* @param sh The shell
+* @param text The word so far
+* @param command The word is the first of a command
+* @return A NULL terminated list that the caller frees along with each
+* entry, or NULL if there are no matches
+*/
+char **complete_word(struct shell *sh, const char *text, bool command) {
+    struct match_list m = { 0 };
+    if (command && !strchr(text, '/')) {
+        struct cmd_index *ix = index_get(sh);
+        uint32_t node = ix ? trie_find(ix, text, false) : 0;
+        size_t len = strlen(text);
+        if (ix && (node || len == 0) && len <= NAME_MAX) {
+            char buf[NAME_MAX + 1];
+            memcpy(buf, text, len);
+            trie_walk(ix, node, buf, len, &m);
+        }
+    } else {
+        complete_files(sh, text, &m);
+    }
+    if (m.failed || m.count == 0) {
+        match_free(&m);
+        return NULL;
+    }
+    return m.items;
+}
+
+// the first word of a command starts the line or follows an operator
+static bool at_command(int start) {
+    for (int i = start - 1; i >= 0; i--) {
+        char c = rl_line_buffer[i];
+        if (c == '|' || c == '&' || c == ';') {
+            return true;
+        }
+        if (c != ' ' && c != '\t') {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+* @brief readline's attempted completion function. The matches from
+* complete_word come back in the form readline wants, with their longest
+* common prefix first, and readline's own filename completion is turned
+* off so a Tab never walks a directory that the cache already holds.
+*
+* @param text The word being completed
+* @param start Where it starts in rl_line_buffer
+* @param end Where it ends
+* @return The matches or NULL if there are none
+*/
+char **complete_hook(const char *text, int start, int end) {
+    UNUSED(end)
+    rl_attempted_completion_over = 1;
+    if (!complete_shell) {
+        return NULL;
+    }
+    bool command = at_command(start) && !strchr(text, '/');
+    char **words = complete_word(complete_shell, text, command);
+    if (!words) {
+        return NULL;
+    }
+    // readline adds the '/' after a directory, which only makes sense for files
+    rl_filename_completion_desired = !command;
+
+    // readline wants the common prefix in front, or the only match on its own
+    size_t n = 0, common = strlen(words[0]);
+    while (words[n]) {
+        size_t k = 0;
+        while (k < common && words[n][k] == words[0][k]) {
+            k++;
+        }
+        common = k;
+        n++;
+    }
+    if (n == 1) {
+        return words;
+    }
+    char **rval = malloc((n + 2) * sizeof(*rval));
+    char *lead = strndup(words[0], common);
+    if (!rval || !lead) {
+        free(rval);
+        free(lead);
+        for (size_t i = 0; i < n; i++) {
+            free(words[i]);
+        }
+        free(words);
+        return NULL;
+    }
+    rval[0] = lead;
+    memcpy(rval + 1, words, (n + 1) * sizeof(*rval));
+    free(words);
+    return rval;
+}
+
+/**
+* @brief Stop watching PATH and free the command index.
+*
+* @param sh The shell
+*/
+void complete_destroy(struct shell *sh) {
+    index_free(sh);
+    if (complete_shell == sh) {
+        complete_shell = NULL;
+    }
+}
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include "lab.h"
+
+// resolve path against cwd without touching the file system, dropping ".",
+// ".." and repeated slashes
+static int normalize(const char *cwd, const char *path, char *out) {
+    size_t len = 0;
+    if (path[0] != '/') {
+        len = strlen(cwd);
+        memcpy(out, cwd, len);
+        while (len > 0 && out[len - 1] == '/') {
+            len--;
+        }
+    }
+
+    for (const char *p = path; *p;) {
+        while (*p == '/') {
+            p++;
+        }
+        if (!*p) {
+            break;
+        }
+        const char *end = strchrnul(p, '/');
+        size_t n = (size_t)(end - p);
+        if (n == 2 && p[0] == '.' && p[1] == '.') {
+            while (len > 0 && out[len - 1] != '/') {
+                len--;
+            }
+            if (len > 0) {
+                len--;
+            }
+        } else if (n != 1 || p[0] != '.') {
+            if (len + 1 + n >= PATH_MAX) {
+                return -1;
+            }
+            out[len++] = '/';
+            memcpy(out + len, p, n);
+            len += n;
+        }
+        p = end;
+    }
+
+    if (len == 0) {
+        out[len++] = '/';
+    }
+    out[len] = '\0';
+    return 0;
+}
+
+// the shell moved, tell children through PWD and the prompt through its cache
+static void cwd_changed(struct shell *sh, const char *cwd) {
+    if (!cwd) {
+        if (!getcwd(sh->cwd, sizeof(sh->cwd))) {
+            sh->cwd[0] = '\0';
+        }
+    } else if (cwd != sh->cwd) {
+        snprintf(sh->cwd, sizeof(sh->cwd), "%s", cwd);
+    }
+    if (sh->cwd[0]) {
+        setenv("PWD", sh->cwd, 1);
+    }
+    prompt_invalidate(&sh->prompt_tmpl, PROMPT_DEP_CWD);
+}
+
+// an O_PATH descriptor of the current directory, held on the stack for fchdir
+static int open_cwd(void) {
+    return open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+/**
+* @brief Set up the current directory cache and the empty directory
+* stack. The directory is read once here and after that only changes
+* through dirs_cd, pushd and popd. Called by sh_init.
+*
+* @param sh The shell
+*/
+void dirs_init(struct shell *sh) {
+    sh->home = NULL;
+    sh->dirs.count = 0;
+    if (!getcwd(sh->cwd, sizeof(sh->cwd))) {
+        sh->cwd[0] = '\0';
+    }
+}
+
+/**
+* @brief The user's home directory. $HOME is preferred, the password
+* database is only asked when it is not set, and either way the answer is
+* kept for the life of the shell.
+*
+* @param sh The shell
+* @return The home directory or NULL if it can't be found
+*/
+const char *dirs_home(struct shell *sh) {
+    if (!sh->home) {
+        const char *home = getenv("HOME");
+        if (home && *home) {
+            sh->home = strdup(home);
+        } else {
+            // this can go out to NSS or LDAP, so only ever once
+            struct passwd *pw = getpwuid(getuid());
+            if (pw && pw->pw_dir) {
+                sh->home = strdup(pw->pw_dir);
+            }
+        }
+    }
+    return sh->home;
+}
+
+/**
+* @brief Change directory and update sh->cwd in place. Like cd in other
+* shells the path is resolved against sh->cwd first, so ".." goes back the
+* way the user came through a symbolic link. If that fails, or the current
+* directory is unknown, the path is handed to chdir as it is.
+*
+* @param sh The shell
+* @param path Where to go, NULL for the home directory
+* @return On success, zero is returned. On error, -1 is returned, and
+* errno is set to indicate the error.
+*/
+int dirs_cd(struct shell *sh, const char *path) {
+    if (!path) {
+        path = dirs_home(sh);
+        if (!path) {
+            errno = ENOENT;
+            return -1;
+        }
+    }
+
+    char target[PATH_MAX];
+    if (sh->cwd[0] == '/' && normalize(sh->cwd, path, target) == 0 && chdir(target) == 0) {
+        cwd_changed(sh, target);
+        return 0;
+    }
+    if (chdir(path) < 0) {
+        return -1;
+    }
+    cwd_changed(sh, NULL);
+    return 0;
+}
+
+/**
+* @brief pushd: save the current directory on the stack and change to
+* path, or with no path swap the current directory with the top of the
+* stack. Errors are reported on stderr.
+*
+* @param sh The shell
+* @param path Directory to change to or NULL to swap
+* @return On success, zero is returned. On error, -1 is returned.
+*/
+int dirs_push(struct shell *sh, const char *path) {
+    struct dir_stack *ds = &sh->dirs;
+    if (path && ds->count == DIR_STACK_MAX) {
+        fprintf(stderr, "pushd: directory stack full\n");
+        return -1;
+    }
+    if (!path && ds->count == 0) {
+        fprintf(stderr, "pushd: no other directory\n");
+        return -1;
+    }
+
+    struct dir_entry here = { NULL, open_cwd() };
+    if (here.fd < 0) {
+        perror("pushd");
+        return -1;
+    }
+    if (!sh->cwd[0]) {
+        cwd_changed(sh, NULL);
+    }
+    here.path = strdup(sh->cwd[0] ? sh->cwd : ".");
+    if (!here.path) {
+        close(here.fd);
+        return -1;
+    }
+
+    if (path) {
+        if (dirs_cd(sh, path) < 0) {
+            fprintf(stderr, "pushd: %s: %s\n", path, strerror(errno));
+            free(here.path);
+            close(here.fd);
+            return -1;
+        }
+        ds->items[ds->count++] = here;
+        return 0;
+    }
+
+    // swap, the old top is reached through its descriptor
+    struct dir_entry top = ds->items[ds->count - 1];
+    if (fchdir(top.fd) < 0) {
+        fprintf(stderr, "pushd: %s: %s\n", top.path, strerror(errno));
+        free(here.path);
+        close(here.fd);
+        return -1;
+    }
+    ds->items[ds->count - 1] = here;
+    cwd_changed(sh, top.path);
+    free(top.path);
+    close(top.fd);
+    return 0;
+}
+
+/**
+* @brief popd: change to the directory on top of the stack and remove it.
+* Errors are reported on stderr.
+*
+* @param sh The shell
+* @return On success, zero is returned. On error, -1 is returned.
+*/
+int dirs_pop(struct shell *sh) {
+    struct dir_stack *ds = &sh->dirs;
+    if (ds->count == 0) {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return -1;
+    }
+
+    struct dir_entry top = ds->items[--ds->count];
+    int rval = 0;
+    if (fchdir(top.fd) < 0) {
+        fprintf(stderr, "popd: %s: %s\n", top.path, strerror(errno));
+        rval = -1;
+    } else {
+        cwd_changed(sh, top.path);
+    }
+    free(top.path);
+    close(top.fd);
+    return rval;
+}
+
+// print one directory, with the home directory shortened to ~ unless long_form
+static void print_dir(struct shell *sh, const char *dir, bool long_form) {
+    const char *home = long_form ? NULL : dirs_home(sh);
+    size_t len = home ? strlen(home) : 0;
+    if (len > 1 && strncmp(dir, home, len) == 0 && (dir[len] == '\0' || dir[len] == '/')) {
+        printf("~%s", dir + len);
+    } else {
+        printf("%s", dir);
+    }
+}
+
+/**
+* @brief Print the current directory followed by the stack, top first.
+*
+* @param sh The shell
+* @param long_form Print the home directory in full instead of as ~
+*/
+void dirs_print(struct shell *sh, bool long_form) {
+    if (!sh->cwd[0]) {
+        cwd_changed(sh, NULL);
+    }
+    print_dir(sh, sh->cwd[0] ? sh->cwd : ".", long_form);
+    for (size_t i = sh->dirs.count; i > 0; i--) {
+        putchar(' ');
+        print_dir(sh, sh->dirs.items[i - 1].path, long_form);
+    }
+    putchar('\n');
+}
+
+/**
+* @brief Empty the directory stack, this is what dirs -c does.
+*
+* @param sh The shell
+*/
+void dirs_clear(struct shell *sh) {
+    while (sh->dirs.count > 0) {
+        struct dir_entry *e = &sh->dirs.items[--sh->dirs.count];
+        free(e->path);
+        close(e->fd);
+    }
+}
+
+/**
+* @brief Empty the directory stack and forget the cached home directory.
+*
+* @param sh The shell
+*/
+void dirs_destroy(struct shell *sh) {
+    dirs_clear(sh);
+    free(sh->home);
+    sh->home = NULL;
+}
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "lab.h"
+#include "p2shell.h"
+
+// a shell that is never interactive and has no event loop, history or
+// prompt, only the parts sh_spawn and the job table use are set up
+struct p2sh {
+    struct shell sh;
+    int dirfd;      // the context's working directory
+    struct glob_cache *globs;   // listings its patterns are matched against
+};
+
+// the job and, when its last stage never started, what it exits with
+struct p2sh_proc {
+    struct job *job;
+    int failed;     // 0 when the last stage started
+};
+
+/**
+* @brief Make a context that starts commands in the current working
+* directory.
+*
+* @return The context or NULL if it could not be made
+*/
+struct p2sh *p2sh_new(void) {
+    struct p2sh *ctx = calloc(1, sizeof(*ctx));
+    if (!ctx) {
+        return NULL;
+    }
+    ctx->dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ctx->globs = glob_cache_new();
+    if (ctx->dirfd < 0 || !ctx->globs) {
+        if (ctx->dirfd >= 0) {
+            close(ctx->dirfd);
+        }
+        glob_cache_free(ctx->globs);
+        free(ctx);
+        return NULL;
+    }
+
+    struct shell *sh = &ctx->sh;
+    sh->shell_terminal = -1;
+    sh->shell_is_interactive = false;
+    sh->shell_pgid = getpgrp();
+    sh->terminal_pgid = -1;
+    sh->backend = SPAWN_POSIX;    // vfork semantics, nothing of the caller's threads is copied
+    sh->memo.fd = -1;
+    sh->loop = NULL;
+    sh->sigchld_watch = NULL;
+    sh->sigchld_fd = -1;
+    return ctx;
+}
+
+/**
+* @brief Free a context. Every command started in it must have been
+* waited for.
+*
+* @param ctx The context
+*/
+void p2sh_free(struct p2sh *ctx) {
+    if (!ctx) {
+        return;
+    }
+    jobs_destroy(&ctx->sh);
+    path_cache_destroy(&ctx->sh.path_cache);
+    glob_cache_free(ctx->globs);
+    close(ctx->dirfd);
+    free(ctx);
+}
+
+/**
+* @brief Change the directory commands start in and that relative
+* patterns and redirections are resolved in. The process's own working
+* directory is left alone.
+*
+* @param ctx The context
+* @param dir The directory, relative to the context's current one
+* @return On success, zero is returned. On error, -1 is returned and
+* errno is set.
+*/
+int p2sh_chdir(struct p2sh *ctx, const char *dir) {
+    int fd = openat(ctx->dirfd, dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    close(ctx->dirfd);
+    ctx->dirfd = fd;
+    return 0;
+}
+
+/**
+* @brief Parse a command line. Patterns are expanded against the
+* context's directory while it is parsed.
+*
+* @param ctx The context
+* @param line The line
+* @return The command, free it with p2sh_cmd_free, or NULL after a
+* message on stderr if the line is empty or is not valid
+*/
+struct p2sh_cmd *p2sh_parse(struct p2sh *ctx, const char *line) {
+    return (struct p2sh_cmd *)pipeline_parse_at(ctx->globs, ctx->dirfd, line);
+}
+
+/**
+* @brief Free a command made by p2sh_parse.
+*
+* @param cmd The command
+*/
+void p2sh_cmd_free(struct p2sh_cmd *cmd) {
+    pipeline_free((struct pipeline *)cmd);
+}
+
+/**
+* @brief Start a command without waiting for it. It is run like
+* pipeline_run runs a background pipeline, minus the built ins and the
+* job control: pipes are close on exec and the context's directory is
+* passed to the spawn backend instead of the process changing its own,
+* so another thread starting a command at the same time never sees
+* either.
+*
+* @param ctx The context
+* @param cmd The command
+* @param fd_in Standard input
+* @param fd_out Standard output
+* @param fd_err Standard error
+* @return The started command or NULL if memory ran out
+*/
+struct p2sh_proc *p2sh_run(struct p2sh *ctx, const struct p2sh_cmd *cmd, int fd_in, int fd_out, int fd_err) {
+    struct shell *sh = &ctx->sh;
+    const struct pipeline *pl = (const struct pipeline *)cmd;
+    size_t max_redirs = 0;
+    for (size_t i = 0; i < pl->nstages; i++) {
+        max_redirs = pl->stages[i].nredirs > max_redirs ? pl->stages[i].nredirs : max_redirs;
+    }
+    struct p2sh_proc *proc = malloc(sizeof(*proc));
+    struct fd_dup *dups = malloc((max_redirs + 1) * sizeof(*dups));
+    struct job *job = proc && dups ? job_new(sh, pl) : NULL;
+    if (!job) {
+        free(proc);
+        free(dups);
+        return NULL;
+    }
+    proc->job = job;
+    proc->failed = 0;
+
+    struct spawn_opts opts;
+    spawn_opts_init(&opts);
+    opts.foreground = false;
+    opts.cwd_fd = ctx->dirfd;
+    dups[0] = (struct fd_dup){ fd_err, STDERR_FILENO };
+
+    int in = fd_in;
+    for (size_t i = 0; i < pl->nstages; i++) {
+        int fds[2] = { -1, -1 };
+        opts.fd_in = in;
+        opts.fd_out = fd_out;
+        if (i + 1 < pl->nstages) {
+            if (pipe2(fds, O_CLOEXEC) < 0) {
+                perror("pipe");
+                proc->failed = 127;
+                break;
+            }
+            opts.fd_out = fds[1];
+        }
+
+        const struct stage *st = &pl->stages[i];
+        pid_t pid = -1;
+        if (open_redirects(st, ctx->dirfd, &dups[1]) == 0) {
+            opts.dups = dups;
+            opts.ndups = 1 + st->nredirs;
+            pid = sh_spawn(sh, st->argv, &opts);
+            close_redirects(st, &dups[1], st->nredirs);
+            if (pid < 0 && i + 1 == pl->nstages) {
+                proc->failed = 127;
+            }
+        } else if (i + 1 == pl->nstages) {
+            proc->failed = 1;
+        }
+        if (pid > 0) {
+            job_add_proc(sh, job, pid);
+            opts.pgid = job->pgid;    // the first stage names the group for the rest
+        }
+
+        // only the pipes are ours to close, the caller's descriptors stay open
+        if (in != fd_in) {
+            close(in);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        in = fds[0];
+    }
+    if (in >= 0 && in != fd_in) {
+        close(in);
+    }
+    free(dups);
+    job->spawned_ns = monotonic_ns();
+    return proc;
+}
+
+/**
+* @brief Wait for a started command to finish and free it. Only its own
+* processes are waited for, by pid, see job_wait_pids.
+*
+* @param ctx The context it was started in
+* @param proc The command
+* @return The exit status of the last stage, or 128 plus the signal
+* number if it was killed
+*/
+int p2sh_wait(struct p2sh *ctx, struct p2sh_proc *proc) {
+    int status = job_wait_pids(&ctx->sh, proc->job);
+    if (proc->failed) {
+        status = proc->failed;
+    }
+    job_remove(&ctx->sh, proc->job);
+    free(proc);
+    return status;
+}
@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "lab.h"
+
+// how one stage of a pipeline is run
+struct stage_plan {
+    const struct builtin *builtin;  // NULL for an external command
+    bool in_shell;                  // run the built in in the shell once every process started
+    int fd_in;                      // stdin for a built in run in the shell
+    int fd_out;                     // stdout for a built in run in the shell
+};
+
+// a built in stage can run in the shell unless something has to run at the
+// same time as it. One that changes the shell only does in the last stage,
+// where a line like cd dir would have it, and never from inside a $(...).
+// Only one stage per pipeline gets to, the last one that can, since two
+// built ins run one after the other in the shell could each be waiting on
+// the other through the stages between them
+static void plan_stages(struct shell *sh, const struct pipeline *pl, struct stage_plan *plan) {
+    bool claimed = false;
+    for (size_t i = pl->nstages; i-- > 0;) {
+        const struct builtin *b = builtin_find(pl->stages[i].argv[0]);
+        bool parent = b && (b->flags & BUILTIN_PARENT);
+        plan[i].builtin = b;
+        plan[i].in_shell = !claimed && b && !pl->background && !(b->flags & BUILTIN_WAITS) &&
+                           !(parent && (sh->subst_depth > 0 || i != pl->nstages - 1));
+        plan[i].fd_in = STDIN_FILENO;
+        plan[i].fd_out = STDOUT_FILENO;
+        claimed |= plan[i].in_shell;
+    }
+}
+
+/**
+* @brief Close the files open_redirects opened for the first n
+* redirections of a stage, once the stage has its own copies.
+*
+* @param st The stage
+* @param dups What open_redirects filled in
+* @param n How many of its redirections to close
+*/
+void close_redirects(const struct stage *st, const struct fd_dup *dups, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (st->redirs[i].kind != REDIR_DUP) {
+            close(dups[i].from);
+        }
+    }
+}
+
+/**
+* @brief Open the files a stage redirects to and fill in the dup2 calls
+* that apply its redirections. The files are close on exec so no other
+* child sees them and they sit above the descriptors 0 to 9 a redirection
+* can name so applying one never clobbers the source of the next.
+*
+* @param st The stage
+* @param dirfd What relative paths are relative to, AT_FDCWD for the
+* working directory
+* @param dups Room for st->nredirs entries
+* @return On success, zero is returned. On error, -1 is returned after
+* the error is printed and nothing is left open.
+*/
+int open_redirects(const struct stage *st, int dirfd, struct fd_dup *dups) {
+    for (size_t i = 0; i < st->nredirs; i++) {
+        const struct redirect *r = &st->redirs[i];
+        dups[i].to = r->fd;
+        if (r->kind == REDIR_DUP) {
+            dups[i].from = r->from;
+            continue;
+        }
+
+        int flags = O_RDONLY;
+        if (r->kind == REDIR_OUT) {
+            flags = O_WRONLY | O_CREAT | O_TRUNC;
+        } else if (r->kind == REDIR_APPEND) {
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+        }
+        int fd = openat(dirfd, r->path, flags | O_CLOEXEC, 0666);
+        if (fd >= 0 && fd < 10) {
+            int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+            close(fd);
+            fd = high;
+        }
+        if (fd < 0) {
+            perror(r->path);
+            close_redirects(st, dups, i);
+            return -1;
+        }
+        dups[i].from = fd;
+    }
+    return 0;
+}
+
+// run a built in stage in the shell with fd_in and fd_out standing in for
+// stdin and stdout and its redirections applied on top, every descriptor
+// it replaced is put back afterwards
+static int run_in_shell(struct shell *sh, const struct stage *st, int fd_in, int fd_out) {
+    size_t max = st->nredirs + 2;
+    struct fd_dup *moves = NULL;
+    int *saved = NULL;
+    size_t n = 0;
+
+    if (fd_in != STDIN_FILENO || fd_out != STDOUT_FILENO || st->nredirs > 0) {
+        moves = malloc(max * sizeof(*moves));
+        saved = malloc(max * sizeof(*saved));
+        if (!moves || !saved) {
+            fprintf(stderr, "Memory allocation failed for redirections.\n");
+            free(moves);
+            free(saved);
+            sh->last_status = 1;
+            return sh->last_status;
+        }
+        if (fd_in != STDIN_FILENO) {
+            moves[n++] = (struct fd_dup){ fd_in, STDIN_FILENO };
+        }
+        if (fd_out != STDOUT_FILENO) {
+            moves[n++] = (struct fd_dup){ fd_out, STDOUT_FILENO };
+        }
+        if (open_redirects(st, AT_FDCWD, &moves[n]) < 0) {
+            free(moves);
+            free(saved);
+            sh->last_status = 1;
+            return sh->last_status;
+        }
+    }
+    size_t first_redirect = n;
+    n += moves ? st->nredirs : 0;
+
+    fflush(stdout);
+    for (size_t i = 0; i < n; i++) {
+        saved[i] = fcntl(moves[i].to, F_DUPFD_CLOEXEC, 10);     // -1 if it was not open
+        dup2(moves[i].from, moves[i].to);
+    }
+
+    // a reader that quits early must not take the shell down with SIGPIPE
+    struct sigaction ignore, old_pipe;
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigemptyset(&ignore.sa_mask);
+    sigaction(SIGPIPE, &ignore, &old_pipe);
+
+    TRACE_BEGIN(t_builtin);
+    do_builtin(sh, st->argv);
+    TRACE_END(t_builtin, "do_builtin");
+    fflush(stdout);
+    clearerr(stdout);
+
+    sigaction(SIGPIPE, &old_pipe, NULL);
+    for (size_t i = n; i-- > 0;) {
+        if (saved[i] >= 0) {
+            dup2(saved[i], moves[i].to);
+            close(saved[i]);
+        } else {
+            close(moves[i].to);
+        }
+    }
+    if (moves) {
+        close_redirects(st, &moves[first_redirect], st->nredirs);
+    }
+    free(moves);
+    free(saved);
+    return sh->last_status;
+}
+
+/**
+* @brief Run every stage of a pipeline concurrently. N-1 pipes connect the
+* stages and all of them join one process group that is added to the job
+* table. A foreground pipeline gets the terminal and the shell waits for
+* every stage, or for the job to stop, before taking the terminal back.
+* A background pipeline is left running and reported when it finishes.
+* The last built in stage runs in the shell itself, with its pipes
+* standing in for stdin and stdout, once every other stage has started.
+* Other built in stages, ones that wait on other processes, ones in a
+* background pipeline and ones that change the shell, such as cd, in any
+* stage but the last get a process of their own.
+*
+* @param sh The shell
+* @param pl The pipeline to run
+* @return The exit status of the last stage, 128 plus the signal number if
+* it was killed or stopped, 0 for a background job, or -1 if it could not
+* be started
+*/
+int pipeline_run(struct shell *sh, struct pipeline *pl) {
+    size_t max_redirs = 0;
+    for (size_t i = 0; i < pl->nstages; i++) {
+        max_redirs = pl->stages[i].nredirs > max_redirs ? pl->stages[i].nredirs : max_redirs;
+    }
+    struct stage_plan *plan = malloc(pl->nstages * sizeof(*plan));
+    struct fd_dup *dups = malloc((max_redirs + 2) * sizeof(*dups));
+    struct job *job = plan && dups ? job_new(sh, pl) : NULL;
+    if (!job) {
+        free(plan);
+        free(dups);
+        fprintf(stderr, "Memory allocation failed for job.\n");
+        return -1;
+    }
+    plan_stages(sh, pl, plan);
+
+    struct spawn_opts opts;
+    spawn_opts_init(&opts);
+    opts.foreground = !pl->background;
+    bool last_failed = false;
+
+    // a background job writes into its ring instead of over the prompt, a
+    // stage's own redirections still apply on top
+    int capture = pl->background ? job_capture(sh, job) : -1;
+
+    for (size_t i = 0; i < pl->nstages; i++) {
+        // close on exec keeps every other stage from holding this pipe open
+        int fds[2] = { -1, -1 };
+        opts.fd_out = STDOUT_FILENO;
+        if (i + 1 < pl->nstages) {
+            if (pipe2(fds, O_CLOEXEC) < 0) {
+                perror("pipe");
+                break;
+            }
+            opts.fd_out = fds[1];
+        }
+
+        if (plan[i].in_shell) {
+            // keep the pipe ends open until it runs
+            plan[i].fd_in = opts.fd_in;
+            plan[i].fd_out = opts.fd_out;
+            opts.fd_in = fds[0] >= 0 ? fds[0] : STDIN_FILENO;
+            continue;
+        }
+
+        // a stage whose files can't be opened is not started, like one that is not found
+        const struct stage *st = &pl->stages[i];
+        pid_t pid = -1;
+        size_t ncapture = 0;
+        if (capture >= 0) {
+            if (i + 1 == pl->nstages) {
+                dups[ncapture++] = (struct fd_dup){ capture, STDOUT_FILENO };
+            }
+            dups[ncapture++] = (struct fd_dup){ capture, STDERR_FILENO };
+        }
+        if (open_redirects(st, AT_FDCWD, &dups[ncapture]) == 0) {
+            opts.dups = dups;
+            opts.ndups = ncapture + st->nredirs;
+            TRACE_BEGIN(t_spawn);
+            pid = plan[i].builtin ? sh_spawn_builtin(sh, plan[i].builtin, st->argv, &opts)
+                                  : sh_spawn(sh, st->argv, &opts);
+            TRACE_END(t_spawn, "sh_spawn");
+            close_redirects(st, &dups[ncapture], st->nredirs);
+        } else if (i + 1 == pl->nstages) {
+            last_failed = true;
+        }
+        if (pid > 0) {
+            job_add_proc(sh, job, pid);
+            opts.pgid = job->pgid;    // the first stage names the group for the rest
+        }
+
+        // the children hold their own copies now
+        if (opts.fd_in != STDIN_FILENO) {
+            close(opts.fd_in);
+        }
+        if (opts.fd_out != STDOUT_FILENO) {
+            close(opts.fd_out);
+        }
+        opts.fd_in = fds[0] >= 0 ? fds[0] : STDIN_FILENO;
+    }
+    if (opts.fd_in != STDIN_FILENO) {
+        close(opts.fd_in);
+    }
+    if (capture >= 0) {
+        close(capture);
+    }
+    job->spawned_ns = monotonic_ns();
+
+    // every process is running now so the built in can read and write its pipes
+    bool last_in_shell = false;
+    int in_shell_status = 0;
+    for (size_t i = 0; i < pl->nstages; i++) {
+        if (!plan[i].in_shell) {
+            continue;
+        }
+        in_shell_status = run_in_shell(sh, &pl->stages[i], plan[i].fd_in, plan[i].fd_out);
+        last_in_shell = i + 1 == pl->nstages;
+        if (plan[i].fd_in != STDIN_FILENO) {
+            close(plan[i].fd_in);
+        }
+        if (plan[i].fd_out != STDOUT_FILENO) {
+            close(plan[i].fd_out);
+        }
+    }
+    free(plan);
+    free(dups);
+
+    if (job->nprocs == 0) {
+        job_remove(sh, job);
+        if (last_in_shell) {
+            return in_shell_status;
+        }
+        return last_failed ? 1 : -1;
+    }
+
+    if (pl->background) {
+        printf("[%d] %d\n", job->id, job->pgid);
+        return 0;
+    }
+    int rval = job_foreground(sh, job, false);
+    if (last_in_shell) {
+        return in_shell_status;
+    }
+    return last_failed ? 1 : rval;
+}
+
+// run a built in in the shell, timing it like a job when asked to
+static void run_builtin(struct shell *sh, struct pipeline *pl, const char *line) {
+    if (!pl->timed && !sh->stats) {
+        run_in_shell(sh, &pl->stages[0], STDIN_FILENO, STDOUT_FILENO);
+        return;
+    }
+
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    long long start = monotonic_ns();
+    run_in_shell(sh, &pl->stages[0], STDIN_FILENO, STDOUT_FILENO);
+
+    // the shell's own usage is all a built in can be charged with
+    struct cmd_stats st;
+    memset(&st, 0, sizeof(st));
+    st.run_ns = monotonic_ns() - start;
+    st.status = sh->last_status;
+    getrusage(RUSAGE_SELF, &after);
+    timersub(&after.ru_utime, &before.ru_utime, &st.usage.ru_utime);
+    timersub(&after.ru_stime, &before.ru_stime, &st.usage.ru_stime);
+    st.usage.ru_maxrss = after.ru_maxrss;
+    st.usage.ru_minflt = after.ru_minflt - before.ru_minflt;
+    st.usage.ru_majflt = after.ru_majflt - before.ru_majflt;
+    st.usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw;
+    st.usage.ru_nivcsw = after.ru_nivcsw - before.ru_nivcsw;
+    if (pl->timed) {
+        line += 4;      // log the command the same way jobs show it, without "time"
+        line += strspn(line, " \t");
+    }
+    cmd_stats_report(sh, &st, pl->timed, line);
+}
+
+/**
+* @brief Run one line of input. Leading and trailing whitespace is trimmed
+* in place, blank lines and lines starting with '#' are ignored, built in
+* commands run in the shell and everything else is run as a pipeline. The
+* exit status is also stored in sh->last_status.
+*
+* @param sh The shell
+* @param line The line to run, modified by trim_white
+* @return The exit status of the line
+*/
+int sh_run_line(struct shell *sh, char *line) {
+    // do nothing on blank lines or comments
+    TRACE_BEGIN(t_trim);
+    line = trim_white(line);
+    TRACE_END(t_trim, "trim_white");
+    if (!*line || *line == '#') {
+        return sh->last_status;
+    }
+
+    TRACE_BEGIN(t_parse);
+    struct pipeline *pl = sh_parse(sh, line);
+    TRACE_END(t_parse, "sh_parse");
+    if (!pl) {
+        sh->last_status = 2;    // what other shells report for a syntax error
+        return sh->last_status;
+    }
+    sh_run_parsed(sh, pl, line);
+    pipeline_free(pl);
+    return sh->last_status;
+}
+
+/**
+* @brief Run a line that is already parsed, the part of sh_run_line after
+* sh_parse. Built in commands run in the shell and everything else is run
+* as a pipeline. The exit status is also stored in sh->last_status.
+*
+* @param sh The shell
+* @param pl The parsed line, left for the caller to free
+* @param line The trimmed line it was parsed from, for stats mode
+* @return The exit status of the line
+*/
+int sh_run_parsed(struct shell *sh, struct pipeline *pl, const char *line) {
+    // check to see if we are launching a built in command
+    if (pl->nstages == 1 && !pl->background && builtin_find(pl->stages[0].argv[0])) {
+        run_builtin(sh, pl, line);
+    } else {
+        int rval = pipeline_run(sh, pl);
+        sh->last_status = rval < 0 ? 127 : rval;
+    }
+    return sh->last_status;
+}
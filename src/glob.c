@@ -0,0 +1,610 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "lab.h"
+
+#define GLOB_CACHE_DIRS 16                // listings kept from one line to the next
+#define GLOB_CACHE_BYTES (16 << 20)       // and the most memory they may hold together
+#define GLOB_BATCH (256 * 1024)           // bytes of entries asked of getdents64 at once
+
+// one name in a listing, the name itself is in the listing's pool
+struct glob_name {
+    uint32_t off;        // where the name starts in names
+    unsigned char type;  // d_type, DT_UNKNOWN if the file system doesn't say
+};
+
+// every entry of one directory except . and .., sorted by name
+struct glob_dir {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;   // of the directory when it was read
+    bool racy;               // read so soon after a change that mtime can't be trusted
+    unsigned busy;           // walks iterating it right now, it can't be evicted
+    unsigned long used;      // tick of the last lookup, the oldest goes first
+    char *names;             // every name NUL terminated, back to back
+    size_t names_len;
+    size_t names_cap;
+    struct glob_name *ents;
+    size_t count;
+    size_t cap;
+};
+
+// the listings kept between lines, one per embedding context and one
+// for everything else
+struct glob_cache {
+    struct glob_dir **dirs;
+    size_t ndirs;
+    size_t cap;
+    unsigned long tick;
+    char *batch;             // getdents64 buffer, kept for the next directory
+};
+
+// the cache of callers without one of their own, cmd_parse can run on
+// several threads so it is shared under a lock
+static struct glob_cache shared;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// the matches of one pattern as they are found
+struct glob_walk {
+    char path[PATH_MAX];     // the path being built, sized to the current depth
+    char *pool;              // matched paths back to back
+    size_t pool_len;
+    size_t pool_cap;
+    size_t *offs;            // where each match starts in pool
+    size_t count;
+    size_t offs_cap;
+    size_t dirs;             // listings walked, more than one and the matches need sorting
+    bool failed;             // out of memory
+    int dirfd;               // what a relative pattern is relative to
+    struct glob_cache *cache;   // where listings are looked up
+};
+
+// a record in struct glob_words ahead of its matches
+struct glob_record {
+    size_t count;
+    size_t bytes;
+};
+
+static bool is_glob_char(char c) {
+    return c == '*' || c == '?' || c == '[';
+}
+
+// grow *buf to hold need elements of size bytes
+static int reserve(void *buf, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t n = *cap ? *cap : 64;
+    while (n < need) {
+        n *= 2;
+    }
+    void *p = realloc(*(void **)buf, n * size);
+    if (!p) {
+        return -1;
+    }
+    *(void **)buf = p;
+    *cap = n;
+    return 0;
+}
+
+// true if a component has a wildcard that isn't escaped, a '[' only counts
+// when a ']' closes it
+static bool has_magic(const char *comp) {
+    for (const char *p = comp; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '*' || *p == '?') {
+            return true;
+        } else if (*p == '[' && strchr(p + 2, ']')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// copy comp to out without its escapes, returning the length or -1 if it
+// would not fit in avail bytes
+static long unescape(const char *comp, char *out, size_t avail) {
+    size_t n = 0;
+    for (const char *p = comp; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        }
+        if (n + 1 >= avail) {
+            return -1;
+        }
+        out[n++] = *p;
+    }
+    out[n] = '\0';
+    return (long)n;
+}
+
+// the literal start of a component, every match begins with it
+static size_t literal_prefix(const char *comp, char *out) {
+    size_t n = 0;
+    for (const char *p = comp; *p && !is_glob_char(*p); p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        }
+        out[n++] = *p;
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static int name_cmp(const void *a, const void *b, void *names) {
+    const struct glob_name *x = a, *y = b;
+    return strcmp((char *)names + x->off, (char *)names + y->off);
+}
+
+static void dir_free(struct glob_dir *d) {
+    free(d->names);
+    free(d->ents);
+    free(d);
+}
+
+// read every entry of fd into d in big batches, then sort them once
+static int dir_read(struct glob_cache *c, struct glob_dir *d, int fd, const struct stat *st) {
+    if (!c->batch && !(c->batch = malloc(GLOB_BATCH))) {
+        return -1;
+    }
+    d->dev = st->st_dev;
+    d->ino = st->st_ino;
+    d->mtime = st->st_mtim;
+    d->names_len = 0;
+    d->count = 0;
+
+    for (;;) {
+        ssize_t n = getdents64(fd, c->batch, GLOB_BATCH);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        for (ssize_t pos = 0; pos < n;) {
+            struct dirent64 *de = (struct dirent64 *)(c->batch + pos);
+            pos += de->d_reclen;
+            const char *name = de->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            size_t len = strlen(name) + 1;
+            if (reserve(&d->names, &d->names_cap, d->names_len + len, 1) < 0 ||
+                reserve(&d->ents, &d->cap, d->count + 1, sizeof(*d->ents)) < 0) {
+                return -1;
+            }
+            d->ents[d->count++] = (struct glob_name){ (uint32_t)d->names_len, de->d_type };
+            memcpy(d->names + d->names_len, name, len);
+            d->names_len += len;
+        }
+    }
+    qsort_r(d->ents, d->count, sizeof(*d->ents), name_cmp, d->names);
+
+    // a change in the same clock tick as the read would leave mtime as it is
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    d->racy = now.tv_sec <= d->mtime.tv_sec + 1;
+    return 0;
+}
+
+static size_t cache_bytes(const struct glob_cache *c) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < c->ndirs; i++) {
+        bytes += c->dirs[i]->names_cap + c->dirs[i]->cap * sizeof(struct glob_name);
+    }
+    return bytes;
+}
+
+// drop the least recently used listings that aren't being walked until the
+// cache is back under its limits
+static void cache_trim(struct glob_cache *c) {
+    while (c->ndirs > GLOB_CACHE_DIRS || (c->ndirs > 1 && cache_bytes(c) > GLOB_CACHE_BYTES)) {
+        size_t victim = c->ndirs;
+        for (size_t i = 0; i < c->ndirs; i++) {
+            if (!c->dirs[i]->busy && (victim == c->ndirs || c->dirs[i]->used < c->dirs[victim]->used)) {
+                victim = i;
+            }
+        }
+        if (victim == c->ndirs) {
+            return;
+        }
+        dir_free(c->dirs[victim]);
+        c->dirs[victim] = c->dirs[--c->ndirs];
+    }
+}
+
+// the listing of path, read again only if the directory changed since
+static struct glob_dir *dir_lookup(const char *path, struct glob_walk *w) {
+    struct glob_cache *c = w->cache;
+    int fd = openat(w->dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    struct glob_dir *d = NULL;
+    for (size_t i = 0; i < c->ndirs; i++) {
+        if (c->dirs[i]->dev == st.st_dev && c->dirs[i]->ino == st.st_ino) {
+            d = c->dirs[i];
+            break;
+        }
+    }
+    if (d && !d->racy && d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        close(fd);
+        d->used = ++c->tick;
+        return d;
+    }
+    if (d && d->busy) {
+        // a walk further up is still iterating the old listing
+        d = NULL;
+    }
+
+    if (!d) {
+        if (reserve(&c->dirs, &c->cap, c->ndirs + 1, sizeof(*c->dirs)) < 0 ||
+            !(d = calloc(1, sizeof(*d)))) {
+            close(fd);
+            w->failed = true;
+            return NULL;
+        }
+        c->dirs[c->ndirs++] = d;
+    }
+    d->used = ++c->tick;
+    int rval = dir_read(c, d, fd, &st);
+    close(fd);
+    if (rval < 0) {
+        // forget it, a half read listing would be served as the whole
+        if (errno == ENOMEM) {
+            w->failed = true;
+        }
+        d->dev = 0;
+        d->ino = 0;
+        d->racy = true;
+        return NULL;
+    }
+    return d;
+}
+
+// the first name in the listing that is not less than prefix
+static size_t lower_bound(const struct glob_dir *d, const char *prefix) {
+    size_t lo = 0, hi = d->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(d->names + d->ents[mid].off, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void add_match(struct glob_walk *w, size_t len) {
+    if (reserve(&w->pool, &w->pool_cap, w->pool_len + len + 1, 1) < 0 ||
+        reserve(&w->offs, &w->offs_cap, w->count + 1, sizeof(*w->offs)) < 0) {
+        w->failed = true;
+        return;
+    }
+    w->offs[w->count++] = w->pool_len;
+    memcpy(w->pool + w->pool_len, w->path, len);
+    w->pool[w->pool_len + len] = '\0';
+    w->pool_len += len + 1;
+}
+
+// does path name a directory, following symbolic links
+static bool is_dir(const struct glob_walk *w) {
+    struct stat st;
+    return fstatat(w->dirfd, w->path, &st, 0) == 0 && S_ISDIR(st.st_mode);
+}
+
+// match the components of pat below the directory w->path[0..len)
+static void walk(struct glob_walk *w, size_t len, const char *pat) {
+    char comp[NAME_MAX + 1];
+    const char *end = strchrnul(pat, '/');
+    const char *rest = end;
+    while (*rest == '/') {
+        rest++;
+    }
+    // a trailing slash only matches directories and is kept
+    bool dir_only = *rest == '\0' && rest != end;
+    size_t n = (size_t)(end - pat);
+    if (n > NAME_MAX) {
+        return;
+    }
+    memcpy(comp, pat, n);
+    comp[n] = '\0';
+
+    if (!has_magic(comp)) {
+        long m = unescape(comp, w->path + len, sizeof(w->path) - len - 1);
+        if (m < 0) {
+            return;
+        }
+        len += (size_t)m;
+        if (*rest) {
+            w->path[len++] = '/';
+            walk(w, len, rest);
+        } else if (dir_only ? is_dir(w) : faccessat(w->dirfd, w->path, F_OK, AT_SYMLINK_NOFOLLOW) == 0) {
+            if (dir_only) {
+                w->path[len++] = '/';
+            }
+            add_match(w, len);
+        }
+        return;
+    }
+
+    w->path[len] = '\0';
+    struct glob_dir *d = dir_lookup(len ? w->path : ".", w);
+    if (!d) {
+        return;
+    }
+    w->dirs++;
+    d->busy++;
+
+    // the listing is sorted so every name with the literal prefix is in one run
+    char prefix[NAME_MAX + 1];
+    size_t plen = literal_prefix(comp, prefix);
+    for (size_t i = lower_bound(d, prefix); i < d->count && !w->failed; i++) {
+        const char *name = d->names + d->ents[i].off;
+        if (strncmp(name, prefix, plen) != 0) {
+            break;
+        }
+        if (fnmatch(comp, name, FNM_PERIOD) != 0) {
+            continue;
+        }
+        size_t nlen = strlen(name);
+        if (len + nlen + 2 > sizeof(w->path)) {
+            continue;
+        }
+        unsigned char type = d->ents[i].type;
+        if ((*rest || dir_only) && type != DT_DIR && type != DT_LNK && type != DT_UNKNOWN) {
+            continue;
+        }
+        memcpy(w->path + len, name, nlen + 1);
+        if (*rest) {
+            w->path[len + nlen] = '/';
+            walk(w, len + nlen + 1, rest);
+        } else if (!dir_only || type == DT_DIR || is_dir(w)) {
+            if (dir_only) {
+                w->path[len + nlen++] = '/';
+            }
+            add_match(w, len + nlen);
+        }
+    }
+    d->busy--;
+}
+
+static int match_cmp(const void *a, const void *b, void *pool) {
+    return strcmp((char *)pool + *(const size_t *)a, (char *)pool + *(const size_t *)b);
+}
+
+/**
+* @brief Expand a pathname pattern and append its matches to gw as one
+* record. Quoted characters must arrive escaped with a backslash. * ? and
+* [...] match within a single component of the path, a leading '.' must
+* be matched explicitly and . and .. never are. Directories are listed
+* with getdents64 into a cache keyed by device, inode and mtime, so the
+* same directory is only read again once it has changed, and each listing
+* is sorted once so the names sharing a pattern's literal prefix are
+* found with a binary search. The matches come back sorted.
+*
+* @param gw Where the matches go, zero initialized before the first call
+* @param cache The listings to use, NULL for the process's shared cache
+* @param dirfd What a relative pattern is matched in, AT_FDCWD for the
+* working directory
+* @param pattern The pattern with quoted characters escaped
+* @param count Set to the number of matches, zero if there were none
+* @param bytes Set to the size of the matches, NULs included
+* @return The matches, NUL terminated and back to back, or NULL if memory
+* ran out
+*/
+const char *glob_expand(struct glob_words *gw, struct glob_cache *cache, int dirfd, const char *pattern, size_t *count,
+                        size_t *bytes) {
+    struct glob_walk *w = calloc(1, sizeof(*w));
+    if (!w) {
+        return NULL;
+    }
+    w->dirfd = dirfd;
+
+    const char *p = pattern;
+    size_t len = 0;
+    if (*p == '/') {
+        w->path[len++] = '/';
+        while (*p == '/') {
+            p++;
+        }
+    }
+    if (*p) {
+        // a context's own cache is only ever used by one thread at a time
+        w->cache = cache ? cache : &shared;
+        if (!cache) {
+            pthread_mutex_lock(&shared_lock);
+        }
+        walk(w, len, p);
+        cache_trim(w->cache);
+        if (!cache) {
+            pthread_mutex_unlock(&shared_lock);
+        }
+    }
+    if (w->dirs > 1 && w->count > 1) {
+        qsort_r(w->offs, w->count, sizeof(*w->offs), match_cmp, w->pool);
+    }
+
+    const char *rval = NULL;
+    char *out = w->failed ? NULL : glob_record_begin(gw, w->pool_len);
+    if (out) {
+        for (size_t i = 0; i < w->count; i++) {
+            const char *m = w->pool + w->offs[i];
+            size_t n = strlen(m) + 1;
+            memcpy(out, m, n);
+            out += n;
+        }
+        rval = glob_record_end(gw, w->count, w->pool_len);
+        *count = w->count;
+        *bytes = w->pool_len;
+    }
+    free(w->pool);
+    free(w->offs);
+    free(w);
+    return rval;
+}
+
+/**
+* @brief Call fn for each name in a directory that starts with prefix,
+* in sorted order, from the shared cached listing glob_expand uses without
+* a cache of its own. Names starting with '.' are only passed when prefix
+* does too. fn runs with the cache locked so it must not call back into
+* glob.
+*
+* @param dir The directory, "" for the current one
+* @param prefix What every name must start with
+* @param fn Called with each name and its d_type
+* @param data Passed to fn
+* @return On success, zero is returned. On error, -1 is returned.
+*/
+int glob_list(const char *dir, const char *prefix, glob_list_fn fn, void *data) {
+    struct glob_walk *w = calloc(1, sizeof(*w));
+    if (!w) {
+        return -1;
+    }
+    w->dirfd = AT_FDCWD;
+    w->cache = &shared;
+    pthread_mutex_lock(&shared_lock);
+    struct glob_dir *d = dir_lookup(*dir ? dir : ".", w);
+    free(w);
+    if (!d) {
+        pthread_mutex_unlock(&shared_lock);
+        return -1;
+    }
+
+    size_t plen = strlen(prefix);
+    for (size_t i = lower_bound(d, prefix); i < d->count; i++) {
+        const char *name = d->names + d->ents[i].off;
+        if (strncmp(name, prefix, plen) != 0) {
+            break;
+        }
+        if (name[0] != '.' || prefix[0] == '.') {
+            fn(name, d->ents[i].type, data);
+        }
+    }
+    cache_trim(&shared);
+    pthread_mutex_unlock(&shared_lock);
+    return 0;
+}
+
+/**
+* @brief Make room for a record of up to max bytes at the end of gw. The
+* record is only added by glob_record_end, so nothing else may append to
+* gw in between.
+*
+* @param gw The records
+* @param max The most bytes the record will hold
+* @return Where the record's words go, or NULL if memory ran out
+*/
+char *glob_record_begin(struct glob_words *gw, size_t max) {
+    if (reserve(&gw->buf, &gw->cap, gw->len + sizeof(struct glob_record) + max, 1) < 0) {
+        return NULL;
+    }
+    return gw->buf + gw->len + sizeof(struct glob_record);
+}
+
+/**
+* @brief Add the record started with glob_record_begin.
+*
+* @param gw The records
+* @param count The number of words written
+* @param bytes Their size, NULs included
+* @return The words
+*/
+const char *glob_record_end(struct glob_words *gw, size_t count, size_t bytes) {
+    struct glob_record rec = { count, bytes };
+    memcpy(gw->buf + gw->len, &rec, sizeof(rec));
+    gw->len += sizeof(rec) + bytes;
+    return gw->buf + gw->len - bytes;
+}
+
+/**
+* @brief Read back the next record glob_expand appended to gw, in the
+* order they were appended. The parser's writing pass uses this to get
+* exactly the words its measuring pass was sized for.
+*
+* @param gw The records
+* @param count Set to the number of matches
+* @param bytes Set to the size of the matches, NULs included
+* @return The matches, NUL terminated and back to back
+*/
+const char *glob_next(struct glob_words *gw, size_t *count, size_t *bytes) {
+    struct glob_record rec = { 0, 0 };
+    if (gw->pos + sizeof(rec) <= gw->len) {
+        memcpy(&rec, gw->buf + gw->pos, sizeof(rec));
+        gw->pos += sizeof(rec);
+    }
+    const char *rval = gw->buf ? gw->buf + gw->pos : "";
+    gw->pos += rec.bytes;
+    *count = rec.count;
+    *bytes = rec.bytes;
+    return rval;
+}
+
+/**
+* @brief Free the records of a struct glob_words.
+*
+* @param gw The records
+*/
+void glob_words_free(struct glob_words *gw) {
+    free(gw->buf);
+    *gw = (struct glob_words){ 0 };
+}
+
+// free every listing in c, it stays usable
+static void cache_clear(struct glob_cache *c) {
+    for (size_t i = 0; i < c->ndirs; i++) {
+        dir_free(c->dirs[i]);
+    }
+    free(c->dirs);
+    free(c->batch);
+    *c = (struct glob_cache){ 0 };
+}
+
+/**
+* @brief Forget every listing in the shared cache.
+*/
+void glob_cache_clear(void) {
+    pthread_mutex_lock(&shared_lock);
+    cache_clear(&shared);
+    pthread_mutex_unlock(&shared_lock);
+}
+
+/**
+* @brief Make an empty cache of directory listings for glob_expand, for a
+* caller that must not share the process's cache and its lock.
+*
+* @return The cache or NULL if memory ran out
+*/
+struct glob_cache *glob_cache_new(void) {
+    return calloc(1, sizeof(struct glob_cache));
+}
+
+/**
+* @brief Free a cache made by glob_cache_new.
+*
+* @param cache The cache, may be NULL
+*/
+void glob_cache_free(struct glob_cache *cache) {
+    if (!cache) {
+        return;
+    }
+    cache_clear(cache);
+    free(cache);
+}
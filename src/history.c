@@ -0,0 +1,358 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <readline/readline.h>
+#include <readline/history.h>
+#include "lab.h"
+
+#define HIST_MIN_ALLOC 64   // ring slots allocated on first add
+
+// slot holding entry i, 0 is the oldest
+static size_t slot(struct history *h, size_t i) {
+    return (h->head + i) % h->alloc;
+}
+
+static void evict_oldest(struct history *h) {
+    char *old = h->ring[h->head];
+    h->bytes -= strlen(old) + 1;
+    free(old);
+    h->ring[h->head] = NULL;
+    h->head = (h->head + 1) % h->alloc;
+    h->count--;
+    h->base++;
+}
+
+// make room for one more entry, growing the ring until it reaches the cap
+static int make_room(struct history *h) {
+    if (h->count < h->alloc) {
+        return 0;
+    }
+    if (h->alloc == h->max_entries) {
+        evict_oldest(h);
+        return 0;
+    }
+
+    size_t alloc = h->alloc ? h->alloc * 2 : HIST_MIN_ALLOC;
+    if (alloc > h->max_entries) {
+        alloc = h->max_entries;
+    }
+    char **ring = malloc(alloc * sizeof(char *));
+    if (!ring) {
+        return -1;
+    }
+
+    // unwrap the old ring so the oldest entry starts at slot 0
+    for (size_t i = 0; i < h->count; i++) {
+        ring[i] = h->ring[slot(h, i)];
+    }
+    free(h->ring);
+    h->ring = ring;
+    h->alloc = alloc;
+    h->head = 0;
+    return 0;
+}
+
+// store an entry in the ring only, readline mirroring and the file are up to the caller
+static int store(struct history *h, const char *line, size_t len) {
+    char *entry = strndup(line, len);
+    if (!entry || make_room(h) < 0) {
+        free(entry);
+        return -1;
+    }
+    h->ring[slot(h, h->count++)] = entry;
+    h->bytes += len + 1;
+    while (h->bytes > h->max_bytes && h->count > 1) {
+        evict_oldest(h);
+    }
+    if (h->readline) {
+        add_history(entry);
+    }
+    return 0;
+}
+
+// where the lines at the end of data that fit under both caps start, end
+// is set to the end of the last one without its newline
+static size_t tail_start(const struct history *h, const char *data, size_t size, size_t *end_out) {
+    // walk back from the end one line at a time until a cap is hit
+    size_t start = size;
+    size_t end = size;
+    size_t entries = 0, bytes = 0;
+    if (end > 0 && data[end - 1] == '\n') {
+        end--;
+    }
+    size_t pos = end;
+    while (pos > 0 && entries < h->max_entries) {
+        const char *nl = memrchr(data, '\n', pos);
+        size_t line_start = nl ? (size_t)(nl - data) + 1 : 0;
+        bytes += pos - line_start + 1;
+        if (bytes > h->max_bytes && entries > 0) {
+            break;
+        }
+        entries++;
+        start = line_start;
+        pos = line_start ? line_start - 1 : 0;
+    }
+    *end_out = end;
+    return start;
+}
+
+// read only the entries from the end of the file that fit under both caps
+static void load_tail(struct history *h, int fd, size_t size) {
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        return;
+    }
+
+    // now replay them oldest first
+    size_t end;
+    for (size_t pos = tail_start(h, data, size, &end); pos < end;) {
+        const char *nl = memchr(data + pos, '\n', end - pos);
+        size_t len = nl ? (size_t)(nl - (data + pos)) : end - pos;
+        if (len > 0) {
+            store(h, data + pos, len);
+        }
+        pos += len + 1;
+    }
+    munmap((void *)data, size);
+}
+
+static void load(struct history *h) {
+    h->loaded = true;
+    if (!h->path) {
+        return;
+    }
+
+    int fd = open(h->path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            h->file_bytes = (size_t)st.st_size;
+            load_tail(h, fd, (size_t)st.st_size);
+        }
+        close(fd);
+    }
+
+    h->fd = open(h->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+}
+
+// true if fd is still the file at path, a compaction renames a new one in
+static bool same_file(int fd, const char *path, struct stat *st) {
+    struct stat at;
+    return fstat(fd, st) == 0 && stat(path, &at) == 0 && st->st_dev == at.st_dev && st->st_ino == at.st_ino;
+}
+
+// lock the history file for an append, shared with other shells appending,
+// and follow it to the new file when another shell compacted it meanwhile
+static bool lock_append(struct history *h) {
+    while (h->fd >= 0) {
+        flock(h->fd, LOCK_SH);
+        struct stat st;
+        if (same_file(h->fd, h->path, &st)) {
+            h->file_bytes = (size_t)st.st_size;     // other shells' lines count too
+            return true;
+        }
+        close(h->fd);   // and the lock with it
+        h->fd = open(h->path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    }
+    return false;
+}
+
+// the history readline's startup hook loads
+static struct history *hook_history = NULL;
+
+// readline calls this before it draws a prompt, the first one loads the
+// file so Up has the earlier sessions' lines from the start
+static int load_hook(void) {
+    if (hook_history && !hook_history->loaded) {
+        load(hook_history);
+        using_history();    // readline set its place in the list before this
+    }
+    return 0;
+}
+
+// rewrite the file once appends have doubled it past the cap, keeping the
+// newest lines of the file as it is now so the ones other shells appended
+// stay. The caller holds the shared lock, taken alone here so no shell
+// appends until the new file is in place.
+static void compact(struct history *h) {
+    flock(h->fd, LOCK_EX);
+    int in = open(h->path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (!same_file(h->fd, h->path, &st) || in < 0 || fstat(in, &st) < 0 || st.st_size == 0) {
+        // another shell compacted it first
+        if (in >= 0) {
+            close(in);
+        }
+        flock(h->fd, LOCK_SH);
+        return;
+    }
+    size_t size = (size_t)st.st_size;
+    const char *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, in, 0);
+    close(in);
+    char *tmp = NULL;
+    if (data == MAP_FAILED || asprintf(&tmp, "%s.XXXXXX", h->path) < 0) {
+        if (data != MAP_FAILED) {
+            munmap((void *)data, size);
+        }
+        flock(h->fd, LOCK_SH);
+        return;
+    }
+
+    // mkostemp makes it 0600 like the file it replaces
+    size_t end;
+    size_t start = tail_start(h, data, size, &end);
+    int out = mkostemp(tmp, O_CLOEXEC);
+    bool done = out >= 0 && write_all(out, data + start, size - start) == 0;
+    if (out >= 0 && close(out) < 0) {
+        done = false;
+    }
+    munmap((void *)data, size);
+    if (done && rename(tmp, h->path) == 0) {
+        // shells waiting on the old file find it replaced and open this one
+        close(h->fd);
+        h->fd = open(h->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+        h->file_bytes = size - start;
+        if (h->fd >= 0) {
+            flock(h->fd, LOCK_SH);
+        }
+    } else {
+        if (out >= 0) {
+            unlink(tmp);
+        }
+        flock(h->fd, LOCK_SH);
+    }
+    free(tmp);
+}
+
+/**
+* @brief Set up an empty history. Nothing is read from path until the
+* history is first used or, mirrored into readline, until readline is
+* about to draw its first prompt.
+*
+* @param h The history
+* @param max_entries Most entries to keep, at least one
+* @param max_bytes Most bytes of entries to keep
+* @param path History file to load and append to, or NULL for none
+* @param readline Mirror entries into readline's history list
+*/
+void hist_init(struct history *h, size_t max_entries, size_t max_bytes, const char *path, bool readline) {
+    memset(h, 0, sizeof(*h));
+    h->max_entries = max_entries ? max_entries : 1;
+    h->max_bytes = max_bytes;
+    h->path = path ? strdup(path) : NULL;
+    h->fd = -1;
+    h->readline = readline;
+    if (readline) {
+        stifle_history((int)h->max_entries);
+        hook_history = h;
+        rl_startup_hook = load_hook;
+    }
+}
+
+/**
+* @brief Add an entry, evicting the oldest entries until both caps are
+* met, and append it to the history file. Once the file has grown to
+* twice the byte cap it is rewritten with its newest entries under both
+* caps, from whichever shells appended them. Shells append under a shared
+* flock and the rewrite takes it alone, so no entry is lost to it.
+*
+* @param h The history
+* @param line The entry to add
+* @return On success, zero is returned. On error, -1 is returned.
+*/
+int hist_add(struct history *h, const char *line) {
+    if (!h->loaded) {
+        load(h);
+    }
+
+    size_t len = strlen(line);
+    if (store(h, line, len) < 0) {
+        return -1;
+    }
+
+    if (lock_append(h)) {
+        // one write per entry so O_APPEND keeps concurrent shells from interleaving
+        char stackbuf[512];
+        char *buf = len + 1 <= sizeof(stackbuf) ? stackbuf : malloc(len + 1);
+        if (buf) {
+            memcpy(buf, line, len);
+            buf[len] = '\n';
+            if (write(h->fd, buf, len + 1) == (ssize_t)(len + 1)) {
+                h->file_bytes += len + 1;
+            }
+            if (buf != stackbuf) {
+                free(buf);
+            }
+        }
+        if (h->file_bytes > 2 * h->max_bytes) {
+            compact(h);
+        }
+        if (h->fd >= 0) {
+            flock(h->fd, LOCK_UN);
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief Get an entry by age.
+*
+* @param h The history
+* @param i Index of the entry, 0 is the oldest
+* @return The entry or NULL if i is out of range
+*/
+const char *hist_get(struct history *h, size_t i) {
+    if (!h->loaded) {
+        load(h);
+    }
+    if (i >= h->count) {
+        return NULL;
+    }
+    return h->ring[slot(h, i)];
+}
+
+/**
+* @brief Print every entry the way the history builtin shows it.
+*
+* @param h The history
+*/
+void hist_print(struct history *h) {
+    if (!h->loaded) {
+        load(h);
+    }
+    if (h->count == 0) {
+        printf("No command history available.\n");
+        return;
+    }
+    for (size_t i = 0; i < h->count; i++) {
+        printf("%lu: %s\n", h->base + i + 1, h->ring[slot(h, i)]);
+    }
+}
+
+/**
+* @brief Free the entries and close the history file.
+*
+* @param h The history
+*/
+void hist_destroy(struct history *h) {
+    if (hook_history == h) {
+        hook_history = NULL;
+        rl_startup_hook = NULL;
+    }
+    while (h->count > 0) {
+        evict_oldest(h);
+    }
+    free(h->ring);
+    free(h->path);
+    if (h->fd >= 0) {
+        close(h->fd);
+    }
+    memset(h, 0, sizeof(*h));
+    h->fd = -1;
+}
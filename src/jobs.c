@@ -0,0 +1,895 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <readline/readline.h>
+#include "lab.h"
+
+#define JOBS_KEPT 32                 // finished jobs kept for jobs -o before the oldest goes
+
+// set by the SIGCHLD handler, cleared when jobs_reap collects the children
+static volatile sig_atomic_t sigchld_pending = 0;
+
+// the shell readline's signal hook reaps for
+static struct shell *hook_shell = NULL;
+
+static void on_sigchld(int sig) {
+    UNUSED(sig)
+    sigchld_pending = 1;
+}
+
+// readline calls this when a signal interrupts it waiting for input
+static int reap_hook(void) {
+    if (hook_shell) {
+        jobs_reap(hook_shell);
+    }
+    return 0;
+}
+
+static int pidfd_open(pid_t pid) {
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+// convert a wait status into the number a shell reports as $?
+static int exit_code(int status) {
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    if (WIFSTOPPED(status)) {
+        return 128 + WSTOPSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+static const char *state_name(enum job_state state) {
+    switch (state) {
+        case JOB_RUNNING:
+            return "Running";
+        case JOB_STOPPED:
+            return "Stopped";
+        case JOB_DONE:
+        default:
+            return "Done";
+    }
+}
+
+// write one redirection the way it would be typed, the descriptor is left
+// out when it is the default one for the operator
+static char *redirect_text(char *p, const struct redirect *r) {
+    static const char *ops[] = { "<", ">", ">>", ">&" };
+    int def = r->kind == REDIR_IN ? STDIN_FILENO : STDOUT_FILENO;
+    if (r->fd != def || r->kind == REDIR_DUP) {
+        *p++ = (char)('0' + r->fd);
+    }
+    p = stpcpy(p, ops[r->kind]);
+    if (r->kind == REDIR_DUP) {
+        *p++ = (char)('0' + r->from);
+    } else {
+        p = stpcpy(p, r->path);
+    }
+    return p;
+}
+
+// rebuild the command line from the parsed words for jobs to show
+static char *command_text(const struct pipeline *pl) {
+    size_t len = 1;
+    for (size_t i = 0; i < pl->nstages; i++) {
+        for (char **w = pl->stages[i].argv; *w; w++) {
+            len += strlen(*w) + 1;
+        }
+        for (size_t r = 0; r < pl->stages[i].nredirs; r++) {
+            const struct redirect *redir = &pl->stages[i].redirs[r];
+            len += 5 + (redir->path ? strlen(redir->path) : 0);     // " 2>>" or " 2>&1"
+        }
+        len += 3;       // " | " or " &"
+    }
+
+    char *text = malloc(len);
+    if (!text) {
+        return NULL;
+    }
+
+    char *p = text;
+    for (size_t i = 0; i < pl->nstages; i++) {
+        if (i > 0) {
+            p = stpcpy(p, " | ");
+        }
+        for (char **w = pl->stages[i].argv; *w; w++) {
+            if (w != pl->stages[i].argv) {
+                *p++ = ' ';
+            }
+            p = stpcpy(p, *w);
+        }
+        for (size_t r = 0; r < pl->stages[i].nredirs; r++) {
+            *p++ = ' ';
+            p = redirect_text(p, &pl->stages[i].redirs[r]);
+        }
+    }
+    if (pl->background) {
+        p = stpcpy(p, " &");
+    }
+    *p = '\0';
+    return text;
+}
+
+// stop watching a process that has been reaped or is being forgotten
+static void proc_unwatch(struct shell *sh, struct job_proc *proc) {
+    if (!proc->watch) {
+        return;
+    }
+    // a forked built in has no loop but still holds a copy of the pidfd
+    if (sh->loop) {
+        loop_remove(sh, proc->watch);
+    }
+    close(proc->pidfd);
+    proc->watch = NULL;
+    proc->pidfd = -1;
+}
+
+// record a status change reported by wait4 against the process it belongs to
+static void mark_proc(struct shell *sh, pid_t pid, int status, const struct rusage *ru) {
+    for (size_t j = 0; j < sh->njobs; j++) {
+        struct job *job = sh->jobs[j];
+        for (size_t i = 0; i < job->nprocs; i++) {
+            struct job_proc *proc = &job->procs[i];
+            if (proc->pid != pid) {
+                continue;
+            }
+
+            if (WIFSTOPPED(status)) {
+                proc->stopped = true;
+                proc->status = status;
+                job->notified = false;
+            } else if (WIFCONTINUED(status)) {
+                proc->stopped = false;
+            } else {
+                proc->done = true;
+                proc->stopped = false;
+                proc->status = status;
+                proc->usage = *ru;
+                proc_unwatch(sh, proc);
+                if (job_state(job) == JOB_DONE) {
+                    job->end_ns = monotonic_ns();
+                }
+            }
+            return;
+        }
+    }
+}
+
+// a process's pidfd became readable, it has exited and can be reaped
+static void on_pidfd(struct shell *sh, void *data) {
+    struct job_proc *proc = data;
+    int status;
+    struct rusage ru;
+    TRACE_BEGIN(t_wait);
+    pid_t pid = wait4(proc->pid, &status, WNOHANG, &ru);
+    TRACE_END(t_wait, "wait4");
+    if (pid > 0) {
+        mark_proc(sh, pid, status, &ru);
+    } else if (pid < 0 && errno == ECHILD) {
+        // someone else reaped it, don't wait on it forever
+        memset(&ru, 0, sizeof(ru));
+        mark_proc(sh, proc->pid, 0, &ru);
+    }
+}
+
+// drain the signalfd, true if SIGCHLD arrived since it was last read
+static bool sigchld_arrived(struct shell *sh) {
+    struct signalfd_siginfo info[8];
+    bool arrived = false;
+    while (read(sh->sigchld_fd, info, sizeof(info)) > 0) {
+        arrived = true;
+    }
+    return arrived;
+}
+
+static void on_sigchld_fd(struct shell *sh, void *data) {
+    UNUSED(data)
+    jobs_reap(sh);
+}
+
+// write what the ring still holds from byte from of the job's output on
+static void output_show(struct job_output *out, size_t from) {
+    if (!out->ring) {
+        return;
+    }
+    if (out->total - from > JOB_OUTPUT_SIZE) {
+        from = out->total - JOB_OUTPUT_SIZE;
+    }
+    fflush(stdout);
+    size_t at = from % JOB_OUTPUT_SIZE, len = out->total - from;
+    size_t first = len < JOB_OUTPUT_SIZE - at ? len : JOB_OUTPUT_SIZE - at;
+    write_all(STDOUT_FILENO, out->ring + at, first);
+    write_all(STDOUT_FILENO, out->ring, len - first);
+    out->shown = out->total;
+}
+
+static void output_close(struct shell *sh, struct job_output *out) {
+    if (out->watch && sh->loop) {
+        loop_remove(sh, out->watch);
+    }
+    if (out->fd >= 0) {
+        close(out->fd);
+    }
+    out->watch = NULL;
+    out->fd = -1;
+}
+
+// read everything the pipe has into the ring without blocking, a job in
+// the foreground also gets it written straight through
+static void on_output(struct shell *sh, void *data) {
+    struct job *job = data;
+    struct job_output *out = &job->out;
+    char spill[512];
+    for (;;) {
+        size_t at = out->total % JOB_OUTPUT_SIZE;
+        ssize_t n = out->ring ? read(out->fd, out->ring + at, JOB_OUTPUT_SIZE - at)
+                              : read(out->fd, spill, sizeof(spill));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            return;
+        }
+        if (n <= 0) {
+            output_close(sh, out);
+            return;
+        }
+
+        // the first bytes decide that the job needs a ring at all
+        if (!out->ring) {
+            out->ring = malloc(JOB_OUTPUT_SIZE);
+            if (!out->ring) {
+                continue;
+            }
+            memcpy(out->ring, spill, (size_t)n);
+        }
+        size_t before = out->total;
+        out->total += (size_t)n;
+        if (!job->background) {
+            output_show(out, before);
+        }
+    }
+}
+
+/**
+* @brief Send a background job's stdout and stderr to a pipe the event loop
+* reads into a ring buffer of JOB_OUTPUT_SIZE bytes, so the job never
+* writes over the prompt and a job that prints a lot costs no more memory
+* than one that prints a little. There is no thread or process per job,
+* only the pipe and one watch, and the ring is not allocated until the job
+* writes something. The output is shown by jobs -o or by fg. Without an
+* event loop there is nothing to do it and the job writes to the terminal.
+*
+* @param sh The shell
+* @param job The job, before any of its processes start
+* @return The write end to give every process of the job, close on exec,
+* or -1 if the output is not captured
+*/
+int job_capture(struct shell *sh, struct job *job) {
+    if (!sh->loop) {
+        return -1;
+    }
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    job->out.fd = fds[0];
+    job->out.watch = loop_add(sh, fds[0], on_output, job);
+    if (!job->out.watch) {
+        output_close(sh, &job->out);
+        close(fds[1]);
+        return -1;
+    }
+    return fds[1];
+}
+
+/**
+* @brief Print the output a job's ring still holds, for jobs -o. A finished
+* job it was kept for is removed from the table afterwards.
+*
+* @param sh The shell
+* @param job The job
+*/
+void job_output_print(struct shell *sh, struct job *job) {
+    struct job_output *out = &job->out;
+    if (out->fd >= 0) {
+        on_output(sh, job);
+    }
+    if (out->total > JOB_OUTPUT_SIZE) {
+        printf("[%d] %zu earlier bytes dropped\n", job->id, out->total - JOB_OUTPUT_SIZE);
+    }
+    output_show(out, 0);
+    if (job->kept) {
+        job_remove(sh, job);
+    }
+}
+
+// block until every process of the job is done or the job stops
+static int job_wait(struct shell *sh, struct job *job) {
+    while (job_state(job) == JOB_RUNNING) {
+        // pidfds report exits and the signalfd stops, anything else the loop
+        // watches is serviced while the job runs
+        if (sh->loop && loop_run(sh, -1) >= 0) {
+            continue;
+        }
+
+        int status;
+        struct rusage ru;
+        TRACE_BEGIN(t_wait);
+        pid_t pid = wait4(-job->pgid, &status, WUNTRACED, &ru);
+        TRACE_END(t_wait, "wait4");
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            // nothing is left in the group to wait for
+            perror("wait4");
+            for (size_t i = 0; i < job->nprocs; i++) {
+                job->procs[i].done = true;
+            }
+            job->end_ns = monotonic_ns();
+            break;
+        }
+        mark_proc(sh, pid, status, &ru);
+    }
+
+    if (job_state(job) == JOB_STOPPED) {
+        for (size_t i = 0; i < job->nprocs; i++) {
+            if (job->procs[i].stopped) {
+                return exit_code(job->procs[i].status);
+            }
+        }
+    }
+    return exit_code(job->procs[job->nprocs - 1].status);
+}
+
+/**
+* @brief Wait for every process of a job to exit by its pid, never by its
+* group or with -1, so a caller sharing the process with others only ever
+* reaps its own children. Stops are not waited for.
+*
+* @param sh The shell
+* @param job The job
+* @return The exit status of the last process, 128 plus the signal number
+* if it was killed, or 127 if the job has no processes
+*/
+int job_wait_pids(struct shell *sh, struct job *job) {
+    for (size_t i = 0; i < job->nprocs; i++) {
+        struct job_proc *proc = &job->procs[i];
+        while (!proc->done) {
+            int status;
+            struct rusage ru;
+            pid_t pid = wait4(proc->pid, &status, 0, &ru);
+            if (pid < 0 && errno == EINTR) {
+                continue;
+            }
+            if (pid < 0) {
+                // someone else reaped it, there is no status to report
+                perror("wait4");
+                proc->done = true;
+                proc->status = 127 << 8;
+                break;
+            }
+            mark_proc(sh, pid, status, &ru);
+        }
+    }
+    job->end_ns = monotonic_ns();
+    return job->nprocs ? exit_code(job->procs[job->nprocs - 1].status) : 127;
+}
+
+// report what a finished job cost if it was timed or stats mode is on
+static void job_report(struct shell *sh, struct job *job) {
+    if (!job->timed && !sh->stats) {
+        return;
+    }
+
+    struct cmd_stats st;
+    memset(&st, 0, sizeof(st));
+    st.spawn_ns = job->spawned_ns - job->start_ns;
+    st.run_ns = job->end_ns - job->spawned_ns;
+    st.status = exit_code(job->procs[job->nprocs - 1].status);
+    for (size_t i = 0; i < job->nprocs; i++) {
+        cmd_stats_add(&st, &job->procs[i].usage);
+    }
+    cmd_stats_report(sh, &st, job->timed, job->cmd);
+}
+
+static void job_continue(struct job *job) {
+    for (size_t i = 0; i < job->nprocs; i++) {
+        job->procs[i].stopped = false;
+    }
+    job->notified = false;
+    if (kill(-job->pgid, SIGCONT) < 0) {
+        perror("kill (SIGCONT)");
+    }
+}
+
+/**
+* @brief Install the SIGCHLD handler that drives asynchronous reaping of
+* jobs. Called by sh_init. With an event loop SIGCHLD is blocked instead and
+* read from a signalfd in the loop.
+*
+* @param sh The shell
+*/
+void jobs_init(struct shell *sh) {
+    sh->jobs = NULL;
+    sh->njobs = 0;
+    sh->jobs_cap = 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // readline gives up its read when SIGCHLD arrives, reap right then
+    hook_shell = sh;
+    rl_signal_event_hook = reap_hook;
+
+    sh->sigchld_watch = NULL;
+    if (!sh->loop) {
+        return;
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    sh->sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sh->sigchld_fd >= 0) {
+        sh->sigchld_watch = loop_add(sh, sh->sigchld_fd, on_sigchld_fd, NULL);
+    }
+    if (!sh->sigchld_watch) {
+        // stops can't be seen without it, go back to the handler
+        perror("signalfd");
+        if (sh->sigchld_fd >= 0) {
+            close(sh->sigchld_fd);
+        }
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+        loop_destroy(sh);
+    }
+}
+
+// add a job for cmd with room for nprocs processes, cmd is freed on failure
+static struct job *job_alloc(struct shell *sh, char *cmd, size_t nprocs) {
+    if (!cmd) {
+        return NULL;
+    }
+    if (sh->njobs == sh->jobs_cap) {
+        size_t cap = sh->jobs_cap ? sh->jobs_cap * 2 : 8;
+        struct job **jobs = realloc(sh->jobs, cap * sizeof(*jobs));
+        if (!jobs) {
+            free(cmd);
+            return NULL;
+        }
+        sh->jobs = jobs;
+        sh->jobs_cap = cap;
+    }
+
+    struct job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        free(cmd);
+        return NULL;
+    }
+    job->procs = malloc(nprocs * sizeof(*job->procs));
+    job->cmd = cmd;
+    if (!job->procs) {
+        free(job->cmd);
+        free(job);
+        return NULL;
+    }
+    job->out.fd = -1;
+    job->start_ns = monotonic_ns();
+    job->spawned_ns = job->start_ns;
+    job->end_ns = job->start_ns;
+
+    // like other shells the new job is numbered one past the highest in use
+    job->id = sh->njobs ? sh->jobs[sh->njobs - 1]->id + 1 : 1;
+    sh->jobs[sh->njobs++] = job;
+    return job;
+}
+
+/**
+* @brief Add a new job for pl to the job table. The job has no processes
+* until job_add_proc is called for each stage that starts.
+*
+* @param sh The shell
+* @param pl The pipeline the job runs, used for the command shown by jobs
+* @return The new job or NULL if memory could not be allocated
+*/
+struct job *job_new(struct shell *sh, const struct pipeline *pl) {
+    struct job *job = job_alloc(sh, command_text(pl), pl->nstages);
+    if (job) {
+        job->background = pl->background;
+        job->timed = pl->timed;
+    }
+    return job;
+}
+
+/**
+* @brief Add a new foreground job to the job table for something other
+* than a parsed pipeline, such as a built in that starts processes of its
+* own and wants them stopped and continued like any other job.
+*
+* @param sh The shell
+* @param cmd The command shown by jobs, copied
+* @param nprocs The most processes job_add_proc will be called for
+* @return The new job or NULL if memory could not be allocated
+*/
+struct job *job_new_cmd(struct shell *sh, const char *cmd, size_t nprocs) {
+    return job_alloc(sh, strdup(cmd), nprocs);
+}
+
+/**
+* @brief Add a new foreground job to the job table for a command that is
+* not a parsed pipeline, shown by jobs like the line was typed.
+*
+* @param sh The shell
+* @param argv The words of the command, joined with spaces
+* @param nprocs The most processes job_add_proc will be called for
+* @return The new job or NULL if memory could not be allocated
+*/
+struct job *job_new_argv(struct shell *sh, char **argv, size_t nprocs) {
+    size_t len = 1;
+    for (char **w = argv; *w; w++) {
+        len += strlen(*w) + 1;
+    }
+    char *text = malloc(len);
+    if (!text) {
+        return NULL;
+    }
+    char *p = text;
+    *p = '\0';
+    for (char **w = argv; *w; w++) {
+        p = stpcpy(p, *w);
+        *p++ = ' ';
+    }
+    if (p > text) {
+        p[-1] = '\0';
+    }
+    return job_alloc(sh, text, nprocs);
+}
+
+/**
+* @brief Record that a process was started for a job. The first process
+* added names the job's process group. With an event loop the process's
+* pidfd is watched so its exit is reaped as soon as it happens.
+*
+* @param sh The shell
+* @param job The job
+* @param pid The process
+* @return On success, zero is returned. On error, -1 is returned.
+*/
+int job_add_proc(struct shell *sh, struct job *job, pid_t pid) {
+    if (job->nprocs == 0) {
+        job->pgid = sh->shared_pgroup ? sh->shell_pgid : pid;
+    }
+    struct job_proc *proc = &job->procs[job->nprocs++];
+    proc->pid = pid;
+    proc->status = 0;
+    proc->done = false;
+    proc->stopped = false;
+    proc->pidfd = -1;
+    proc->watch = NULL;
+
+    if (sh->loop) {
+        // without a pidfd the exit is still picked up through SIGCHLD
+        proc->pidfd = pidfd_open(pid);
+        if (proc->pidfd >= 0) {
+            proc->watch = loop_add(sh, proc->pidfd, on_pidfd, proc);
+            if (!proc->watch) {
+                close(proc->pidfd);
+                proc->pidfd = -1;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief Remove a job from the table and free it.
+*
+* @param sh The shell
+* @param job The job to remove
+*/
+void job_remove(struct shell *sh, struct job *job) {
+    for (size_t j = 0; j < sh->njobs; j++) {
+        if (sh->jobs[j] == job) {
+            memmove(&sh->jobs[j], &sh->jobs[j + 1], (sh->njobs - j - 1) * sizeof(*sh->jobs));
+            sh->njobs--;
+            break;
+        }
+    }
+    for (size_t i = 0; i < job->nprocs; i++) {
+        proc_unwatch(sh, &job->procs[i]);
+    }
+    output_close(sh, &job->out);
+    free(job->out.ring);
+    free(job->procs);
+    free(job->cmd);
+    free(job);
+}
+
+/**
+* @brief Work out what state a job is in from its processes.
+*
+* @param job The job
+* @return JOB_DONE once every process is reaped, JOB_STOPPED when every
+* live process is stopped, otherwise JOB_RUNNING
+*/
+enum job_state job_state(const struct job *job) {
+    bool any_stopped = false;
+    for (size_t i = 0; i < job->nprocs; i++) {
+        if (!job->procs[i].done && !job->procs[i].stopped) {
+            return JOB_RUNNING;
+        }
+        any_stopped |= job->procs[i].stopped;
+    }
+    return any_stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+/**
+* @brief Find a job from a jobs/fg/bg argument. The spec may be a job
+* number with or without a leading '%'. NULL selects the most recently
+* started job.
+*
+* @param sh The shell
+* @param spec The job to look for
+* @return The job or NULL if there is no such job
+*/
+struct job *job_find(struct shell *sh, const char *spec) {
+    if (sh->njobs == 0) {
+        return NULL;
+    }
+    if (!spec) {
+        return sh->jobs[sh->njobs - 1];
+    }
+
+    if (*spec == '%') {
+        spec++;
+    }
+    char *end;
+    long id = strtol(spec, &end, 10);
+    if (end == spec || *end != '\0') {
+        return NULL;
+    }
+    for (size_t j = 0; j < sh->njobs; j++) {
+        if (sh->jobs[j]->id == id) {
+            return sh->jobs[j];
+        }
+    }
+    return NULL;
+}
+
+/**
+* @brief Put a job in the foreground and wait for it to finish or stop. If
+* cont is set the job is sent SIGCONT first, restoring the terminal modes
+* it had when it stopped. A finished job is removed from the table.
+*
+* @param sh The shell
+* @param job The job
+* @param cont Continue the job before waiting on it
+* @return The exit status of the last process, or 128 plus the signal
+* number if it was killed or stopped
+*/
+int job_foreground(struct shell *sh, struct job *job, bool cont) {
+    job->background = false;
+    if (sh->shell_is_interactive) {
+        TRACE_BEGIN(t_give);
+        terminal_give(sh, job->pgid);
+        if (cont && job->has_tmodes) {
+            tcsetattr(sh->shell_terminal, TCSADRAIN, &job->tmodes);
+        }
+        TRACE_END(t_give, "terminal to job");
+    }
+    if (job->out.total > job->out.shown) {
+        output_show(&job->out, job->out.shown);
+    }
+    if (cont) {
+        job_continue(job);
+    }
+
+    int rval = job_wait(sh, job);
+    enum job_state state = job_state(job);
+    if (job->out.fd >= 0) {
+        on_output(sh, job);
+    }
+
+    // get control of the shell
+    if (sh->shell_is_interactive) {
+        TRACE_BEGIN(t_take);
+        job->has_tmodes = terminal_take(sh, state == JOB_STOPPED ? &job->tmodes : NULL);
+        TRACE_END(t_take, "terminal to shell");
+    }
+
+    if (state == JOB_DONE) {
+        job_report(sh, job);
+        job_remove(sh, job);
+    } else {
+        printf("\n[%d]+  Stopped\t%s\n", job->id, job->cmd);
+        job->notified = true;
+    }
+    return rval;
+}
+
+/**
+* @brief Continue a stopped job in the background.
+*
+* @param sh The shell
+* @param job The job
+*/
+void job_background(struct shell *sh, struct job *job) {
+    UNUSED(sh)
+    job->background = true;
+    job_continue(job);
+
+    // a job started in the background already has its " &"
+    size_t len = strlen(job->cmd);
+    bool amp = len >= 2 && strcmp(job->cmd + len - 2, " &") == 0;
+    printf("[%d]+ %s%s\n", job->id, job->cmd, amp ? "" : " &");
+}
+
+/**
+* @brief Collect the status of every job process that has changed state
+* without blocking. Does nothing unless SIGCHLD arrived since the last
+* call so it is cheap to call often.
+*
+* @param sh The shell
+*/
+void jobs_reap(struct shell *sh) {
+    if (sh->loop) {
+        if (!sigchld_arrived(sh)) {
+            return;
+        }
+    } else if (!sigchld_pending) {
+        return;
+    } else {
+        // clear first so a SIGCHLD that lands while reaping is not lost
+        sigchld_pending = 0;
+    }
+
+    for (size_t j = 0; j < sh->njobs; j++) {
+        struct job *job = sh->jobs[j];
+        for (size_t i = 0; i < job->nprocs; i++) {
+            if (job->procs[i].done) {
+                continue;
+            }
+            int status;
+            struct rusage ru;
+            if (wait4(job->procs[i].pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru) > 0) {
+                mark_proc(sh, job->procs[i].pid, status, &ru);
+            }
+        }
+    }
+}
+
+// drop the oldest finished jobs kept for their output beyond JOBS_KEPT
+static void keep_bounded(struct shell *sh) {
+    size_t kept = 0;
+    for (size_t j = 0; j < sh->njobs; j++) {
+        kept += sh->jobs[j]->kept;
+    }
+    for (size_t j = 0; j < sh->njobs && kept > JOBS_KEPT;) {
+        if (sh->jobs[j]->kept) {
+            job_remove(sh, sh->jobs[j]);
+            kept--;
+            continue;
+        }
+        j++;
+    }
+}
+
+/**
+* @brief Reap and then tell the user about background jobs that finished
+* or stopped since the last call. Finished jobs are removed unless they
+* left output nobody has seen, which is kept for jobs -o. Called before
+* each prompt.
+*
+* @param sh The shell
+*/
+void jobs_notify(struct shell *sh) {
+    jobs_reap(sh);
+
+    for (size_t j = 0; j < sh->njobs;) {
+        struct job *job = sh->jobs[j];
+        enum job_state state = job_state(job);
+        if (state == JOB_DONE && job->kept) {
+            j++;
+            continue;
+        }
+        if (state == JOB_DONE) {
+            if (job->out.fd >= 0) {
+                on_output(sh, job);
+            }
+            job_report(sh, job);
+
+            // output nobody has seen yet stays for jobs -o
+            if (job->out.total > job->out.shown) {
+                printf("[%d]   Done\t%s\t(%zu bytes of output, jobs -o %d)\n", job->id, job->cmd,
+                       job->out.total, job->id);
+                job->kept = true;
+                keep_bounded(sh);
+                j = 0;
+                continue;
+            }
+            printf("[%d]   Done\t%s\n", job->id, job->cmd);
+            job_remove(sh, job);
+            continue;
+        }
+        if (state == JOB_STOPPED && !job->notified) {
+            printf("[%d]+  Stopped\t%s\n", job->id, job->cmd);
+            job->notified = true;
+        }
+        j++;
+    }
+}
+
+/**
+* @brief Check whether jobs_notify has anything to tell the user, so the
+* event loop only redraws the prompt when a job finished or stopped.
+*
+* @param sh The shell
+* @return True if a job finished or stopped and has not been reported
+*/
+bool jobs_need_notify(struct shell *sh) {
+    for (size_t j = 0; j < sh->njobs; j++) {
+        enum job_state state = job_state(sh->jobs[j]);
+        if ((state == JOB_DONE && !sh->jobs[j]->kept) || (state == JOB_STOPPED && !sh->jobs[j]->notified)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+* @brief Print the job table the way the jobs builtin shows it.
+*
+* @param sh The shell
+*/
+void jobs_print(struct shell *sh) {
+    jobs_reap(sh);
+    for (size_t j = 0; j < sh->njobs; j++) {
+        struct job *job = sh->jobs[j];
+        printf("[%d]  %-8s\t%s\n", job->id, state_name(job_state(job)), job->cmd);
+    }
+}
+
+/**
+* @brief Free every job in the table.
+*
+* @param sh The shell
+*/
+void jobs_destroy(struct shell *sh) {
+    while (sh->njobs > 0) {
+        job_remove(sh, sh->jobs[sh->njobs - 1]);
+    }
+    free(sh->jobs);
+    sh->jobs = NULL;
+    sh->jobs_cap = 0;
+    if (hook_shell == sh) {
+        hook_shell = NULL;
+        rl_signal_event_hook = NULL;
+    }
+    if (sh->sigchld_watch) {
+        loop_remove(sh, sh->sigchld_watch);
+        close(sh->sigchld_fd);
+        sh->sigchld_watch = NULL;
+
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    }
+}
@@ -1,15 +1,28 @@
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
+#include <errno.h>
 #include <signal.h>
 #include <pwd.h>
+#include <fcntl.h>
 #include <readline/readline.h>
 #include <readline/history.h>
 #include "lab.h"
 
+// launch backend picked with -b, applied to the shell by sh_init
+static enum spawn_backend opt_backend = SPAWN_POSIX;
+
+// script picked with -f, running one makes the shell non-interactive
+static const char *opt_script = NULL;
+
+// stats mode picked with -s, every command's cost is logged
+static bool opt_stats = false;
 
 
 /**
@@ -37,7 +50,8 @@ char *get_prompt(const char *env) {
 /**
 * Changes the current working directory of the shell. Uses the linux system
 * call chdir. With no arguments the users home directory is used as the
-* directory to change to.
+* directory to change to, $HOME if it is set. The cd builtin uses dirs_cd,
+* which also keeps the shell's cached directory up to date.
 *
 * @param dir The directory to change to
 * @return  On success, zero is returned.  On error, -1 is returned, and
@@ -46,6 +60,12 @@ char *get_prompt(const char *env) {
 //Simplified change_dir function to fix failing tests post code review
 int change_dir(char **dir) {
     if (!dir[1] || !dir) {
+        // $HOME first, the password database can be slow to ask
+        const char *home = getenv("HOME");
+        if (home && *home) {
+            return chdir(home);
+        }
+
         // Retrieve the home directory of user
         struct passwd *pw = getpwuid(getuid());
         
@@ -63,11 +83,386 @@ int change_dir(char **dir) {
 }
 
 
+// recover the arena header that sits directly in front of argv
+static struct cmd_arena *arena_of(char **argv) {
+    return (struct cmd_arena *)((char *)argv - offsetof(struct cmd_arena, argv));
+}
+
+// lay out an arena of slots argv entries followed by bytes of words
+static void arena_init(struct cmd_arena *arena, size_t slots, size_t bytes) {
+    arena->buf = (char *)&arena->argv[slots];
+    arena->size = bytes;
+    arena->argc = 0;
+    arena->cap = slots;
+}
+
+// characters that end a word on their own and separate commands
+static bool is_operator(char c) {
+    return c == '|' || c == '&' || c == '<' || c == '>';
+}
+
+static bool is_redirect(char c) {
+    return c == '<' || c == '>';
+}
+
+static bool is_name_char(char c, bool first) {
+    return isalpha((unsigned char)c) || c == '_' || (!first && isdigit((unsigned char)c));
+}
+
+#define LEX_NAME_MAX 256    // longer variable names expand to nothing
+
+// the lexer runs twice over a line, first measuring then writing the words,
+// and both passes take exactly the same steps so the sizes always agree. A
+// line with a $(...) is checked once before that with nothing run.
+struct lex {
+    const char *p;       // next byte of the line
+    char *out;           // where word bytes go, NULL while measuring
+    size_t len;          // bytes of words so far, NULs included
+    size_t cap;          // longest a pattern may be, 0 when not scanning one
+    bool ops;            // '|', '&', '<' and '>' end words and come back as LEX_OP
+    bool pattern;        // quoted bytes are escaped so the word can be matched
+    bool magic;          // the word has an unquoted '*', '?' or '['
+    char op;             // the operator of the last LEX_OP
+    bool substituted;    // the word has a $(...) in it and is never a pattern
+    size_t splits;       // words a $(...) split off the word being scanned
+    size_t words;        // words the last LEX_WORD stands for, more for a pattern
+    struct glob_words *glob;   // matches of each pattern and output of each $(...)
+    struct shell *sh;    // runs $(...), NULL if the line may not have any
+    bool dry;            // only checking, a $(...) is one word and patterns aren't matched
+    int dirfd;           // where relative patterns are matched
+    struct glob_cache *globs;   // listings they are matched against, NULL for the shared ones
+    const char *err;     // what was wrong for LEX_ERROR
+};
+
+enum lex_token {
+    LEX_END,
+    LEX_WORD,
+    LEX_OP,
+    LEX_ERROR,
+};
+
+static bool is_glob_char(char c) {
+    return c == '*' || c == '?' || c == '[';
+}
+
+static void lex_raw(struct lex *lx, const char *s, size_t n) {
+    if (lx->cap && lx->len + n >= lx->cap) {
+        // too long for a pattern, carry on measuring so the caller can tell
+        lx->out = NULL;
+    }
+    if (lx->out) {
+        memcpy(lx->out + lx->len, s, n);
+    }
+    lx->len += n;
+}
+
+// quoted bytes, when scanning a pattern the ones that would match are escaped
+static void lex_put(struct lex *lx, const char *s, size_t n) {
+    if (!lx->pattern) {
+        lex_raw(lx, s, n);
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        if (is_glob_char(s[i]) || s[i] == '\\') {
+            lex_raw(lx, "\\", 1);
+        }
+        lex_raw(lx, &s[i], 1);
+    }
+}
+
+// an unquoted byte of a word
+static void lex_lit(struct lex *lx, char c) {
+    if (is_glob_char(c)) {
+        lx->magic = true;
+    }
+    lex_raw(lx, &c, 1);
+}
+
+// the ')' that closes a $( whose inside starts at p, stepping over quotes,
+// escapes and parentheses nested inside it
+static const char *subst_end(const char *p) {
+    int depth = 1;
+    for (; *p; p++) {
+        if (*p == '\\' && p[1]) {
+            p++;
+        } else if (*p == '\'') {
+            p = strchr(p + 1, '\'');
+            if (!p) {
+                return NULL;
+            }
+        } else if (*p == '"') {
+            for (p++; *p && *p != '"'; p++) {
+                if (*p == '\\' && p[1]) {
+                    p++;
+                }
+            }
+            if (!*p) {
+                return NULL;
+            }
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static int subst_check(struct lex *lx, const char *cmd, size_t len);
+
+// run the command of $(...) with lx->p on the '(', unquoted output is split
+// into words at blanks and each one after the first ends the word so far
+static int lex_subst(struct lex *lx, bool quoted) {
+    const char *cmd = lx->p + 1;
+    const char *end = subst_end(cmd);
+    if (!end) {
+        lx->err = "unterminated $(";
+        return -1;
+    }
+    lx->p = end + 1;
+    if (!lx->sh || !lx->glob) {
+        lx->err = "command substitution needs a shell";
+        return -1;
+    }
+    lx->substituted = true;
+    if (lx->dry) {
+        lex_raw(lx, "$", 1);
+        return subst_check(lx, cmd, (size_t)(end - cmd));
+    }
+
+    // the command runs once, while measuring, and its words are read back after
+    size_t count, bytes;
+    const char *words;
+    if (lx->out) {
+        words = glob_next(lx->glob, &count, &bytes);
+    } else {
+        words = subst_capture(lx->sh, lx->glob, cmd, (size_t)(end - cmd), !quoted, &count, &bytes);
+        if (!words) {
+            lx->err = "command substitution failed";
+            return -1;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t n = strlen(words);
+        if (i > 0) {
+            lex_raw(lx, "", 1);
+            lx->splits++;
+        }
+        lex_raw(lx, words, n);
+        words += n + 1;
+    }
+    return 0;
+}
+
+// expand $NAME, ${NAME} or $(command) with lx->p just past the '$', a '$'
+// that starts none of them is kept as it is
+static int lex_dollar(struct lex *lx, bool quoted) {
+    if (*lx->p == '(') {
+        return lex_subst(lx, quoted);
+    }
+    const char *name = lx->p;
+    bool braced = *name == '{';
+    if (braced) {
+        name++;
+    }
+    size_t n = 0;
+    while (is_name_char(name[n], n == 0)) {
+        n++;
+    }
+
+    if (braced && (n == 0 || name[n] != '}')) {
+        lx->err = "bad substitution";
+        return -1;
+    }
+    if (n == 0) {
+        lex_put(lx, "$", 1);
+        return 0;
+    }
+    lx->p = name + n + (braced ? 1 : 0);
+
+    char key[LEX_NAME_MAX];
+    if (n < sizeof(key)) {
+        memcpy(key, name, n);
+        key[n] = '\0';
+        const char *value = getenv(key);
+        if (value) {
+            lex_put(lx, value, strlen(value));
+        }
+    }
+    return 0;
+}
+
+// the inside of "...", where only $ expands and \ escapes $ " \ and `
+static int lex_double_quoted(struct lex *lx) {
+    for (;;) {
+        char c = *lx->p++;
+        if (c == '\0') {
+            lx->err = "unterminated \"";
+            return -1;
+        }
+        if (c == '"') {
+            return 0;
+        }
+        if (c == '\\' && *lx->p && strchr("$\"\\`", *lx->p)) {
+            lex_put(lx, lx->p++, 1);
+        } else if (c == '$') {
+            if (lex_dollar(lx, true) < 0) {
+                return -1;
+            }
+        } else {
+            lex_put(lx, &c, 1);
+        }
+    }
+}
+
+// scan the bytes of one word, setting *quoted if any part of it was
+static int lex_word(struct lex *lx, bool *quoted) {
+    for (;;) {
+        char c = *lx->p;
+        if (c == '\0' || isspace((unsigned char)c) || (lx->ops && is_operator(c))) {
+            return 0;
+        }
+        lx->p++;
+        if (c == '\\') {
+            if (*lx->p) {
+                lex_put(lx, lx->p++, 1);
+            }
+            *quoted = true;
+        } else if (c == '\'') {
+            const char *end = strchr(lx->p, '\'');
+            if (!end) {
+                lx->err = "unterminated '";
+                return -1;
+            }
+            lex_put(lx, lx->p, (size_t)(end - lx->p));
+            lx->p = end + 1;
+            *quoted = true;
+        } else if (c == '"') {
+            if (lex_double_quoted(lx) < 0) {
+                return -1;
+            }
+            *quoted = true;
+        } else if (c == '$') {
+            if (lex_dollar(lx, false) < 0) {
+                return -1;
+            }
+        } else {
+            lex_lit(lx, c);
+        }
+    }
+}
+
+// expand the word at start as a pattern, its matches replace what was
+// written from begin on, returning 0 when it matches nothing
+static int lex_glob(struct lex *lx, const char *start, size_t begin) {
+    const char *matches;
+    size_t count, bytes;
+    if (lx->out) {
+        matches = glob_next(lx->glob, &count, &bytes);
+    } else {
+        // scan the word again with the quoted bytes escaped
+        char pat[PATH_MAX];
+        struct lex sub = { .p = start, .out = pat, .cap = sizeof(pat), .ops = lx->ops, .pattern = true };
+        bool quoted = false;
+        lex_word(&sub, &quoted);
+        // one that is too long still gets its record, with no matches
+        pat[sub.len < sizeof(pat) ? sub.len : 0] = '\0';
+        matches = glob_expand(lx->glob, lx->globs, lx->dirfd, pat, &count, &bytes);
+        if (!matches) {
+            lx->err = "out of memory";
+            return -1;
+        }
+    }
+    if (count == 0) {
+        return 0;
+    }
+
+    // the writing pass has already put the word itself down, so the space
+    // taken is the longer of the two
+    size_t written = lx->len - begin;
+    lx->len = begin;
+    lex_raw(lx, matches, bytes);
+    if (written > bytes) {
+        lx->len = begin + written;
+    }
+    lx->words = count;
+    return 1;
+}
+
+// scan the next word or operator, in the writing pass *word is where the
+// word was written and *raw is always where it started in the line. A
+// pattern that matches files, or a word that $(...) split, stands for
+// lx->words words back to back.
+static enum lex_token lex_next(struct lex *lx, char **word, const char **raw) {
+    for (;;) {
+        while (isspace((unsigned char)*lx->p)) lx->p++;
+        if (*lx->p == '\0') {
+            return LEX_END;
+        }
+        if (lx->ops && is_operator(*lx->p)) {
+            lx->op = *lx->p++;
+            return LEX_OP;
+        }
+
+        const char *start = lx->p;
+        size_t begin = lx->len;
+        bool quoted = false;
+        lx->magic = false;
+        lx->substituted = false;
+        lx->splits = 0;
+        if (lex_word(lx, &quoted) < 0) {
+            return LEX_ERROR;
+        }
+
+        // "" is an empty word but an unquoted variable that is empty is no word at all
+        if (!quoted && lx->len == begin) {
+            continue;
+        }
+        if (word) {
+            *word = lx->out ? lx->out + begin : NULL;
+        }
+        if (raw) {
+            *raw = start;
+        }
+        if (lx->magic && lx->glob && !lx->substituted && !lx->dry) {
+            int globbed = lex_glob(lx, start, begin);
+            if (globbed < 0) {
+                return LEX_ERROR;
+            }
+            if (globbed) {
+                return LEX_WORD;
+            }
+        }
+        lex_put(lx, "", 1);
+        lx->words = 1 + lx->splits;
+        return LEX_WORD;
+    }
+}
+
+// point argv at each of the words the last LEX_WORD wrote from word on
+static void lex_store(const struct lex *lx, char *word, char **argv) {
+    for (size_t i = 0; i < lx->words; i++) {
+        argv[i] = word;
+        word += strlen(word) + 1;
+    }
+}
+
+// true if the word just scanned was a single unquoted digit
+static bool lex_digit(const struct lex *lx, const char *raw) {
+    return lx->p - raw == 1 && isdigit((unsigned char)raw[0]);
+}
+
 /**
 * @brief Convert line read from the user into to format that will work with
 * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
-* This function allocates memory that must be reclaimed with the cmd_free
-* function.
+* Words may be quoted with '...' or "..." and a backslash escapes the next
+* character. $NAME and ${NAME} expand to the value of the environment
+* variable outside single quotes, the value is never split into more
+* words. Unquoted *, ? and [...] make a word a pattern that expands to the
+* sorted paths it matches, see glob_expand, and a pattern that matches
+* nothing is kept as it is. The line is measured in a first pass so the result, a struct
+* cmd_arena holding the argv array and every word, is a single allocation
+* that must be reclaimed with the cmd_free function.
 *
 * @param line The line to process
 *
@@ -80,58 +475,63 @@ char **cmd_parse(const char *line) {
         return NULL;
     }
 
-    // copy user input so we can also access the original string
-    char *input = strdup(line);
+    // sysconf costs a getrlimit syscall so only look it up once, threads
+    // racing to do it all store the same value
+    static long cached_arg_max = 0;
+    long arg_max = __atomic_load_n(&cached_arg_max, __ATOMIC_RELAXED);
+    if (arg_max <= 0) {
+        arg_max = sysconf(_SC_ARG_MAX);
+        __atomic_store_n(&cached_arg_max, arg_max, __ATOMIC_RELAXED);
+    }
 
-    //check for failed malloc
-    if (!input) {
-        fprintf(stderr, "Memory allocation failed for input.\n");
-        return NULL;
+    // count the words and their bytes first so there is only one malloc
+    struct glob_words gw = { 0 };
+    struct lex lx = { .p = line, .glob = &gw, .dirfd = AT_FDCWD };
+    size_t argc = 0;
+    enum lex_token tok;
+    while ((tok = lex_next(&lx, NULL, NULL)) == LEX_WORD) {
+        argc += lx.words;
     }
-    
-    // points to an array of memory addresses (each of those addresses points to a string)
-    long arg_max = sysconf(_SC_ARG_MAX);
-    char **args = malloc(arg_max * sizeof(char *));  // allocate memory for 64 args
-    
-    // check for failed malloc
-    if (!args) {
-        fprintf(stderr, "Memory allocation failed for arguments array.\n");
-        free(input);
+    if (tok == LEX_ERROR) {
+        fprintf(stderr, "syntax error: %s\n", lx.err);
+        glob_words_free(&gw);
         return NULL;
     }
 
-    int position = 0;
-    
-    // break input into tokens using delimiter (space)
-    char *token = strtok(input, " ");               // use strtok_r for thread safe version
-    while (token != NULL) {
-        args[position++] = strdup(token);   // copy tokens to args array
-        token = strtok(NULL, " ");          // sets token to next token in input
+    if (argc == 0) {  // If no arguments were found
+        fprintf(stderr, "cmd_parse: No args found.\n");
+        glob_words_free(&gw);
+        return NULL;  
     }
 
     //handle if too many args
-    if (position >= arg_max - 1) {
+    if ((long)argc >= arg_max - 1) {
         fprintf(stderr, "Too many arguments (limit reached)\n");
-        for (int i = 0; i < position; i++) {
-            free(args[i]);
-        }
-        free(args);
-        free(input);
+        glob_words_free(&gw);
         return NULL;
     }
 
-    if (position == 0) {  // If no arguments were found
-        fprintf(stderr, "cmd_parse: No args found.\n");
-        free(input);
-        free(args);
-        return NULL;  
-    }
+    struct cmd_arena *arena = malloc(sizeof(*arena) + (argc + 1) * sizeof(char *) + lx.len);
 
-    // add NULL termination to args list
-    args[position] = NULL;
+    //check for failed malloc
+    if (!arena) {
+        fprintf(stderr, "Memory allocation failed for arguments.\n");
+        glob_words_free(&gw);
+        return NULL;
+    }
+    arena_init(arena, argc + 1, lx.len);
 
-    free(input);
-    return args;
+    // same walk again, this time writing the words and reading back the matches
+    lx = (struct lex){ .p = line, .out = arena->buf, .glob = &gw, .dirfd = AT_FDCWD };
+    for (size_t i = 0; i < argc; i += lx.words) {
+        char *word;
+        lex_next(&lx, &word, NULL);
+        lex_store(&lx, word, &arena->argv[i]);
+    }
+    glob_words_free(&gw);
+    arena->argv[argc] = NULL;
+    arena->argc = argc;
+    return arena->argv;
 }
 
 /**
@@ -141,13 +541,276 @@ char **cmd_parse(const char *line) {
 */
 void cmd_free(char **line) {
     if (!line) return;
-    
-    int i = 0;
-    while (line[i] != NULL) {
-        free(line[i]);
-        i++;
+
+    // the words live in the same allocation as argv
+    free(arena_of(line));
+}
+
+// what the measuring pass over a line found, enough to size the pipeline
+struct parse_counts {
+    size_t slots;     // argv entries including the NULL that ends every stage
+    size_t stages;    // commands separated by '|'
+    size_t redirs;    // redirections of every stage
+    size_t bytes;     // bytes of every word, NULs included
+};
+
+static int syntax_error(char near) {
+    fprintf(stderr, "syntax error near '%c'\n", near);
+    return -1;
+}
+
+// one pass of pipeline_parse, measuring into n while pl is NULL and writing
+// into pl, sized from n, the second time, or with dry set only checking
+static int parse_line(struct shell *sh, struct glob_cache *globs, int dirfd, const char *line, struct parse_counts *n,
+                      struct pipeline *pl, struct glob_words *gw, bool dry) {
+    struct lex lx = { .p = line, .out = pl ? pl->arena->buf : NULL, .ops = true, .glob = gw, .sh = sh,
+                      .dry = dry, .dirfd = dirfd, .globs = globs };
+    char **argv = pl ? pl->arena->argv : NULL;
+    struct redirect *redirs = pl ? (struct redirect *)&pl->stages[n->stages] : NULL;
+    size_t argc = 0, nstages = 1, nredirs = 0;
+    size_t stage_words = 0, stage_redirs = 0;
+    bool background = false;
+    int fd = -1;
+
+    // stages are stored back to back in argv with a NULL between each one
+    if (pl) {
+        pl->stages[0] = (struct stage){ argv, redirs, 0 };
+    }
+    for (;;) {
+        char *word = NULL;
+        const char *raw = NULL;
+        enum lex_token tok = lex_next(&lx, &word, &raw);
+        if (tok == LEX_END) {
+            break;
+        }
+        if (tok == LEX_ERROR) {
+            fprintf(stderr, "syntax error: %s\n", lx.err);
+            return -1;
+        }
+        if (background) {
+            // '&' is only allowed at the very end of the line
+            return syntax_error('&');
+        }
+
+        if (tok == LEX_WORD) {
+            // a lone digit right before '<' or '>' names the descriptor
+            if (lex_digit(&lx, raw) && is_redirect(*lx.p)) {
+                fd = raw[0] - '0';
+                continue;
+            }
+            if (argv) {
+                lex_store(&lx, word, &argv[argc]);
+            }
+            argc += lx.words;
+            stage_words += lx.words;
+            continue;
+        }
+
+        char sym = lx.op;
+        if (is_redirect(sym)) {
+            struct redirect r = {
+                .fd = fd >= 0 ? fd : (sym == '<' ? STDIN_FILENO : STDOUT_FILENO),
+                .kind = sym == '<' ? REDIR_IN : REDIR_OUT,
+                .path = NULL,
+                .from = -1,
+            };
+            if (sym == '>' && *lx.p == '>') {
+                r.kind = REDIR_APPEND;
+                lx.p++;
+            } else if (*lx.p == '&') {
+                r.kind = REDIR_DUP;
+                lx.p++;
+            }
+
+            tok = lex_next(&lx, &word, &raw);
+            if (tok == LEX_ERROR) {
+                fprintf(stderr, "syntax error: %s\n", lx.err);
+                return -1;
+            }
+            if (tok != LEX_WORD || (r.kind == REDIR_DUP && !lex_digit(&lx, raw))) {
+                return syntax_error(sym);
+            }
+            if (lx.words != 1) {
+                fprintf(stderr, "%.*s: ambiguous redirect\n", (int)(lx.p - raw), raw);
+                return -1;
+            }
+            if (r.kind == REDIR_DUP) {
+                r.from = raw[0] - '0';
+            } else {
+                r.path = word;
+            }
+            if (redirs) {
+                redirs[nredirs] = r;
+                pl->stages[nstages - 1].nredirs++;
+            }
+            nredirs++;
+            stage_redirs++;
+            fd = -1;
+        } else if (sym == '|') {
+            if (stage_words == 0) {
+                return syntax_error('|');
+            }
+            if (argv) {
+                argv[argc] = NULL;
+                pl->stages[nstages] = (struct stage){ &argv[argc + 1], &redirs[nredirs], 0 };
+            }
+            argc++;
+            nstages++;
+            stage_words = 0;
+            stage_redirs = 0;
+        } else {
+            if (stage_words == 0) {
+                return syntax_error('&');
+            }
+            background = true;
+        }
+    }
+
+    if (stage_words == 0) {
+        if (nstages > 1) {
+            syntax_error('|');
+        } else if (stage_redirs > 0) {
+            fprintf(stderr, "syntax error: redirection without a command\n");
+        }
+        return -1;
+    }
+    if (argv) {
+        argv[argc] = NULL;
+    }
+    n->slots = argc + 1;
+    n->stages = nstages;
+    n->redirs = nredirs;
+    n->bytes = lx.len;
+    if (pl) {
+        pl->background = background;
+        pl->nstages = nstages;
+        pl->arena->argc = argc;
     }
+    return 0;
+}
+
+// check the command of a $(...) parses, and the ones inside it, without
+// running anything
+static int subst_check(struct lex *lx, const char *cmd, size_t len) {
+    char *line = strndup(cmd, len);
+    if (!line) {
+        lx->err = "out of memory";
+        return -1;
+    }
+    char *trimmed = trim_white(line);
+    struct parse_counts n;
+    int rval = *trimmed ? parse_line(lx->sh, lx->globs, lx->dirfd, trimmed, &n, NULL, lx->glob, true) : 0;
     free(line);
+    if (rval < 0) {
+        lx->err = "command substitution failed";
+    }
+    return rval;
+}
+
+/**
+* @brief Parse a line into a pipeline of commands separated by '|'. The
+* pipe character ends a word even without surrounding spaces so "a|b" is
+* two stages. Empty stages such as "a | | b" are a syntax error. A
+* trailing '&' marks the pipeline to run in the background and a leading
+* "time" word marks it to be timed. Each stage may redirect a descriptor
+* with "< file", "> file", ">> file" or ">&n", a single digit right before
+* the operator picks the descriptor as in "2>&1". Words are quoted and
+* expanded as for cmd_parse, a quoted operator is part of a word, and a
+* redirection to a pattern must match a single file. The line
+* is measured first so the pipeline, its redirections and every word are
+* one allocation that must be reclaimed with pipeline_free. There is no
+* shell to run commands with, so $(...) is a syntax error, see sh_parse.
+*
+* @param line The line to process
+* @return The parsed pipeline or NULL on error or an empty line
+*/
+struct pipeline *pipeline_parse(const char *line) {
+    return pipeline_parse_at(NULL, AT_FDCWD, line);
+}
+
+// both passes of a parse, see sh_parse
+static struct pipeline *parse(struct shell *sh, struct glob_cache *globs, int dirfd, const char *line) {
+    if (!line) {
+        return NULL;
+    }
+
+    struct parse_counts n;
+    struct glob_words gw = { 0 };
+
+    // a line that can't parse runs none of its commands
+    if (sh && strstr(line, "$(") && parse_line(sh, globs, dirfd, line, &n, NULL, &gw, true) < 0) {
+        return NULL;
+    }
+    if (parse_line(sh, globs, dirfd, line, &n, NULL, &gw, false) < 0) {
+        glob_words_free(&gw);
+        return NULL;
+    }
+
+    // pipeline and stages, then the redirections, then the arena with the words
+    size_t head = sizeof(struct pipeline) + n.stages * sizeof(struct stage) + n.redirs * sizeof(struct redirect);
+    struct pipeline *pl = malloc(head + sizeof(struct cmd_arena) + n.slots * sizeof(char *) + n.bytes);
+    if (!pl) {
+        fprintf(stderr, "Memory allocation failed for pipeline.\n");
+        glob_words_free(&gw);
+        return NULL;
+    }
+    pl->arena = (struct cmd_arena *)((char *)pl + head);
+    arena_init(pl->arena, n.slots, n.bytes);
+    pl->timed = false;
+    parse_line(sh, globs, dirfd, line, &n, pl, &gw, false);
+    glob_words_free(&gw);
+
+    // time is a prefix like in other shells, on its own it is just a command
+    char **argv = pl->arena->argv;
+    if (strcmp(argv[0], "time") == 0 && argv[1]) {
+        pl->timed = true;
+        pl->stages[0].argv++;
+    }
+    return pl;
+}
+
+/**
+* @brief Parse a line like pipeline_parse, running each $(command) in it
+* while the line is measured, once the whole line is known to parse.
+* Their output stands in for them with trailing newlines removed. Outside
+* double quotes it is split into words at blanks and never taken as a
+* pattern.
+*
+* @param sh The shell the commands run in, NULL to not allow any
+* @param line The line to process
+* @return The parsed pipeline or NULL on error or an empty line
+*/
+struct pipeline *sh_parse(struct shell *sh, const char *line) {
+    return parse(sh, NULL, AT_FDCWD, line);
+}
+
+/**
+* @brief Parse a line like pipeline_parse with relative patterns matched
+* in the directory dirfd names instead of the working directory, against
+* the listings in globs. With a cache of its own per thread nothing is
+* shared with other threads, so this may be called on several at once
+* with no lock taken, with the shared cache they take turns expanding
+* patterns.
+*
+* @param globs The directory listings, NULL for the shared cache
+* @param dirfd The directory, AT_FDCWD for the working directory
+* @param line The line to process
+* @return The parsed pipeline or NULL on error or an empty line
+*/
+struct pipeline *pipeline_parse_at(struct glob_cache *globs, int dirfd, const char *line) {
+    return parse(NULL, globs, dirfd, line);
+}
+
+/**
+* @brief Free a pipeline constructed with pipeline_parse
+*
+* @param pl The pipeline to free
+*/
+void pipeline_free(struct pipeline *pl) {
+    if (!pl) return;
+
+    // the words and redirections share the pipeline's allocation
+    free(pl);
 }
 
 /**
@@ -183,58 +846,60 @@ char *trim_white(char *line) {
 }
 
 /**
-* @brief Takes an argument list and checks if the first argument is a
-* built in command such as exit, cd, jobs, etc. If the command is a
-* built in command this function will handle the command and then return
-* true. If the first argument is NOT a built in command this function will
-* return false.
+* @brief Write all of buf to fd, carrying on after a short write or an
+* interrupted one.
 *
-* @param sh The shell
-* @param argv The command to check
-* @return True if the command was a built in command
+* @param fd The file descriptor
+* @param buf What to write
+* @param len How many bytes
+* @return On success, zero is returned. On error, -1 is returned.
 */
-bool do_builtin(struct shell *sh, char **argv) {
-
-    if (!argv || !argv[0]) {
-        cmd_free(argv);
-        return false;
-    }
-
-    //exit
-    if (strcmp(argv[0], "exit") == 0) {
-        printf("Exiting shell normally.\n");
-        
-        //free resources then exit
-        sh_destroy(sh);
-        exit(0);    // dont need to return anything since program terminated
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
     }
+    return 0;
+}
 
-    
-    //cd
-    if (strcmp(argv[0], "cd") == 0) {
-        if (change_dir(argv) != 0) {        //edited to simplify post codereview
-            return false;
-        }
+#define HIST_DEFAULT_ENTRIES 1000
+#define HIST_DEFAULT_BYTES (1 << 20)
 
-        return true;
+// read a size from the environment falling back to def when unset or invalid
+static size_t env_size(const char *name, size_t def) {
+    const char *val = getenv(name);
+    if (!val || !*val) {
+        return def;
     }
+    char *end;
+    unsigned long long n = strtoull(val, &end, 10);
+    return *end == '\0' ? (size_t)n : def;
+}
 
-    //history
-    if (strcmp(argv[0], "history") == 0) {
-        HIST_ENTRY **history_entries = history_list();  // Get the history list
-        if (history_entries) {
-            int i = 0;
-            while (history_entries[i] != NULL) {
-                printf("%d: %s\n", i + 1, history_entries[i]->line);
-                i++;
-            }
-        } else {
-            printf("No command history available.\n");
+// MY_HISTSIZE and MY_HISTBYTES cap the history, MY_HISTFILE moves the file
+// and an empty MY_HISTFILE keeps history in memory only
+static void init_history(struct shell *sh) {
+    char *path = NULL;
+    const char *file = getenv("MY_HISTFILE");
+    if (!file) {
+        const char *home = getenv("HOME");
+        if (home && asprintf(&path, "%s/.p2shell_history", home) < 0) {
+            path = NULL;
         }
-        return true;
+    } else if (*file) {
+        path = strdup(file);
     }
 
-    return false;  // Always return false if not built in
+    hist_init(&sh->history, env_size("MY_HISTSIZE", HIST_DEFAULT_ENTRIES),
+              env_size("MY_HISTBYTES", HIST_DEFAULT_BYTES), path, sh->shell_is_interactive);
+    free(path);
 }
 
 /**
@@ -250,7 +915,15 @@ bool do_builtin(struct shell *sh, char **argv) {
 void sh_init(struct shell *sh) {
 
     sh->shell_terminal = STDIN_FILENO;  // standard input (keyboard input)
-    sh->shell_is_interactive = isatty(sh->shell_terminal);
+    sh->shell_is_interactive = !opt_script && isatty(sh->shell_terminal);
+    sh->shell_pgid = getpgrp();
+    sh->shared_pgroup = !sh->shell_is_interactive;   // without job control children stay in our group
+    sh->script = opt_script;
+    sh->last_status = 0;
+    sh->subst_depth = 0;
+    sh->memo.fd = -1;
+    sh->memo.map = NULL;
+    sh->memo.size = 0;
 
     // set up process groups if interactive
     if (sh->shell_is_interactive) {
@@ -267,6 +940,7 @@ void sh_init(struct shell *sh) {
             perror("Failed to take control of the terminal");
             exit(1);
         }
+        sh->terminal_pgid = sh->shell_pgid;
 
         // save current terminal settings
         if (tcgetattr(sh->shell_terminal, &sh->shell_tmodes) < 0) { //tcgetattr(file descriptor, pointer to struct termios - stores terminal settings)
@@ -283,11 +957,45 @@ void sh_init(struct shell *sh) {
 
     }
 
-    // Initialize the command history feature
+    // Initialize the command history feature, capped and persisted per MY_HIST*
     using_history();
+    init_history(sh);
 
     //set up shell prompt
-    sh->prompt = get_prompt(getenv("MY_PROMPT"));
+    sh->prompt = get_prompt("MY_PROMPT");
+
+    sh->backend = opt_backend;
+    memset(&sh->path_cache, 0, sizeof(sh->path_cache));
+
+    // the terminal, SIGCHLD and every job are waited on in one epoll set
+    sh->loop = NULL;
+    if (sh->shell_is_interactive) {
+        loop_init(sh);
+    }
+
+    // start reaping background jobs as soon as they finish
+    jobs_init(sh);
+
+    // the working directory is read once, cd keeps it up to date after that
+    dirs_init(sh);
+
+    // compiled once, the segments are cached between prompts
+    prompt_init(sh);
+
+    // command names are indexed on the first Tab, not at startup
+    complete_init(sh);
+
+    // stats mode logs to stderr unless MY_STATSFILE names a file to append to
+    sh->stats = opt_stats;
+    sh->stats_fd = STDERR_FILENO;
+    const char *stats_file = getenv("MY_STATSFILE");
+    if (sh->stats && stats_file && *stats_file) {
+        sh->stats_fd = open(stats_file, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (sh->stats_fd < 0) {
+            perror(stats_file);
+            sh->stats_fd = STDERR_FILENO;
+        }
+    }
 
 }
 
@@ -303,6 +1011,28 @@ void sh_destroy(struct shell *sh) {
     if (sh->prompt) {
         free(sh->prompt);
     }
+    path_cache_destroy(&sh->path_cache);
+    jobs_destroy(sh);
+    prompt_destroy(sh);
+    complete_destroy(sh);
+    memo_close(sh);
+    loop_destroy(sh);
+    dirs_destroy(sh);
+    glob_cache_clear();
+    hist_destroy(&sh->history);
+    if (sh->stats && sh->stats_fd != STDERR_FILENO) {
+        close(sh->stats_fd);
+    }
+#ifdef SH_TRACE
+    // MY_TRACEFILE picks where the trace goes, the default is per pid in /tmp
+    char trace_path[64];
+    const char *trace_file = getenv("MY_TRACEFILE");
+    if (!trace_file || !*trace_file) {
+        snprintf(trace_path, sizeof(trace_path), "/tmp/p2shell-trace.%d.json", (int)getpid());
+        trace_file = trace_path;
+    }
+    trace_dump(trace_file);
+#endif
 
     // Restore terminal settings if necessary
     if (sh->shell_is_interactive) {
@@ -316,6 +1046,9 @@ void sh_destroy(struct shell *sh) {
 
 /**
 * @brief Parse command line args from the user when the shell was launched
+* -v prints the version, -b spawn|fork selects the launch backend and
+* -f script runs the script non-interactively instead of reading the
+* terminal and -s turns on stats mode.
 *
 * @param argc Number of args
 * @param argv The arg array
@@ -323,14 +1056,29 @@ void sh_destroy(struct shell *sh) {
 void parse_args(int argc, char **argv) {
     int opt;
 
-    while ((opt = getopt(argc, argv, "v")) != -1) {
+    while ((opt = getopt(argc, argv, "vb:f:s")) != -1) {
         switch(opt) {
             case 'v':
                 //print the version and then exit
                 printf("Shell Version: %d.%d\n", lab_VERSION_MAJOR, lab_VERSION_MINOR);
                 exit(0);
+            case 'b':
+                //pick how external commands are launched
+                if (spawn_backend_parse(optarg, &opt_backend) < 0) {
+                    fprintf(stderr, "Unknown backend %s, expected spawn or fork\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'f':
+                //run a script instead of reading the terminal
+                opt_script = optarg;
+                break;
+            case 's':
+                //log the time and resources every command used
+                opt_stats = true;
+                break;
             case '?':   //unknown option
-                fprintf(stderr, "Unknown option\n", opt);
+                fprintf(stderr, "Unknown option\n");
                 exit(1);    
         }
     }
@@ -2,8 +2,12 @@
 #define LAB_H
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #define lab_VERSION_MAJOR 1
@@ -15,15 +19,511 @@ extern "C"
 {
 #endif
 
+  /**
+   * @brief The ways the shell can launch an external command. Both put the
+   * child in its own process group and hand it the terminal, fork just pays
+   * for copying the shell's page tables on every command.
+   */
+  enum spawn_backend
+  {
+    SPAWN_POSIX,    // posix_spawn, glibc implements this with CLONE_VFORK
+    SPAWN_FORK,     // fork then exec, the child sets itself up before exec
+  };
+
+  /**
+   * @brief One resolved command in the PATH cache.
+   */
+  struct path_entry
+  {
+    char *name;     // command name as typed, NULL marks an empty slot
+    char *path;     // absolute path the name resolved to
+  };
+
+  /**
+   * @brief Hash table from command name to the executable it resolved to in
+   * PATH. Entries are filled on first lookup and the whole table is dropped
+   * when PATH changes so external commands can be exec'd directly instead
+   * of letting execvp probe every PATH directory each time.
+   */
+  struct path_cache
+  {
+    struct path_entry *slots;   // open addressing table, cap is a power of two
+    size_t cap;                 // number of slots allocated
+    size_t count;               // number of slots in use
+    char *path_env;             // value of PATH the entries were resolved against
+  };
+
+  /**
+   * @brief The state of a job as shown by the jobs builtin.
+   */
+  enum job_state
+  {
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE,
+  };
+
+  /**
+   * @brief One process of a job.
+   */
+  struct job_proc
+  {
+    pid_t pid;
+    int status;      // wait status once the process is done
+    bool done;       // reaped, status is valid
+    bool stopped;    // stopped by a signal and not continued yet
+    struct rusage usage;   // resources used, from wait4 once done
+    int pidfd;             // readable once the process exits, -1 without an event loop
+    struct watch *watch;   // pidfd in the event loop, NULL once done
+  };
+
+#define JOB_OUTPUT_SIZE (16 << 10)  // output kept per background job, older bytes are dropped
+
+  /**
+   * @brief The captured stdout and stderr of a background job, the last
+   * JOB_OUTPUT_SIZE bytes of it in a ring.
+   */
+  struct job_output
+  {
+    int fd;                // read end of the job's output pipe, -1 if not captured or at EOF
+    struct watch *watch;   // fd in the event loop
+    char *ring;            // allocated when the job first writes
+    size_t total;          // bytes read so far, byte i is at ring[i % JOB_OUTPUT_SIZE]
+    size_t shown;          // bytes already shown by jobs -o or fg
+  };
+
+  /**
+   * @brief A pipeline the shell has launched and not finished reporting on.
+   * Every process of the job shares the process group pgid.
+   */
+  struct job
+  {
+    int id;                    // number used by jobs, fg and bg
+    pid_t pgid;                // process group of every process in the job
+    char *cmd;                 // command line shown by jobs
+    struct job_proc *procs;    // one entry per pipeline stage that started
+    size_t nprocs;             // number of entries in procs
+    bool background;           // launched with '&' or continued with bg
+    bool notified;             // the user has been told about the last stop
+    bool has_tmodes;           // tmodes holds the job's terminal modes
+    struct termios tmodes;     // terminal modes saved when the job stopped
+    bool timed;                // run with the time prefix
+    long long start_ns;        // monotonic time the job was created
+    long long spawned_ns;      // monotonic time the last process was started
+    long long end_ns;          // monotonic time the last process was reaped
+    struct job_output out;     // what a background job printed
+    bool kept;                 // done but kept until its output is looked at
+  };
+
+  /**
+   * @brief What one command cost, reported by the time prefix and by stats
+   * mode. Wall time is split into the time taken to start every process
+   * and the time from then until the last one was reaped.
+   */
+  struct cmd_stats
+  {
+    long long spawn_ns;     // from the start of the command until its last process started
+    long long run_ns;       // from then until the command finished
+    struct rusage usage;    // summed over every process, ru_maxrss is the largest
+    int status;             // exit status of the command
+  };
+
+  /**
+   * @brief Command history capped by both entry count and total bytes. The
+   * entries live in a ring so adding to a full history evicts the oldest
+   * entry in constant time. When a history file is set every entry is also
+   * appended to it as it is added, the file is only read the first time the
+   * history is used and then only its tail.
+   */
+  struct history
+  {
+    char **ring;           // entry i is ring[(head + i) % alloc]
+    size_t alloc;          // slots allocated in ring, grows up to max_entries
+    size_t head;           // slot of the oldest entry
+    size_t count;          // entries in the ring
+    size_t bytes;          // bytes used by the entries in the ring
+    size_t max_entries;    // entry cap
+    size_t max_bytes;      // byte cap
+    unsigned long base;    // number of entries evicted, keeps numbering stable
+    char *path;            // history file or NULL to keep history in memory
+    int fd;                // history file opened for appending, -1 until loaded
+    size_t file_bytes;     // size of the history file
+    bool loaded;           // the tail of the history file has been read
+    bool readline;         // mirror entries into readline for line editing
+  };
+
+  struct shell;
+
+  /**
+   * @brief Called by the event loop when a watched descriptor is readable.
+   */
+  typedef void (*watch_fn)(struct shell *sh, void *data);
+
+  /**
+   * @brief A descriptor in the event loop's epoll set and what to call when
+   * it becomes readable.
+   */
+  struct watch
+  {
+    int fd;               // the watched descriptor, owned by whoever added it
+    watch_fn fn;          // called when fd is readable
+    void *data;           // passed to fn
+    bool removed;         // taken out of the set, fn is not called again
+    struct watch *next;   // next on the loop's list of removed watches
+  };
+
+  /**
+   * @brief The epoll set the interactive shell waits in. The terminal, SIGCHLD
+   * and every running process are descriptors in the one set so none of them
+   * has to wait while another is serviced.
+   */
+  struct event_loop
+  {
+    int epfd;             // epoll set of every watch
+    int depth;            // loop_run calls in progress, a foreground job nests one
+    struct watch *dead;   // removed watches, freed when no loop_run is dispatching
+    struct watch *terminal;   // the terminal while loop_interact reads it
+  };
+
+  /**
+   * @brief Kinds of segment a prompt template is compiled into, one per
+   * escape plus literal text.
+   */
+  enum prompt_seg_kind
+  {
+    PSEG_TEXT,       // literal text
+    PSEG_CWD,        // \w, working directory with $HOME shown as ~
+    PSEG_CWD_BASE,   // \W, last component of the working directory
+    PSEG_STATUS,     // \?, exit status of the last command
+    PSEG_SIGIL,      // \$, '#' for root and '$' for everyone else
+    PSEG_USER,       // \u, user name
+    PSEG_HOST,       // \h, host name up to the first '.'
+    PSEG_TIME,       // \t, local time as HH:MM:SS
+    PSEG_GIT,        // \g, git branch or short commit, empty outside a repository
+  };
+
+  /**
+   * @brief One piece of a compiled prompt.
+   */
+  struct prompt_seg
+  {
+    enum prompt_seg_kind kind;
+    const char *text;    // literal bytes for PSEG_TEXT, in the template's text buffer
+    size_t len;          // bytes in text
+  };
+
+  /**
+   * @brief What a cached prompt segment depends on, passed to
+   * prompt_invalidate when it changes.
+   */
+  enum prompt_dep
+  {
+    PROMPT_DEP_CWD = 1 << 0,   // the working directory, \w \W and \g
+    PROMPT_DEP_GIT = 1 << 1,   // the repository's HEAD, \g
+  };
+
+  struct prompt_git_job;
+
+  /**
+   * @brief A prompt template compiled once from MY_PROMPT. Every segment
+   * keeps its last value and is only computed again when what it depends
+   * on changes, so showing the prompt normally costs no system calls beyond
+   * a stat of the git HEAD. The git segment is looked up on a worker thread
+   * when there is an event loop and the prompt is drawn again once it is
+   * known.
+   */
+  struct prompt_template
+  {
+    struct prompt_seg *segs;     // the compiled template
+    size_t nsegs;                // number of entries in segs
+    char *text;                  // literal text of every PSEG_TEXT segment
+    unsigned uses;               // bit (1 << kind) set for every kind in segs
+    unsigned dirty;              // enum prompt_dep values changed since last computed
+    bool changed;                // a segment changed on its own, the prompt needs drawing again
+    char *buf;                   // the rendered prompt
+    size_t cap;                  // bytes allocated for buf
+    char *cwd;                   // cached \w
+    char user[64];               // cached \u
+    char host[64];               // cached \h
+    char sigil;                  // cached \$
+    long time_sec;               // second time_text was formatted for
+    char time_text[16];          // cached \t
+    char *git_branch;            // cached \g, NULL outside a repository
+    char *git_head;              // HEAD file the branch was read from
+    struct timespec git_mtime;   // mtime of git_head when it was read
+    struct prompt_git_job *git_job;   // lookup running on the worker thread
+    int git_fd;                  // eventfd the worker signals, -1 without a loop
+    struct watch *git_watch;     // git_fd in the event loop
+  };
+
+#define DIR_STACK_MAX 32   // directories pushd can hold
+
+  /**
+   * @brief A directory saved by pushd. The open descriptor lets popd return
+   * with a single fchdir instead of walking the path again.
+   */
+  struct dir_entry
+  {
+    char *path;    // the directory as dirs shows it
+    int fd;        // O_PATH descriptor of the directory
+  };
+
+  /**
+   * @brief The pushd stack, the most recently pushed directory last. The
+   * current directory is not on it, dirs shows that first.
+   */
+  struct dir_stack
+  {
+    struct dir_entry items[DIR_STACK_MAX];
+    size_t count;
+  };
+
+  /**
+   * @brief A node of the command name trie, one per character. Children
+   * of a node are a list kept in character order so walking the trie
+   * gives the names sorted.
+   */
+  struct trie_node
+  {
+    uint32_t child;     // first child, 0 if none since the root is never a child
+    uint32_t sibling;   // next child of the same parent, 0 at the end
+    uint64_t dirs;      // bit per PATH directory holding the name ending here
+    char c;             // the character this node adds
+  };
+
+#define CMD_INDEX_DIRS 63                           // PATH directories with a bit of their own
+#define CMD_INDEX_BUILTIN (1ULL << CMD_INDEX_DIRS)  // the name is a built in command
+
+  /**
+   * @brief Every command name tab completion offers: the built in commands
+   * and the files in each PATH directory. It is built the first time Tab
+   * is pressed and then kept up to date from inotify events, so a new or
+   * removed binary changes it by one name instead of a rescan of PATH.
+   */
+  struct cmd_index
+  {
+    struct trie_node *nodes;   // nodes[0] is the root
+    size_t count;              // nodes in use
+    size_t cap;                // nodes allocated
+    char *path_env;            // PATH the index was built from, NULL before the first Tab
+    int *wds;                  // inotify watch of each PATH directory by bit
+    size_t ndirs;              // PATH directories watched
+    int inotify_fd;            // -1 until the index is built
+    struct watch *watch;       // inotify_fd in the event loop
+    bool stale;                // events were lost, build it again on the next Tab
+  };
+
+  /**
+   * @brief The memo builtin's store of command results, a file shared by
+   * every shell that is mapped the first time memo runs.
+   */
+  struct memo_store
+  {
+    int fd;        // the store file, -1 until memo first runs
+    void *map;     // the whole file mapped shared
+    size_t size;   // bytes mapped
+  };
+
+  /**
+   * @brief Matches of the patterns on a line, one record per pattern in
+   * the order glob_expand was called. The parser expands while measuring
+   * and reads the same records back with glob_next while writing, so both
+   * passes see the same matches even if a directory changes in between.
+   */
+  struct glob_words
+  {
+    char *buf;     // records back to back, a count and size then the matches
+    size_t len;    // bytes used in buf
+    size_t cap;    // bytes allocated for buf
+    size_t pos;    // where glob_next reads the next record
+  };
+
+  /**
+   * @brief Directory listings kept by glob_expand from one line to the
+   * next, see glob_cache_new.
+   */
+  struct glob_cache;
+
   struct shell
   {
     int shell_is_interactive;
     pid_t shell_pgid;
+    bool shared_pgroup;    // no job control, children join shell_pgid instead of groups of their own
+    bool forked;           // a child of the shell running a stage or a built in, not the shell itself
     struct termios shell_tmodes;
     int shell_terminal;
+    pid_t terminal_pgid;   // group the shell last gave the terminal to, shell_pgid while it has it
     char *prompt;
+    enum spawn_backend backend;
+    struct path_cache path_cache;
+    struct job **jobs;     // job table, oldest first
+    size_t njobs;          // number of jobs in the table
+    size_t jobs_cap;       // slots allocated for jobs
+    int last_status;       // exit status of the last command run
+    struct history history;  // commands entered at the prompt
+    const char *script;    // script given with -f, NULL reads stdin or the terminal
+    bool stats;            // stats mode, log what every command cost to stats_fd
+    int stats_fd;          // where stats mode writes, stderr or MY_STATSFILE
+    struct event_loop *loop;      // NULL blocks in readline and wait4 instead
+    int sigchld_fd;               // signalfd for SIGCHLD, only used with loop
+    struct watch *sigchld_watch;  // sigchld_fd in the loop
+    struct prompt_template prompt_tmpl;   // sh->prompt compiled, shown by prompt_render
+    char cwd[PATH_MAX];    // current directory kept up to date by dirs_cd, empty if unknown
+    char *home;            // home directory, looked up the first time it is needed
+    struct dir_stack dirs;   // directories saved by pushd
+    struct cmd_index commands;   // command names for tab completion
+    int subst_depth;       // $(...) being run, their built ins that change the shell fork
+    struct memo_store memo;   // results kept by the memo builtin
+  };
+
+  /**
+   * @brief Properties of a built in command that decide where it can run.
+   */
+  enum builtin_flags
+  {
+    BUILTIN_PARENT = 1 << 0,   // changes the shell itself so it must run in the shell process
+    BUILTIN_FORKS = 1 << 1,    // starts child processes of its own
+    BUILTIN_WAITS = 1 << 2,    // waits on other processes, in a pipeline it needs a process of its own
+  };
+
+  /**
+   * @brief A built in command. Takes the whole argv including the command
+   * name and returns its exit status.
+   */
+  typedef int (*builtin_fn)(struct shell *sh, char **argv);
+
+  /**
+   * @brief One entry of the built in command table. The table is listed in
+   * src/builtins.def and indexed by a perfect hash that tools/mkbuiltins.c
+   * generates from that list at build time.
+   */
+  struct builtin
+  {
+    const char *name;    // what the user types
+    size_t len;          // strlen(name)
+    builtin_fn fn;       // runs the command
+    unsigned flags;      // enum builtin_flags
+  };
+
+  /**
+   * @brief Seeded FNV-1a used to index the built in table. The generator and
+   * the shell share it so the seed found at build time works at run time.
+   *
+   * @param name The bytes to hash
+   * @param len Number of bytes in name
+   * @param seed The seed picked by the generator
+   * @return The hash
+   */
+  static inline unsigned builtin_hash(const char *name, size_t len, unsigned seed)
+  {
+    unsigned h = 2166136261u ^ seed;
+    for (size_t i = 0; i < len; i++) {
+      h ^= (unsigned char)name[i];
+      h *= 16777619u;
+    }
+    return h ^ (h >> 15);
+  }
+
+  /**
+   * @brief Backing storage for a parsed line. The header, argv and the
+   * token bytes argv points into are a single allocation sized by a
+   * measuring pass over the line. The header sits directly in front of argv
+   * so cmd_free can recover it from the char ** that is handed to execvp
+   * and release everything in a single call.
+   */
+  struct cmd_arena
+  {
+    char *buf;       // token bytes right after argv, each token is NUL terminated
+    size_t size;     // bytes in buf
+    size_t argc;     // number of tokens stored in argv
+    size_t cap;      // slots allocated for argv including the NULL terminator
+    char *argv[];    // NULL terminated argument vector
+  };
+
+  /**
+   * @brief Kinds of redirection a command can have.
+   */
+  enum redirect_kind
+  {
+    REDIR_IN,        // n< file, n defaults to 0
+    REDIR_OUT,       // n> file, truncates, n defaults to 1
+    REDIR_APPEND,    // n>> file, n defaults to 1
+    REDIR_DUP,       // n>&m or n<&m, makes n a copy of m
+  };
+
+  /**
+   * @brief One redirection of a command, applied in the order written after
+   * the pipes are connected.
+   */
+  struct redirect
+  {
+    int fd;                     // descriptor of the command that is redirected
+    enum redirect_kind kind;
+    const char *path;           // file to open, NULL for REDIR_DUP
+    int from;                   // descriptor copied onto fd for REDIR_DUP
+  };
+
+  /**
+   * @brief One command in a pipeline.
+   */
+  struct stage
+  {
+    char **argv;     // NULL terminated slice of the pipeline's arena argv
+    struct redirect *redirs;    // redirections in the order written
+    size_t nredirs;             // number of entries in redirs
+  };
+
+  /**
+   * @brief A parsed line of one or more commands joined with '|'. Every
+   * stage's words live in a single cmd_arena with a NULL between stages so
+   * each stage's argv can be handed straight to exec. The arena and the
+   * redirections are in the same allocation as the pipeline.
+   */
+  struct pipeline
+  {
+    struct cmd_arena *arena;   // the words of every stage, after the redirections
+    bool background;           // the line ended with '&'
+    bool timed;                // the line started with the time prefix
+    size_t nstages;            // number of entries in stages
+    struct stage stages[];
+  };
+
+  /**
+   * @brief One dup2(from, to) to make in a child.
+   */
+  struct fd_dup
+  {
+    int from;
+    int to;
+  };
+
+  /**
+   * @brief One resource limit to set in a child before it runs, the soft
+   * and hard limit both become limit.
+   */
+  struct spawn_rlimit
+  {
+    int resource;      // RLIMIT_AS, RLIMIT_CPU, ...
+    rlim_t limit;
   };
 
+  /**
+   * @brief Options for sh_spawn. A zero initialized struct is not valid, use
+   * spawn_opts_init or pass NULL to sh_spawn to get the defaults.
+   */
+  struct spawn_opts
+  {
+    pid_t pgid;        // process group to join, 0 starts a new group
+    int fd_in;         // becomes the child's stdin
+    int fd_out;        // becomes the child's stdout
+    bool foreground;   // give the group the terminal if the shell is interactive
+    const struct fd_dup *dups;  // applied in order after stdin and stdout
+    size_t ndups;               // number of entries in dups
+    int cwd_fd;                 // directory the child starts in, -1 for the shell's
+    int cgroup_fd;              // cgroup v2 directory the child starts in, -1 for the shell's
+    const struct spawn_rlimit *rlimits;   // set in the child before exec
+    size_t nrlimits;                      // number of entries in rlimits
+  };
 
 
   /**
@@ -37,10 +537,48 @@ extern "C"
    */
   char *get_prompt(const char *env);
 
+  /**
+   * @brief Compile the shell's prompt template sh->prompt into
+   * sh->prompt_tmpl. Backslash escapes are \w \W \? \$ \u \h \t \g as
+   * described by enum prompt_seg_kind, \n for a newline, \e for an escape
+   * character, \[ and \] around terminal control sequences so readline
+   * knows they take no room and \\ for a backslash.
+   *
+   * @param sh The shell
+   * @return On success, zero is returned. On error, -1 is returned.
+   */
+  int prompt_init(struct shell *sh);
+
+  /**
+   * @brief Render the prompt from the cached segments, recomputing only the
+   * ones whose dependencies changed. Never waits on the git lookup when
+   * there is an event loop, the old value is shown until it completes.
+   *
+   * @param sh The shell
+   * @return The prompt, valid until the next call
+   */
+  const char *prompt_render(struct shell *sh);
+
+  /**
+   * @brief Mark what cached segments depend on as changed, cd calls this.
+   *
+   * @param pt The prompt
+   * @param deps enum prompt_dep values that changed
+   */
+  void prompt_invalidate(struct prompt_template *pt, unsigned deps);
+
+  /**
+   * @brief Free the compiled prompt, waiting for a git lookup in progress.
+   *
+   * @param sh The shell
+   */
+  void prompt_destroy(struct shell *sh);
+
   /**
    * Changes the current working directory of the shell. Uses the linux system
    * call chdir. With no arguments the users home directory is used as the
-   * directory to change to.
+   * directory to change to, $HOME if it is set. The cd builtin uses dirs_cd,
+   * which also keeps the shell's cached directory up to date.
    *
    * @param dir The directory to change to
    * @return  On success, zero is returned.  On error, -1 is returned, and
@@ -49,48 +587,1057 @@ extern "C"
   int change_dir(char **dir);
 
   /**
-   * @brief Convert line read from the user into to format that will work with
-   * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
-   * This function allocates memory that must be reclaimed with the cmd_free
-   * function.
+   * @brief Set up the current directory cache and the empty directory
+   * stack. The directory is read once here and after that only changes
+   * through dirs_cd, pushd and popd. Called by sh_init.
    *
-   * @param line The line to process
+   * @param sh The shell
+   */
+  void dirs_init(struct shell *sh);
+
+  /**
+   * @brief The user's home directory. $HOME is preferred, the password
+   * database is only asked when it is not set, and either way the answer is
+   * kept for the life of the shell.
    *
-   * @return The line read in a format suitable for exec
+   * @param sh The shell
+   * @return The home directory or NULL if it can't be found
    */
-  char **cmd_parse(char const *line);
+  const char *dirs_home(struct shell *sh);
 
   /**
-   * @brief Free the line that was constructed with parse_cmd
+   * @brief Change directory and update sh->cwd in place. Like cd in other
+   * shells the path is resolved against sh->cwd first, so ".." goes back the
+   * way the user came through a symbolic link. If that fails, or the current
+   * directory is unknown, the path is handed to chdir as it is.
    *
-   * @param line the line to free
+   * @param sh The shell
+   * @param path Where to go, NULL for the home directory
+   * @return On success, zero is returned. On error, -1 is returned, and
+   * errno is set to indicate the error.
    */
-  void cmd_free(char ** line);
+  int dirs_cd(struct shell *sh, const char *path);
 
   /**
-   * @brief Trim the whitespace from the start and end of a string.
-   * For example "   ls -a   " becomes "ls -a". This function modifies
-   * the argument line so that all printable chars are moved to the
-   * front of the string
+   * @brief pushd: save the current directory on the stack and change to
+   * path, or with no path swap the current directory with the top of the
+   * stack. Errors are reported on stderr.
    *
-   * @param line The line to trim
-   * @return The new line with no whitespace
+   * @param sh The shell
+   * @param path Directory to change to or NULL to swap
+   * @return On success, zero is returned. On error, -1 is returned.
    */
-  char *trim_white(char *line);
+  int dirs_push(struct shell *sh, const char *path);
 
+  /**
+   * @brief popd: change to the directory on top of the stack and remove it.
+   * Errors are reported on stderr.
+   *
+   * @param sh The shell
+   * @return On success, zero is returned. On error, -1 is returned.
+   */
+  int dirs_pop(struct shell *sh);
 
   /**
-   * @brief Takes an argument list and checks if the first argument is a
-   * built in command such as exit, cd, jobs, etc. If the command is a
-   * built in command this function will handle the command and then return
-   * true. If the first argument is NOT a built in command this function will
-   * return false.
+   * @brief Print the current directory followed by the stack, top first.
    *
    * @param sh The shell
-   * @param argv The command to check
-   * @return True if the command was a built in command
+   * @param long_form Print the home directory in full instead of as ~
    */
-  bool do_builtin(struct shell *sh, char **argv);
+  void dirs_print(struct shell *sh, bool long_form);
+
+  /**
+   * @brief Empty the directory stack, this is what dirs -c does.
+   *
+   * @param sh The shell
+   */
+  void dirs_clear(struct shell *sh);
+
+  /**
+   * @brief Empty the directory stack and forget the cached home directory.
+   *
+   * @param sh The shell
+   */
+  void dirs_destroy(struct shell *sh);
+
+  /**
+   * @brief Expand a pathname pattern and append its matches to gw as one
+   * record. Quoted characters must arrive escaped with a backslash. * ? and
+   * [...] match within a single component of the path, a leading '.' must
+   * be matched explicitly and . and .. never are. Directories are listed
+   * with getdents64 into a cache keyed by device, inode and mtime, so the
+   * same directory is only read again once it has changed, and each listing
+   * is sorted once so the names sharing a pattern's literal prefix are
+   * found with a binary search. The matches come back sorted.
+   *
+   * @param gw Where the matches go, zero initialized before the first call
+   * @param cache The listings to use, NULL for the process's shared cache
+   * @param dirfd What a relative pattern is matched in, AT_FDCWD for the
+   * working directory
+   * @param pattern The pattern with quoted characters escaped
+   * @param count Set to the number of matches, zero if there were none
+   * @param bytes Set to the size of the matches, NULs included
+   * @return The matches, NUL terminated and back to back, or NULL if memory
+   * ran out
+   */
+  const char *glob_expand(struct glob_words *gw, struct glob_cache *cache, int dirfd, const char *pattern, size_t *count,
+                          size_t *bytes);
+
+  /**
+   * @brief Called by glob_list with each name and its d_type.
+   */
+  typedef void (*glob_list_fn)(const char *name, unsigned char type, void *data);
+
+  /**
+   * @brief Call fn for each name in a directory that starts with prefix,
+   * in sorted order, from the shared cached listing glob_expand uses without
+   * a cache of its own. Names starting with '.' are only passed when prefix
+   * does too. fn runs with the cache locked so it must not call back into
+   * glob.
+   *
+   * @param dir The directory, "" for the current one
+   * @param prefix What every name must start with
+   * @param fn Called with each name and its d_type
+   * @param data Passed to fn
+   * @return On success, zero is returned. On error, -1 is returned.
+   */
+  int glob_list(const char *dir, const char *prefix, glob_list_fn fn, void *data);
+
+  /**
+   * @brief Make room for a record of up to max bytes at the end of gw. The
+   * record is only added by glob_record_end, so nothing else may append to
+   * gw in between.
+   *
+   * @param gw The records
+   * @param max The most bytes the record will hold
+   * @return Where the record's words go, or NULL if memory ran out
+   */
+  char *glob_record_begin(struct glob_words *gw, size_t max);
+
+  /**
+   * @brief Add the record started with glob_record_begin.
+   *
+   * @param gw The records
+   * @param count The number of words written
+   * @param bytes Their size, NULs included
+   * @return The words
+   */
+  const char *glob_record_end(struct glob_words *gw, size_t count, size_t bytes);
+
+  /**
+   * @brief Read back the next record glob_expand appended to gw, in the
+   * order they were appended. The parser's writing pass uses this to get
+   * exactly the words its measuring pass was sized for.
+   *
+   * @param gw The records
+   * @param count Set to the number of matches
+   * @param bytes Set to the size of the matches, NULs included
+   * @return The matches, NUL terminated and back to back
+   */
+  const char *glob_next(struct glob_words *gw, size_t *count, size_t *bytes);
+
+  /**
+   * @brief Free the records of a struct glob_words.
+   *
+   * @param gw The records
+   */
+  void glob_words_free(struct glob_words *gw);
+
+  /**
+   * @brief Forget every listing in the shared cache.
+   */
+  void glob_cache_clear(void);
+
+  /**
+   * @brief Make an empty cache of directory listings for glob_expand, for a
+   * caller that must not share the process's cache and its lock.
+   *
+   * @return The cache or NULL if memory ran out
+   */
+  struct glob_cache *glob_cache_new(void);
+
+  /**
+   * @brief Free a cache made by glob_cache_new.
+   *
+   * @param cache The cache, may be NULL
+   */
+  void glob_cache_free(struct glob_cache *cache);
+
+  /**
+   * @brief Set up tab completion: the index of command names starts empty
+   * and the completion hook is handed to readline. Called by sh_init.
+   *
+   * @param sh The shell
+   */
+  void complete_init(struct shell *sh);
+
+  /**
+   * @brief Everything a word could complete to, sorted. In command position
+   * that is the built in commands and the names in every PATH directory,
+   * from an index kept current with inotify, unless the word has a slash
+   * in it. Anywhere else, or with a slash, it is the files named by the
+   * word so far, read through the glob directory cache.
+   *
+   * @param sh The shell
+   * @param text The word so far
+   * @param command The word is the first of a command
+   * @return A NULL terminated list that the caller frees along with each
+   * entry, or NULL if there are no matches
+   */
+  char **complete_word(struct shell *sh, const char *text, bool command);
+
+  /**
+   * @brief readline's attempted completion function. The matches from
+   * complete_word come back in the form readline wants, with their longest
+   * common prefix first, and readline's own filename completion is turned
+   * off so a Tab never walks a directory that the cache already holds.
+   *
+   * @param text The word being completed
+   * @param start Where it starts in rl_line_buffer
+   * @param end Where it ends
+   * @return The matches or NULL if there are none
+   */
+  char **complete_hook(const char *text, int start, int end);
+
+  /**
+   * @brief Stop watching PATH and free the command index.
+   *
+   * @param sh The shell
+   */
+  void complete_destroy(struct shell *sh);
+
+  /**
+   * @brief Convert line read from the user into to format that will work with
+   * execvp. We limit the number of arguments to ARG_MAX loaded from sysconf.
+   * Words may be quoted with '...' or "..." and a backslash escapes the next
+   * character. $NAME and ${NAME} expand to the value of the environment
+   * variable outside single quotes, the value is never split into more
+   * words. Unquoted *, ? and [...] make a word a pattern that expands to the
+   * sorted paths it matches, see glob_expand, and a pattern that matches
+   * nothing is kept as it is. The line is measured in a first pass so the result, a struct
+   * cmd_arena holding the argv array and every word, is a single allocation
+   * that must be reclaimed with the cmd_free function.
+   *
+   * @param line The line to process
+   *
+   * @return The line read in a format suitable for exec
+   */
+  char **cmd_parse(char const *line);
+
+  /**
+   * @brief Parse a line into a pipeline of commands separated by '|'. The
+   * pipe character ends a word even without surrounding spaces so "a|b" is
+   * two stages. Empty stages such as "a | | b" are a syntax error. A
+   * trailing '&' marks the pipeline to run in the background and a leading
+   * "time" word marks it to be timed. Each stage may redirect a descriptor
+   * with "< file", "> file", ">> file" or ">&n", a single digit right before
+   * the operator picks the descriptor as in "2>&1". Words are quoted and
+   * expanded as for cmd_parse, a quoted operator is part of a word, and a
+   * redirection to a pattern must match a single file. The line
+   * is measured first so the pipeline, its redirections and every word are
+   * one allocation that must be reclaimed with pipeline_free. There is no
+   * shell to run commands with, so $(...) is a syntax error, see sh_parse.
+   *
+   * @param line The line to process
+   * @return The parsed pipeline or NULL on error or an empty line
+   */
+  struct pipeline *pipeline_parse(const char *line);
+
+  /**
+   * @brief Parse a line like pipeline_parse, running each $(command) in it
+   * while the line is measured, once the whole line is known to parse.
+   * Their output stands in for them with trailing newlines removed. Outside
+   * double quotes it is split into words at blanks and never taken as a
+   * pattern.
+   *
+   * @param sh The shell the commands run in, NULL to not allow any
+   * @param line The line to process
+   * @return The parsed pipeline or NULL on error or an empty line
+   */
+  struct pipeline *sh_parse(struct shell *sh, const char *line);
+
+  /**
+   * @brief Parse a line like pipeline_parse with relative patterns matched
+   * in the directory dirfd names instead of the working directory, against
+   * the listings in globs. With a cache of its own per thread nothing is
+   * shared with other threads, so this may be called on several at once
+   * with no lock taken, with the shared cache they take turns expanding
+   * patterns.
+   *
+   * @param globs The directory listings, NULL for the shared cache
+   * @param dirfd The directory, AT_FDCWD for the working directory
+   * @param line The line to process
+   * @return The parsed pipeline or NULL on error or an empty line
+   */
+  struct pipeline *pipeline_parse_at(struct glob_cache *globs, int dirfd, const char *line);
+
+  /**
+   * @brief Run the command of a $(...) with its output captured and append
+   * the words it makes to gw as one record. Output goes to a memfd, so
+   * there is no temporary file and a command that writes a lot never
+   * blocks on a reader, and is read back with a single pread straight into
+   * gw where it is split in place. The command is parsed and run as a
+   * pipeline by this shell, with no other shell process: external
+   * commands go through sh_spawn and the spawn backend, built ins run in
+   * the shell except for ones that would change it, which get a process
+   * of their own like in a subshell.
+   *
+   * @param sh The shell
+   * @param gw Where the words go
+   * @param cmd The command, not NUL terminated
+   * @param len Its length
+   * @param split Split the output into words at blanks
+   * @param count Set to the number of words
+   * @param bytes Set to their size, NULs included
+   * @return The words or NULL on a syntax error or if memory ran out
+   */
+  const char *subst_capture(struct shell *sh, struct glob_words *gw, const char *cmd, size_t len, bool split,
+                            size_t *count, size_t *bytes);
+
+  /**
+   * @brief Free a pipeline constructed with pipeline_parse
+   *
+   * @param pl The pipeline to free
+   */
+  void pipeline_free(struct pipeline *pl);
+
+  /**
+   * @brief Free the line that was constructed with parse_cmd
+   *
+   * @param line the line to free
+   */
+  void cmd_free(char ** line);
+
+  /**
+   * @brief Trim the whitespace from the start and end of a string.
+   * For example "   ls -a   " becomes "ls -a". This function modifies
+   * the argument line so that all printable chars are moved to the
+   * front of the string
+   *
+   * @param line The line to trim
+   * @return The new line with no whitespace
+   */
+  char *trim_white(char *line);
+
+  /**
+   * @brief Write all of buf to fd, carrying on after a short write or an
+   * interrupted one.
+   *
+   * @param fd The file descriptor
+   * @param buf What to write
+   * @param len How many bytes
+   * @return On success, zero is returned. On error, -1 is returned.
+   */
+  int write_all(int fd, const char *buf, size_t len);
+
+
+  /**
+   * @brief Takes an argument list and checks if the first argument is a
+   * built in command such as exit, cd, hash, jobs, parallel, etc. If the command is a
+   * built in command this function will handle the command, store its exit
+   * status in sh->last_status and then return true. If the first argument
+   * is NOT a built in command this function will return false.
+   *
+   * @param sh The shell
+   * @param argv The command to check
+   * @return True if the command was a built in command
+   */
+  bool do_builtin(struct shell *sh, char **argv);
+
+  /**
+   * @brief Find a built in command by name. This is a single probe of a
+   * perfect hash table so names that are not built in, which is most of
+   * them, are turned away after one hash and at most one compare.
+   *
+   * @param name The command name
+   * @return The table entry or NULL if name is not a built in command
+   */
+  const struct builtin *builtin_find(const char *name);
+
+  /**
+   * @brief The table of built in commands, for completion.
+   *
+   * @param count Set to the number of entries
+   * @return The first entry
+   */
+  const struct builtin *builtin_list(size_t *count);
+
+  /**
+   * @brief Set opts to the sh_spawn defaults: a new process group in the
+   * foreground that inherits the shell's stdin and stdout.
+   *
+   * @param opts The options to initialize
+   */
+  void spawn_opts_init(struct spawn_opts *opts);
+
+  /**
+   * @brief Run a built in command in a child process set up like sh_spawn
+   * would set up an external one. Used for built ins that have to run at
+   * the same time as the rest of their pipeline or in the background.
+   *
+   * @param sh The shell, the child works on its own copy
+   * @param b The built in to run
+   * @param argv The command, argv[0] is the built in's name
+   * @param opts How to launch the command or NULL for the defaults
+   * @return The pid of the child or -1 if it could not be started
+   */
+  pid_t sh_spawn_builtin(struct shell *sh, const struct builtin *b, char **argv, const struct spawn_opts *opts);
+
+  /**
+   * @brief Launch an external command using the backend selected in sh. The
+   * child is placed in opts->pgid, or a new process group named after it,
+   * or the shell's own group when sh->shared_pgroup is set, and gets
+   * opts->fd_in and opts->fd_out as stdin and stdout, then the
+   * redirections in opts->dups are applied in order. If the shell
+   * is interactive and opts->foreground is set the group is given control of
+   * the terminal before the command runs, the caller is responsible for
+   * taking the terminal back once it is done waiting on the child. Pipe fds
+   * passed in should be close on exec so no other child inherits them. A
+   * child with a cgroup or rlimits in opts is started with clone3, or fork
+   * on kernels without it, so it is limited before it runs.
+   *
+   * @param sh The shell
+   * @param argv The command to run, argv[0] is resolved through the PATH cache
+   * @param opts How to launch the command or NULL for the defaults
+   * @return The pid of the child or -1 if it could not be started
+   */
+  pid_t sh_spawn(struct shell *sh, char **argv, const struct spawn_opts *opts);
+
+  /**
+   * @brief Give the terminal to a process group. Nothing is done if the shell
+   * is not interactive or sh->terminal_pgid says the group already has it,
+   * which is the case for every stage after the first and for a job fg puts
+   * back in the foreground right after it started.
+   *
+   * @param sh The shell
+   * @param pgid The group to give it to
+   */
+  void terminal_give(struct shell *sh, pid_t pgid);
+
+  /**
+   * @brief Take the terminal back after a foreground job and put the shell's
+   * modes back if the job changed them. The modes are read once and only
+   * written when they differ, a job that never had the terminal costs no
+   * system call at all.
+   *
+   * @param sh The shell
+   * @param modes Where to keep the job's modes if they differ from the
+   * shell's, for a job that stopped, or NULL
+   * @return True if modes was filled in
+   */
+  bool terminal_take(struct shell *sh, struct termios *modes);
+
+  /**
+   * @brief Run every stage of a pipeline concurrently. N-1 pipes connect the
+   * stages and all of them join one process group that is added to the job
+   * table. A foreground pipeline gets the terminal and the shell waits for
+   * every stage, or for the job to stop, before taking the terminal back.
+   * A background pipeline is left running and reported when it finishes.
+   * The last built in stage runs in the shell itself, with its pipes
+   * standing in for stdin and stdout, once every other stage has started.
+   * Other built in stages, ones that wait on other processes, ones in a
+   * background pipeline and ones that change the shell, such as cd, in any
+   * stage but the last get a process of their own.
+   *
+   * @param sh The shell
+   * @param pl The pipeline to run
+   * @return The exit status of the last stage, 128 plus the signal number if
+   * it was killed or stopped, 0 for a background job, or -1 if it could not
+   * be started
+   */
+  int pipeline_run(struct shell *sh, struct pipeline *pl);
+
+  /**
+   * @brief Open the files a stage redirects to and fill in the dup2 calls
+   * that apply its redirections. The files are close on exec so no other
+   * child sees them and they sit above the descriptors 0 to 9 a redirection
+   * can name so applying one never clobbers the source of the next.
+   *
+   * @param st The stage
+   * @param dirfd What relative paths are relative to, AT_FDCWD for the
+   * working directory
+   * @param dups Room for st->nredirs entries
+   * @return On success, zero is returned. On error, -1 is returned after
+   * the error is printed and nothing is left open.
+   */
+  int open_redirects(const struct stage *st, int dirfd, struct fd_dup *dups);
+
+  /**
+   * @brief Close the files open_redirects opened for the first n
+   * redirections of a stage, once the stage has its own copies.
+   *
+   * @param st The stage
+   * @param dups What open_redirects filled in
+   * @param n How many of its redirections to close
+   */
+  void close_redirects(const struct stage *st, const struct fd_dup *dups, size_t n);
+
+  /**
+   * @brief Run a command once per input with at most N copies running at the
+   * same time, this is the parallel builtin. The arguments are
+   * "[-j N] command [args...] ::: input...", every "{}" word in the command is
+   * replaced by the input or the input is appended when there is none. N
+   * defaults to the number of online CPUs. From the shell the pool runs in a
+   * process of its own, one job with the children in its group that can be
+   * stopped and continued like any other; in a pipeline or in the background
+   * it runs in the job's process it already has. Children are started
+   * through sh_spawn and a slot is refilled as soon as its child exits, the
+   * pool sleeps in poll on the children's pidfds in between. The exit code
+   * of every input is reported on stderr as it finishes.
+   *
+   * @param sh The shell
+   * @param argv The builtin's argv starting with "parallel"
+   * @return The number of inputs that failed, at most 125, 128
+   * plus the signal number if the pool's job was killed or stopped, or -1 on
+   * a usage error
+   */
+  int parallel_run(struct shell *sh, char **argv);
+
+  /**
+   * @brief The memo builtin. "memo [-e NAME]... [-f FILE]... command
+   * [args...]" runs a command whose output depends only on its arguments,
+   * the current directory, the environment variables named with -e and the
+   * files named with -f. The first run is captured and kept with its exit
+   * status in a store on disk, $MY_MEMOFILE or ~/.p2shell_memo, that is
+   * mapped into the shell; a later run with the same arguments, directory,
+   * variables and files, by mtime, size and inode, replays the output
+   * without starting anything. The store is shared by every shell under
+   * flock and evicts the least recently used results to make room. It holds
+   * MY_MEMOSIZE bytes, 16 MiB by default, as set by the shell that made it,
+   * since the others have it mapped. Only stdout is cached, stderr goes
+   * straight through, and a command killed by a signal is not kept. A
+   * command stopped with Ctrl-Z is left in the job table like any other
+   * and is not kept either, what it writes once continued is dropped.
+   * memo -c empties the store.
+   *
+   * @param sh The shell
+   * @param argv The builtin's argv starting with "memo"
+   * @return The exit status of the command, replayed on a hit
+   */
+  int memo_run(struct shell *sh, char **argv);
+
+  /**
+   * @brief The on builtin, "on [-h host[,host...]] command [args...]" runs
+   * a command on every peer at the same time and streams back their output
+   * with the host in front of each line, stdout to stdout and stderr to
+   * stderr. The peers are the hosts given with -h or else those listed in
+   * MY_PEERS, separated by commas or blanks. The words of the command are
+   * the ones this shell parsed and expanded, quoted again for the remote
+   * shell. Each peer is reached with ssh, or $MY_SSH, through a control
+   * master so the first command to a host opens a connection that every
+   * later one multiplexes its session over, for ten minutes after the last
+   * one finishes, and a command only pays for a new channel. The clients
+   * and the process relaying their output make up one job, so the whole
+   * fan out can be stopped, continued and put in the background like any
+   * other. A host that fails is reported on stderr. The control sockets
+   * are kept in $XDG_RUNTIME_DIR/p2shell-ssh, or /tmp/p2shell-ssh-UID, and
+   * that directory is refused unless it belongs to the user with mode 0700.
+   *
+   * @param sh The shell
+   * @param argv The builtin's argv starting with "on"
+   * @return 0 if the command succeeded everywhere, 1 if it failed on a peer,
+   * 2 on a usage error
+   */
+  int peer_run(struct shell *sh, char **argv);
+
+  /**
+   * @brief Unmap the memo store.
+   *
+   * @param sh The shell
+   */
+  void memo_close(struct shell *sh);
+
+  /**
+   * @brief The limit builtin. "limit [-m MEM] [-c CPU%] [-i IO/s] [-p PIDS]
+   * [-t SECS] command [args...]" runs a command that can't take more than
+   * its share of the machine. The command is started inside a cgroup v2 of
+   * its own, made for it under $MY_CGROUP, which should be a delegated
+   * cgroup, or else the shell's own cgroup. A cgroup with processes in it
+   * can't hand controllers down, so before the shell's own is used the
+   * shell is moved to a leaf p2shell-shell-PID inside it. The job's cgroup
+   * gets memory.max, cpu.max, io.max for the disk of the current directory
+   * and pids.max set from the options. clone3 with CLONE_INTO_CGROUP starts
+   * it there, so it never runs outside, and on kernels without it the child
+   * moves itself before it execs. A limit the cgroup can't set, because its
+   * controller isn't delegated or other processes share the cgroup, fails
+   * the command with a message. Only without cgroup v2, or with an empty
+   * MY_CGROUP, do limits fall back to an rlimit where there is one,
+   * RLIMIT_AS for -m, and are reported as not enforced otherwise. -t is
+   * always RLIMIT_CPU. The cgroup is removed once the command is done, in
+   * stats mode after a line with its peak memory, OOM kills and CPU
+   * throttling. The command and the process that
+   * sets it up are one job that can be stopped and continued. Sizes take a
+   * K, M, G or T suffix.
+   *
+   * @param sh The shell
+   * @param argv The builtin's argv starting with "limit"
+   * @return The exit status of the command, 128 plus the signal number if
+   * it was killed, 2 for a usage error or 1 if the limits could not be set
+   */
+  int limit_run(struct shell *sh, char **argv);
+
+  /**
+   * @brief Run one line of input. Leading and trailing whitespace is trimmed
+   * in place, blank lines and lines starting with '#' are ignored, built in
+   * commands run in the shell and everything else is run as a pipeline. The
+   * exit status is also stored in sh->last_status.
+   *
+   * @param sh The shell
+   * @param line The line to run, modified by trim_white
+   * @return The exit status of the line
+   */
+  int sh_run_line(struct shell *sh, char *line);
+
+  /**
+   * @brief Run a line that is already parsed, the part of sh_run_line after
+   * sh_parse. Built in commands run in the shell and everything else is run
+   * as a pipeline. The exit status is also stored in sh->last_status.
+   *
+   * @param sh The shell
+   * @param pl The parsed line, left for the caller to free
+   * @param line The trimmed line it was parsed from, for stats mode
+   * @return The exit status of the line
+   */
+  int sh_run_parsed(struct shell *sh, struct pipeline *pl, const char *line);
+
+  /**
+   * @brief Run every line of a script back to back without readline or
+   * history. Regular files are mapped with mmap and split in place, pipes
+   * and other streams are read through a large stdio buffer. When the
+   * script is stdin and it is a regular file the file offset is moved past
+   * each line before it runs so commands that read stdin see the rest of
+   * the script, just like other shells.
+   * 
+   * A script named by path is compiled the first time it runs: every line
+   * that parses the same each time, with no variable, $(...) or glob, is
+   * parsed once and its pipeline stored with offsets for pointers in
+   * .NAME.p2c next to the script, or in $MY_SCRIPTCACHE named after the
+   * script's hash. Later runs map that file, put each pipeline's pointers
+   * back as it is reached and run it with no parsing or allocation. The
+   * cache is keyed by a hash of the script, a stale or damaged one is
+   * compiled again and an empty MY_SCRIPTCACHE turns it off. A cache is
+   * only used when it and its directory belong to the effective user and
+   * no one else can write to them.
+   *
+   * @param sh The shell
+   * @param path The script to run or NULL to read stdin
+   * @return The exit status of the last line run, or 127 if the script
+   * could not be opened
+   */
+  int sh_run_script(struct shell *sh, const char *path);
+
+  /**
+   * @brief Set up an empty history. Nothing is read from path until the
+   * history is first used or, mirrored into readline, until readline is
+   * about to draw its first prompt.
+   *
+   * @param h The history
+   * @param max_entries Most entries to keep, at least one
+   * @param max_bytes Most bytes of entries to keep
+   * @param path History file to load and append to, or NULL for none
+   * @param readline Mirror entries into readline's history list
+   */
+  void hist_init(struct history *h, size_t max_entries, size_t max_bytes, const char *path, bool readline);
+
+  /**
+   * @brief Add an entry, evicting the oldest entries until both caps are
+   * met, and append it to the history file. Once the file has grown to
+   * twice the byte cap it is rewritten with its newest entries under both
+   * caps, from whichever shells appended them. Shells append under a shared
+   * flock and the rewrite takes it alone, so no entry is lost to it.
+   *
+   * @param h The history
+   * @param line The entry to add
+   * @return On success, zero is returned. On error, -1 is returned.
+   */
+  int hist_add(struct history *h, const char *line);
+
+  /**
+   * @brief Get an entry by age.
+   *
+   * @param h The history
+   * @param i Index of the entry, 0 is the oldest
+   * @return The entry or NULL if i is out of range
+   */
+  const char *hist_get(struct history *h, size_t i);
+
+  /**
+   * @brief Print every entry the way the history builtin shows it.
+   *
+   * @param h The history
+   */
+  void hist_print(struct history *h);
+
+  /**
+   * @brief Free the entries and close the history file.
+   *
+   * @param h The history
+   */
+  void hist_destroy(struct history *h);
+
+  /**
+   * @brief Install the SIGCHLD handler that drives asynchronous reaping of
+   * jobs. Called by sh_init.
+   *
+   * @param sh The shell
+   */
+  void jobs_init(struct shell *sh);
+
+  /**
+   * @brief Add a new job for pl to the job table. The job has no processes
+   * until job_add_proc is called for each stage that starts.
+   *
+   * @param sh The shell
+   * @param pl The pipeline the job runs, used for the command shown by jobs
+   * @return The new job or NULL if memory could not be allocated
+   */
+  struct job *job_new(struct shell *sh, const struct pipeline *pl);
+
+  /**
+   * @brief Add a new foreground job to the job table for something other
+   * than a parsed pipeline, such as a built in that starts processes of its
+   * own and wants them stopped and continued like any other job.
+   *
+   * @param sh The shell
+   * @param cmd The command shown by jobs, copied
+   * @param nprocs The most processes job_add_proc will be called for
+   * @return The new job or NULL if memory could not be allocated
+   */
+  struct job *job_new_cmd(struct shell *sh, const char *cmd, size_t nprocs);
+
+  /**
+   * @brief Add a new foreground job to the job table for a command that is
+   * not a parsed pipeline, shown by jobs like the line was typed.
+   *
+   * @param sh The shell
+   * @param argv The words of the command, joined with spaces
+   * @param nprocs The most processes job_add_proc will be called for
+   * @return The new job or NULL if memory could not be allocated
+   */
+  struct job *job_new_argv(struct shell *sh, char **argv, size_t nprocs);
+
+  /**
+   * @brief Record that a process was started for a job. The first process
+   * added names the job's process group. With an event loop the process's
+   * pidfd is watched so its exit is reaped as soon as it happens.
+   *
+   * @param sh The shell
+   * @param job The job
+   * @param pid The process
+   * @return On success, zero is returned. On error, -1 is returned.
+   */
+  int job_add_proc(struct shell *sh, struct job *job, pid_t pid);
+
+  /**
+   * @brief Remove a job from the table and free it.
+   *
+   * @param sh The shell
+   * @param job The job to remove
+   */
+  void job_remove(struct shell *sh, struct job *job);
+
+  /**
+   * @brief Work out what state a job is in from its processes.
+   *
+   * @param job The job
+   * @return JOB_DONE once every process is reaped, JOB_STOPPED when every
+   * live process is stopped, otherwise JOB_RUNNING
+   */
+  enum job_state job_state(const struct job *job);
+
+  /**
+   * @brief Find a job from a jobs/fg/bg argument. The spec may be a job
+   * number with or without a leading '%'. NULL selects the most recently
+   * started job.
+   *
+   * @param sh The shell
+   * @param spec The job to look for
+   * @return The job or NULL if there is no such job
+   */
+  struct job *job_find(struct shell *sh, const char *spec);
+
+  /**
+   * @brief Put a job in the foreground and wait for it to finish or stop. If
+   * cont is set the job is sent SIGCONT first, restoring the terminal modes
+   * it had when it stopped. A finished job is removed from the table.
+   *
+   * @param sh The shell
+   * @param job The job
+   * @param cont Continue the job before waiting on it
+   * @return The exit status of the last process, or 128 plus the signal
+   * number if it was killed or stopped
+   */
+  int job_foreground(struct shell *sh, struct job *job, bool cont);
+
+  /**
+   * @brief Wait for every process of a job to exit by its pid, never by its
+   * group or with -1, so a caller sharing the process with others only ever
+   * reaps its own children. Stops are not waited for.
+   *
+   * @param sh The shell
+   * @param job The job
+   * @return The exit status of the last process, 128 plus the signal number
+   * if it was killed, or 127 if the job has no processes
+   */
+  int job_wait_pids(struct shell *sh, struct job *job);
+
+  /**
+   * @brief Continue a stopped job in the background.
+   *
+   * @param sh The shell
+   * @param job The job
+   */
+  void job_background(struct shell *sh, struct job *job);
+
+  /**
+   * @brief Send a background job's stdout and stderr to a pipe the event loop
+   * reads into a ring buffer of JOB_OUTPUT_SIZE bytes, so the job never
+   * writes over the prompt and a job that prints a lot costs no more memory
+   * than one that prints a little. There is no thread or process per job,
+   * only the pipe and one watch, and the ring is not allocated until the job
+   * writes something. The output is shown by jobs -o or by fg. Without an
+   * event loop there is nothing to do it and the job writes to the terminal.
+   *
+   * @param sh The shell
+   * @param job The job, before any of its processes start
+   * @return The write end to give every process of the job, close on exec,
+   * or -1 if the output is not captured
+   */
+  int job_capture(struct shell *sh, struct job *job);
+
+  /**
+   * @brief Print the output a job's ring still holds, for jobs -o. A finished
+   * job it was kept for is removed from the table afterwards.
+   *
+   * @param sh The shell
+   * @param job The job
+   */
+  void job_output_print(struct shell *sh, struct job *job);
+
+  /**
+   * @brief Collect the status of every job process that has changed state
+   * without blocking. Does nothing unless SIGCHLD arrived since the last
+   * call, or with an event loop unless the signalfd is readable, so it is
+   * cheap to call often.
+   *
+   * @param sh The shell
+   */
+  void jobs_reap(struct shell *sh);
+
+  /**
+   * @brief Reap and then tell the user about background jobs that finished
+   * or stopped since the last call. Finished jobs are removed unless they
+   * left output nobody has seen, which is kept for jobs -o. Called before
+   * each prompt.
+   *
+   * @param sh The shell
+   */
+  void jobs_notify(struct shell *sh);
+
+  /**
+   * @brief Check whether jobs_notify has anything to tell the user, so the
+   * event loop only redraws the prompt when a job finished or stopped.
+   *
+   * @param sh The shell
+   * @return True if a job finished or stopped and has not been reported
+   */
+  bool jobs_need_notify(struct shell *sh);
+
+  /**
+   * @brief Print the job table the way the jobs builtin shows it.
+   *
+   * @param sh The shell
+   */
+  void jobs_print(struct shell *sh);
+
+  /**
+   * @brief Free every job in the table.
+   *
+   * @param sh The shell
+   */
+  void jobs_destroy(struct shell *sh);
+
+  /**
+   * @brief Create the event loop and make it sh->loop. Called by sh_init for
+   * an interactive shell before jobs_init, which adds SIGCHLD to it.
+   *
+   * @param sh The shell
+   * @return On success, zero is returned. On error, -1 is returned and the
+   * shell keeps blocking in readline and wait4.
+   */
+  int loop_init(struct shell *sh);
+
+  /**
+   * @brief Watch a descriptor for input. The descriptor stays owned by the
+   * caller, take it out with loop_remove before closing it.
+   *
+   * @param sh The shell
+   * @param fd The descriptor to watch
+   * @param fn Called from loop_run each time fd is readable
+   * @param data Passed to fn
+   * @return The watch or NULL on error
+   */
+  struct watch *loop_add(struct shell *sh, int fd, watch_fn fn, void *data);
+
+  /**
+   * @brief Stop or resume calling a watch. A paused watch is out of the
+   * epoll set but keeps its place for loop_pause to put it back. The
+   * terminal is paused while a foreground job owns it.
+   *
+   * @param sh The shell
+   * @param w The watch
+   * @param paused True to stop calling it
+   */
+  void loop_pause(struct shell *sh, struct watch *w, bool paused);
+
+  /**
+   * @brief Take a watch out of the set. Safe to call from any watch's fn,
+   * including the one being removed.
+   *
+   * @param sh The shell
+   * @param w The watch
+   */
+  void loop_remove(struct shell *sh, struct watch *w);
+
+  /**
+   * @brief Wait for watched descriptors to become readable and call their
+   * watches. Calls may nest, job_wait runs the loop from inside the
+   * terminal's watch until the foreground job is done.
+   *
+   * @param sh The shell
+   * @param timeout_ms Longest to wait, -1 waits until something is ready
+   * @return The number of watches called, 0 on timeout or a signal, or -1
+   * on error
+   */
+  int loop_run(struct shell *sh, int timeout_ms);
+
+  /**
+   * @brief Read and run commands from the terminal until end of file. The
+   * terminal is read with readline's callback interface from inside the
+   * event loop so background jobs are reported the moment they finish,
+   * with the prompt and the line being typed drawn again below.
+   *
+   * @param sh The shell, sh->loop must be set
+   * @return Zero at end of file, -1 if the loop failed and the caller should
+   * carry on with plain readline
+   */
+  int loop_interact(struct shell *sh);
+
+  /**
+   * @brief Free the event loop. Every watch should have been removed.
+   *
+   * @param sh The shell
+   */
+  void loop_destroy(struct shell *sh);
+
+  /**
+   * @brief Read the monotonic clock.
+   *
+   * @return Nanoseconds since an arbitrary fixed point
+   */
+  long long monotonic_ns(void);
+
+  /**
+   * @brief Add the resources one process used to a command's totals. Times
+   * and counters are summed, max RSS keeps the largest.
+   *
+   * @param st The command's stats
+   * @param ru What the process used, as returned by wait4
+   */
+  void cmd_stats_add(struct cmd_stats *st, const struct rusage *ru);
+
+  /**
+   * @brief Report what a command cost. A timed command gets a block on
+   * stderr like the time prefix of other shells, stats mode appends one
+   * key=value line per command to sh->stats_fd.
+   *
+   * @param sh The shell
+   * @param st What the command cost
+   * @param timed The command was run with the time prefix
+   * @param cmd The command line for the stats log
+   */
+  void cmd_stats_report(struct shell *sh, const struct cmd_stats *st, bool timed, const char *cmd);
+
+  /**
+   * @brief Spans around the shell's hot paths for profiling, compiled in
+   * only when building with make TRACE=1. TRACE_BEGIN(t) starts a span timed
+   * by a local named t and TRACE_END(t, name) records it, both expand to
+   * nothing in a normal build.
+   */
+#ifdef SH_TRACE
+#define TRACE_BEGIN(t) long long t = monotonic_ns()
+#define TRACE_END(t, name) trace_span(name, t, monotonic_ns())
+#else
+#define TRACE_BEGIN(t) do { } while (0)
+#define TRACE_END(t, name) do { } while (0)
+#endif
+
+  /**
+   * @brief Record a finished span in the trace ring. The ring holds the most
+   * recent spans of this process and claiming a slot is a single atomic add
+   * so recording never takes a lock. Only built with SH_TRACE.
+   *
+   * @param name What the span measured, must be a string literal
+   * @param start_ns Monotonic time the span started
+   * @param end_ns Monotonic time the span ended
+   */
+  void trace_span(const char *name, long long start_ns, long long end_ns);
+
+  /**
+   * @brief Write the spans in the trace ring as Chrome trace JSON, which
+   * chrome://tracing and the Perfetto UI load directly. Only built with
+   * SH_TRACE.
+   *
+   * @param path File to write
+   * @return On success, zero is returned. On error, -1 is returned.
+   */
+  int trace_dump(const char *path);
+
+  /**
+   * @brief Look up a spawn backend by the name used on the command line,
+   * either "spawn" or "fork".
+   *
+   * @param name The backend name
+   * @param backend Set to the matching backend on success
+   * @return On success, zero is returned. On error, -1 is returned.
+   */
+  int spawn_backend_parse(const char *name, enum spawn_backend *backend);
+
+  /**
+   * @brief Resolve a command name to the executable that execvp would run.
+   * Names containing a slash are returned unchanged. Other names are looked
+   * up in the cache first and on a miss every PATH directory is searched and
+   * the result is remembered. If PATH has changed since the last lookup the
+   * cache is emptied before searching.
+   *
+   * @param cache The cache to use
+   * @param name The command name
+   * @return The path to exec, owned by the cache, or NULL if name was not found
+   */
+  const char *path_lookup(struct path_cache *cache, const char *name);
+
+  /**
+   * @brief Drop a single name from the cache, used when the executable it
+   * pointed at has gone away.
+   *
+   * @param cache The cache to use
+   * @param name The command name to forget
+   */
+  void path_forget(struct path_cache *cache, const char *name);
+
+  /**
+   * @brief Forget every resolved command, this is what hash -r does.
+   *
+   * @param cache The cache to clear
+   */
+  void path_cache_clear(struct path_cache *cache);
+
+  /**
+   * @brief Free all memory held by the cache.
+   *
+   * @param cache The cache to destroy
+   */
+  void path_cache_destroy(struct path_cache *cache);
 
   /**
    * @brief Initialize the shell for use. Allocate all data structures
@@ -114,6 +1661,9 @@ extern "C"
 
   /**
    * @brief Parse command line args from the user when the shell was launched
+   * -v prints the version, -b spawn|fork selects the launch backend and
+   * -f script runs the script non-interactively instead of reading the
+   * terminal and -s turns on stats mode.
    *
    * @param argc Number of args
    * @param argv The arg array
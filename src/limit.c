@@ -0,0 +1,436 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/sysmacros.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "lab.h"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define CGROUP2_MAGIC 0x63677270        // statfs f_type of a cgroup v2 mount
+#define CPU_PERIOD_US 100000            // cpu.max period, -c is a share of it
+#define CGROUP_LEAF "p2shell-shell"     // the shell's own leaf, see cgroup_base
+
+// what the limit builtin was asked for, zero for a limit that is not set
+struct limits {
+    long long memory;     // bytes
+    long long cpu;        // percent of one CPU
+    long long io;         // bytes per second read and written
+    long long pids;       // processes and threads
+    long long seconds;    // CPU time, always an rlimit
+};
+
+static int usage(void) {
+    fprintf(stderr, "usage: limit [-m MEM] [-c CPU%%] [-i IO/s] [-p PIDS] [-t SECS] [--] command [args...]\n");
+    return 2;
+}
+
+// a positive number with an optional K, M, G or T binary suffix
+static int parse_size(const char *s, long long *out) {
+    char *end;
+    errno = 0;
+    long long n = strtoll(s, &end, 10);
+    if (errno || end == s || n <= 0) {
+        return -1;
+    }
+    const char *suffixes = "KMGT";
+    const char *unit = *end ? strchr(suffixes, *end & ~0x20) : NULL;
+    if (*end && (!unit || end[1])) {
+        return -1;
+    }
+    for (const char *u = suffixes; unit && u <= unit; u++) {
+        if (n > LLONG_MAX / 1024) {
+            return -1;
+        }
+        n *= 1024;
+    }
+    *out = n;
+    return 0;
+}
+
+static int knob_write(int dirfd, const char *name, const char *value) {
+    int fd = openat(dirfd, name, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    size_t len = strlen(value);
+    int rval = write(fd, value, len) == (ssize_t)len ? 0 : -1;
+    close(fd);
+    return rval;
+}
+
+// move pid into the leaf named after the shell under the cgroup dirfd
+// names, making the leaf the first time
+static int cgroup_move(int dirfd, const char *leaf, pid_t pid) {
+    if (mkdirat(dirfd, leaf, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+    int fd = openat(dirfd, leaf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    char value[32];
+    snprintf(value, sizeof(value), "%d", (int)pid);
+    int rval = knob_write(fd, "cgroup.procs", value);
+    close(fd);
+    return rval;
+}
+
+// the cgroup v2 directory job cgroups are made in: $MY_CGROUP, or the
+// shell's own cgroup when the unified hierarchy is mounted, -1 when
+// neither is there or an empty MY_CGROUP means rlimits only. A cgroup
+// with processes in it can't give controllers to its children, so the
+// first time the shell's own cgroup is used the shell, and this process
+// when it is a child of it, are moved to a leaf CGROUP_LEAF-PID inside
+// it. A shell already in such a leaf uses the cgroup above it
+static int cgroup_base(struct shell *sh, char *buf, size_t size) {
+    const char *env = getenv("MY_CGROUP");
+    if (env) {
+        if (!*env || (size_t)snprintf(buf, size, "%s", env) >= size) {
+            return -1;
+        }
+        return 0;
+    }
+
+    struct statfs fs;
+    if (statfs(CGROUP_ROOT, &fs) < 0 || fs.f_type != CGROUP2_MAGIC) {
+        return -1;
+    }
+    FILE *f = fopen("/proc/self/cgroup", "re");
+    if (!f) {
+        return -1;
+    }
+    char line[PATH_MAX];
+    int rval = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            rval = (size_t)snprintf(buf, size, CGROUP_ROOT "%s", line + 3) < size ? 0 : -1;
+            break;
+        }
+    }
+    fclose(f);
+    // the root cgroup is the one that may have processes and children both
+    if (rval < 0 || strcmp(line + 3, "/") == 0) {
+        return rval;
+    }
+
+    char *slash = strrchr(buf, '/');
+    if (strncmp(slash + 1, CGROUP_LEAF "-", strlen(CGROUP_LEAF "-")) == 0) {
+        *slash = '\0';
+        return 0;
+    }
+    pid_t shell = sh->forked ? getppid() : getpid();
+    char leaf[64];
+    snprintf(leaf, sizeof(leaf), CGROUP_LEAF "-%d", (int)shell);
+    int dirfd = open(buf, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd < 0) {
+        return -1;
+    }
+    rval = cgroup_move(dirfd, leaf, shell);
+    if (rval == 0 && sh->forked) {
+        rval = cgroup_move(dirfd, leaf, getpid());
+    }
+    if (rval < 0) {
+        fprintf(stderr, "limit: %s: can't move the shell into %s: %s\n", buf, leaf, strerror(errno));
+    }
+    close(dirfd);
+    return 0;
+}
+
+// the whole disk the current directory is on, io.max only takes disks
+static int io_device(char *buf, size_t size) {
+    struct stat st;
+    if (stat(".", &st) < 0 || major(st.st_dev) == 0) {
+        return -1;
+    }
+    snprintf(buf, size, "%u:%u", major(st.st_dev), minor(st.st_dev));
+
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/dev/block/%s/partition", buf);
+    if (access(path, F_OK) == 0) {
+        snprintf(path, sizeof(path), "/sys/dev/block/%s/../dev", buf);
+        FILE *f = fopen(path, "re");
+        if (!f) {
+            return -1;
+        }
+        bool ok = fgets(buf, (int)size, f) != NULL;
+        fclose(f);
+        if (!ok) {
+            return -1;
+        }
+        buf[strcspn(buf, "\n")] = '\0';
+    }
+    return 0;
+}
+
+// a controller has to be enabled in the parent first, it may be already
+static int controller_enable(int base, const char *base_path, const char *name) {
+    char value[16];
+    snprintf(value, sizeof(value), "+%s", name);
+    if (knob_write(base, "cgroup.subtree_control", value) == 0) {
+        return 0;
+    }
+    fprintf(stderr, "limit: %s: can't enable the %s controller: %s, set MY_CGROUP to a delegated cgroup "
+                    "or to nothing for rlimits only\n", base_path, name, strerror(errno));
+    return -1;
+}
+
+static int limit_write(int cg, const char *name, const char *value) {
+    if (knob_write(cg, name, value) == 0) {
+        return 0;
+    }
+    fprintf(stderr, "limit: %s: %s\n", name, strerror(errno));
+    return -1;
+}
+
+// set every limit in lim on the cgroup and clear it there, -1 after a
+// message if one can't be set. Only an io limit without a disk to put it
+// on is left in lim
+static int cgroup_limit(int base, const char *base_path, int cg, struct limits *lim) {
+    char value[128];
+    if (lim->memory) {
+        snprintf(value, sizeof(value), "%lld", lim->memory);
+        if (controller_enable(base, base_path, "memory") < 0 || limit_write(cg, "memory.max", value) < 0) {
+            return -1;
+        }
+        knob_write(cg, "memory.swap.max", "0");   // not there without swap accounting
+        lim->memory = 0;
+    }
+    if (lim->cpu) {
+        snprintf(value, sizeof(value), "%lld %d", lim->cpu * CPU_PERIOD_US / 100, CPU_PERIOD_US);
+        if (controller_enable(base, base_path, "cpu") < 0 || limit_write(cg, "cpu.max", value) < 0) {
+            return -1;
+        }
+        lim->cpu = 0;
+    }
+    char dev[32];
+    if (lim->io && io_device(dev, sizeof(dev)) == 0) {
+        snprintf(value, sizeof(value), "%s rbps=%lld wbps=%lld", dev, lim->io, lim->io);
+        if (controller_enable(base, base_path, "io") < 0 || limit_write(cg, "io.max", value) < 0) {
+            return -1;
+        }
+        lim->io = 0;
+    }
+    if (lim->pids) {
+        snprintf(value, sizeof(value), "%lld", lim->pids);
+        if (controller_enable(base, base_path, "pids") < 0 || limit_write(cg, "pids.max", value) < 0) {
+            return -1;
+        }
+        lim->pids = 0;
+    }
+    return 0;
+}
+
+// the value of key in a flat keyed cgroup file, or its first number when
+// key is NULL, -1 if the file or key isn't there
+static long long knob_read(int dirfd, const char *name, const char *key) {
+    int fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    char buf[4096];
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    if (!key) {
+        return strtoll(buf, NULL, 10);
+    }
+    size_t klen = strlen(key);
+    for (char *line = buf; line && *line; line = strchr(line, '\n'), line = line ? line + 1 : NULL) {
+        if (strncmp(line, key, klen) == 0 && line[klen] == ' ') {
+            return strtoll(line + klen + 1, NULL, 10);
+        }
+    }
+    return -1;
+}
+
+// add what the cgroup saw to the stats log, the rusage the shell gets for
+// the job can't tell page cache charged to it or time it was throttled
+static void cgroup_report(struct shell *sh, int cg, const char *name, int status) {
+    if (!sh->stats) {
+        return;
+    }
+    // -1 for anything the cgroup has no controller for
+    long long peak = knob_read(cg, "memory.peak", NULL);
+    char line[512];
+    int len = snprintf(line, sizeof(line),
+                       "limit status=%d memory_peak_kb=%lld oom_kill=%lld cpu_usage_us=%lld "
+                       "cpu_throttled_us=%lld cgroup=%s\n",
+                       status, peak < 0 ? -1 : peak / 1024, knob_read(cg, "memory.events", "oom_kill"),
+                       knob_read(cg, "cpu.stat", "usage_usec"), knob_read(cg, "cpu.stat", "throttled_usec"), name);
+    if (len > 0 && write(sh->stats_fd, line, (size_t)len) < 0) {
+        perror("stats");
+    }
+}
+
+// the options in lim and the index of the command in argv, or -1
+static int parse_limits(char **argv, struct limits *lim) {
+    memset(lim, 0, sizeof(*lim));
+    int i = 1;
+    for (; argv[i] && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        long long *slot = NULL;
+        switch (argv[i][1] && !argv[i][2] ? argv[i][1] : '\0') {
+            case 'm': slot = &lim->memory; break;
+            case 'c': slot = &lim->cpu; break;
+            case 'i': slot = &lim->io; break;
+            case 'p': slot = &lim->pids; break;
+            case 't': slot = &lim->seconds; break;
+            default: return -1;
+        }
+        if (!argv[i + 1] || parse_size(argv[++i], slot) < 0) {
+            return -1;
+        }
+    }
+    return argv[i] ? i : -1;
+}
+
+// start the command in its cgroup and wait for it, see limit_run
+static int limit_child(struct shell *sh, char **argv) {
+    struct limits lim;
+    int i = parse_limits(argv, &lim);
+    if (i < 0) {
+        return usage();
+    }
+
+    // a cgroup named after the helper process, one per job
+    char base_path[PATH_MAX], name[64];
+    snprintf(name, sizeof(name), "p2shell-%d", (int)getpid());
+    int base = -1, cg = -1;
+    if ((lim.memory || lim.cpu || lim.io || lim.pids) && cgroup_base(sh, base_path, sizeof(base_path)) == 0) {
+        base = open(base_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (base < 0 || mkdirat(base, name, 0755) < 0 ||
+            (cg = openat(base, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+            fprintf(stderr, "limit: %s/%s: %s\n", base_path, name, strerror(errno));
+        } else if (cgroup_limit(base, base_path, cg, &lim) < 0) {
+            close(cg);
+            cg = -1;
+            unlinkat(base, name, AT_REMOVEDIR);
+        }
+        if (cg < 0) {
+            if (base >= 0) {
+                close(base);
+            }
+            return 1;
+        }
+    }
+
+    struct spawn_rlimit rl[2];
+    size_t nrl = 0;
+    if (lim.memory) {
+        rl[nrl++] = (struct spawn_rlimit){ RLIMIT_AS, (rlim_t)lim.memory };
+    }
+    if (lim.seconds) {
+        rl[nrl++] = (struct spawn_rlimit){ RLIMIT_CPU, (rlim_t)lim.seconds };
+    }
+    if (lim.cpu) {
+        fprintf(stderr, "limit: -c needs cgroup v2, not enforced\n");
+    }
+    if (lim.io) {
+        fprintf(stderr, "limit: -i needs cgroup v2 and a disk, not enforced\n");
+    }
+    if (lim.pids) {
+        fprintf(stderr, "limit: -p needs cgroup v2, not enforced\n");
+    }
+
+    // the command stays in the helper's group so stopping the job stops both
+    struct spawn_opts opts;
+    spawn_opts_init(&opts);
+    opts.pgid = getpgrp();
+    opts.foreground = false;
+    opts.cgroup_fd = cg;
+    opts.rlimits = rl;
+    opts.nrlimits = nrl;
+    fflush(stdout);
+    pid_t pid = sh_spawn(sh, &argv[i], &opts);
+    int status = 127;
+    if (pid > 0) {
+        int ws;
+        while (waitpid(pid, &ws, 0) < 0 && errno == EINTR) {
+        }
+        status = WIFSIGNALED(ws) ? 128 + WTERMSIG(ws) : WEXITSTATUS(ws);
+    }
+
+    if (cg >= 0) {
+        cgroup_report(sh, cg, name, status);
+        close(cg);
+        // anything the command left running keeps the cgroup, and its limits
+        if (unlinkat(base, name, AT_REMOVEDIR) < 0 && errno != ENOENT) {
+            fprintf(stderr, "limit: %s/%s: %s\n", base_path, name, strerror(errno));
+        }
+    }
+    if (base >= 0) {
+        close(base);
+    }
+    return status;
+}
+
+// limit_child runs in a process of its own, it has the cgroup to clean up
+// once the command is done even if the job was stopped and continued
+static const struct builtin limit_builtin = { "limit", 5, limit_child, BUILTIN_FORKS | BUILTIN_WAITS };
+
+/**
+* @brief The limit builtin. "limit [-m MEM] [-c CPU%] [-i IO/s] [-p PIDS]
+* [-t SECS] command [args...]" runs a command that can't take more than
+* its share of the machine. The command is started inside a cgroup v2 of
+* its own, made for it under $MY_CGROUP, which should be a delegated
+* cgroup, or else the shell's own cgroup. A cgroup with processes in it
+* can't hand controllers down, so before the shell's own is used the
+* shell is moved to a leaf p2shell-shell-PID inside it. The job's cgroup
+* gets memory.max, cpu.max, io.max for the disk of the current directory
+* and pids.max set from the options. clone3 with CLONE_INTO_CGROUP starts
+* it there, so it never runs outside, and on kernels without it the child
+* moves itself before it execs. A limit the cgroup can't set, because its
+* controller isn't delegated or other processes share the cgroup, fails
+* the command with a message. Only without cgroup v2, or with an empty
+* MY_CGROUP, do limits fall back to an rlimit where there is one,
+* RLIMIT_AS for -m, and are reported as not enforced otherwise. -t is
+* always RLIMIT_CPU. The cgroup is removed once the command is done, in
+* stats mode after a line with its peak memory, OOM kills and CPU
+* throttling. The command and the process that
+* sets it up are one job that can be stopped and continued. Sizes take a
+* K, M, G or T suffix.
+*
+* @param sh The shell
+* @param argv The builtin's argv starting with "limit"
+* @return The exit status of the command, 128 plus the signal number if
+* it was killed, 2 for a usage error or 1 if the limits could not be set
+*/
+int limit_run(struct shell *sh, char **argv) {
+    struct limits lim;
+    if (parse_limits(argv, &lim) < 0) {
+        return usage();
+    }
+
+    // in a pipeline or in the background this already is a process of a job
+    if (sh->forked || getpgrp() != sh->shell_pgid) {
+        return limit_child(sh, argv);
+    }
+
+    struct job *job = job_new_argv(sh, argv, 1);
+    if (!job) {
+        fprintf(stderr, "limit: out of memory\n");
+        return 1;
+    }
+
+    pid_t pid = sh_spawn_builtin(sh, &limit_builtin, argv, NULL);
+    if (pid < 0) {
+        job_remove(sh, job);
+        return 1;
+    }
+    job_add_proc(sh, job, pid);
+    job->spawned_ns = monotonic_ns();
+    return job_foreground(sh, job, false);
+}
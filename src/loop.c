@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <readline/readline.h>
+#include "lab.h"
+
+#define LOOP_EVENTS 32   // events taken from the kernel per epoll_wait
+
+// readline's line handler takes no argument so the shell it runs lines for lives here
+static struct shell *line_shell = NULL;
+static bool line_eof = false;
+
+// free watches once nothing can still be holding an event for them
+static void free_dead(struct event_loop *loop) {
+    while (loop->dead) {
+        struct watch *w = loop->dead;
+        loop->dead = w->next;
+        free(w);
+    }
+}
+
+/**
+* @brief Create the event loop and make it sh->loop. Called by sh_init for
+* an interactive shell before jobs_init, which adds SIGCHLD to it.
+*
+* @param sh The shell
+* @return On success, zero is returned. On error, -1 is returned and the
+* shell keeps blocking in readline and wait4.
+*/
+int loop_init(struct shell *sh) {
+    struct event_loop *loop = calloc(1, sizeof(*loop));
+    if (!loop) {
+        return -1;
+    }
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        perror("epoll_create1");
+        free(loop);
+        return -1;
+    }
+    sh->loop = loop;
+    return 0;
+}
+
+/**
+* @brief Watch a descriptor for input. The descriptor stays owned by the
+* caller, take it out with loop_remove before closing it.
+*
+* @param sh The shell
+* @param fd The descriptor to watch
+* @param fn Called from loop_run each time fd is readable
+* @param data Passed to fn
+* @return The watch or NULL on error
+*/
+struct watch *loop_add(struct shell *sh, int fd, watch_fn fn, void *data) {
+    struct watch *w = calloc(1, sizeof(*w));
+    if (!w) {
+        return NULL;
+    }
+    w->fd = fd;
+    w->fn = fn;
+    w->data = data;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = w };
+    if (epoll_ctl(sh->loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        perror("epoll_ctl");
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+/**
+* @brief Stop or resume calling a watch. A paused watch is out of the
+* epoll set but keeps its place for loop_pause to put it back. The
+* terminal is paused while a foreground job owns it.
+*
+* @param sh The shell
+* @param w The watch
+* @param paused True to stop calling it
+*/
+void loop_pause(struct shell *sh, struct watch *w, bool paused) {
+    // hangups are reported even for an empty event mask so the fd leaves the set
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = w };
+    if (epoll_ctl(sh->loop->epfd, paused ? EPOLL_CTL_DEL : EPOLL_CTL_ADD, w->fd, &ev) < 0) {
+        perror("epoll_ctl");
+    }
+}
+
+/**
+* @brief Take a watch out of the set. Safe to call from any watch's fn,
+* including the one being removed.
+*
+* @param sh The shell
+* @param w The watch
+*/
+void loop_remove(struct shell *sh, struct watch *w) {
+    struct event_loop *loop = sh->loop;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, w->fd, NULL);    // ENOENT if it was paused
+
+    // an event for it may already be in a batch being dispatched
+    w->removed = true;
+    w->next = loop->dead;
+    loop->dead = w;
+    if (loop->depth == 0) {
+        free_dead(loop);
+    }
+}
+
+/**
+* @brief Wait for watched descriptors to become readable and call their
+* watches. Calls may nest, job_wait runs the loop from inside the
+* terminal's watch until the foreground job is done.
+*
+* @param sh The shell
+* @param timeout_ms Longest to wait, -1 waits until something is ready
+* @return The number of watches called, 0 on timeout or a signal, or -1
+* on error
+*/
+int loop_run(struct shell *sh, int timeout_ms) {
+    struct event_loop *loop = sh->loop;
+    struct epoll_event events[LOOP_EVENTS];
+
+    int n = epoll_wait(loop->epfd, events, LOOP_EVENTS, timeout_ms);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    int called = 0;
+    loop->depth++;
+    for (int i = 0; i < n; i++) {
+        struct watch *w = events[i].data.ptr;
+        if (!w->removed) {
+            w->fn(sh, w->data);
+            called++;
+        }
+    }
+    if (--loop->depth == 0) {
+        free_dead(loop);
+    }
+    return called;
+}
+
+// readline has a whole line, run it with the terminal out of the set
+static void on_line(char *line) {
+    struct shell *sh = line_shell;
+    if (!line) {
+        line_eof = true;
+        rl_callback_handler_remove();
+        return;
+    }
+
+    // the command owns the terminal until it is done, stop reading it meanwhile
+    loop_pause(sh, sh->loop->terminal, true);
+    // do nothing on blank lines don't save history or attempt to exec
+    char *cmd = trim_white(line);
+    if (*cmd) {
+        hist_add(&sh->history, cmd);
+        sh_run_line(sh, cmd);
+    }
+    free(line);
+
+    // report background jobs that finished while the command ran
+    jobs_notify(sh);
+    rl_set_prompt(prompt_render(sh));
+    loop_pause(sh, sh->loop->terminal, false);
+}
+
+static void on_terminal(struct shell *sh, void *data) {
+    UNUSED(sh)
+    UNUSED(data)
+    rl_callback_read_char();
+}
+
+/**
+* @brief Read and run commands from the terminal until end of file. The
+* terminal is read with readline's callback interface from inside the
+* event loop so background jobs are reported the moment they finish,
+* with the prompt and the line being typed drawn again below.
+*
+* @param sh The shell, sh->loop must be set
+* @return Zero at end of file, -1 if the loop failed and the caller should
+* carry on with plain readline
+*/
+int loop_interact(struct shell *sh) {
+    struct event_loop *loop = sh->loop;
+    loop->terminal = loop_add(sh, sh->shell_terminal, on_terminal, NULL);
+    if (!loop->terminal) {
+        return -1;
+    }
+
+    line_shell = sh;
+    line_eof = false;
+    jobs_notify(sh);
+    rl_callback_handler_install(prompt_render(sh), on_line);
+
+    int rval = 0;
+    while (!line_eof) {
+        if (loop_run(sh, -1) < 0) {
+            perror("epoll_wait");
+            rl_callback_handler_remove();
+            rval = -1;
+            break;
+        }
+
+        // a background job finished or a slow prompt segment came in while
+        // the user was at the prompt
+        if (!line_eof && (jobs_need_notify(sh) || sh->prompt_tmpl.changed)) {
+            rl_clear_visible_line();
+            jobs_notify(sh);
+            fflush(stdout);
+            rl_set_prompt(prompt_render(sh));
+            rl_forced_update_display();
+        }
+    }
+
+    loop_remove(sh, loop->terminal);
+    loop->terminal = NULL;
+    line_shell = NULL;
+    return rval;
+}
+
+/**
+* @brief Free the event loop. Every watch should have been removed.
+*
+* @param sh The shell
+*/
+void loop_destroy(struct shell *sh) {
+    struct event_loop *loop = sh->loop;
+    if (!loop) {
+        return;
+    }
+    // exit runs from the terminal's watch, which is still in the set
+    if (loop->terminal) {
+        loop_remove(sh, loop->terminal);
+    }
+    free_dead(loop);
+    close(loop->epfd);
+    free(loop);
+    sh->loop = NULL;
+}
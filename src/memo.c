@@ -0,0 +1,463 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "lab.h"
+
+#define MEMO_MAGIC 0x316f6d656d733270ULL    // "p2smemo1"
+#define MEMO_SLOTS 1024                     // entries the store can hold
+#define MEMO_DEFAULT_BYTES (16 << 20)       // room for keys and output, MY_MEMOSIZE changes it
+#define MEMO_PAGE 4096
+
+// one cached result, its key and output are back to back in the data area
+struct memo_slot {
+    uint64_t hash;       // of the key, 0 marks a free slot
+    uint64_t used;       // tick of the last hit, the oldest is evicted first
+    uint64_t off;        // where the key starts in the data area
+    uint32_t key_len;
+    uint32_t out_len;
+    int32_t status;      // exit status to replay
+    uint32_t pad;
+};
+
+// the start of the store file, the data area follows on the next page
+struct memo_header {
+    uint64_t magic;
+    uint64_t data_size;
+    uint64_t tick;
+    uint64_t nslots;
+    struct memo_slot slots[MEMO_SLOTS];
+};
+
+// what a command's result depends on, built up as one blob
+struct memo_key {
+    char *buf;
+    size_t len;
+    size_t cap;
+    bool failed;
+};
+
+static size_t data_start(void) {
+    return (sizeof(struct memo_header) + MEMO_PAGE - 1) / MEMO_PAGE * MEMO_PAGE;
+}
+
+static char *data_area(struct memo_store *ms) {
+    return (char *)ms->map + data_start();
+}
+
+static void key_add(struct memo_key *k, char tag, const void *data, size_t n) {
+    if (k->failed) {
+        return;
+    }
+    if (k->len + n + 2 > k->cap) {
+        size_t cap = k->cap ? k->cap * 2 : 256;
+        while (cap < k->len + n + 2) {
+            cap *= 2;
+        }
+        char *buf = realloc(k->buf, cap);
+        if (!buf) {
+            k->failed = true;
+            return;
+        }
+        k->buf = buf;
+        k->cap = cap;
+    }
+    k->buf[k->len++] = tag;
+    memcpy(k->buf + k->len, data, n);
+    k->len += n;
+    k->buf[k->len++] = '\0';
+}
+
+static void key_str(struct memo_key *k, char tag, const char *s) {
+    key_add(k, tag, s, strlen(s));
+}
+
+// FNV-1a, the whole key is compared on a hit so this only has to spread
+static uint64_t key_hash(const struct memo_key *k) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < k->len; i++) {
+        h ^= (unsigned char)k->buf[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+static size_t env_bytes(const char *name, size_t def) {
+    const char *val = getenv(name);
+    if (!val || !*val) {
+        return def;
+    }
+    char *end;
+    unsigned long long n = strtoull(val, &end, 10);
+    return *end == '\0' && n > 0 ? (size_t)n : def;
+}
+
+// lay out an empty store in the mapped file, the caller holds LOCK_EX
+static void store_format(struct memo_store *ms, size_t data_size) {
+    struct memo_header *hdr = ms->map;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->data_size = data_size;
+    hdr->nslots = MEMO_SLOTS;
+    hdr->magic = MEMO_MAGIC;
+}
+
+// map the store the first time memo runs, MY_MEMOFILE moves it and an
+// empty MY_MEMOFILE turns caching off
+static int store_open(struct memo_store *ms) {
+    if (ms->map) {
+        return 0;
+    }
+    char *path = NULL;
+    const char *file = getenv("MY_MEMOFILE");
+    if (!file) {
+        const char *home = getenv("HOME");
+        if (!home || asprintf(&path, "%s/.p2shell_memo", home) < 0) {
+            return -1;
+        }
+    } else if (*file) {
+        path = strdup(file);
+    }
+    if (!path) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        perror(path);
+        free(path);
+        return -1;
+    }
+    free(path);
+
+    // a store already laid out keeps its size, other shells have it mapped
+    // and a file cut shorter under them would fault, MY_MEMOSIZE only sizes
+    // a new one and a file is never shrunk
+    flock(fd, LOCK_EX);
+    struct stat st = { 0 };
+    struct memo_header hdr;
+    size_t data_size = env_bytes("MY_MEMOSIZE", MEMO_DEFAULT_BYTES);
+    bool fresh = fstat(fd, &st) < 0 || (size_t)st.st_size < data_start() ||
+                 pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr) ||
+                 hdr.magic != MEMO_MAGIC || hdr.nslots != MEMO_SLOTS || hdr.data_size == 0 ||
+                 hdr.data_size > (uint64_t)st.st_size - data_start();
+    if (!fresh) {
+        data_size = hdr.data_size;
+    }
+    size_t size = data_start() + data_size;
+    if (fresh && (size_t)st.st_size < size && ftruncate(fd, (off_t)size) < 0) {
+        perror("memo");
+        flock(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("memo: mmap");
+        flock(fd, LOCK_UN);
+        close(fd);
+        return -1;
+    }
+    ms->fd = fd;
+    ms->map = map;
+    ms->size = size;
+
+    // a file made by something else starts over
+    if (fresh) {
+        store_format(ms, data_size);
+    }
+    flock(fd, LOCK_UN);
+    return 0;
+}
+
+static struct memo_slot *store_find(struct memo_store *ms, const struct memo_key *k, uint64_t hash) {
+    struct memo_header *hdr = ms->map;
+    for (size_t i = 0; i < MEMO_SLOTS; i++) {
+        struct memo_slot *s = &hdr->slots[i];
+        if (s->hash == hash && s->key_len == k->len &&
+            memcmp(data_area(ms) + s->off, k->buf, k->len) == 0) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static int by_offset(const void *a, const void *b) {
+    const struct memo_slot *x = *(struct memo_slot *const *)a, *y = *(struct memo_slot *const *)b;
+    return x->off < y->off ? -1 : x->off > y->off;
+}
+
+// the first gap in the data area that holds need bytes, or -1
+static long store_gap(struct memo_store *ms, size_t need) {
+    struct memo_header *hdr = ms->map;
+    struct memo_slot *live[MEMO_SLOTS];
+    size_t n = 0;
+    for (size_t i = 0; i < MEMO_SLOTS; i++) {
+        if (hdr->slots[i].hash) {
+            live[n++] = &hdr->slots[i];
+        }
+    }
+    qsort(live, n, sizeof(*live), by_offset);
+
+    uint64_t at = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (live[i]->off - at >= need) {
+            return (long)at;
+        }
+        at = live[i]->off + live[i]->key_len + live[i]->out_len;
+    }
+    return hdr->data_size - at >= need ? (long)at : -1;
+}
+
+// drop the least recently used entry, false if there was none
+static bool store_evict(struct memo_store *ms) {
+    struct memo_header *hdr = ms->map;
+    struct memo_slot *oldest = NULL;
+    for (size_t i = 0; i < MEMO_SLOTS; i++) {
+        struct memo_slot *s = &hdr->slots[i];
+        if (s->hash && (!oldest || s->used < oldest->used)) {
+            oldest = s;
+        }
+    }
+    if (oldest) {
+        oldest->hash = 0;
+    }
+    return oldest != NULL;
+}
+
+// keep a result, evicting old ones until it fits, the caller holds LOCK_EX
+static void store_put(struct memo_store *ms, const struct memo_key *k, uint64_t hash,
+                      const char *out, size_t out_len, int status) {
+    struct memo_header *hdr = ms->map;
+    size_t need = k->len + out_len;
+    if (need > hdr->data_size || k->len > UINT32_MAX || out_len > UINT32_MAX) {
+        return;
+    }
+
+    // another shell may have run the same command meanwhile
+    struct memo_slot *s = store_find(ms, k, hash);
+    if (s) {
+        s->hash = 0;
+    }
+    for (;;) {
+        s = NULL;
+        for (size_t i = 0; i < MEMO_SLOTS && !s; i++) {
+            if (!hdr->slots[i].hash) {
+                s = &hdr->slots[i];
+            }
+        }
+        long off = s ? store_gap(ms, need) : -1;
+        if (off >= 0) {
+            memcpy(data_area(ms) + off, k->buf, k->len);
+            memcpy(data_area(ms) + off + k->len, out, out_len);
+            *s = (struct memo_slot){ .hash = 0, .used = ++hdr->tick, .off = (uint64_t)off,
+                                     .key_len = (uint32_t)k->len, .out_len = (uint32_t)out_len,
+                                     .status = status };
+            // published last so a reader never sees a half written entry
+            __atomic_store_n(&s->hash, hash, __ATOMIC_RELEASE);
+            return;
+        }
+        if (!store_evict(ms)) {
+            return;
+        }
+    }
+}
+
+// run argv with stdout going to fd, from the shell as a job of its own
+// that can be stopped and continued, in a job's process in its group
+static int run_into(struct shell *sh, char **argv, int fd) {
+    struct spawn_opts opts;
+    spawn_opts_init(&opts);
+    opts.fd_out = fd;
+    struct job *job = NULL;
+    if (sh->forked || getpgrp() != sh->shell_pgid) {
+        opts.pgid = getpgrp();
+        opts.foreground = false;
+    } else if (!(job = job_new_argv(sh, argv, 1))) {
+        fprintf(stderr, "memo: out of memory\n");
+        return 1;
+    }
+    fflush(stdout);
+    pid_t pid = sh_spawn(sh, argv, &opts);
+    if (pid < 0) {
+        if (job) {
+            job_remove(sh, job);
+        }
+        return 127;
+    }
+    if (job) {
+        job_add_proc(sh, job, pid);
+        return job_foreground(sh, job, false);
+    }
+
+    // the shell waits for the whole group, a stop stops this process too
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+static int usage(void) {
+    fprintf(stderr, "usage: memo [-e NAME]... [-f FILE]... [--] command [args...]\n"
+                    "       memo -c\n");
+    return 2;
+}
+
+/**
+* @brief The memo builtin. "memo [-e NAME]... [-f FILE]... command
+* [args...]" runs a command whose output depends only on its arguments,
+* the current directory, the environment variables named with -e and the
+* files named with -f. The first run is captured and kept with its exit
+* status in a store on disk, $MY_MEMOFILE or ~/.p2shell_memo, that is
+* mapped into the shell; a later run with the same arguments, directory,
+* variables and files, by mtime, size and inode, replays the output
+* without starting anything. The store is shared by every shell under
+* flock and evicts the least recently used results to make room. It holds
+* MY_MEMOSIZE bytes, 16 MiB by default, as set by the shell that made it,
+* since the others have it mapped. Only stdout is cached, stderr goes
+* straight through, and a command killed by a signal is not kept. A
+* command stopped with Ctrl-Z is left in the job table like any other
+* and is not kept either, what it writes once continued is dropped.
+* memo -c empties the store.
+*
+* @param sh The shell
+* @param argv The builtin's argv starting with "memo"
+* @return The exit status of the command, replayed on a hit
+*/
+int memo_run(struct shell *sh, char **argv) {
+    struct memo_store *ms = &sh->memo;
+    if (argv[1] && strcmp(argv[1], "-c") == 0 && !argv[2]) {
+        if (store_open(ms) < 0) {
+            return 1;
+        }
+        flock(ms->fd, LOCK_EX);
+        store_format(ms, ((struct memo_header *)ms->map)->data_size);
+        flock(ms->fd, LOCK_UN);
+        return 0;
+    }
+
+    struct memo_key k = { 0 };
+    key_str(&k, 'd', sh->cwd[0] ? sh->cwd : ".");
+    size_t i = 1;
+    for (; argv[i] && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        }
+        if ((strcmp(argv[i], "-e") != 0 && strcmp(argv[i], "-f") != 0) || !argv[i + 1]) {
+            free(k.buf);
+            return usage();
+        }
+        const char *name = argv[++i];
+        if (argv[i - 1][1] == 'e') {
+            const char *value = getenv(name);
+            key_str(&k, value ? 'e' : 'u', name);
+            if (value) {
+                key_str(&k, '=', value);
+            }
+            continue;
+        }
+        struct stat st;
+        key_str(&k, 'f', name);
+        if (stat(name, &st) == 0) {
+            uint64_t id[5] = { st.st_dev, st.st_ino, (uint64_t)st.st_size,
+                               (uint64_t)st.st_mtim.tv_sec, (uint64_t)st.st_mtim.tv_nsec };
+            key_add(&k, 's', id, sizeof(id));
+        }
+    }
+    if (!argv[i]) {
+        free(k.buf);
+        return usage();
+    }
+    if (builtin_find(argv[i])) {
+        fprintf(stderr, "memo: %s: cannot memoize a built in\n", argv[i]);
+        free(k.buf);
+        return 2;
+    }
+    for (size_t j = i; argv[j]; j++) {
+        key_str(&k, 'a', argv[j]);
+    }
+    if (k.failed) {
+        fprintf(stderr, "memo: out of memory\n");
+        free(k.buf);
+        return 1;
+    }
+
+    // with no store the command still runs, just every time
+    uint64_t hash = key_hash(&k);
+    bool stored = store_open(ms) == 0;
+    if (stored) {
+        flock(ms->fd, LOCK_SH);
+        struct memo_slot *s = store_find(ms, &k, hash);
+        if (s) {
+            struct memo_header *hdr = ms->map;
+            __atomic_store_n(&s->used, __atomic_add_fetch(&hdr->tick, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+            int status = s->status;
+            fflush(stdout);
+            int rval = write_all(STDOUT_FILENO, data_area(ms) + s->off + s->key_len, s->out_len);
+            flock(ms->fd, LOCK_UN);
+            free(k.buf);
+            if (rval < 0) {
+                perror("memo");
+            }
+            return status;
+        }
+        flock(ms->fd, LOCK_UN);
+    }
+
+    // a miss, the output is captured whole and then shown and kept
+    int fd = memfd_create("p2shell-memo", MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memo: memfd_create");
+        free(k.buf);
+        return 1;
+    }
+    int status = run_into(sh, &argv[i], fd);
+    struct stat st;
+    size_t len = fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+    char *out = len ? mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    if (out == MAP_FAILED) {
+        out = NULL;
+        len = 0;
+    }
+    if (out && write_all(STDOUT_FILENO, out, len) < 0) {
+        perror("memo");
+    }
+    if (stored && status != 127 && status < 128) {
+        flock(ms->fd, LOCK_EX);
+        store_put(ms, &k, hash, out ? out : "", len, status);
+        flock(ms->fd, LOCK_UN);
+    }
+    if (out) {
+        munmap(out, len);
+    }
+    close(fd);
+    free(k.buf);
+    return status;
+}
+
+/**
+* @brief Unmap the memo store.
+*
+* @param sh The shell
+*/
+void memo_close(struct shell *sh) {
+    struct memo_store *ms = &sh->memo;
+    if (ms->map) {
+        munmap(ms->map, ms->size);
+        close(ms->fd);
+    }
+    ms->map = NULL;
+    ms->fd = -1;
+    ms->size = 0;
+}
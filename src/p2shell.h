@@ -0,0 +1,117 @@
+#ifndef P2SHELL_H
+#define P2SHELL_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+  /**
+   * @brief The interface for running shell command lines from another
+   * program. A context holds everything a command depends on, its working
+   * directory, the PATH cache and the directory listings patterns are
+   * matched against, and never touches the terminal, signal
+   * handlers or readline, so it can be used from a process that is not a
+   * shell. A context is used by one thread at a time, but each thread can
+   * have its own and use it while others use theirs with no lock held
+   * between them. The lines are parsed as the shell does, except that
+   * there are no built in commands and $(...) is a syntax error, and
+   * every stage runs as a process of its own.
+   *
+   * The environment is read while a line is parsed and a command is
+   * started, so like getenv it must not be changed while another thread
+   * uses a context. Children are reaped by pid, so SIGCHLD must not be
+   * ignored and nothing in the process may wait on -1.
+   */
+  struct p2sh;
+
+  /**
+   * @brief A parsed command line, it can be run any number of times.
+   */
+  struct p2sh_cmd;
+
+  /**
+   * @brief A command line that was started and not yet waited for.
+   */
+  struct p2sh_proc;
+
+  /**
+   * @brief Make a context that starts commands in the current working
+   * directory.
+   *
+   * @return The context or NULL if it could not be made
+   */
+  struct p2sh *p2sh_new(void);
+
+  /**
+   * @brief Free a context. Every command started in it must have been
+   * waited for.
+   *
+   * @param sh The context
+   */
+  void p2sh_free(struct p2sh *sh);
+
+  /**
+   * @brief Change the directory commands start in and that relative
+   * patterns and redirections are resolved in. The process's own working
+   * directory is left alone.
+   *
+   * @param sh The context
+   * @param dir The directory, relative to the context's current one
+   * @return On success, zero is returned. On error, -1 is returned and
+   * errno is set.
+   */
+  int p2sh_chdir(struct p2sh *sh, const char *dir);
+
+  /**
+   * @brief Parse a command line. Patterns are expanded against the
+   * context's directory while it is parsed.
+   *
+   * @param sh The context
+   * @param line The line
+   * @return The command, free it with p2sh_cmd_free, or NULL after a
+   * message on stderr if the line is empty or is not valid
+   */
+  struct p2sh_cmd *p2sh_parse(struct p2sh *sh, const char *line);
+
+  /**
+   * @brief Free a command made by p2sh_parse.
+   *
+   * @param cmd The command
+   */
+  void p2sh_cmd_free(struct p2sh_cmd *cmd);
+
+  /**
+   * @brief Start a command without waiting for it. Its stages are joined
+   * with pipes and put in a process group of their own. The descriptors
+   * are the first stage's stdin, the last stage's stdout and every
+   * stage's stderr, the command's own redirections apply on top of them.
+   * The command may be freed as soon as this returns.
+   *
+   * @param sh The context
+   * @param cmd The command
+   * @param fd_in Standard input
+   * @param fd_out Standard output
+   * @param fd_err Standard error
+   * @return The started command, pass it to p2sh_wait, or NULL if memory
+   * ran out. A stage that could not be started is reported on stderr,
+   * when it is the last the command exits with 127, or 1 if it was one of
+   * its redirections that failed.
+   */
+  struct p2sh_proc *p2sh_run(struct p2sh *sh, const struct p2sh_cmd *cmd, int fd_in, int fd_out, int fd_err);
+
+  /**
+   * @brief Wait for a started command to finish and free it.
+   *
+   * @param sh The context it was started in
+   * @param proc The command
+   * @return The exit status of the last stage, or 128 plus the signal
+   * number if it was killed
+   */
+  int p2sh_wait(struct p2sh *sh, struct p2sh_proc *proc);
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+
+#endif
@@ -0,0 +1,287 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "lab.h"
+
+#define PAR_FAILURES_MAX 125    // more failures are counted as this many, to fit an exit status
+
+// one running child of the pool
+struct par_slot {
+    pid_t pid;       // 0 when the slot is free
+    size_t index;    // which input the child is running on
+    char **argv;     // argv built for the child
+};
+
+static int pidfd_open(pid_t pid) {
+    return (int)syscall(SYS_pidfd_open, pid, 0);
+}
+
+// substitute arg for every "{}" word in the template or append it if there is none
+static char **build_argv(char **tmpl, size_t ntmpl, char *arg) {
+    char **argv = malloc((ntmpl + 2) * sizeof(char *));
+    if (!argv) {
+        return NULL;
+    }
+
+    bool replaced = false;
+    for (size_t i = 0; i < ntmpl; i++) {
+        if (strcmp(tmpl[i], "{}") == 0) {
+            argv[i] = arg;
+            replaced = true;
+        } else {
+            argv[i] = tmpl[i];
+        }
+    }
+    size_t n = ntmpl;
+    if (!replaced) {
+        argv[n++] = arg;
+    }
+    argv[n] = NULL;
+    return argv;
+}
+
+static int usage(void) {
+    fprintf(stderr, "usage: parallel [-j N] command [args...] ::: input...\n");
+    return -1;
+}
+
+// what "[-j N] command [args...] ::: input..." asks for
+struct par_args {
+    size_t jobs;
+    char **tmpl;
+    size_t ntmpl;
+    char **inputs;
+    size_t ninputs;
+};
+
+static int par_parse(char **argv, struct par_args *pa) {
+    long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t i = 1;
+
+    if (argv[i] && strcmp(argv[i], "-j") == 0) {
+        if (!argv[i + 1]) {
+            return usage();
+        }
+        char *end;
+        jobs = strtol(argv[i + 1], &end, 10);
+        if (*end != '\0' || jobs < 1) {
+            fprintf(stderr, "parallel: invalid job count %s\n", argv[i + 1]);
+            return -1;
+        }
+        i += 2;
+    }
+    pa->jobs = jobs < 1 ? 1 : (size_t)jobs;
+
+    pa->tmpl = &argv[i];
+    pa->ntmpl = 0;
+    while (pa->tmpl[pa->ntmpl] && strcmp(pa->tmpl[pa->ntmpl], ":::") != 0) {
+        pa->ntmpl++;
+    }
+    if (pa->ntmpl == 0 || !pa->tmpl[pa->ntmpl]) {
+        return usage();
+    }
+    pa->inputs = &pa->tmpl[pa->ntmpl + 1];
+    pa->ninputs = 0;
+    while (pa->inputs[pa->ninputs]) {
+        pa->ninputs++;
+    }
+    return 0;
+}
+
+// wait for a child the slow way, one that stopped on its own stops the
+// rest of the pool with it. In a job of its own the whole group stops so
+// the shell sees it and can continue it, in the shell's group only the
+// other children do, the shell itself must keep running.
+static void reap(struct shell *sh, const struct par_slot *slots, size_t nslots, pid_t pid) {
+    for (;;) {
+        int status;
+        pid_t got = waitpid(pid, &status, WUNTRACED);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got < 0 || !WIFSTOPPED(status)) {
+            return;
+        }
+        if (getpgrp() != sh->shell_pgid) {
+            kill(-getpgrp(), SIGSTOP);
+            continue;
+        }
+        for (size_t s = 0; s < nslots; s++) {
+            if (slots[s].pid && slots[s].pid != pid) {
+                kill(slots[s].pid, SIGSTOP);
+            }
+        }
+    }
+}
+
+// run the pool in a process of a job, the children join its group
+static int run_pool(struct shell *sh, const struct par_args *pa) {
+    char **tmpl = pa->tmpl, **inputs = pa->inputs;
+    size_t ntmpl = pa->ntmpl, ninputs = pa->ninputs;
+    if (ninputs == 0) {
+        return 0;
+    }
+
+    size_t nslots = pa->jobs < ninputs ? pa->jobs : ninputs;
+    struct par_slot *slots = calloc(nslots, sizeof(*slots));
+    struct pollfd *fds = malloc(nslots * sizeof(*fds));
+    if (!slots || !fds) {
+        free(slots);
+        free(fds);
+        fprintf(stderr, "parallel: out of memory\n");
+        return -1;
+    }
+    for (size_t s = 0; s < nslots; s++) {
+        fds[s].fd = -1;     // poll skips negative fds
+        fds[s].events = POLLIN;
+    }
+
+    struct spawn_opts opts;
+    spawn_opts_init(&opts);
+    opts.pgid = getpgrp();
+    opts.foreground = false;
+
+    size_t next = 0, running = 0;
+    int failures = 0;
+    while (next < ninputs || running > 0) {
+        for (size_t s = 0; s < nslots && next < ninputs; s++) {
+            if (slots[s].pid) {
+                continue;
+            }
+
+            size_t index = next++;
+            char **child_argv = build_argv(tmpl, ntmpl, inputs[index]);
+            pid_t pid = child_argv ? sh_spawn(sh, child_argv, &opts) : -1;
+            int pidfd = pid > 0 ? pidfd_open(pid) : -1;
+            if (pid > 0 && pidfd < 0) {
+                perror("parallel: pidfd_open");
+                reap(sh, slots, nslots, pid);
+                pid = -1;
+            }
+            if (pid <= 0) {
+                fprintf(stderr, "parallel: %s: could not start\n", inputs[index]);
+                free(child_argv);
+                failures++;
+                continue;
+            }
+
+            slots[s].pid = pid;
+            slots[s].index = index;
+            slots[s].argv = child_argv;
+            fds[s].fd = pidfd;
+            running++;
+        }
+        if (running == 0) {
+            continue;
+        }
+
+        if (poll(fds, nslots, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("parallel: poll");
+            break;
+        }
+
+        for (size_t s = 0; s < nslots; s++) {
+            if (fds[s].fd < 0 || !(fds[s].revents & (POLLIN | POLLHUP))) {
+                continue;
+            }
+
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if (waitid(P_PIDFD, fds[s].fd, &info, WEXITED) < 0) {
+                perror("parallel: waitid");
+            }
+
+            int code = info.si_code == CLD_EXITED ? info.si_status : 128 + info.si_status;
+            fprintf(stderr, "parallel: [%zu] %s: exit %d\n", slots[s].index + 1, inputs[slots[s].index], code);
+            if (code != 0) {
+                failures++;
+            }
+
+            close(fds[s].fd);
+            fds[s].fd = -1;
+            free(slots[s].argv);
+            slots[s].pid = 0;
+            slots[s].argv = NULL;
+            running--;
+        }
+    }
+
+    // anything still running after an error is waited on the slow way
+    for (size_t s = 0; s < nslots; s++) {
+        if (slots[s].pid) {
+            reap(sh, slots, nslots, slots[s].pid);
+            close(fds[s].fd);
+            free(slots[s].argv);
+        }
+    }
+    free(slots);
+    free(fds);
+    return failures < PAR_FAILURES_MAX ? failures : PAR_FAILURES_MAX;
+}
+
+// what the pool's own process runs, its exit status counts the failures
+static int pool_run(struct shell *sh, char **argv) {
+    struct par_args pa;
+    if (par_parse(argv, &pa) < 0) {
+        return 2;
+    }
+    int failures = run_pool(sh, &pa);
+    return failures < 0 ? 1 : failures;
+}
+
+static const struct builtin pool_builtin = { "parallel", 8, pool_run, BUILTIN_FORKS | BUILTIN_WAITS };
+
+/**
+* @brief Run a command once per input with at most N copies running at the
+* same time, this is the parallel builtin. The arguments are
+* "[-j N] command [args...] ::: input...", every "{}" word in the command is
+* replaced by the input or the input is appended when there is none. N
+* defaults to the number of online CPUs. From the shell the pool runs in a
+* process of its own, one job with the children in its group that can be
+* stopped and continued like any other; in a pipeline or in the background
+* it runs in the job's process it already has. Children are started
+* through sh_spawn and a slot is refilled as soon as its child exits, the
+* pool sleeps in poll on the children's pidfds in between. The exit code
+* of every input is reported on stderr as it finishes.
+*
+* @param sh The shell
+* @param argv The builtin's argv starting with "parallel"
+* @return The number of inputs that failed, at most 125, 128
+* plus the signal number if the pool's job was killed or stopped, or -1 on
+* a usage error
+*/
+int parallel_run(struct shell *sh, char **argv) {
+    struct par_args pa;
+    if (par_parse(argv, &pa) < 0) {
+        return -1;
+    }
+
+    // in a pipeline or in the background this already is a process of a job
+    if (sh->forked || getpgrp() != sh->shell_pgid) {
+        return run_pool(sh, &pa);
+    }
+
+    struct job *job = job_new_argv(sh, argv, 1);
+    if (!job) {
+        fprintf(stderr, "parallel: out of memory\n");
+        return -1;
+    }
+    pid_t pid = sh_spawn_builtin(sh, &pool_builtin, argv, NULL);
+    if (pid < 0) {
+        job_remove(sh, job);
+        return -1;
+    }
+    job_add_proc(sh, job, pid);
+    job->spawned_ns = monotonic_ns();
+    return job_foreground(sh, job, false);
+}
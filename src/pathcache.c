@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "lab.h"
+
+#define PATH_CACHE_MIN 64   // slots allocated on first use
+
+// FNV-1a, command names are short so this is plenty
+static uint32_t name_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// find the slot holding name or the empty slot where it would go
+static struct path_entry *find_slot(struct path_cache *cache, const char *name) {
+    size_t mask = cache->cap - 1;
+    size_t i = name_hash(name) & mask;
+    while (cache->slots[i].name && strcmp(cache->slots[i].name, name) != 0) {
+        i = (i + 1) & mask;     // linear probing
+    }
+    return &cache->slots[i];
+}
+
+static int grow(struct path_cache *cache) {
+    size_t cap = cache->cap ? cache->cap * 2 : PATH_CACHE_MIN;
+    struct path_entry *slots = calloc(cap, sizeof(*slots));
+    if (!slots) {
+        return -1;
+    }
+
+    struct path_entry *old = cache->slots;
+    size_t old_cap = cache->cap;
+    cache->slots = slots;
+    cache->cap = cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name) {
+            *find_slot(cache, old[i].name) = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// search every PATH directory for an executable regular file called name
+static char *search_path(const char *path_env, const char *name) {
+    char buf[PATH_MAX];
+    size_t name_len = strlen(name);
+    const char *dir = path_env;
+
+    while (dir) {
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+
+        // an empty PATH element means the current directory
+        if (dir_len + name_len + 2 <= sizeof(buf)) {
+            size_t n = 0;
+            if (dir_len == 0) {
+                buf[n++] = '.';
+            } else {
+                memcpy(buf, dir, dir_len);
+                n = dir_len;
+            }
+            buf[n++] = '/';
+            memcpy(buf + n, name, name_len + 1);
+
+            struct stat st;
+            if (stat(buf, &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+                return strdup(buf);
+            }
+        }
+        dir = end ? end + 1 : NULL;
+    }
+    return NULL;
+}
+
+/**
+* @brief Forget every resolved command, this is what hash -r does.
+*
+* @param cache The cache to clear
+*/
+void path_cache_clear(struct path_cache *cache) {
+    for (size_t i = 0; i < cache->cap; i++) {
+        free(cache->slots[i].name);
+        free(cache->slots[i].path);
+        cache->slots[i].name = NULL;
+        cache->slots[i].path = NULL;
+    }
+    cache->count = 0;
+}
+
+/**
+* @brief Free all memory held by the cache.
+*
+* @param cache The cache to destroy
+*/
+void path_cache_destroy(struct path_cache *cache) {
+    path_cache_clear(cache);
+    free(cache->slots);
+    free(cache->path_env);
+    cache->slots = NULL;
+    cache->cap = 0;
+    cache->path_env = NULL;
+}
+
+/**
+* @brief Drop a single name from the cache, used when the executable it
+* pointed at has gone away.
+*
+* @param cache The cache to use
+* @param name The command name to forget
+*/
+void path_forget(struct path_cache *cache, const char *name) {
+    if (cache->cap == 0) {
+        return;
+    }
+
+    struct path_entry *slot = find_slot(cache, name);
+    if (!slot->name) {
+        return;
+    }
+    free(slot->name);
+    free(slot->path);
+    slot->name = NULL;
+    slot->path = NULL;
+    cache->count--;
+
+    // shift the rest of the probe run back so lookups never stop early
+    size_t mask = cache->cap - 1;
+    size_t hole = (size_t)(slot - cache->slots);
+    size_t i = (hole + 1) & mask;
+    while (cache->slots[i].name) {
+        size_t home = name_hash(cache->slots[i].name) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            cache->slots[hole] = cache->slots[i];
+            cache->slots[i].name = NULL;
+            cache->slots[i].path = NULL;
+            hole = i;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+/**
+* @brief Resolve a command name to the executable that execvp would run.
+* Names containing a slash are returned unchanged. Other names are looked
+* up in the cache first and on a miss every PATH directory is searched and
+* the result is remembered. If PATH has changed since the last lookup the
+* cache is emptied before searching.
+*
+* @param cache The cache to use
+* @param name The command name
+* @return The path to exec, owned by the cache, or NULL if name was not found
+*/
+const char *path_lookup(struct path_cache *cache, const char *name) {
+    if (!name || !*name) {
+        return NULL;
+    }
+    if (strchr(name, '/')) {
+        return name;
+    }
+
+    // execvp falls back to this search path when PATH is unset
+    const char *path_env = getenv("PATH");
+    if (!path_env) {
+        path_env = "/bin:/usr/bin";
+    }
+    if (!cache->path_env || strcmp(cache->path_env, path_env) != 0) {
+        path_cache_clear(cache);
+        free(cache->path_env);
+        cache->path_env = strdup(path_env);
+    }
+
+    if (cache->cap == 0 && grow(cache) < 0) {
+        return NULL;
+    }
+    struct path_entry *slot = find_slot(cache, name);
+    if (slot->name) {
+        return slot->path;
+    }
+
+    char *path = search_path(path_env, name);
+    if (!path) {
+        return NULL;
+    }
+
+    // keep the load factor under 3/4 so probe runs stay short
+    if ((cache->count + 1) * 4 > cache->cap * 3) {
+        if (grow(cache) < 0) {
+            free(path);
+            return NULL;
+        }
+        slot = find_slot(cache, name);
+    }
+    slot->name = strdup(name);
+    if (!slot->name) {
+        free(path);
+        return NULL;
+    }
+    slot->path = path;
+    cache->count++;
+    return path;
+}
@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "lab.h"
+
+#define PEER_LINE 4096      // a longer line is passed on in pieces
+#define PEER_PERSIST "10m"  // how long an idle connection is kept open
+
+// one output stream of one peer, cut into lines that get the host in front
+struct peer_stream {
+    int fd;                // read end of the pipe, -1 once it hit EOF
+    int out;               // where the prefixed lines go
+    size_t len;            // bytes of an unfinished line in buf
+    char buf[PEER_LINE];
+};
+
+// one host a command runs on
+struct peer {
+    const char *host;
+    pid_t pid;               // the ssh client, 0 once it was waited on
+    struct peer_stream streams[2];   // its stdout and stderr
+};
+
+// what "on [-h host[,host...]] command [args...]" asks for
+struct relay_job {
+    char *list;      // copy of the host list, hosts point into it
+    char **hosts;
+    size_t nhosts;
+    char **argv;     // the command
+};
+
+// write one line with the host in front in a single write so lines from
+// different peers never mix
+static void emit_line(const char *host, int out, const char *line, size_t len) {
+    size_t hlen = strlen(host);
+    char *buf = malloc(hlen + len + 3);
+    if (!buf) {
+        return;
+    }
+    memcpy(buf, host, hlen);
+    memcpy(buf + hlen, ": ", 2);
+    memcpy(buf + hlen + 2, line, len);
+    buf[hlen + 2 + len] = '\n';
+    write_all(out, buf, hlen + len + 3);
+    free(buf);
+}
+
+// read what is there and pass on every finished line, false at EOF
+static bool stream_read(struct peer *p, struct peer_stream *s) {
+    ssize_t n = read(s->fd, s->buf + s->len, sizeof(s->buf) - s->len);
+    if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return true;
+    }
+    if (n <= 0) {
+        if (s->len > 0) {
+            emit_line(p->host, s->out, s->buf, s->len);
+        }
+        s->len = 0;
+        return false;
+    }
+
+    s->len += (size_t)n;
+    size_t start = 0;
+    for (size_t i = s->len - (size_t)n; i < s->len; i++) {
+        if (s->buf[i] == '\n') {
+            emit_line(p->host, s->out, s->buf + start, i - start);
+            start = i + 1;
+        }
+    }
+    if (start == 0 && s->len == sizeof(s->buf)) {
+        emit_line(p->host, s->out, s->buf, s->len);
+        start = s->len;
+    }
+    memmove(s->buf, s->buf + start, s->len - start);
+    s->len -= start;
+    return true;
+}
+
+// the words already expanded by the shell, each quoted for the remote shell
+static char *remote_command(char **argv) {
+    size_t len = 1;
+    for (char **w = argv; *w; w++) {
+        len += 3;
+        for (const char *c = *w; *c; c++) {
+            len += *c == '\'' ? 4 : 1;
+        }
+    }
+    char *cmd = malloc(len);
+    if (!cmd) {
+        return NULL;
+    }
+    char *p = cmd;
+    for (char **w = argv; *w; w++) {
+        if (w != argv) {
+            *p++ = ' ';
+        }
+        *p++ = '\'';
+        for (const char *c = *w; *c; c++) {
+            if (*c == '\'') {
+                p = stpcpy(p, "'\\''");
+            } else {
+                *p++ = *c;
+            }
+        }
+        *p++ = '\'';
+    }
+    *p = '\0';
+    return cmd;
+}
+
+// where the ssh control sockets live, made private to the user. The name
+// in /tmp can be guessed, so a directory that was already there is only
+// used when it is a real directory of ours that no one else can enter,
+// otherwise another user could swap the sockets and see every command
+static char *control_dir(void) {
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    char *dir;
+    int rval = runtime && *runtime ? asprintf(&dir, "%s/p2shell-ssh", runtime)
+                                   : asprintf(&dir, "/tmp/p2shell-ssh-%u", (unsigned)getuid());
+    if (rval < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        perror(dir);
+        free(dir);
+        return NULL;
+    }
+    if (lstat(dir, &st) < 0) {
+        perror(dir);
+        free(dir);
+        return NULL;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != getuid() || (st.st_mode & 0777) != 0700) {
+        fprintf(stderr, "on: %s: not a private directory of this user\n", dir);
+        free(dir);
+        return NULL;
+    }
+    return dir;
+}
+
+// start the ssh client for one peer with its output going to two new pipes
+static int peer_start(struct shell *sh, struct peer *p, char **ssh_argv) {
+    int out[2], err[2];
+    if (pipe2(out, O_CLOEXEC) < 0) {
+        perror("on: pipe");
+        return -1;
+    }
+    if (pipe2(err, O_CLOEXEC) < 0) {
+        perror("on: pipe");
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+
+    // the relay is the group leader, every ssh client joins its group
+    struct spawn_opts opts;
+    spawn_opts_init(&opts);
+    opts.pgid = getpgrp();
+    opts.foreground = false;
+    opts.fd_out = out[1];
+    struct fd_dup dup_err = { err[1], STDERR_FILENO };
+    opts.dups = &dup_err;
+    opts.ndups = 1;
+    p->pid = sh_spawn(sh, ssh_argv, &opts);
+    close(out[1]);
+    close(err[1]);
+    p->streams[0] = (struct peer_stream){ .fd = out[0], .out = STDOUT_FILENO };
+    p->streams[1] = (struct peer_stream){ .fd = err[0], .out = STDERR_FILENO };
+    if (p->pid < 0) {
+        p->pid = 0;
+        close(out[0]);
+        close(err[0]);
+        p->streams[0].fd = p->streams[1].fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// run the command on every peer at once, relay their output line by line
+// and report the ones that failed
+static int relay(struct shell *sh, const struct relay_job *rj) {
+    char *cmd = remote_command(rj->argv);
+    char *dir = control_dir();
+    char *control = NULL;
+    struct peer *peers = calloc(rj->nhosts, sizeof(*peers));
+    struct pollfd *fds = calloc(rj->nhosts * 2, sizeof(*fds));
+    if (!cmd || !dir || !peers || !fds || asprintf(&control, "ControlPath=%s/%%C", dir) < 0) {
+        fprintf(stderr, "on: could not start\n");
+        free(fds);
+        free(peers);
+        free(dir);
+        free(cmd);
+        return 1;
+    }
+
+    const char *ssh = getenv("MY_SSH");
+    char *ssh_argv[] = {
+        (char *)(ssh && *ssh ? ssh : "ssh"),
+        "-n", "-T",
+        "-o", "BatchMode=yes",
+        "-o", "ControlMaster=auto",
+        "-o", control,
+        "-o", "ControlPersist=" PEER_PERSIST,
+        "--", NULL, cmd, NULL
+    };
+    const size_t host_arg = sizeof(ssh_argv) / sizeof(ssh_argv[0]) - 3;
+
+    int failures = 0;
+    size_t open_streams = 0;
+    for (size_t i = 0; i < rj->nhosts; i++) {
+        peers[i].host = rj->hosts[i];
+        peers[i].streams[0].fd = peers[i].streams[1].fd = -1;
+        ssh_argv[host_arg] = rj->hosts[i];
+        if (peer_start(sh, &peers[i], ssh_argv) < 0) {
+            fprintf(stderr, "on: %s: could not start\n", peers[i].host);
+            failures++;
+            continue;
+        }
+        open_streams += 2;
+    }
+
+    while (open_streams > 0) {
+        for (size_t i = 0; i < rj->nhosts * 2; i++) {
+            fds[i].fd = peers[i / 2].streams[i % 2].fd;
+            fds[i].events = POLLIN;
+        }
+        if (poll(fds, rj->nhosts * 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("on: poll");
+            break;
+        }
+        for (size_t i = 0; i < rj->nhosts * 2; i++) {
+            struct peer *p = &peers[i / 2];
+            struct peer_stream *s = &p->streams[i % 2];
+            if (s->fd < 0 || !(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            if (!stream_read(p, s)) {
+                close(s->fd);
+                s->fd = -1;
+                open_streams--;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < rj->nhosts; i++) {
+        if (!peers[i].pid) {
+            continue;
+        }
+        for (int j = 0; j < 2; j++) {
+            if (peers[i].streams[j].fd >= 0) {
+                close(peers[i].streams[j].fd);
+            }
+        }
+        int status;
+        while (waitpid(peers[i].pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+        if (code != 0) {
+            fprintf(stderr, "on: %s: exit %d\n", peers[i].host, code);
+            failures++;
+        }
+    }
+    free(fds);
+    free(peers);
+    free(control);
+    free(dir);
+    free(cmd);
+    return failures > 0 ? 1 : 0;
+}
+
+// split a list of hosts at commas and blanks, in place
+static char **split_hosts(char *list, size_t *count) {
+    size_t cap = 8, n = 0;
+    char **hosts = malloc(cap * sizeof(*hosts));
+    char *save = NULL;
+    for (char *tok = strtok_r(list, ", \t\n", &save); hosts && tok; tok = strtok_r(NULL, ", \t\n", &save)) {
+        if (n == cap) {
+            cap *= 2;
+            char **grown = realloc(hosts, cap * sizeof(*hosts));
+            if (!grown) {
+                free(hosts);
+                return NULL;
+            }
+            hosts = grown;
+        }
+        hosts[n++] = tok;
+    }
+    *count = n;
+    return hosts;
+}
+
+static int usage(void) {
+    fprintf(stderr, "usage: on [-h host[,host...]] command [args...]\n");
+    return 2;
+}
+
+// fill in rj from the builtin's argv, 2 after a message if it can't run
+static int relay_parse(char **argv, struct relay_job *rj) {
+    size_t i = 1;
+    const char *list = getenv("MY_PEERS");
+    if (argv[i] && strcmp(argv[i], "-h") == 0) {
+        if (!argv[i + 1]) {
+            return usage();
+        }
+        list = argv[i + 1];
+        i += 2;
+    }
+    if (argv[i] && strcmp(argv[i], "--") == 0) {
+        i++;
+    }
+    if (!argv[i]) {
+        return usage();
+    }
+    if (!list || !*list) {
+        fprintf(stderr, "on: no peers, set MY_PEERS or use -h\n");
+        return 2;
+    }
+
+    rj->argv = &argv[i];
+    rj->list = strdup(list);
+    rj->hosts = rj->list ? split_hosts(rj->list, &rj->nhosts) : NULL;
+    if (!rj->hosts || rj->nhosts == 0) {
+        if (rj->hosts) {
+            fprintf(stderr, "on: no peers, set MY_PEERS or use -h\n");
+        }
+        free(rj->hosts);
+        free(rj->list);
+        return 2;
+    }
+    return 0;
+}
+
+// the job's only process, it works out the peers from argv again
+static int relay_run(struct shell *sh, char **argv) {
+    struct relay_job rj;
+    int rval = relay_parse(argv, &rj);
+    if (rval == 0) {
+        rval = relay(sh, &rj);
+        free(rj.hosts);
+        free(rj.list);
+    }
+    return rval;
+}
+
+static const struct builtin relay_builtin = { "on", 2, relay_run, BUILTIN_FORKS | BUILTIN_WAITS };
+
+/**
+* @brief The on builtin, "on [-h host[,host...]] command [args...]" runs
+* a command on every peer at the same time and streams back their output
+* with the host in front of each line, stdout to stdout and stderr to
+* stderr. The peers are the hosts given with -h or else those listed in
+* MY_PEERS, separated by commas or blanks. The words of the command are
+* the ones this shell parsed and expanded, quoted again for the remote
+* shell. Each peer is reached with ssh, or $MY_SSH, through a control
+* master so the first command to a host opens a connection that every
+* later one multiplexes its session over, for ten minutes after the last
+* one finishes, and a command only pays for a new channel. The clients
+* and the process relaying their output make up one job, so the whole
+* fan out can be stopped, continued and put in the background like any
+* other. A host that fails is reported on stderr. The control sockets
+* are kept in $XDG_RUNTIME_DIR/p2shell-ssh, or /tmp/p2shell-ssh-UID, and
+* that directory is refused unless it belongs to the user with mode 0700.
+*
+* @param sh The shell
+* @param argv The builtin's argv starting with "on"
+* @return 0 if the command succeeded everywhere, 1 if it failed on a peer,
+* 2 on a usage error
+*/
+int peer_run(struct shell *sh, char **argv) {
+    struct relay_job rj;
+    int rval = relay_parse(argv, &rj);
+    if (rval != 0) {
+        return rval;
+    }
+
+    // in a pipeline or in the background this already is a process of a
+    // job, it can do the relaying itself
+    if (sh->forked || getpgrp() != sh->shell_pgid) {
+        rval = relay(sh, &rj);
+        free(rj.hosts);
+        free(rj.list);
+        return rval;
+    }
+    free(rj.hosts);
+    free(rj.list);
+
+    struct job *job = job_new_argv(sh, argv, 1);
+    if (!job) {
+        fprintf(stderr, "on: out of memory\n");
+        return 1;
+    }
+
+    pid_t pid = sh_spawn_builtin(sh, &relay_builtin, argv, NULL);
+    if (pid < 0) {
+        job_remove(sh, job);
+        return 1;
+    }
+    job_add_proc(sh, job, pid);
+    job->spawned_ns = monotonic_ns();
+    return job_foreground(sh, job, false);
+}
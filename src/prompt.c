@@ -0,0 +1,436 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <readline/readline.h>
+#include "lab.h"
+
+#define GIT_HEAD_MAX 256   // longest HEAD file read, a ref name or a hash fits easily
+
+// a git lookup, run on the worker thread when there is an event loop
+struct prompt_git_job {
+    pthread_t thread;
+    int fd;                  // eventfd written once the lookup is done
+    char *dir;               // directory the lookup starts from
+    char *branch;            // result, NULL outside a repository
+    char *head;              // HEAD file the result was read from
+    struct timespec mtime;   // mtime of head when it was read
+};
+
+// read the branch out of a HEAD file, a detached HEAD shows its short hash
+static void read_head(struct prompt_git_job *job, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    char buf[GIT_HEAD_MAX];
+    struct stat st;
+    ssize_t n = fstat(fd, &st) == 0 ? read(fd, buf, sizeof(buf) - 1) : -1;
+    close(fd);
+    if (n <= 0) {
+        return;
+    }
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+
+    const char *name = buf;
+    if (strncmp(name, "ref: refs/heads/", 16) == 0) {
+        name += 16;
+    } else if (strncmp(name, "ref: ", 5) == 0) {
+        name += 5;
+    } else {
+        buf[7] = '\0';
+    }
+    job->branch = strdup(name);
+    job->head = strdup(path);
+    job->mtime = st.st_mtim;
+}
+
+// walk up from job->dir to the repository the directory is in, if any
+static void git_lookup(struct prompt_git_job *job) {
+    char dir[PATH_MAX];
+    char path[PATH_MAX + 16];
+    snprintf(dir, sizeof(dir), "%s", job->dir);
+
+    for (;;) {
+        snprintf(path, sizeof(path), "%s/.git", strcmp(dir, "/") == 0 ? "" : dir);
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            if (S_ISREG(st.st_mode)) {
+                // a worktree or submodule has a file naming its git directory
+                FILE *f = fopen(path, "re");
+                char gitdir[PATH_MAX];
+                bool ok = f && fscanf(f, "gitdir: %4095s", gitdir) == 1;
+                if (f) {
+                    fclose(f);
+                }
+                if (!ok) {
+                    return;
+                }
+                int len = gitdir[0] == '/' ? snprintf(path, sizeof(path), "%s", gitdir)
+                                           : snprintf(path, sizeof(path), "%s/%s", dir, gitdir);
+                if (len < 0 || (size_t)len >= sizeof(path)) {
+                    return;
+                }
+            }
+            strncat(path, "/HEAD", sizeof(path) - strlen(path) - 1);
+            read_head(job, path);
+            return;
+        }
+
+        char *slash = strrchr(dir, '/');
+        if (!slash || (slash == dir && dir[1] == '\0')) {
+            return;     // checked the root, not in a repository
+        }
+        if (slash == dir) {
+            dir[1] = '\0';
+        } else {
+            *slash = '\0';
+        }
+    }
+}
+
+static void *git_worker(void *arg) {
+    struct prompt_git_job *job = arg;
+    git_lookup(job);
+    uint64_t one = 1;
+    if (write(job->fd, &one, sizeof(one)) < 0) {
+        perror("prompt: eventfd");
+    }
+    return NULL;
+}
+
+// replace the cached branch with the result of a finished lookup
+static void git_install(struct prompt_template *pt, struct prompt_git_job *job) {
+    bool same = (!pt->git_branch && !job->branch) ||
+                (pt->git_branch && job->branch && strcmp(pt->git_branch, job->branch) == 0);
+    pt->changed |= !same;
+
+    free(pt->git_branch);
+    free(pt->git_head);
+    pt->git_branch = job->branch;
+    pt->git_head = job->head;
+    pt->git_mtime = job->mtime;
+    free(job->dir);
+    free(job);
+}
+
+// start looking up the branch, on the worker thread if there is a loop to hear back from it
+static void git_start(struct shell *sh) {
+    struct prompt_template *pt = &sh->prompt_tmpl;
+    struct prompt_git_job *job = calloc(1, sizeof(*job));
+    char *dir = sh->cwd[0] ? strdup(sh->cwd) : getcwd(NULL, 0);
+    if (!job || !dir) {
+        free(job);
+        free(dir);
+        return;
+    }
+    job->dir = dir;
+    job->fd = pt->git_fd;
+    pt->dirty &= ~PROMPT_DEP_GIT;
+
+    if (pt->git_watch && pthread_create(&job->thread, NULL, git_worker, job) == 0) {
+        pt->git_job = job;
+        return;
+    }
+    git_lookup(job);
+    git_install(pt, job);
+}
+
+// the worker finished, show the result and look again if cd ran meanwhile
+static void on_git_done(struct shell *sh, void *data) {
+    struct prompt_template *pt = data;
+    uint64_t count;
+    if (read(pt->git_fd, &count, sizeof(count)) < 0 || !pt->git_job) {
+        return;
+    }
+    struct prompt_git_job *job = pt->git_job;
+    pthread_join(job->thread, NULL);
+    pt->git_job = NULL;
+    git_install(pt, job);
+    if (pt->dirty & PROMPT_DEP_GIT) {
+        git_start(sh);
+    }
+}
+
+// true if HEAD has been written since the branch was read, a checkout or commit
+static bool git_head_moved(const struct prompt_template *pt) {
+    struct stat st;
+    if (!pt->git_head || stat(pt->git_head, &st) < 0) {
+        return pt->git_head != NULL;
+    }
+    return st.st_mtim.tv_sec != pt->git_mtime.tv_sec || st.st_mtim.tv_nsec != pt->git_mtime.tv_nsec;
+}
+
+// the shell's directory with the home directory shown as ~
+static void cache_cwd(struct shell *sh) {
+    struct prompt_template *pt = &sh->prompt_tmpl;
+    free(pt->cwd);
+    pt->cwd = sh->cwd[0] ? strdup(sh->cwd) : getcwd(NULL, 0);
+    if (!pt->cwd) {
+        pt->cwd = strdup("?");
+        return;
+    }
+    const char *home = dirs_home(sh);
+    size_t len = home ? strlen(home) : 0;
+    if (len > 1 && strncmp(pt->cwd, home, len) == 0 && (pt->cwd[len] == '\0' || pt->cwd[len] == '/')) {
+        memmove(pt->cwd + 1, pt->cwd + len, strlen(pt->cwd + len) + 1);
+        pt->cwd[0] = '~';
+    }
+}
+
+// compile tmpl into segments, literal runs become one PSEG_TEXT each
+static int compile(struct prompt_template *pt, const char *tmpl) {
+    size_t n = strlen(tmpl);
+    // an escape never produces more bytes than it was written with
+    pt->segs = malloc((n + 1) * sizeof(*pt->segs));
+    pt->text = malloc(n + 1);
+    if (!pt->segs || !pt->text) {
+        return -1;
+    }
+
+    char *out = pt->text;
+    struct prompt_seg *lit = NULL;
+    for (const char *p = tmpl; *p; p++) {
+        enum prompt_seg_kind kind = PSEG_TEXT;
+        char c = *p;
+        if (c == '\\' && p[1]) {
+            switch (*++p) {
+                case 'w': kind = PSEG_CWD; break;
+                case 'W': kind = PSEG_CWD_BASE; break;
+                case '?': kind = PSEG_STATUS; break;
+                case '$': kind = PSEG_SIGIL; break;
+                case 'u': kind = PSEG_USER; break;
+                case 'h': kind = PSEG_HOST; break;
+                case 't': kind = PSEG_TIME; break;
+                case 'g': kind = PSEG_GIT; break;
+                case 'n': c = '\n'; break;
+                case 'e': c = '\033'; break;
+                case '[': c = RL_PROMPT_START_IGNORE; break;
+                case ']': c = RL_PROMPT_END_IGNORE; break;
+                case '\\': break;
+                default:
+                    // unknown escapes are shown as written
+                    if (!lit) {
+                        lit = &pt->segs[pt->nsegs++];
+                        *lit = (struct prompt_seg){ PSEG_TEXT, out, 0 };
+                    }
+                    *out++ = '\\';
+                    lit->len++;
+                    c = *p;
+                    break;
+            }
+        }
+
+        if (kind != PSEG_TEXT) {
+            pt->segs[pt->nsegs++] = (struct prompt_seg){ kind, NULL, 0 };
+            pt->uses |= 1u << kind;
+            lit = NULL;
+            continue;
+        }
+        if (!lit) {
+            lit = &pt->segs[pt->nsegs++];
+            *lit = (struct prompt_seg){ PSEG_TEXT, out, 0 };
+        }
+        *out++ = c;
+        lit->len++;
+    }
+    return 0;
+}
+
+// append len bytes to the rendered prompt
+static int put(struct prompt_template *pt, size_t *used, const char *s, size_t len) {
+    if (*used + len + 1 > pt->cap) {
+        size_t cap = pt->cap ? pt->cap : 64;
+        while (cap < *used + len + 1) {
+            cap *= 2;
+        }
+        char *buf = realloc(pt->buf, cap);
+        if (!buf) {
+            return -1;
+        }
+        pt->buf = buf;
+        pt->cap = cap;
+    }
+    memcpy(pt->buf + *used, s, len);
+    *used += len;
+    pt->buf[*used] = '\0';
+    return 0;
+}
+
+static int put_str(struct prompt_template *pt, size_t *used, const char *s) {
+    return put(pt, used, s, strlen(s));
+}
+
+/**
+* @brief Compile the shell's prompt template sh->prompt into
+* sh->prompt_tmpl. Backslash escapes are \w \W \? \$ \u \h \t \g as
+* described by enum prompt_seg_kind, \n for a newline, \e for an escape
+* character, \[ and \] around terminal control sequences so readline
+* knows they take no room and \\ for a backslash.
+*
+* @param sh The shell
+* @return On success, zero is returned. On error, -1 is returned.
+*/
+int prompt_init(struct shell *sh) {
+    struct prompt_template *pt = &sh->prompt_tmpl;
+    memset(pt, 0, sizeof(*pt));
+    pt->git_fd = -1;
+    pt->time_sec = -1;
+    pt->dirty = PROMPT_DEP_CWD;
+    if (compile(pt, sh->prompt ? sh->prompt : "shell>") < 0) {
+        return -1;
+    }
+
+    // these don't change for the life of the shell, without $USER the user
+    // is looked up in the password database when \u is first drawn
+    const char *user = getenv("USER");
+    if ((pt->uses & (1u << PSEG_USER)) && user && *user) {
+        snprintf(pt->user, sizeof(pt->user), "%s", user);
+    }
+    if (gethostname(pt->host, sizeof(pt->host)) < 0) {
+        strcpy(pt->host, "?");
+    }
+    pt->host[sizeof(pt->host) - 1] = '\0';
+    pt->host[strcspn(pt->host, ".")] = '\0';
+    pt->sigil = geteuid() == 0 ? '#' : '$';
+
+    // looking for the repository can touch many directories, keep it off the prompt
+    if ((pt->uses & (1u << PSEG_GIT)) && sh->loop) {
+        pt->git_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (pt->git_fd >= 0) {
+            pt->git_watch = loop_add(sh, pt->git_fd, on_git_done, pt);
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief Render the prompt from the cached segments, recomputing only the
+* ones whose dependencies changed. Never waits on the git lookup when
+* there is an event loop, the old value is shown until it completes.
+*
+* @param sh The shell
+* @return The prompt, valid until the next call
+*/
+const char *prompt_render(struct shell *sh) {
+    struct prompt_template *pt = &sh->prompt_tmpl;
+
+    // a new directory may be in a different repository as well
+    if (pt->dirty & PROMPT_DEP_CWD) {
+        if (pt->uses & ((1u << PSEG_CWD) | (1u << PSEG_CWD_BASE))) {
+            cache_cwd(sh);
+        }
+        pt->dirty = (pt->dirty & ~PROMPT_DEP_CWD) | PROMPT_DEP_GIT;
+    }
+    if (pt->uses & (1u << PSEG_GIT)) {
+        if (git_head_moved(pt)) {
+            pt->dirty |= PROMPT_DEP_GIT;
+        }
+        if ((pt->dirty & PROMPT_DEP_GIT) && !pt->git_job) {
+            git_start(sh);
+        }
+    }
+    pt->changed = false;
+
+    size_t used = 0;
+    int rval = put(pt, &used, "", 0);
+    for (size_t i = 0; i < pt->nsegs && rval == 0; i++) {
+        const struct prompt_seg *seg = &pt->segs[i];
+        char num[16];
+        switch (seg->kind) {
+            case PSEG_TEXT:
+                rval = put(pt, &used, seg->text, seg->len);
+                break;
+            case PSEG_CWD:
+                rval = put_str(pt, &used, pt->cwd);
+                break;
+            case PSEG_CWD_BASE: {
+                const char *base = strrchr(pt->cwd, '/');
+                rval = put_str(pt, &used, base && base[1] ? base + 1 : pt->cwd);
+                break;
+            }
+            case PSEG_STATUS:
+                snprintf(num, sizeof(num), "%d", sh->last_status);
+                rval = put_str(pt, &used, num);
+                break;
+            case PSEG_SIGIL:
+                rval = put(pt, &used, &pt->sigil, 1);
+                break;
+            case PSEG_USER:
+                if (!pt->user[0]) {
+                    // this can go out to NSS or LDAP, so only ever once
+                    struct passwd *pw = getpwuid(geteuid());
+                    snprintf(pt->user, sizeof(pt->user), "%s", pw ? pw->pw_name : "?");
+                }
+                rval = put_str(pt, &used, pt->user);
+                break;
+            case PSEG_HOST:
+                rval = put_str(pt, &used, pt->host);
+                break;
+            case PSEG_TIME: {
+                // formatting is only redone once a second
+                time_t now = time(NULL);
+                if (now != pt->time_sec) {
+                    struct tm tm;
+                    localtime_r(&now, &tm);
+                    strftime(pt->time_text, sizeof(pt->time_text), "%H:%M:%S", &tm);
+                    pt->time_sec = now;
+                }
+                rval = put_str(pt, &used, pt->time_text);
+                break;
+            }
+            case PSEG_GIT:
+                if (pt->git_branch) {
+                    rval = put_str(pt, &used, pt->git_branch);
+                }
+                break;
+        }
+    }
+    return rval == 0 ? pt->buf : (sh->prompt ? sh->prompt : "shell>");
+}
+
+/**
+* @brief Mark what cached segments depend on as changed, cd calls this.
+*
+* @param pt The prompt
+* @param deps enum prompt_dep values that changed
+*/
+void prompt_invalidate(struct prompt_template *pt, unsigned deps) {
+    pt->dirty |= deps;
+}
+
+/**
+* @brief Free the compiled prompt, waiting for a git lookup in progress.
+*
+* @param sh The shell
+*/
+void prompt_destroy(struct shell *sh) {
+    struct prompt_template *pt = &sh->prompt_tmpl;
+    if (pt->git_job) {
+        pthread_join(pt->git_job->thread, NULL);
+        git_install(pt, pt->git_job);
+        pt->git_job = NULL;
+    }
+    if (pt->git_watch && sh->loop) {
+        loop_remove(sh, pt->git_watch);
+    }
+    if (pt->git_fd >= 0) {
+        close(pt->git_fd);
+    }
+    free(pt->segs);
+    free(pt->text);
+    free(pt->buf);
+    free(pt->cwd);
+    free(pt->git_branch);
+    free(pt->git_head);
+    memset(pt, 0, sizeof(*pt));
+    pt->git_fd = -1;
+}
@@ -0,0 +1,609 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <libgen.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lab.h"
+
+#define SCRIPT_BUFSIZ (1 << 16)  // stdio buffer for scripts that can't be mapped
+#define CACHE_MAGIC "p2shc01"    // start of a compiled script, bumped when the layout changes
+#define CACHE_ALIGN 16           // every image starts on this boundary
+
+// what a compiled line turned out to be
+enum cache_kind {
+    LINE_SKIP,     // blank or a comment
+    LINE_PARSE,    // expands something when it runs, or did not parse, so it is parsed every time
+    LINE_IMAGE,    // parsed once, its pipeline is in the file with offsets for pointers
+    LINE_READY,    // an image whose pointers were put back, only ever in memory
+};
+
+// the start of a compiled script
+struct cache_header {
+    char magic[8];
+    uint32_t ptr_size;      // sizeof(void *) where it was written
+    uint32_t nrecords;      // one per line of the script
+    uint64_t script_size;
+    uint64_t hash;          // of the script's bytes, a cache for other bytes is stale
+};
+
+// one line of the script, the records follow the header in order
+struct cache_record {
+    uint64_t line_off;      // where the line starts in the script
+    uint64_t data_off;      // where its image and then its trimmed text start in the cache
+    uint32_t line_len;
+    uint32_t image_size;    // bytes of pipeline image before the text
+    uint32_t kind;          // enum cache_kind
+    uint32_t pad;
+};
+
+// a compiled script being built in memory
+struct cache_build {
+    struct cache_record *recs;
+    size_t nrecs;
+    size_t recs_cap;
+    char *data;             // images and texts, offsets are from the start of data
+    size_t len;
+    size_t cap;
+};
+
+// grow the reusable line buffer so it can hold len bytes plus a NUL
+static int reserve(char **buf, size_t *cap, size_t len) {
+    if (len + 1 <= *cap) {
+        return 0;
+    }
+    size_t n = *cap ? *cap : 256;
+    while (n < len + 1) {
+        n *= 2;
+    }
+    char *grown = realloc(*buf, n);
+    if (!grown) {
+        return -1;
+    }
+    *buf = grown;
+    *cap = n;
+    return 0;
+}
+
+// split a mapped script into lines, copying each into one reused buffer
+static int run_mapped(struct shell *sh, int fd, const char *data, size_t size, size_t off) {
+    char *line = NULL;
+    size_t cap = 0;
+
+    while (off < size) {
+        const char *start = data + off;
+        const char *nl = memchr(start, '\n', size - off);
+        size_t len = nl ? (size_t)(nl - start) : size - off;
+        off += len + (nl ? 1 : 0);
+
+        if (reserve(&line, &cap, len) < 0) {
+            fprintf(stderr, "Memory allocation failed for script line.\n");
+            break;
+        }
+        memcpy(line, start, len);
+        line[len] = '\0';
+
+        // commands reading our stdin must start just after this line
+        if (fd == STDIN_FILENO) {
+            lseek(fd, (off_t)off, SEEK_SET);
+        }
+        sh_run_line(sh, line);
+        jobs_notify(sh);
+    }
+    free(line);
+    return sh->last_status;
+}
+
+static int run_stream(struct shell *sh, FILE *in) {
+    setvbuf(in, NULL, _IOFBF, SCRIPT_BUFSIZ);
+
+    char *line = NULL;
+    size_t cap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &cap, in)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n') {
+            line[len - 1] = '\0';
+        }
+        sh_run_line(sh, line);
+        jobs_notify(sh);
+    }
+    free(line);
+    return sh->last_status;
+}
+
+// FNV-1a over the script, a changed byte anywhere makes the cache stale
+static uint64_t script_hash(const char *data, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char)data[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// a line whose words depend on when it runs: variables, $(...) and globs
+static bool line_expands(const char *line) {
+    return strpbrk(line, "$*?[") != NULL;
+}
+
+// turn the pointer in slot, which points into the block at base, into its
+// offset plus one, 0 stays NULL
+static bool pack_ptr(const char *base, size_t size, void *slot) {
+    char *p;
+    memcpy(&p, slot, sizeof(p));
+    uintptr_t off = 0;
+    if (p) {
+        if (p < base || p >= base + size) {
+            return false;
+        }
+        off = (uintptr_t)(p - base) + 1;
+    }
+    memcpy(slot, &off, sizeof(off));
+    return true;
+}
+
+static bool unpack_ptr(char *base, size_t size, void *slot) {
+    uintptr_t off;
+    memcpy(&off, slot, sizeof(off));
+    if (off > size) {
+        return false;
+    }
+    char *p = off ? base + off - 1 : NULL;
+    memcpy(slot, &p, sizeof(p));
+    return true;
+}
+
+// size of the single allocation sh_parse made for pl
+static size_t pipeline_size(const struct pipeline *pl) {
+    return (size_t)(pl->arena->buf - (const char *)pl) + pl->arena->size;
+}
+
+// copy pl into out with every pointer made an offset into the copy
+static bool pipeline_pack(const struct pipeline *pl, char *out, size_t size) {
+    const char *base = (const char *)pl;
+    memcpy(out, pl, size);
+    struct pipeline *cp = (struct pipeline *)out;
+    for (size_t i = 0; i < pl->nstages; i++) {
+        const struct stage *st = &pl->stages[i];
+        if (st->nredirs > 0) {
+            struct redirect *redirs = (struct redirect *)(out + ((const char *)st->redirs - base));
+            for (size_t j = 0; j < st->nredirs; j++) {
+                if (!pack_ptr(base, size, &redirs[j].path)) {
+                    return false;
+                }
+            }
+        } else {
+            cp->stages[i].redirs = NULL;
+        }
+        if (!pack_ptr(base, size, &cp->stages[i].argv) || !pack_ptr(base, size, &cp->stages[i].redirs)) {
+            return false;
+        }
+    }
+    struct cmd_arena *arena = (struct cmd_arena *)(out + ((const char *)pl->arena - base));
+    for (size_t k = 0; k < pl->arena->cap; k++) {
+        if (!pack_ptr(base, size, &arena->argv[k])) {
+            return false;
+        }
+    }
+    return pack_ptr(base, size, &arena->buf) && pack_ptr(base, size, &cp->arena);
+}
+
+// a NUL terminated string that starts and ends inside the image
+static bool string_in(const char *image, size_t size, const char *s) {
+    return s >= image && s < image + size && memchr(s, '\0', (size_t)(image + size - s)) != NULL;
+}
+
+// put the pointers of an image back in place, checking every one lands
+// inside it, every word and path ends inside it and every stage's argv is
+// a NULL terminated slice of the arena's, so a damaged cache is parsed
+// again instead of run
+static bool pipeline_unpack(char *image, size_t size) {
+    struct pipeline *pl = (struct pipeline *)image;
+    if (size < sizeof(*pl) || image[size - 1] != '\0' ||
+        pl->nstages == 0 || pl->nstages > (size - sizeof(*pl)) / sizeof(struct stage) ||
+        !unpack_ptr(image, size, &pl->arena) || !pl->arena ||
+        (uintptr_t)pl->arena % _Alignof(struct cmd_arena) != 0 ||
+        (char *)pl->arena + sizeof(struct cmd_arena) > image + size) {
+        return false;
+    }
+    struct cmd_arena *arena = pl->arena;
+    if (arena->cap == 0 || arena->cap > (size_t)(image + size - (char *)arena->argv) / sizeof(char *) ||
+        !unpack_ptr(image, size, &arena->buf)) {
+        return false;
+    }
+    for (size_t k = 0; k < arena->cap; k++) {
+        if (!unpack_ptr(image, size, &arena->argv[k]) ||
+            (arena->argv[k] && !string_in(image, size, arena->argv[k]))) {
+            return false;
+        }
+    }
+    if (arena->argv[arena->cap - 1]) {
+        return false;
+    }
+    for (size_t i = 0; i < pl->nstages; i++) {
+        struct stage *st = &pl->stages[i];
+        if (!unpack_ptr(image, size, &st->argv) || !st->argv || !unpack_ptr(image, size, &st->redirs) ||
+            (st->nredirs > 0 && (!st->redirs || (uintptr_t)st->redirs % _Alignof(struct redirect) != 0 ||
+             st->nredirs > (size_t)(image + size - (char *)st->redirs) / sizeof(struct redirect)))) {
+            return false;
+        }
+        // the slot after the last word is the NULL checked above
+        size_t at = (size_t)((char *)st->argv - (char *)arena->argv);
+        if ((char *)st->argv < (char *)arena->argv || at % sizeof(char *) != 0 ||
+            at / sizeof(char *) >= arena->cap || !st->argv[0]) {
+            return false;
+        }
+        for (size_t j = 0; j < st->nredirs; j++) {
+            struct redirect *rd = &st->redirs[j];
+            if (!unpack_ptr(image, size, &rd->path) || (unsigned)rd->kind > REDIR_DUP ||
+                (rd->kind != REDIR_DUP && !string_in(image, size, rd->path))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// room for n more bytes of data, starting on the image boundary
+static char *build_reserve(struct cache_build *b, size_t n) {
+    size_t at = (b->len + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+    if (at + n > b->cap) {
+        size_t cap = b->cap ? b->cap : 4096;
+        while (cap < at + n) {
+            cap *= 2;
+        }
+        char *data = realloc(b->data, cap);
+        if (!data) {
+            return NULL;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memset(b->data + b->len, 0, at - b->len);
+    b->len = at + n;
+    return b->data + at;
+}
+
+static struct cache_record *build_record(struct cache_build *b) {
+    if (b->nrecs == b->recs_cap) {
+        size_t cap = b->recs_cap ? b->recs_cap * 2 : 256;
+        struct cache_record *recs = realloc(b->recs, cap * sizeof(*recs));
+        if (!recs) {
+            return NULL;
+        }
+        b->recs = recs;
+        b->recs_cap = cap;
+    }
+    struct cache_record *rec = &b->recs[b->nrecs++];
+    memset(rec, 0, sizeof(*rec));
+    return rec;
+}
+
+// compile one trimmed line into rec, anything that can't be an image is parsed when it runs
+static int build_line(struct cache_build *b, struct cache_record *rec, const char *line) {
+    if (!*line || *line == '#') {
+        rec->kind = LINE_SKIP;
+        return 0;
+    }
+    rec->kind = LINE_PARSE;
+    struct pipeline *pl = line_expands(line) ? NULL : sh_parse(NULL, line);
+    if (!pl) {
+        return 0;
+    }
+
+    size_t size = pipeline_size(pl), text = strlen(line) + 1;
+    char *out = size <= UINT32_MAX ? build_reserve(b, size + text) : NULL;
+    if (!out) {
+        pipeline_free(pl);
+        return -1;
+    }
+    if (pipeline_pack(pl, out, size)) {
+        memcpy(out + size, line, text);
+        rec->kind = LINE_IMAGE;
+        rec->data_off = (uint64_t)(out - b->data);
+        rec->image_size = (uint32_t)size;
+    } else {
+        b->len = (size_t)(out - b->data);
+    }
+    pipeline_free(pl);
+    return 0;
+}
+
+// parse every line that parses the same each time it runs. Syntax errors
+// are left for the line to report when the script gets to it, so stderr
+// is quiet while compiling
+static int build_script(struct cache_build *b, const char *data, size_t size) {
+    char *line = NULL;
+    size_t cap = 0;
+    int rval = 0;
+
+    fflush(stderr);
+    int saved = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 10);
+    int null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (null >= 0) {
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+    for (size_t off = 0; off < size && rval == 0;) {
+        const char *start = data + off;
+        const char *nl = memchr(start, '\n', size - off);
+        size_t len = nl ? (size_t)(nl - start) : size - off;
+        struct cache_record *rec = build_record(b);
+        if (!rec || len > UINT32_MAX || reserve(&line, &cap, len) < 0) {
+            rval = -1;
+            break;
+        }
+        rec->line_off = off;
+        rec->line_len = (uint32_t)len;
+        off += len + (nl ? 1 : 0);
+        memcpy(line, start, len);
+        line[len] = '\0';
+        rval = build_line(b, rec, trim_white(line));
+    }
+    fflush(stderr);
+    if (saved >= 0) {
+        dup2(saved, STDERR_FILENO);
+        close(saved);
+    }
+    free(line);
+    return rval;
+}
+
+// the layout of the cache file: header, records, then data from data_start
+static size_t data_start(size_t nrecords) {
+    size_t end = sizeof(struct cache_header) + nrecords * sizeof(struct cache_record);
+    return (end + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+// only a file or directory of our own that nobody else can write to is
+// trusted, the hash finds a cache but says nothing about who wrote it
+static bool cache_owned(const struct stat *st) {
+    return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+// where the compiled copy of path is kept: in $MY_SCRIPTCACHE named after
+// the script's hash, else next to the script as .NAME.p2c. NULL if an
+// empty MY_SCRIPTCACHE turned it off or the directory is not ours alone,
+// in a shared one like /tmp another user could put a cache in its place
+static char *cache_path(const char *path, uint64_t hash) {
+    const char *dir = getenv("MY_SCRIPTCACHE");
+    char *cache = NULL;
+    struct stat st;
+    if (dir) {
+        if (*dir && stat(dir, &st) == 0 && S_ISDIR(st.st_mode) && cache_owned(&st) &&
+            asprintf(&cache, "%s/%016llx.p2c", dir, (unsigned long long)hash) < 0) {
+            return NULL;
+        }
+        return cache;
+    }
+    char *d = strdup(path), *n = strdup(path);
+    if (d && n) {
+        const char *parent = dirname(d);
+        if (stat(parent, &st) == 0 && cache_owned(&st) &&
+            asprintf(&cache, "%s/.%s.p2c", parent, basename(n)) < 0) {
+            cache = NULL;
+        }
+    }
+    free(d);
+    free(n);
+    return cache;
+}
+
+// write the cache to a temporary file and move it into place, so a shell
+// reading it at the same time sees the old one or the new one
+static void cache_write(const char *cache, const struct cache_header *hdr, const struct cache_build *b) {
+    char *tmp;
+    if (asprintf(&tmp, "%s.XXXXXX", cache) < 0) {
+        return;
+    }
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) {
+        free(tmp);
+        return;
+    }
+    size_t start = data_start(b->nrecs);
+    struct cache_record *recs = malloc(b->nrecs * sizeof(*recs));
+    bool ok = recs != NULL;
+    if (ok) {
+        for (size_t i = 0; i < b->nrecs; i++) {
+            recs[i] = b->recs[i];
+            recs[i].data_off += start;
+        }
+        static const char zeros[CACHE_ALIGN];
+        size_t head = sizeof(*hdr) + b->nrecs * sizeof(*recs);
+        ok = write(fd, hdr, sizeof(*hdr)) == (ssize_t)sizeof(*hdr) &&
+             write(fd, recs, b->nrecs * sizeof(*recs)) == (ssize_t)(b->nrecs * sizeof(*recs)) &&
+             write(fd, zeros, start - head) == (ssize_t)(start - head) &&
+             write(fd, b->data, b->len) == (ssize_t)b->len;
+    }
+    free(recs);
+    close(fd);
+    if (!ok || rename(tmp, cache) < 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+// map a cache that matches the script, NULL if there is none, it is stale
+// or someone else could have written it
+static char *cache_map(const char *cache, size_t size, uint64_t hash, size_t *len) {
+    int fd = open(cache, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    char *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && cache_owned(&st) &&
+        (size_t)st.st_size >= sizeof(struct cache_header)) {
+        // private and writable so the pointers can be put back in place
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const struct cache_header *hdr = (const struct cache_header *)map;
+    *len = (size_t)st.st_size;
+    if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) != 0 || hdr->ptr_size != sizeof(void *) ||
+        hdr->script_size != size || hdr->hash != hash || data_start(hdr->nrecords) > *len) {
+        munmap(map, *len);
+        return NULL;
+    }
+    const struct cache_record *recs = (const struct cache_record *)(map + sizeof(*hdr));
+    for (size_t i = 0; i < hdr->nrecords; i++) {
+        const struct cache_record *r = &recs[i];
+        if (r->line_off + r->line_len > size || r->kind > LINE_IMAGE ||
+            (r->kind == LINE_IMAGE && (r->data_off % CACHE_ALIGN != 0 || r->data_off > *len ||
+                                       r->image_size >= *len - r->data_off ||
+                                       !memchr(map + r->data_off + r->image_size, '\0',
+                                               *len - r->data_off - r->image_size)))) {
+            munmap(map, *len);
+            return NULL;
+        }
+    }
+    return map;
+}
+
+// run the lines of a script from its compiled records
+static int run_compiled(struct shell *sh, const char *data, struct cache_record *recs, size_t nrecs,
+                        char *images) {
+    char *line = NULL;
+    size_t cap = 0;
+
+    for (size_t i = 0; i < nrecs; i++) {
+        struct cache_record *r = &recs[i];
+        if (r->kind == LINE_IMAGE) {
+            r->kind = pipeline_unpack(images + r->data_off, r->image_size) ? LINE_READY : LINE_PARSE;
+        }
+        if (r->kind == LINE_READY) {
+            struct pipeline *pl = (struct pipeline *)(images + r->data_off);
+            sh_run_parsed(sh, pl, images + r->data_off + r->image_size);
+        } else if (r->kind == LINE_PARSE) {
+            if (reserve(&line, &cap, r->line_len) < 0) {
+                fprintf(stderr, "Memory allocation failed for script line.\n");
+                break;
+            }
+            memcpy(line, data + r->line_off, r->line_len);
+            line[r->line_len] = '\0';
+            sh_run_line(sh, line);
+        }
+        jobs_notify(sh);
+    }
+    free(line);
+    return sh->last_status;
+}
+
+// run a mapped script through its compiled form, compiling it first if
+// the cache is missing or stale, -1 if it can't be compiled at all
+static int run_cached(struct shell *sh, const char *path, const char *data, size_t size) {
+    uint64_t hash = script_hash(data, size);
+    char *cache = cache_path(path, hash);
+    if (!cache) {
+        return -1;
+    }
+
+    size_t len;
+    char *map = cache_map(cache, size, hash, &len);
+    if (map) {
+        free(cache);
+        const struct cache_header *hdr = (const struct cache_header *)map;
+        madvise(map, len, MADV_SEQUENTIAL);
+        int status = run_compiled(sh, data, (struct cache_record *)(map + sizeof(*hdr)), hdr->nrecords, map);
+        munmap(map, len);
+        return status;
+    }
+
+    struct cache_build b = { 0 };
+    if (build_script(&b, data, size) < 0 || b.nrecs > UINT32_MAX) {
+        free(b.recs);
+        free(b.data);
+        free(cache);
+        return -1;
+    }
+    struct cache_header hdr = { .ptr_size = sizeof(void *), .nrecords = (uint32_t)b.nrecs,
+                                .script_size = size, .hash = hash };
+    memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+    cache_write(cache, &hdr, &b);
+    free(cache);
+
+    int status = run_compiled(sh, data, b.recs, b.nrecs, b.data);
+    free(b.recs);
+    free(b.data);
+    return status;
+}
+
+/**
+* @brief Run every line of a script back to back without readline or
+* history. Regular files are mapped with mmap and split in place, pipes
+* and other streams are read through a large stdio buffer. When the
+* script is stdin and it is a regular file the file offset is moved past
+* each line before it runs so commands that read stdin see the rest of
+* the script, just like other shells.
+* 
+* A script named by path is compiled the first time it runs: every line
+* that parses the same each time, with no variable, $(...) or glob, is
+* parsed once and its pipeline stored with offsets for pointers in
+* .NAME.p2c next to the script, or in $MY_SCRIPTCACHE named after the
+* script's hash. Later runs map that file, put each pipeline's pointers
+* back as it is reached and run it with no parsing or allocation. The
+* cache is keyed by a hash of the script, a stale or damaged one is
+* compiled again and an empty MY_SCRIPTCACHE turns it off. A cache is
+* only used when it and its directory belong to the effective user and
+* no one else can write to them.
+*
+* @param sh The shell
+* @param path The script to run or NULL to read stdin
+* @return The exit status of the last line run, or 127 if the script
+* could not be opened
+*/
+int sh_run_script(struct shell *sh, const char *path) {
+    int fd = STDIN_FILENO;
+    if (path) {
+        // close on exec so the commands in the script never see it
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            perror(path);
+            return 127;
+        }
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        // stdin may already be part way through the file
+        off_t start = fd == STDIN_FILENO ? lseek(fd, 0, SEEK_CUR) : 0;
+        if (start < 0 || start > st.st_size) {
+            start = 0;
+        }
+        void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+            madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+            int status = path ? run_cached(sh, path, data, (size_t)st.st_size) : -1;
+            if (status < 0) {
+                status = run_mapped(sh, fd, data, (size_t)st.st_size, (size_t)start);
+            }
+            munmap(data, (size_t)st.st_size);
+            if (path) {
+                close(fd);
+            }
+            return status;
+        }
+    }
+
+    // fall back to buffered reads for pipes, terminals and empty files
+    FILE *in = path ? fdopen(fd, "r") : stdin;
+    if (!in) {
+        perror(path);
+        close(fd);
+        return 127;
+    }
+    int status = run_stream(sh, in);
+    if (path) {
+        fclose(in);
+    }
+    return status;
+}
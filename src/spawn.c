@@ -0,0 +1,498 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <termios.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#ifdef SYS_clone3
+#include <linux/sched.h>
+#endif
+#include "lab.h"
+
+extern char **environ;
+
+// glibc 2.35 can hand the terminal to the child between fork and exec
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+#define HAVE_SPAWN_TCSETPGRP 1
+#endif
+
+// and since 2.29 it can change the child's directory
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_CHDIR 1
+#endif
+
+// job control signals the shell ignores and every child must get back
+static const int child_signals[] = { SIGINT, SIGQUIT, SIGTSTP, SIGTTIN, SIGTTOU };
+
+#define N_CHILD_SIGNALS (sizeof(child_signals) / sizeof(child_signals[0]))
+
+/**
+* @brief Look up a spawn backend by the name used on the command line,
+* either "spawn" or "fork".
+*
+* @param name The backend name
+* @param backend Set to the matching backend on success
+* @return On success, zero is returned. On error, -1 is returned.
+*/
+int spawn_backend_parse(const char *name, enum spawn_backend *backend) {
+    if (strcmp(name, "spawn") == 0) {
+        *backend = SPAWN_POSIX;
+        return 0;
+    }
+    if (strcmp(name, "fork") == 0) {
+        *backend = SPAWN_FORK;
+        return 0;
+    }
+    return -1;
+}
+
+// perror for a child between fork and exec, in one write and with a
+// description that needs no locale or allocation
+static void child_error(const char *what) {
+    const char *desc = strerrordesc_np(errno);
+    const char *parts[] = { what, ": ", desc ? desc : "Unknown error", "\n" };
+    char buf[512];
+    size_t len = 0;
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++) {
+        size_t n = strlen(parts[i]);
+        n = n < sizeof(buf) - len ? n : sizeof(buf) - len;
+        memcpy(buf + len, parts[i], n);
+        len += n;
+    }
+    ssize_t rval = write(STDERR_FILENO, buf, len);
+    UNUSED(rval)
+}
+
+// join the job's group, take the terminal and restore what the shell changed.
+// Only the first process of a group takes the terminal, by the time the
+// next one starts the parent has made sure the group has it
+static void child_setup(struct shell *sh, const struct spawn_opts *opts, bool give_terminal) {
+    pid_t child = getpid();
+    pid_t pgid = opts->pgid ? opts->pgid : child;
+    setpgid(child, pgid);
+    if (give_terminal && opts->pgid == 0) {
+        tcsetpgrp(sh->shell_terminal, pgid);
+    }
+    for (size_t i = 0; i < N_CHILD_SIGNALS; i++) {
+        signal(child_signals[i], SIG_DFL);
+    }
+    // the event loop blocks SIGCHLD and its epoll set is shared with the
+    // parent, a forked built in waits the blocking way
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    sh->loop = NULL;
+    sh->sigchld_watch = NULL;
+    sh->forked = true;
+    if (opts->fd_in != STDIN_FILENO) {
+        dup2(opts->fd_in, STDIN_FILENO);
+    }
+    if (opts->fd_out != STDOUT_FILENO) {
+        dup2(opts->fd_out, STDOUT_FILENO);
+    }
+    for (size_t i = 0; i < opts->ndups; i++) {
+        dup2(opts->dups[i].from, opts->dups[i].to);
+    }
+    if (opts->cwd_fd >= 0 && fchdir(opts->cwd_fd) < 0) {
+        child_error("fchdir");
+        _exit(EXIT_FAILURE);
+    }
+}
+
+// a shell without job control keeps its children in its own group like
+// other shells running a script do, a child in a group of its own that
+// never gets the terminal is stopped as soon as it reads from it
+static const struct spawn_opts *group_opts(const struct shell *sh, const struct spawn_opts *opts,
+                                           struct spawn_opts *shared) {
+    if (!sh->shared_pgroup) {
+        return opts;
+    }
+    *shared = *opts;
+    shared->pgid = sh->shell_pgid;
+    return shared;
+}
+
+/*
+This is in the parent put the child process into its own
+process group and give it control of the terminal
+to avoid a race condition
+*/
+static void parent_setup(struct shell *sh, pid_t pid, const struct spawn_opts *opts, bool give_terminal) {
+    pid_t pgid = opts->pgid ? opts->pgid : pid;
+    setpgid(pid, pgid);
+    if (give_terminal) {
+        terminal_give(sh, pgid);
+    }
+}
+
+static pid_t spawn_fork(struct shell *sh, const char *path, char **argv, const struct spawn_opts *opts) {
+    bool give_terminal = sh->shell_is_interactive && opts->foreground;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        /*This is the child process*/
+        child_setup(sh, opts, give_terminal);
+        execve(path, argv, environ);
+        // the cached path may be stale, let execvp search PATH again
+        if (path != argv[0]) {
+            execvp(argv[0], argv);
+        }
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        exit(EXIT_FAILURE);
+    } else if (pid < 0) {
+        // If fork failed we are in trouble!
+        perror("fork return < 0 Process creation failed!");
+        abort();
+    }
+
+    parent_setup(sh, pid, opts, give_terminal);
+    return pid;
+}
+
+// start a child that is already in the cgroup cgroup_fd names, with clone3
+// when the kernel has CLONE_INTO_CGROUP so it never runs outside of it.
+// Otherwise this is fork and *joined is left false for the child to move
+// itself before it execs
+static pid_t clone_into(int cgroup_fd, bool *joined) {
+    *joined = false;
+#if defined(SYS_clone3) && defined(CLONE_INTO_CGROUP)
+    if (cgroup_fd >= 0) {
+        struct clone_args args;
+        memset(&args, 0, sizeof(args));
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = (uint64_t)cgroup_fd;
+        long pid = syscall(SYS_clone3, &args, sizeof(args));
+        if (pid >= 0) {
+            *joined = true;
+            return (pid_t)pid;
+        }
+        // older kernels don't have clone3 or don't know the flag
+        if (errno != ENOSYS && errno != E2BIG && errno != EINVAL) {
+            return -1;
+        }
+    }
+#else
+    UNUSED(cgroup_fd)
+#endif
+    return fork();
+}
+
+// execvp for a child of a raw clone3: every directory of search, which
+// the parent looked up, is tried with execve and a buffer on the stack
+static void exec_search(const char *search, char **argv) {
+    char buf[PATH_MAX];
+    size_t nlen = strlen(argv[0]);
+    for (const char *dir = search; dir;) {
+        const char *colon = strchr(dir, ':');
+        size_t dlen = colon ? (size_t)(colon - dir) : strlen(dir);
+        if (dlen == 0) {
+            // an empty entry is the current directory
+            dir = ".";
+            dlen = 1;
+        }
+        if (dlen + 1 + nlen < sizeof(buf)) {
+            memcpy(buf, dir, dlen);
+            buf[dlen] = '/';
+            memcpy(buf + dlen + 1, argv[0], nlen + 1);
+            execve(buf, argv, environ);
+        }
+        dir = colon ? colon + 1 : NULL;
+    }
+}
+
+// launch with resource limits, like spawn_fork but the child is put in its
+// cgroup and has its rlimits set before exec. After a raw clone3 none of
+// glibc's fork handlers ran, so a lock another thread held stays held in
+// the child and its idea of the thread id is the parent's: the child only
+// makes async-signal-safe calls until exec, the PATH search included
+static pid_t spawn_limited(struct shell *sh, const char *path, char **argv, const struct spawn_opts *opts) {
+    bool give_terminal = sh->shell_is_interactive && opts->foreground;
+    bool joined;
+    const char *search = getenv("PATH");
+
+    pid_t pid = clone_into(opts->cgroup_fd, &joined);
+    if (pid == 0) {
+        if (opts->cgroup_fd >= 0 && !joined) {
+            // writing 0 moves the writer, the command starts inside either way
+            int fd = openat(opts->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+            if (fd < 0 || write(fd, "0", 1) != 1) {
+                child_error("cgroup.procs");
+                _exit(EXIT_FAILURE);
+            }
+            close(fd);
+        }
+        child_setup(sh, opts, give_terminal);
+        for (size_t i = 0; i < opts->nrlimits; i++) {
+            struct rlimit rl = { opts->rlimits[i].limit, opts->rlimits[i].limit };
+            if (setrlimit(opts->rlimits[i].resource, &rl) < 0) {
+                child_error("setrlimit");
+                _exit(EXIT_FAILURE);
+            }
+        }
+        execve(path, argv, environ);
+        if (path != argv[0]) {
+            exec_search(search ? search : "/bin:/usr/bin", argv);
+        }
+        child_error(argv[0]);
+        _exit(EXIT_FAILURE);
+    } else if (pid < 0) {
+        perror("clone3");
+        return -1;
+    }
+
+    parent_setup(sh, pid, opts, give_terminal);
+    return pid;
+}
+
+static pid_t spawn_posix(struct shell *sh, const char *path, char **argv, const struct spawn_opts *opts) {
+    bool give_terminal = sh->shell_is_interactive && opts->foreground;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t defaults, mask;
+
+    sigemptyset(&defaults);
+    for (size_t i = 0; i < N_CHILD_SIGNALS; i++) {
+        sigaddset(&defaults, child_signals[i]);
+    }
+    sigemptyset(&mask);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+    posix_spawnattr_setpgroup(&attr, opts->pgid);    // 0 means a new group named after the child
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    posix_spawnattr_setsigmask(&attr, &mask);
+
+    posix_spawn_file_actions_init(&actions);
+#ifdef HAVE_SPAWN_TCSETPGRP
+    // only the first process of a group needs to take the terminal, and it
+    // has to before its stdin is replaced since that is the terminal fd
+    if (give_terminal && opts->pgid == 0) {
+        posix_spawn_file_actions_addtcsetpgrp_np(&actions, sh->shell_terminal);
+    }
+#endif
+    if (opts->fd_in != STDIN_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, opts->fd_in, STDIN_FILENO);
+    }
+    if (opts->fd_out != STDOUT_FILENO) {
+        posix_spawn_file_actions_adddup2(&actions, opts->fd_out, STDOUT_FILENO);
+    }
+    for (size_t i = 0; i < opts->ndups; i++) {
+        posix_spawn_file_actions_adddup2(&actions, opts->dups[i].from, opts->dups[i].to);
+    }
+#ifdef HAVE_SPAWN_CHDIR
+    if (opts->cwd_fd >= 0) {
+        posix_spawn_file_actions_addfchdir_np(&actions, opts->cwd_fd);
+    }
+#endif
+
+    pid_t pid;
+    int err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+    if (err == ENOENT && path != argv[0]) {
+        // the executable moved since it was cached, resolve it once more
+        path_forget(&sh->path_cache, argv[0]);
+        path = path_lookup(&sh->path_cache, argv[0]);
+        if (path) {
+            err = posix_spawn(&pid, path, &actions, &attr, argv, environ);
+        }
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(err));
+        return -1;
+    }
+
+#ifdef HAVE_SPAWN_TCSETPGRP
+    // the child took the terminal itself, the shell only has to remember it
+    if (give_terminal && opts->pgid == 0) {
+        sh->terminal_pgid = pid;
+    }
+#else
+    // without the glibc extension the child may run briefly before it owns the terminal
+    if (give_terminal && opts->pgid == 0) {
+        terminal_give(sh, pid);
+    }
+#endif
+    return pid;
+}
+
+static bool same_modes(const struct termios *a, const struct termios *b) {
+    return a->c_iflag == b->c_iflag && a->c_oflag == b->c_oflag && a->c_cflag == b->c_cflag &&
+           a->c_lflag == b->c_lflag && memcmp(a->c_cc, b->c_cc, sizeof(a->c_cc)) == 0 &&
+           cfgetispeed(a) == cfgetispeed(b) && cfgetospeed(a) == cfgetospeed(b);
+}
+
+/**
+* @brief Give the terminal to a process group. Nothing is done if the shell
+* is not interactive or sh->terminal_pgid says the group already has it,
+* which is the case for every stage after the first and for a job fg puts
+* back in the foreground right after it started.
+*
+* @param sh The shell
+* @param pgid The group to give it to
+*/
+void terminal_give(struct shell *sh, pid_t pgid) {
+    if (!sh->shell_is_interactive || sh->terminal_pgid == pgid) {
+        return;
+    }
+    tcsetpgrp(sh->shell_terminal, pgid);
+    sh->terminal_pgid = pgid;
+}
+
+/**
+* @brief Take the terminal back after a foreground job and put the shell's
+* modes back if the job changed them. The modes are read once and only
+* written when they differ, a job that never had the terminal costs no
+* system call at all.
+*
+* @param sh The shell
+* @param modes Where to keep the job's modes if they differ from the
+* shell's, for a job that stopped, or NULL
+* @return True if modes was filled in
+*/
+bool terminal_take(struct shell *sh, struct termios *modes) {
+    if (!sh->shell_is_interactive || sh->terminal_pgid == sh->shell_pgid) {
+        return false;
+    }
+    tcsetpgrp(sh->shell_terminal, sh->shell_pgid);
+    sh->terminal_pgid = sh->shell_pgid;
+
+    struct termios now;
+    if (tcgetattr(sh->shell_terminal, &now) < 0 || same_modes(&now, &sh->shell_tmodes)) {
+        return false;
+    }
+    tcsetattr(sh->shell_terminal, TCSADRAIN, &sh->shell_tmodes);
+    if (modes) {
+        *modes = now;
+    }
+    return modes != NULL;
+}
+
+/**
+* @brief Run a built in command in a child process set up like sh_spawn
+* would set up an external one. Used for built ins that have to run at
+* the same time as the rest of their pipeline or in the background.
+*
+* @param sh The shell, the child works on its own copy
+* @param b The built in to run
+* @param argv The command, argv[0] is the built in's name
+* @param opts How to launch the command or NULL for the defaults
+* @return The pid of the child or -1 if it could not be started
+*/
+pid_t sh_spawn_builtin(struct shell *sh, const struct builtin *b, char **argv, const struct spawn_opts *opts) {
+    struct spawn_opts defaults, shared;
+    if (!opts) {
+        spawn_opts_init(&defaults);
+        opts = &defaults;
+    }
+    opts = group_opts(sh, opts, &shared);
+    bool give_terminal = sh->shell_is_interactive && opts->foreground;
+
+    fflush(stdout);     // or the child would print the shell's pending output again
+    pid_t pid = fork();
+    if (pid == 0) {
+        child_setup(sh, opts, give_terminal);
+        int status = b->fn(sh, argv);
+        fflush(stdout);
+        _exit(status);
+    } else if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+
+    parent_setup(sh, pid, opts, give_terminal);
+    return pid;
+}
+
+/**
+* @brief Set opts to the sh_spawn defaults: a new process group in the
+* foreground that inherits the shell's stdin and stdout.
+*
+* @param opts The options to initialize
+*/
+void spawn_opts_init(struct spawn_opts *opts) {
+    opts->pgid = 0;
+    opts->fd_in = STDIN_FILENO;
+    opts->fd_out = STDOUT_FILENO;
+    opts->foreground = true;
+    opts->dups = NULL;
+    opts->ndups = 0;
+    opts->cwd_fd = -1;
+    opts->cgroup_fd = -1;
+    opts->rlimits = NULL;
+    opts->nrlimits = 0;
+}
+
+/**
+* @brief Launch an external command using the backend selected in sh. The
+* child is placed in opts->pgid, or a new process group named after it,
+* or the shell's own group when sh->shared_pgroup is set, and gets opts->fd_in and opts->fd_out as stdin and stdout, then the
+* redirections in opts->dups are applied in order. If the shell
+* is interactive and opts->foreground is set the group is given control of
+* the terminal before the command runs, the caller is responsible for
+* taking the terminal back once it is done waiting on the child. Pipe fds
+* passed in should be close on exec so no other child inherits them. A
+* child with a cgroup or rlimits in opts is started with clone3, or fork
+* on kernels without it, so it is limited before it runs.
+*
+* @param sh The shell
+* @param argv The command to run, argv[0] is resolved through the PATH cache
+* @param opts How to launch the command or NULL for the defaults
+* @return The pid of the child or -1 if it could not be started
+*/
+pid_t sh_spawn(struct shell *sh, char **argv, const struct spawn_opts *opts) {
+    if (!argv || !argv[0]) {
+        return -1;
+    }
+
+    struct spawn_opts defaults, shared;
+    if (!opts) {
+        spawn_opts_init(&defaults);
+        opts = &defaults;
+    }
+    opts = group_opts(sh, opts, &shared);
+
+    // resolve in the parent so the cache is filled for the next command
+    TRACE_BEGIN(t_lookup);
+    const char *path = path_lookup(&sh->path_cache, argv[0]);
+    TRACE_END(t_lookup, "path_lookup");
+    if (!path) {
+        fprintf(stderr, "%s: command not found\n", argv[0]);
+        return -1;
+    }
+
+    pid_t pid;
+    TRACE_BEGIN(t_launch);
+    enum spawn_backend backend = sh->backend;
+#ifndef HAVE_SPAWN_CHDIR
+    if (opts->cwd_fd >= 0) {
+        backend = SPAWN_FORK;   // only a forked child can change directory first
+    }
+#endif
+    if (opts->cgroup_fd >= 0 || opts->nrlimits > 0) {
+        // neither backend can set limits in the child
+        pid = spawn_limited(sh, path, argv, opts);
+        TRACE_END(t_launch, "clone3");
+        return pid;
+    }
+    switch (backend) {
+        case SPAWN_FORK:
+            pid = spawn_fork(sh, path, argv, opts);
+            TRACE_END(t_launch, "fork");
+            break;
+        case SPAWN_POSIX:
+        default:
+            pid = spawn_posix(sh, path, argv, opts);
+            TRACE_END(t_launch, "posix_spawn");
+            break;
+    }
+    return pid;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "lab.h"
+
+#define STATS_LINE_MAX 4096   // longer stats lines have their command cut short
+
+static double seconds(const struct timeval *tv) {
+    return tv->tv_sec + tv->tv_usec / 1e6;
+}
+
+/**
+* @brief Read the monotonic clock.
+*
+* @return Nanoseconds since an arbitrary fixed point
+*/
+long long monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+* @brief Add the resources one process used to a command's totals. Times
+* and counters are summed, max RSS keeps the largest.
+*
+* @param st The command's stats
+* @param ru What the process used, as returned by wait4
+*/
+void cmd_stats_add(struct cmd_stats *st, const struct rusage *ru) {
+    timeradd(&st->usage.ru_utime, &ru->ru_utime, &st->usage.ru_utime);
+    timeradd(&st->usage.ru_stime, &ru->ru_stime, &st->usage.ru_stime);
+    if (ru->ru_maxrss > st->usage.ru_maxrss) {
+        st->usage.ru_maxrss = ru->ru_maxrss;
+    }
+    st->usage.ru_minflt += ru->ru_minflt;
+    st->usage.ru_majflt += ru->ru_majflt;
+    st->usage.ru_nvcsw += ru->ru_nvcsw;
+    st->usage.ru_nivcsw += ru->ru_nivcsw;
+}
+
+/**
+* @brief Report what a command cost. A timed command gets a block on
+* stderr like the time prefix of other shells, stats mode appends one
+* key=value line per command to sh->stats_fd.
+*
+* @param sh The shell
+* @param st What the command cost
+* @param timed The command was run with the time prefix
+* @param cmd The command line for the stats log
+*/
+void cmd_stats_report(struct shell *sh, const struct cmd_stats *st, bool timed, const char *cmd) {
+    double real = (st->spawn_ns + st->run_ns) / 1e9;
+    double user = seconds(&st->usage.ru_utime);
+    double sys = seconds(&st->usage.ru_stime);
+
+    if (timed) {
+        fprintf(stderr, "\nreal\t%.3fs\n"
+                        "spawn\t%.6fs\n"
+                        "user\t%.3fs\n"
+                        "sys\t%.3fs\n"
+                        "maxrss\t%ld KiB\n"
+                        "ctxsw\t%ld voluntary, %ld involuntary\n",
+                real, st->spawn_ns / 1e9, user, sys, st->usage.ru_maxrss,
+                st->usage.ru_nvcsw, st->usage.ru_nivcsw);
+    }
+
+    if (sh->stats) {
+        // one write per line so several shells can share a log opened for appending
+        char line[STATS_LINE_MAX];
+        int len = snprintf(line, sizeof(line),
+                           "stats status=%d real=%.6f spawn=%.6f user=%.6f sys=%.6f "
+                           "maxrss_kb=%ld minflt=%ld majflt=%ld nvcsw=%ld nivcsw=%ld cmd=%s\n",
+                           st->status, real, st->spawn_ns / 1e9, user, sys, st->usage.ru_maxrss,
+                           st->usage.ru_minflt, st->usage.ru_majflt, st->usage.ru_nvcsw,
+                           st->usage.ru_nivcsw, cmd ? cmd : "");
+        if (len >= (int)sizeof(line)) {
+            len = sizeof(line) - 1;
+            line[len - 1] = '\n';
+        }
+        if (len > 0 && write(sh->stats_fd, line, (size_t)len) < 0) {
+            perror("stats");
+        }
+    }
+}
@@ -0,0 +1,156 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "lab.h"
+
+static bool is_blank(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+// split buf into words at runs of blanks, in place, NUL bytes are dropped
+static size_t split_words(char *buf, size_t len, size_t *bytes) {
+    size_t count = 0, out = 0;
+    bool in_word = false;
+    for (size_t i = 0; i < len; i++) {
+        char c = buf[i];
+        if (c == '\0') {
+            continue;
+        }
+        if (is_blank(c)) {
+            if (in_word) {
+                buf[out++] = '\0';
+                in_word = false;
+            }
+            continue;
+        }
+        if (!in_word) {
+            count++;
+            in_word = true;
+        }
+        buf[out++] = c;
+    }
+    if (in_word) {
+        buf[out++] = '\0';
+    }
+    *bytes = out;
+    return count;
+}
+
+// the whole output as one word without its trailing newlines or NUL bytes
+static size_t one_word(char *buf, size_t len, size_t *bytes) {
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (buf[i] != '\0') {
+            buf[out++] = buf[i];
+        }
+    }
+    while (out > 0 && buf[out - 1] == '\n') {
+        out--;
+    }
+    buf[out++] = '\0';
+    *bytes = out;
+    return 1;
+}
+
+// run pl with fd standing in for stdout, the status is left in sh->last_status
+static void run_captured(struct shell *sh, struct pipeline *pl, int fd) {
+    fflush(stdout);
+    int saved = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, STDOUT_FILENO);
+
+    sh->subst_depth++;
+    int status = pipeline_run(sh, pl);
+    sh->subst_depth--;
+    sh->last_status = status < 0 ? 127 : status;
+
+    fflush(stdout);
+    clearerr(stdout);
+    if (saved >= 0) {
+        dup2(saved, STDOUT_FILENO);
+        close(saved);
+    } else {
+        close(STDOUT_FILENO);
+    }
+}
+
+/**
+* @brief Run the command of a $(...) with its output captured and append
+* the words it makes to gw as one record. Output goes to a memfd, so
+* there is no temporary file and a command that writes a lot never
+* blocks on a reader, and is read back with a single pread straight into
+* gw where it is split in place. The command is parsed and run as a
+* pipeline by this shell, with no other shell process: external
+* commands go through sh_spawn and the spawn backend, built ins run in
+* the shell except for ones that would change it, which get a process
+* of their own like in a subshell.
+*
+* @param sh The shell
+* @param gw Where the words go
+* @param cmd The command, not NUL terminated
+* @param len Its length
+* @param split Split the output into words at blanks
+* @param count Set to the number of words
+* @param bytes Set to their size, NULs included
+* @return The words or NULL on a syntax error or if memory ran out
+*/
+const char *subst_capture(struct shell *sh, struct glob_words *gw, const char *cmd, size_t len, bool split,
+                          size_t *count, size_t *bytes) {
+    char *line = strndup(cmd, len);
+    if (!line) {
+        return NULL;
+    }
+    char *trimmed = trim_white(line);
+    struct pipeline *pl = NULL;
+    if (*trimmed && !(pl = sh_parse(sh, trimmed))) {
+        free(line);
+        return NULL;
+    }
+
+    size_t size = 0;
+    int fd = -1;
+    if (pl) {
+        fd = memfd_create("p2shell-subst", MFD_CLOEXEC);
+        if (fd < 0) {
+            perror("memfd_create");
+            pipeline_free(pl);
+            free(line);
+            return NULL;
+        }
+        run_captured(sh, pl, fd);
+        pipeline_free(pl);
+
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            size = (size_t)st.st_size;
+        }
+    }
+    free(line);
+
+    // one byte more for the NUL that ends the last word
+    char *buf = glob_record_begin(gw, size + 1);
+    if (!buf) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(fd, buf + got, size - got, (off_t)got);
+        if (n <= 0) {
+            break;
+        }
+        got += (size_t)n;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    *count = split ? split_words(buf, got, bytes) : one_word(buf, got, bytes);
+    return glob_record_end(gw, *count, *bytes);
+}
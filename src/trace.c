@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include "lab.h"
+
+#ifdef SH_TRACE
+
+#define TRACE_EVENTS (1 << 16)  // spans kept, older ones are overwritten
+
+struct trace_event {
+    const char *name;
+    long long start_ns;
+    long long end_ns;
+};
+
+static struct trace_event ring[TRACE_EVENTS];
+static unsigned long trace_next = 0;    // total spans ever recorded
+
+/**
+* @brief Record a finished span in the trace ring. The ring holds the most
+* recent spans of this process and claiming a slot is a single atomic add
+* so recording never takes a lock. Only built with SH_TRACE.
+*
+* @param name What the span measured, must be a string literal
+* @param start_ns Monotonic time the span started
+* @param end_ns Monotonic time the span ended
+*/
+void trace_span(const char *name, long long start_ns, long long end_ns) {
+    unsigned long i = __atomic_fetch_add(&trace_next, 1, __ATOMIC_RELAXED);
+    struct trace_event *ev = &ring[i & (TRACE_EVENTS - 1)];
+    ev->name = name;
+    ev->start_ns = start_ns;
+    ev->end_ns = end_ns;
+}
+
+/**
+* @brief Write the spans in the trace ring as Chrome trace JSON, which
+* chrome://tracing and the Perfetto UI load directly. Only built with
+* SH_TRACE.
+*
+* @param path File to write
+* @return On success, zero is returned. On error, -1 is returned.
+*/
+int trace_dump(const char *path) {
+    FILE *out = fopen(path, "we");
+    if (!out) {
+        perror(path);
+        return -1;
+    }
+
+    unsigned long end = __atomic_load_n(&trace_next, __ATOMIC_ACQUIRE);
+    unsigned long start = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+    int pid = (int)getpid();
+
+    // complete events with microsecond timestamps, one per line so it diffs well
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (unsigned long i = start; i < end; i++) {
+        const struct trace_event *ev = &ring[i & (TRACE_EVENTS - 1)];
+        fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}\n",
+                i == start ? "" : ",", ev->name, ev->start_ns / 1e3, (ev->end_ns - ev->start_ns) / 1e3, pid, pid);
+    }
+    fprintf(out, "]}\n");
+    return fclose(out) == 0 ? 0 : -1;
+}
+
+#endif
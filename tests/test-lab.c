@@ -1,6 +1,12 @@
 #include <string.h>
+#include <pwd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include "harness/unity.h"
 #include "../src/lab.h"
+#include "../src/p2shell.h"
 
 
 void setUp(void) {
@@ -230,6 +236,1443 @@ void test_ch_dir_non_existent(void)
      cmd_free(cmd);
 }
 
+void test_cmd_parse_many_args(void)
+{
+     //more args than the arena starts with so argv has to grow
+     char line[256] = "cmd";
+     for (int i = 0; i < 40; i++) {
+          strcat(line, " a");
+     }
+     char **rval = cmd_parse(line);
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_EQUAL_STRING("cmd", rval[0]);
+     for (int i = 1; i <= 40; i++) {
+          TEST_ASSERT_EQUAL_STRING("a", rval[i]);
+     }
+     TEST_ASSERT_NULL(rval[41]);
+     cmd_free(rval);
+}
+
+void test_cmd_parse_tabs(void)
+{
+     char **rval = cmd_parse("ls\t-l \t -a");
+     TEST_ASSERT_TRUE(rval);
+     TEST_ASSERT_EQUAL_STRING("ls", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("-l", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("-a", rval[2]);
+     TEST_ASSERT_NULL(rval[3]);
+     cmd_free(rval);
+}
+
+void test_cmd_parse_quotes_and_vars(void)
+{
+     setenv("TEST_LEX", "two words", 1);
+     unsetenv("TEST_LEX_UNSET");
+     char **rval = cmd_parse("echo \"a b\" 'c $TEST_LEX' d\\ e $TEST_LEX x${TEST_LEX}y \"\" $TEST_LEX_UNSET \"$\" \\$HOME");
+     TEST_ASSERT_NOT_NULL(rval);
+     TEST_ASSERT_EQUAL_STRING("echo", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("a b", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("c $TEST_LEX", rval[2]);
+     TEST_ASSERT_EQUAL_STRING("d e", rval[3]);
+     //an expanded value stays one word
+     TEST_ASSERT_EQUAL_STRING("two words", rval[4]);
+     TEST_ASSERT_EQUAL_STRING("xtwo wordsy", rval[5]);
+     TEST_ASSERT_EQUAL_STRING("", rval[6]);
+     TEST_ASSERT_EQUAL_STRING("$", rval[7]);
+     TEST_ASSERT_EQUAL_STRING("$HOME", rval[8]);
+     TEST_ASSERT_NULL(rval[9]);
+     cmd_free(rval);
+
+     TEST_ASSERT_NULL(cmd_parse("echo \"open"));
+     TEST_ASSERT_NULL(cmd_parse("echo 'open"));
+     TEST_ASSERT_NULL(cmd_parse("echo ${TEST LEX}"));
+     TEST_ASSERT_NULL(cmd_parse("$TEST_LEX_UNSET"));
+
+     //quoted operators are part of a word
+     struct pipeline *pl = pipeline_parse("echo 'a|b' \"&\" \\> 2\">\"x | wc > \"$TEST_LEX\"");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_UINT(2, pl->nstages);
+     TEST_ASSERT_FALSE(pl->background);
+     TEST_ASSERT_EQUAL_STRING("a|b", pl->stages[0].argv[1]);
+     TEST_ASSERT_EQUAL_STRING("&", pl->stages[0].argv[2]);
+     TEST_ASSERT_EQUAL_STRING(">", pl->stages[0].argv[3]);
+     TEST_ASSERT_EQUAL_STRING("2>x", pl->stages[0].argv[4]);
+     TEST_ASSERT_NULL(pl->stages[0].argv[5]);
+     TEST_ASSERT_EQUAL_UINT(0, pl->stages[0].nredirs);
+     TEST_ASSERT_EQUAL_UINT(1, pl->stages[1].nredirs);
+     TEST_ASSERT_EQUAL_STRING("two words", pl->stages[1].redirs[0].path);
+     pipeline_free(pl);
+     unsetenv("TEST_LEX");
+}
+
+static int spawn_and_wait(enum spawn_backend backend, const char *line)
+{
+     struct shell sh = {0};
+     sh.backend = backend;
+     char **cmd = cmd_parse(line);
+     pid_t pid = sh_spawn(&sh, cmd, NULL);
+     cmd_free(cmd);
+     path_cache_destroy(&sh.path_cache);
+     if (pid < 0) {
+          return -1;
+     }
+     int status;
+     TEST_ASSERT_EQUAL_INT(pid, waitpid(pid, &status, 0));
+     TEST_ASSERT_TRUE(WIFEXITED(status));
+     return WEXITSTATUS(status);
+}
+
+void test_sh_spawn_backends(void)
+{
+     TEST_ASSERT_EQUAL_INT(0, spawn_and_wait(SPAWN_POSIX, "true"));
+     TEST_ASSERT_EQUAL_INT(1, spawn_and_wait(SPAWN_POSIX, "false"));
+     TEST_ASSERT_EQUAL_INT(0, spawn_and_wait(SPAWN_FORK, "true"));
+     TEST_ASSERT_EQUAL_INT(1, spawn_and_wait(SPAWN_FORK, "false"));
+     TEST_ASSERT_EQUAL_INT(-1, spawn_and_wait(SPAWN_POSIX, "/thisdoesnotexist"));
+
+     //without job control a child stays in the shell's group with either backend
+     for (int b = SPAWN_POSIX; b <= SPAWN_FORK; b++) {
+          struct shell sh = {0};
+          sh.backend = (enum spawn_backend)b;
+          sh.shell_pgid = getpgrp();
+          sh.shared_pgroup = true;
+          char *argv[] = { "sleep", "1", NULL };
+          pid_t pid = sh_spawn(&sh, argv, NULL);
+          TEST_ASSERT_TRUE(pid > 0);
+          TEST_ASSERT_EQUAL_INT(getpgrp(), getpgid(pid));
+          kill(pid, SIGKILL);
+          waitpid(pid, NULL, 0);
+          path_cache_destroy(&sh.path_cache);
+     }
+}
+
+void test_spawn_backend_parse(void)
+{
+     enum spawn_backend backend = SPAWN_POSIX;
+     TEST_ASSERT_EQUAL_INT(0, spawn_backend_parse("fork", &backend));
+     TEST_ASSERT_EQUAL_INT(SPAWN_FORK, backend);
+     TEST_ASSERT_EQUAL_INT(0, spawn_backend_parse("spawn", &backend));
+     TEST_ASSERT_EQUAL_INT(SPAWN_POSIX, backend);
+     TEST_ASSERT_EQUAL_INT(-1, spawn_backend_parse("vfork", &backend));
+}
+
+void test_path_lookup_caches(void)
+{
+     struct path_cache cache = {0};
+     const char *first = path_lookup(&cache, "true");
+     TEST_ASSERT_NOT_NULL(first);
+     TEST_ASSERT_EQUAL_CHAR('/', first[0]);
+     TEST_ASSERT_EQUAL_PTR(first, path_lookup(&cache, "true"));
+     TEST_ASSERT_EQUAL_UINT(1, cache.count);
+     TEST_ASSERT_NULL(path_lookup(&cache, "thisdoesnotexist"));
+     TEST_ASSERT_EQUAL_STRING("./foo", path_lookup(&cache, "./foo"));
+     path_cache_clear(&cache);
+     TEST_ASSERT_EQUAL_UINT(0, cache.count);
+     path_cache_destroy(&cache);
+}
+
+void test_path_lookup_path_change(void)
+{
+     struct path_cache cache = {0};
+     char *saved = strdup(getenv("PATH"));
+     TEST_ASSERT_NOT_NULL(path_lookup(&cache, "true"));
+     setenv("PATH", "/thisdoesnotexist", 1);
+     TEST_ASSERT_NULL(path_lookup(&cache, "true"));
+     TEST_ASSERT_EQUAL_UINT(0, cache.count);
+     setenv("PATH", saved, 1);
+     free(saved);
+     path_cache_destroy(&cache);
+}
+
+void test_path_forget_keeps_others(void)
+{
+     static const char *names[] = { "true", "false", "ls", "cat", "sh", "env", "echo", "mkdir" };
+     struct path_cache cache = {0};
+     for (size_t i = 0; i < 8; i++) {
+          TEST_ASSERT_NOT_NULL(path_lookup(&cache, names[i]));
+     }
+     path_forget(&cache, "ls");
+     path_forget(&cache, "notcached");
+     TEST_ASSERT_EQUAL_UINT(7, cache.count);
+     for (size_t i = 0; i < 8; i++) {
+          if (strcmp(names[i], "ls") != 0) {
+               size_t before = cache.count;
+               TEST_ASSERT_NOT_NULL(path_lookup(&cache, names[i]));
+               TEST_ASSERT_EQUAL_UINT(before, cache.count);
+          }
+     }
+     path_cache_destroy(&cache);
+}
+
+void test_pipeline_parse_stages(void)
+{
+     struct pipeline *pl = pipeline_parse("ls -l | grep foo|wc");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_UINT(3, pl->nstages);
+     TEST_ASSERT_EQUAL_STRING("ls", pl->stages[0].argv[0]);
+     TEST_ASSERT_EQUAL_STRING("-l", pl->stages[0].argv[1]);
+     TEST_ASSERT_NULL(pl->stages[0].argv[2]);
+     TEST_ASSERT_EQUAL_STRING("grep", pl->stages[1].argv[0]);
+     TEST_ASSERT_EQUAL_STRING("foo", pl->stages[1].argv[1]);
+     TEST_ASSERT_NULL(pl->stages[1].argv[2]);
+     TEST_ASSERT_EQUAL_STRING("wc", pl->stages[2].argv[0]);
+     TEST_ASSERT_NULL(pl->stages[2].argv[1]);
+     pipeline_free(pl);
+}
+
+void test_pipeline_parse_errors(void)
+{
+     TEST_ASSERT_NULL(pipeline_parse(""));
+     TEST_ASSERT_NULL(pipeline_parse("| ls"));
+     TEST_ASSERT_NULL(pipeline_parse("ls |"));
+     TEST_ASSERT_NULL(pipeline_parse("ls | | wc"));
+}
+
+void test_pipeline_run_status(void)
+{
+     struct shell sh = {0};
+     struct pipeline *pl = pipeline_parse("echo hello | grep -q hello");
+     TEST_ASSERT_EQUAL_INT(0, pipeline_run(&sh, pl));
+     pipeline_free(pl);
+     pl = pipeline_parse("echo hello | grep -q bye");
+     TEST_ASSERT_EQUAL_INT(1, pipeline_run(&sh, pl));
+     pipeline_free(pl);
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_pipeline_builtin_stages(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     char *start = getcwd(NULL, 0);
+
+     //the last stage runs in the shell so cd sticks
+     struct pipeline *pl = pipeline_parse("true | cd /");
+     TEST_ASSERT_EQUAL_INT(0, pipeline_run(&sh, pl));
+     pipeline_free(pl);
+     char *cwd = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_STRING("/", cwd);
+     free(cwd);
+     pl = pipeline_parse("true | cd /thisdoesnotexist");
+     TEST_ASSERT_EQUAL_INT(1, pipeline_run(&sh, pl));
+     pipeline_free(pl);
+
+     //a built in feeding a command writes into the pipe from the shell
+     pl = pipeline_parse("hash | grep -q true");
+     TEST_ASSERT_EQUAL_INT(0, pipeline_run(&sh, pl));
+     pipeline_free(pl);
+     //only one stage runs in the shell, the other one gets a process
+     pl = pipeline_parse("jobs | cd /tmp");
+     TEST_ASSERT_EQUAL_INT(0, pipeline_run(&sh, pl));
+     pipeline_free(pl);
+     cwd = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_STRING("/tmp", cwd);
+     free(cwd);
+     //one that changes the shell anywhere but last gets a process too
+     pl = pipeline_parse("cd / | cat");
+     TEST_ASSERT_EQUAL_INT(0, pipeline_run(&sh, pl));
+     pipeline_free(pl);
+     cwd = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_STRING("/tmp", cwd);
+     free(cwd);
+     //a reader that exits early must not kill the shell
+     pl = pipeline_parse("hash | true");
+     TEST_ASSERT_EQUAL_INT(0, pipeline_run(&sh, pl));
+     pipeline_free(pl);
+
+     TEST_ASSERT_EQUAL_INT(0, chdir(start));
+     free(start);
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_sh_parse_command_substitution(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     char *start = getcwd(NULL, 0);
+
+     //unquoted output is split, quoted output only loses trailing newlines
+     struct pipeline *pl = sh_parse(&sh, "echo x$(printf 'a  b\\n\\n')y \"$(printf 'c  d\\n\\n')\" $(true) \"$(true)\"");
+     TEST_ASSERT_NOT_NULL(pl);
+     char **argv = pl->stages[0].argv;
+     TEST_ASSERT_EQUAL_STRING("xa", argv[1]);
+     TEST_ASSERT_EQUAL_STRING("by", argv[2]);
+     TEST_ASSERT_EQUAL_STRING("c  d", argv[3]);
+     TEST_ASSERT_EQUAL_STRING("", argv[4]);
+     TEST_ASSERT_NULL(argv[5]);
+     pipeline_free(pl);
+
+     //nested, with a pipeline and a ')' in quotes, more than a pipe holds
+     pl = sh_parse(&sh, "echo $(echo $(seq 1 20000 | tail -n 1) ')') $(seq 1 100000 | wc -l) | cat");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_UINT(2, pl->nstages);
+     TEST_ASSERT_EQUAL_STRING("20000", pl->stages[0].argv[1]);
+     TEST_ASSERT_EQUAL_STRING(")", pl->stages[0].argv[2]);
+     TEST_ASSERT_EQUAL_STRING("100000", pl->stages[0].argv[3]);
+     pipeline_free(pl);
+
+     //a built in that changes the shell runs in a process of its own
+     pl = sh_parse(&sh, "echo $(cd /) $(pwd)");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_STRING(start, pl->stages[0].argv[1]);
+     pipeline_free(pl);
+     char *cwd = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_STRING(start, cwd);
+     free(cwd);
+
+     TEST_ASSERT_NULL(sh_parse(&sh, "echo $(echo"));
+     TEST_ASSERT_NULL(pipeline_parse("echo $(echo)"));
+     TEST_ASSERT_NULL(sh_parse(&sh, "cat > $(echo a b)"));
+
+     //exit leaves only the child, with its status and nothing printed
+     pl = sh_parse(&sh, "echo $(exit 3) st");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_STRING("st", pl->stages[0].argv[1]);
+     TEST_ASSERT_NULL(pl->stages[0].argv[2]);
+     TEST_ASSERT_EQUAL_INT(3, sh.last_status);
+     pipeline_free(pl);
+
+     //nothing runs for a line that does not parse, nested ones included
+     char made[] = "/tmp/p2shell-substXXXXXX", line[128];
+     int fd = mkstemp(made);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+     unlink(made);
+     snprintf(line, sizeof(line), "echo $(touch %s) |", made);
+     TEST_ASSERT_NULL(sh_parse(&sh, line));
+     snprintf(line, sizeof(line), "echo $(touch %s) $(echo $(true |))", made);
+     TEST_ASSERT_NULL(sh_parse(&sh, line));
+     TEST_ASSERT_EQUAL_INT(-1, access(made, F_OK));
+
+     free(start);
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_memo_replay(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     sh.memo.fd = -1;
+     char dir[] = "/tmp/p2shell-memoXXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char store[64], in[64], log[64], line[256];
+     snprintf(store, sizeof(store), "%s/store", dir);
+     snprintf(in, sizeof(in), "%s/in", dir);
+     snprintf(log, sizeof(log), "%s/log", dir);
+     setenv("MY_MEMOFILE", store, 1);
+     unsetenv("MEMO_V");
+     FILE *f = fopen(in, "w");
+     fputs("one\n", f);
+     fclose(f);
+     snprintf(line, sizeof(line), "echo $(memo -f %s -e MEMO_V sh -c 'echo run >> %s; cat %s')", in, log, in);
+
+     //the second run is replayed, a new -e value or -f file runs it again
+     const char *want[] = { "one", "one", "one", "two", "two" };
+     const int runs[] = { 1, 1, 2, 3, 3 };
+     for (int i = 0; i < 5; i++) {
+          if (i == 2) {
+               setenv("MEMO_V", "2", 1);
+          }
+          if (i == 3) {
+               f = fopen(in, "w");
+               fputs("two\n", f);
+               fclose(f);
+          }
+          struct pipeline *pl = sh_parse(&sh, line);
+          TEST_ASSERT_NOT_NULL(pl);
+          TEST_ASSERT_EQUAL_STRING(want[i], pl->stages[0].argv[1]);
+          pipeline_free(pl);
+          int count = 0;
+          char buf[16];
+          f = fopen(log, "r");
+          while (fgets(buf, sizeof(buf), f)) {
+               count++;
+          }
+          fclose(f);
+          TEST_ASSERT_EQUAL_INT(runs[i], count);
+     }
+
+     //the exit status is kept too and memo -c forgets everything
+     for (int i = 0; i < 2; i++) {
+          struct pipeline *pl = sh_parse(&sh, "echo $(memo sh -c 'echo out; exit 3')");
+          TEST_ASSERT_NOT_NULL(pl);
+          TEST_ASSERT_EQUAL_STRING("out", pl->stages[0].argv[1]);
+          TEST_ASSERT_EQUAL_INT(3, sh.last_status);
+          pipeline_free(pl);
+     }
+     char *clear[] = { "memo", "-c", NULL };
+     TEST_ASSERT_EQUAL_INT(0, memo_run(&sh, clear));
+     struct pipeline *pl = sh_parse(&sh, line);
+     TEST_ASSERT_NOT_NULL(pl);
+     pipeline_free(pl);
+     struct stat st;
+     TEST_ASSERT_EQUAL_INT(0, stat(log, &st));
+     TEST_ASSERT_EQUAL_INT(16, st.st_size);
+
+     char *builtin[] = { "memo", "cd", "/", NULL };
+     TEST_ASSERT_EQUAL_INT(2, memo_run(&sh, builtin));
+
+     //a shell asking for another size keeps the store as it was made
+     struct stat before;
+     TEST_ASSERT_EQUAL_INT(0, stat(store, &before));
+     struct shell other = {0};
+     other.memo.fd = -1;
+     setenv("MY_MEMOSIZE", "4096", 1);
+     TEST_ASSERT_EQUAL_INT(0, memo_run(&other, clear));
+     unsetenv("MY_MEMOSIZE");
+     TEST_ASSERT_EQUAL_INT(0, stat(store, &st));
+     TEST_ASSERT_EQUAL_INT64(before.st_size, st.st_size);
+     TEST_ASSERT_EQUAL_size_t(sh.memo.size, other.memo.size);
+     memo_close(&other);
+
+     memo_close(&sh);
+     unsetenv("MY_MEMOFILE");
+     unsetenv("MEMO_V");
+     unlink(store);
+     unlink(in);
+     unlink(log);
+     rmdir(dir);
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_peer_run_prefixes(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     char dir[] = "/tmp/p2shell-peerXXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char ssh[64], log[64], line[256];
+     snprintf(ssh, sizeof(ssh), "%s/ssh", dir);
+     snprintf(log, sizeof(log), "%s/log", dir);
+
+     //a stand in for ssh that logs the host and runs the command here
+     FILE *f = fopen(ssh, "w");
+     fprintf(f, "#!/bin/sh\nwhile [ \"$1\" != -- ]; do shift; done\necho \"$2\" >> %s\nexec sh -c \"$3\"\n", log);
+     fclose(f);
+     chmod(ssh, 0700);
+     setenv("MY_SSH", ssh, 1);
+     setenv("MY_PEERS", "a, b", 1);
+
+     //every line gets its host, the words are quoted again for the far end
+     struct pipeline *pl = sh_parse(&sh, "echo \"$(on echo \"it's\" '$HOME' | sort)\"");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_STRING("a: it's $HOME\nb: it's $HOME", pl->stages[0].argv[1]);
+     pipeline_free(pl);
+     TEST_ASSERT_EQUAL_INT(0, sh.last_status);
+
+     //a failure on any peer fails the whole command
+     snprintf(line, sizeof(line), "echo $(on -h c sh -c 'echo out; exit 3')");
+     pl = sh_parse(&sh, line);
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_STRING("c:", pl->stages[0].argv[1]);
+     TEST_ASSERT_EQUAL_STRING("out", pl->stages[0].argv[2]);
+     pipeline_free(pl);
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+
+     f = fopen(log, "r");
+     char hosts[16] = {0};
+     size_t n = fread(hosts, 1, sizeof(hosts) - 1, f);
+     fclose(f);
+     TEST_ASSERT_EQUAL_UINT(6, n);
+     TEST_ASSERT_EQUAL_STRING("c\n", hosts + 4);
+
+     char *none[] = { "on", NULL };
+     TEST_ASSERT_EQUAL_INT(2, peer_run(&sh, none));
+
+     //a socket directory others can get into is refused
+     char *runtime = getenv("XDG_RUNTIME_DIR") ? strdup(getenv("XDG_RUNTIME_DIR")) : NULL;
+     char sockets[64];
+     snprintf(sockets, sizeof(sockets), "%s/p2shell-ssh", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(sockets, 0700));
+     TEST_ASSERT_EQUAL_INT(0, chmod(sockets, 0755));
+     setenv("XDG_RUNTIME_DIR", dir, 1);
+     pl = sh_parse(&sh, "echo $(on echo hi)");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_NULL(pl->stages[0].argv[1]);
+     pipeline_free(pl);
+     TEST_ASSERT_EQUAL_INT(1, sh.last_status);
+     if (runtime) {
+          setenv("XDG_RUNTIME_DIR", runtime, 1);
+     } else {
+          unsetenv("XDG_RUNTIME_DIR");
+     }
+     free(runtime);
+     rmdir(sockets);
+
+     unsetenv("MY_SSH");
+     unsetenv("MY_PEERS");
+     unlink(ssh);
+     unlink(log);
+     rmdir(dir);
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_pipeline_parse_redirects(void)
+{
+     struct pipeline *pl = pipeline_parse("sort<in 2>>log | cat -n >out 2>&1");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_UINT(2, pl->nstages);
+     TEST_ASSERT_EQUAL_STRING("sort", pl->stages[0].argv[0]);
+     TEST_ASSERT_NULL(pl->stages[0].argv[1]);
+     TEST_ASSERT_EQUAL_UINT(2, pl->stages[0].nredirs);
+     TEST_ASSERT_EQUAL_INT(REDIR_IN, pl->stages[0].redirs[0].kind);
+     TEST_ASSERT_EQUAL_INT(0, pl->stages[0].redirs[0].fd);
+     TEST_ASSERT_EQUAL_STRING("in", pl->stages[0].redirs[0].path);
+     TEST_ASSERT_EQUAL_INT(REDIR_APPEND, pl->stages[0].redirs[1].kind);
+     TEST_ASSERT_EQUAL_INT(2, pl->stages[0].redirs[1].fd);
+     TEST_ASSERT_EQUAL_STRING("log", pl->stages[0].redirs[1].path);
+     TEST_ASSERT_EQUAL_STRING("-n", pl->stages[1].argv[1]);
+     TEST_ASSERT_NULL(pl->stages[1].argv[2]);
+     TEST_ASSERT_EQUAL_UINT(2, pl->stages[1].nredirs);
+     TEST_ASSERT_EQUAL_INT(REDIR_OUT, pl->stages[1].redirs[0].kind);
+     TEST_ASSERT_EQUAL_INT(1, pl->stages[1].redirs[0].fd);
+     TEST_ASSERT_EQUAL_INT(REDIR_DUP, pl->stages[1].redirs[1].kind);
+     TEST_ASSERT_EQUAL_INT(2, pl->stages[1].redirs[1].fd);
+     TEST_ASSERT_EQUAL_INT(1, pl->stages[1].redirs[1].from);
+     pipeline_free(pl);
+
+     //a digit that is not right before the operator is just a word
+     pl = pipeline_parse("echo 2 > out &");
+     TEST_ASSERT_TRUE(pl->background);
+     TEST_ASSERT_EQUAL_STRING("2", pl->stages[0].argv[1]);
+     TEST_ASSERT_EQUAL_INT(1, pl->stages[0].redirs[0].fd);
+     pipeline_free(pl);
+
+     TEST_ASSERT_NULL(pipeline_parse("cat >"));
+     TEST_ASSERT_NULL(pipeline_parse("cat > | wc"));
+     TEST_ASSERT_NULL(pipeline_parse("cat >&x"));
+     TEST_ASSERT_NULL(pipeline_parse("> out"));
+}
+
+void test_redirect_run(void)
+{
+     char path[] = "/tmp/test-redir-XXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+
+     struct shell sh = {0};
+     jobs_init(&sh);
+     char line[128];
+     snprintf(line, sizeof(line), "echo one > %s", path);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     snprintf(line, sizeof(line), "ls /thisdoesnotexist >> %s 2>&1", path);
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, line));
+     //built ins are redirected in the shell and get stdout back afterwards
+     snprintf(line, sizeof(line), "hash >> %s", path);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     snprintf(line, sizeof(line), "grep -q one < %s", path);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     strcpy(line, "cat < /thisdoesnotexist");
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+
+     FILE *in = fopen(path, "r");
+     char buf[512] = {0};
+     TEST_ASSERT_TRUE(fread(buf, 1, sizeof(buf) - 1, in) > 0);
+     fclose(in);
+     unlink(path);
+     TEST_ASSERT_EQUAL_INT(0, strncmp(buf, "one\nls: ", 8));
+     TEST_ASSERT_NOT_NULL(strstr(buf, "echo\t"));
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_pipeline_parse_background(void)
+{
+     struct pipeline *pl = pipeline_parse("sleep 1 | cat&");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_TRUE(pl->background);
+     TEST_ASSERT_EQUAL_UINT(2, pl->nstages);
+     TEST_ASSERT_EQUAL_STRING("cat", pl->stages[1].argv[0]);
+     TEST_ASSERT_NULL(pl->stages[1].argv[1]);
+     pipeline_free(pl);
+
+     pl = pipeline_parse("ls");
+     TEST_ASSERT_FALSE(pl->background);
+     pipeline_free(pl);
+
+     TEST_ASSERT_NULL(pipeline_parse("&"));
+     TEST_ASSERT_NULL(pipeline_parse("sleep 1 & ls"));
+     TEST_ASSERT_NULL(pipeline_parse("sleep 1 | & ls"));
+}
+
+void test_job_background_then_foreground(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     struct pipeline *pl = pipeline_parse("false | true | false &");
+     TEST_ASSERT_EQUAL_INT(0, pipeline_run(&sh, pl));
+     pipeline_free(pl);
+     TEST_ASSERT_EQUAL_UINT(1, sh.njobs);
+
+     struct job *job = job_find(&sh, NULL);
+     TEST_ASSERT_NOT_NULL(job);
+     TEST_ASSERT_EQUAL_PTR(job, job_find(&sh, "%1"));
+     TEST_ASSERT_EQUAL_PTR(job, job_find(&sh, "1"));
+     TEST_ASSERT_NULL(job_find(&sh, "%2"));
+     TEST_ASSERT_EQUAL_UINT(3, job->nprocs);
+     TEST_ASSERT_EQUAL_STRING("false | true | false &", job->cmd);
+
+     TEST_ASSERT_EQUAL_INT(1, job_foreground(&sh, job, false));
+     TEST_ASSERT_EQUAL_UINT(0, sh.njobs);
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+static void count_ready(struct shell *sh, void *data)
+{
+     UNUSED(sh)
+     (*(int *)data)++;
+}
+
+void test_event_loop_jobs(void)
+{
+     struct shell sh = {0};
+     TEST_ASSERT_EQUAL_INT(0, loop_init(&sh));
+     jobs_init(&sh);
+     TEST_ASSERT_NOT_NULL(sh.loop);
+     TEST_ASSERT_NOT_NULL(sh.sigchld_watch);
+
+     //a plain descriptor is serviced by the same loop as the jobs
+     int fds[2];
+     int ready = 0;
+     TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+     struct watch *w = loop_add(&sh, fds[0], count_ready, &ready);
+     TEST_ASSERT_NOT_NULL(w);
+     TEST_ASSERT_EQUAL_INT(0, loop_run(&sh, 0));
+     TEST_ASSERT_EQUAL_INT(1, (int)write(fds[1], "x", 1));
+     TEST_ASSERT_EQUAL_INT(1, loop_run(&sh, 1000));
+     TEST_ASSERT_EQUAL_INT(1, ready);
+     loop_pause(&sh, w, true);
+     TEST_ASSERT_EQUAL_INT(0, loop_run(&sh, 0));
+     loop_pause(&sh, w, false);
+     TEST_ASSERT_EQUAL_INT(1, loop_run(&sh, 0));
+     loop_remove(&sh, w);
+     close(fds[0]);
+     close(fds[1]);
+
+     //the background job is reaped by the loop with no call to jobs_reap
+     char line[64];
+     strcpy(line, "sleep 0.1 &");
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     TEST_ASSERT_EQUAL_UINT(1, sh.njobs);
+     TEST_ASSERT_FALSE(jobs_need_notify(&sh));
+     for (int i = 0; i < 100 && !jobs_need_notify(&sh); i++) {
+          loop_run(&sh, 100);
+     }
+     TEST_ASSERT_TRUE(jobs_need_notify(&sh));
+     TEST_ASSERT_EQUAL_INT(JOB_DONE, job_state(sh.jobs[0]));
+
+     //foreground jobs are waited on through their pidfds
+     strcpy(line, "true | false");
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+     strcpy(line, "false | true");
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+
+     jobs_destroy(&sh);
+     loop_destroy(&sh);
+     TEST_ASSERT_NULL(sh.loop);
+     path_cache_destroy(&sh.path_cache);
+
+     //SIGCHLD is unblocked again for the tests that follow
+     sigset_t mask;
+     sigprocmask(SIG_BLOCK, NULL, &mask);
+     TEST_ASSERT_FALSE(sigismember(&mask, SIGCHLD));
+}
+
+void test_job_output_ring(void)
+{
+     struct shell sh = {0};
+     TEST_ASSERT_EQUAL_INT(0, loop_init(&sh));
+     jobs_init(&sh);
+
+     //a background job's output lands in its ring, only the tail is kept
+     char line[64];
+     strcpy(line, "seq 20000 &");
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     struct job *job = sh.jobs[0];
+     TEST_ASSERT_TRUE(job->out.fd >= 0);
+     for (int i = 0; i < 100 && (job->out.fd >= 0 || job_state(job) != JOB_DONE); i++) {
+          loop_run(&sh, 100);
+     }
+     TEST_ASSERT_EQUAL_INT(-1, job->out.fd);
+     TEST_ASSERT_EQUAL_UINT(108894, job->out.total);
+     size_t end = job->out.total % JOB_OUTPUT_SIZE;
+     TEST_ASSERT_EQUAL_MEMORY("19999\n20000\n", job->out.ring + end - 12, 12);
+
+     //when it is done it stays in the table until jobs -o looks at it
+     jobs_notify(&sh);
+     TEST_ASSERT_EQUAL_UINT(1, sh.njobs);
+     TEST_ASSERT_TRUE(job->kept);
+     TEST_ASSERT_FALSE(jobs_need_notify(&sh));
+
+     //stderr goes to the same place, a job that prints nothing has no ring
+     strcpy(line, "sh -c 'echo hi >&2' &");
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     strcpy(line, "true &");
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     TEST_ASSERT_EQUAL_UINT(3, sh.njobs);
+     for (int i = 0; i < 100 && (sh.jobs[1]->out.fd >= 0 || sh.jobs[2]->out.fd >= 0); i++) {
+          loop_run(&sh, 100);
+     }
+     TEST_ASSERT_EQUAL_MEMORY("hi\n", sh.jobs[1]->out.ring, 3);
+     TEST_ASSERT_NULL(sh.jobs[2]->out.ring);
+
+     jobs_destroy(&sh);
+     loop_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_prompt_template(void)
+{
+     char dir[] = "/tmp/test-prompt-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char path[64];
+     snprintf(path, sizeof(path), "%s/.git", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0700));
+     snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+     FILE *head = fopen(path, "w");
+     fputs("ref: refs/heads/topic\n", head);
+     fclose(head);
+     snprintf(path, sizeof(path), "%s/sub", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(path, 0700));
+     char *old = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_INT(0, chdir(path));
+
+     struct shell sh = {0};
+     sh.prompt = "\\W (\\g) [\\?]\\n\\q\\\\>";
+     TEST_ASSERT_EQUAL_INT(0, prompt_init(&sh));
+     TEST_ASSERT_EQUAL_STRING("sub (topic) [0]\n\\q\\>", prompt_render(&sh));
+     sh.last_status = 3;
+     TEST_ASSERT_EQUAL_STRING("sub (topic) [3]\n\\q\\>", prompt_render(&sh));
+
+     //the directory is only read again once cd says it changed
+     TEST_ASSERT_EQUAL_INT(0, chdir("/"));
+     TEST_ASSERT_EQUAL_STRING("sub (topic) [3]\n\\q\\>", prompt_render(&sh));
+     prompt_invalidate(&sh.prompt_tmpl, PROMPT_DEP_CWD);
+     TEST_ASSERT_EQUAL_STRING("/ () [3]\n\\q\\>", prompt_render(&sh));
+     prompt_destroy(&sh);
+
+     //\u is $USER, the password database is only read without it when drawn
+     char *user = getenv("USER") ? strdup(getenv("USER")) : NULL;
+     setenv("USER", "someone", 1);
+     sh.prompt = "\\u>";
+     TEST_ASSERT_EQUAL_INT(0, prompt_init(&sh));
+     TEST_ASSERT_EQUAL_STRING("someone>", prompt_render(&sh));
+     prompt_destroy(&sh);
+     unsetenv("USER");
+     TEST_ASSERT_EQUAL_INT(0, prompt_init(&sh));
+     TEST_ASSERT_EQUAL_STRING("", sh.prompt_tmpl.user);
+     struct passwd *pw = getpwuid(geteuid());
+     char want[80];
+     snprintf(want, sizeof(want), "%s>", pw ? pw->pw_name : "?");
+     TEST_ASSERT_EQUAL_STRING(want, prompt_render(&sh));
+     prompt_destroy(&sh);
+     if (user) {
+          setenv("USER", user, 1);
+          free(user);
+     }
+
+     //with an event loop the branch arrives after the prompt is first shown
+     TEST_ASSERT_EQUAL_INT(0, chdir(path));
+     TEST_ASSERT_EQUAL_INT(0, loop_init(&sh));
+     sh.prompt = "\\g>";
+     TEST_ASSERT_EQUAL_INT(0, prompt_init(&sh));
+     TEST_ASSERT_EQUAL_STRING(">", prompt_render(&sh));
+     for (int i = 0; i < 100 && !sh.prompt_tmpl.changed; i++) {
+          loop_run(&sh, 100);
+     }
+     TEST_ASSERT_TRUE(sh.prompt_tmpl.changed);
+     TEST_ASSERT_EQUAL_STRING("topic>", prompt_render(&sh));
+     prompt_destroy(&sh);
+     loop_destroy(&sh);
+     dirs_destroy(&sh);
+
+     TEST_ASSERT_EQUAL_INT(0, chdir(old));
+     free(old);
+     rmdir(path);
+     snprintf(path, sizeof(path), "%s/.git/HEAD", dir);
+     unlink(path);
+     snprintf(path, sizeof(path), "%s/.git", dir);
+     rmdir(path);
+     rmdir(dir);
+}
+
+void test_dirs_cd_and_stack(void)
+{
+     char dir[] = "/tmp/test-dirs-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char real[64], link[64];
+     snprintf(real, sizeof(real), "%s/real", dir);
+     snprintf(link, sizeof(link), "%s/link", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(real, 0700));
+     TEST_ASSERT_EQUAL_INT(0, symlink("real", link));
+     char *old = getcwd(NULL, 0);
+
+     struct shell sh = {0};
+     dirs_init(&sh);
+     TEST_ASSERT_EQUAL_STRING(old, sh.cwd);
+     TEST_ASSERT_EQUAL_INT(0, dirs_cd(&sh, dir));
+     TEST_ASSERT_EQUAL_STRING(dir, sh.cwd);
+
+     //the cached directory keeps the path the user took
+     TEST_ASSERT_EQUAL_INT(0, dirs_cd(&sh, "link/./"));
+     TEST_ASSERT_EQUAL_STRING(link, sh.cwd);
+     TEST_ASSERT_EQUAL_STRING(link, getenv("PWD"));
+     TEST_ASSERT_EQUAL_INT(0, dirs_cd(&sh, ".."));
+     TEST_ASSERT_EQUAL_STRING(dir, sh.cwd);
+     TEST_ASSERT_EQUAL_INT(-1, dirs_cd(&sh, "nope"));
+     TEST_ASSERT_EQUAL_STRING(dir, sh.cwd);
+
+     TEST_ASSERT_EQUAL_INT(-1, dirs_pop(&sh));
+     TEST_ASSERT_EQUAL_INT(-1, dirs_push(&sh, NULL));
+     TEST_ASSERT_EQUAL_INT(0, dirs_push(&sh, "real"));
+     TEST_ASSERT_EQUAL_STRING(real, sh.cwd);
+     TEST_ASSERT_EQUAL_UINT(1, sh.dirs.count);
+     TEST_ASSERT_EQUAL_INT(0, dirs_push(&sh, "/"));
+     TEST_ASSERT_EQUAL_STRING("/", sh.cwd);
+
+     //pushd with no directory swaps with the top of the stack
+     TEST_ASSERT_EQUAL_INT(0, dirs_push(&sh, NULL));
+     TEST_ASSERT_EQUAL_STRING(real, sh.cwd);
+     TEST_ASSERT_EQUAL_INT(0, dirs_pop(&sh));
+     TEST_ASSERT_EQUAL_STRING("/", sh.cwd);
+     char *actual = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_STRING("/", actual);
+     free(actual);
+     TEST_ASSERT_EQUAL_INT(0, dirs_pop(&sh));
+     TEST_ASSERT_EQUAL_STRING(dir, sh.cwd);
+     TEST_ASSERT_EQUAL_UINT(0, sh.dirs.count);
+
+     TEST_ASSERT_EQUAL_INT(0, dirs_push(&sh, "link"));
+     dirs_clear(&sh);
+     TEST_ASSERT_EQUAL_UINT(0, sh.dirs.count);
+
+     TEST_ASSERT_EQUAL_INT(0, dirs_cd(&sh, old));
+     dirs_destroy(&sh);
+     free(old);
+     unlink(link);
+     rmdir(real);
+     rmdir(dir);
+}
+
+// create an empty file under dir
+static void touch_in(const char *dir, const char *name)
+{
+     char path[128];
+     snprintf(path, sizeof(path), "%s/%s", dir, name);
+     FILE *f = fopen(path, "w");
+     TEST_ASSERT_NOT_NULL(f);
+     fclose(f);
+}
+
+void test_glob_expand_words(void)
+{
+     char dir[] = "/tmp/test-glob-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char sub[64];
+     snprintf(sub, sizeof(sub), "%s/sub", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(sub, 0700));
+     touch_in(dir, "b.c");
+     touch_in(dir, "a.c");
+     touch_in(dir, "a.h");
+     touch_in(dir, ".hidden.c");
+     touch_in(dir, "*.c");
+     touch_in(sub, "x.c");
+     char *old = getcwd(NULL, 0);
+     TEST_ASSERT_EQUAL_INT(0, chdir(dir));
+
+     //matches are sorted and dot files need an explicit dot
+     char **rval = cmd_parse("ls *.c '*.c' \\*.c nope* a.[ch] */ */*.c .*.c");
+     TEST_ASSERT_NOT_NULL(rval);
+     const char *expect[] = { "ls", "*.c", "a.c", "b.c", "*.c", "*.c", "nope*", "a.c", "a.h",
+                              "sub/", "sub/x.c", ".hidden.c", NULL };
+     for (int i = 0; expect[i]; i++) {
+          TEST_ASSERT_EQUAL_STRING(expect[i], rval[i]);
+     }
+     TEST_ASSERT_NULL(rval[12]);
+     cmd_free(rval);
+
+     //a new file shows up even though the listing was cached
+     touch_in(dir, "c.c");
+     rval = cmd_parse("echo ?.c");
+     TEST_ASSERT_NOT_NULL(rval);
+     TEST_ASSERT_EQUAL_STRING("*.c", rval[1]);
+     TEST_ASSERT_EQUAL_STRING("c.c", rval[4]);
+     TEST_ASSERT_NULL(rval[5]);
+     cmd_free(rval);
+
+     //a long pattern that matches short names still fits
+     rval = cmd_parse("*********************.h");
+     TEST_ASSERT_NOT_NULL(rval);
+     TEST_ASSERT_EQUAL_STRING("a.h", rval[0]);
+     TEST_ASSERT_NULL(rval[1]);
+     cmd_free(rval);
+
+     struct pipeline *pl = pipeline_parse("cat a.* | wc > *.h");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_STRING("a.h", pl->stages[0].argv[2]);
+     TEST_ASSERT_EQUAL_STRING("a.h", pl->stages[1].redirs[0].path);
+     pipeline_free(pl);
+     TEST_ASSERT_NULL(pipeline_parse("cat > ?.c"));
+
+     TEST_ASSERT_EQUAL_INT(0, chdir(old));
+     free(old);
+     const char *names[] = { "a.c", "b.c", "c.c", "a.h", ".hidden.c", "*.c", "sub/x.c", NULL };
+     for (int i = 0; names[i]; i++) {
+          char path[128];
+          snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+          unlink(path);
+     }
+     rmdir(sub);
+     rmdir(dir);
+     glob_cache_clear();
+}
+
+void test_complete_word_index(void)
+{
+     char dir[] = "/tmp/test-complete-XXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char sub[64], path[96];
+     snprintf(sub, sizeof(sub), "%s/fodir", dir);
+     TEST_ASSERT_EQUAL_INT(0, mkdir(sub, 0700));
+     touch_in(dir, "foo2");
+     touch_in(dir, "foo1");
+     char *old_path = strdup(getenv("PATH"));
+     setenv("PATH", dir, 1);
+
+     struct shell sh = {0};
+     complete_init(&sh);
+     char **rval = complete_word(&sh, "fo", true);
+     TEST_ASSERT_NOT_NULL(rval);
+     TEST_ASSERT_EQUAL_STRING("foo1", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("foo2", rval[1]);
+     TEST_ASSERT_NULL(rval[2]);
+     for (int i = 0; rval[i]; i++) free(rval[i]);
+     free(rval);
+
+     rval = complete_word(&sh, "push", true);
+     TEST_ASSERT_NOT_NULL(rval);
+     TEST_ASSERT_EQUAL_STRING("pushd", rval[0]);
+     TEST_ASSERT_NULL(rval[1]);
+     free(rval[0]);
+     free(rval);
+     TEST_ASSERT_NULL(complete_word(&sh, "nope", true));
+
+     //the index follows the directory without being built again
+     touch_in(dir, "foo3");
+     snprintf(path, sizeof(path), "%s/foo1", dir);
+     unlink(path);
+     rval = complete_word(&sh, "foo", true);
+     TEST_ASSERT_NOT_NULL(rval);
+     TEST_ASSERT_EQUAL_STRING("foo2", rval[0]);
+     TEST_ASSERT_EQUAL_STRING("foo3", rval[1]);
+     TEST_ASSERT_NULL(rval[2]);
+     for (int i = 0; rval[i]; i++) free(rval[i]);
+     free(rval);
+
+     //anywhere else it is file names with what was typed in front
+     snprintf(path, sizeof(path), "%s/fo", dir);
+     rval = complete_word(&sh, path, false);
+     TEST_ASSERT_NOT_NULL(rval);
+     TEST_ASSERT_EQUAL_STRING(sub, rval[0]);
+     snprintf(path, sizeof(path), "%s/foo3", dir);
+     TEST_ASSERT_EQUAL_STRING(path, rval[2]);
+     TEST_ASSERT_NULL(rval[3]);
+     for (int i = 0; rval[i]; i++) free(rval[i]);
+     free(rval);
+
+     complete_destroy(&sh);
+     setenv("PATH", old_path, 1);
+     free(old_path);
+     const char *names[] = { "foo2", "foo3", NULL };
+     for (int i = 0; names[i]; i++) {
+          snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+          unlink(path);
+     }
+     rmdir(sub);
+     rmdir(dir);
+     glob_cache_clear();
+}
+
+void test_parallel_run_failures(void)
+{
+     struct shell sh = {0};
+     char **cmd = cmd_parse("parallel -j 2 test {} = a ::: a b a c a");
+     TEST_ASSERT_EQUAL_INT(2, parallel_run(&sh, cmd));
+     cmd_free(cmd);
+
+     cmd = cmd_parse("parallel -j 0 true ::: a");
+     TEST_ASSERT_EQUAL_INT(-1, parallel_run(&sh, cmd));
+     cmd_free(cmd);
+
+     cmd = cmd_parse("parallel true");
+     TEST_ASSERT_EQUAL_INT(-1, parallel_run(&sh, cmd));
+     cmd_free(cmd);
+     path_cache_destroy(&sh.path_cache);
+}
+
+static int run_script_text(struct shell *sh, const char *text)
+{
+     char path[] = "/tmp/test-lab-XXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     TEST_ASSERT_EQUAL_INT((int)strlen(text), write(fd, text, strlen(text)));
+     close(fd);
+     int status = sh_run_script(sh, path);
+     unlink(path);
+     char cache[64];
+     snprintf(cache, sizeof(cache), "/tmp/.%s.p2c", path + 5);
+     unlink(cache);
+     return status;
+}
+
+void test_sh_run_script(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     TEST_ASSERT_EQUAL_INT(1, run_script_text(&sh, "true\nfalse\n"));
+     TEST_ASSERT_EQUAL_INT(0, run_script_text(&sh, "# comment\n\n  \t\nfalse\ntrue"));
+     TEST_ASSERT_EQUAL_INT(1, run_script_text(&sh, "false | true\ntrue | false"));
+     TEST_ASSERT_EQUAL_INT(127, sh_run_script(&sh, "/thisdoesnotexist"));
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_sh_run_script_cache(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     char dir[] = "/tmp/p2shell-cacheXXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char script[64], cache[64], out[64], line[128];
+     snprintf(script, sizeof(script), "%s/s.sh", dir);
+     snprintf(cache, sizeof(cache), "%s/.s.sh.p2c", dir);
+     snprintf(out, sizeof(out), "%s/out", dir);
+
+     //the first run compiles the script next to it, the second runs the cache
+     FILE *f = fopen(script, "w");
+     fprintf(f, "# compiled\necho 'a  b' > %s\necho $HOME >> %s\ntrue |\nfalse\n", out, out);
+     fclose(f);
+     snprintf(line, sizeof(line), "a  b\n%s\n", getenv("HOME"));
+     for (int i = 0; i < 2; i++) {
+          TEST_ASSERT_EQUAL_INT(1, sh_run_script(&sh, script));
+          struct stat st;
+          TEST_ASSERT_EQUAL_INT(0, stat(cache, &st));
+          char buf[128] = {0};
+          f = fopen(out, "r");
+          TEST_ASSERT_TRUE(fread(buf, 1, sizeof(buf) - 1, f) > 0);
+          fclose(f);
+          TEST_ASSERT_EQUAL_STRING(line, buf);
+     }
+
+     //a changed script makes the cache stale and a damaged one is not trusted
+     f = fopen(script, "a");
+     fprintf(f, "true\n");
+     fclose(f);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_script(&sh, script));
+     f = fopen(cache, "r+");
+     fseek(f, 64, SEEK_SET);
+     for (int i = 0; i < 64; i++) {
+          fputc(0xff, f);
+     }
+     fclose(f);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_script(&sh, script));
+
+     //a cache others can write to is compiled again, in a shared directory none is kept
+     struct stat st;
+     TEST_ASSERT_EQUAL_INT(0, chmod(cache, 0666));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_script(&sh, script));
+     TEST_ASSERT_EQUAL_INT(0, stat(cache, &st));
+     TEST_ASSERT_EQUAL_INT(0, st.st_mode & 077);
+     unlink(cache);
+     TEST_ASSERT_EQUAL_INT(0, chmod(dir, 0777));
+     TEST_ASSERT_EQUAL_INT(0, sh_run_script(&sh, script));
+     TEST_ASSERT_EQUAL_INT(-1, access(cache, F_OK));
+     TEST_ASSERT_EQUAL_INT(0, chmod(dir, 0700));
+
+     //an empty MY_SCRIPTCACHE turns it off
+     unlink(cache);
+     setenv("MY_SCRIPTCACHE", "", 1);
+     TEST_ASSERT_EQUAL_INT(0, sh_run_script(&sh, script));
+     TEST_ASSERT_EQUAL_INT(-1, access(cache, F_OK));
+     unsetenv("MY_SCRIPTCACHE");
+
+     unlink(script);
+     unlink(out);
+     rmdir(dir);
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+//run a line in an embedded context and read back what it wrote to fd
+static int embed_run(struct p2sh *sh, const char *line, int fd, char *buf, size_t size)
+{
+     memset(buf, 0, size);
+     if (ftruncate(fd, 0) < 0 || lseek(fd, 0, SEEK_SET) < 0) {
+          return -1;
+     }
+     struct p2sh_cmd *cmd = p2sh_parse(sh, line);
+     if (!cmd) {
+          return -1;
+     }
+     struct p2sh_proc *proc = p2sh_run(sh, cmd, STDIN_FILENO, fd, STDERR_FILENO);
+     p2sh_cmd_free(cmd);
+     int status = proc ? p2sh_wait(sh, proc) : -1;
+     if (pread(fd, buf, size - 1, 0) < 0) {
+          return -1;
+     }
+     return status;
+}
+
+static void *embed_thread(void *arg)
+{
+     const char *dir = arg;
+     long failures = 0;
+     char out[64], buf[64];
+     snprintf(out, sizeof(out), "%s/out.%lx", dir, (unsigned long)pthread_self());
+     int fd = open(out, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+     struct p2sh *sh = p2sh_new();
+     if (fd < 0 || !sh || p2sh_chdir(sh, dir) < 0) {
+          return (void *)1L;
+     }
+     for (int i = 0; i < 20; i++) {
+          failures += embed_run(sh, "printf '%s\\n' *.txt | sort -r", fd, buf, sizeof(buf)) != 0;
+          failures += strcmp(buf, "b.txt\na.txt\n") != 0;
+     }
+     p2sh_free(sh);
+     close(fd);
+     unlink(out);
+     return (void *)failures;
+}
+
+void test_embed_threads(void)
+{
+     char dir[] = "/tmp/p2shell-embedXXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     char path[64], buf[64];
+     snprintf(path, sizeof(path), "%s/a.txt", dir);
+     close(open(path, O_WRONLY | O_CREAT, 0644));
+     snprintf(path, sizeof(path), "%s/b.txt", dir);
+     close(open(path, O_WRONLY | O_CREAT, 0644));
+
+     //every thread has its own context in the same directory, none of them moves the process
+     char cwd[PATH_MAX];
+     TEST_ASSERT_NOT_NULL(getcwd(cwd, sizeof(cwd)));
+     pthread_t threads[4];
+     for (int i = 0; i < 4; i++) {
+          TEST_ASSERT_EQUAL_INT(0, pthread_create(&threads[i], NULL, embed_thread, dir));
+     }
+     for (int i = 0; i < 4; i++) {
+          void *failures;
+          pthread_join(threads[i], &failures);
+          TEST_ASSERT_EQUAL_INT(0, (long)failures);
+     }
+     char now[PATH_MAX];
+     TEST_ASSERT_EQUAL_STRING(cwd, getcwd(now, sizeof(now)));
+
+     //redirections are opened in the context's directory, there are no built ins and no $(...)
+     struct p2sh *sh = p2sh_new();
+     TEST_ASSERT_EQUAL_INT(0, p2sh_chdir(sh, dir));
+     snprintf(path, sizeof(path), "%s/out", dir);
+     int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+     TEST_ASSERT_EQUAL_INT(0, embed_run(sh, "echo hi > c.log | true", fd, buf, sizeof(buf)));
+     TEST_ASSERT_EQUAL_INT(0, embed_run(sh, "cat c.log", fd, buf, sizeof(buf)));
+     TEST_ASSERT_EQUAL_STRING("hi\n", buf);
+     TEST_ASSERT_EQUAL_INT(1, embed_run(sh, "cat < missing", fd, buf, sizeof(buf)));
+     TEST_ASSERT_EQUAL_INT(127, embed_run(sh, "true | cd /", fd, buf, sizeof(buf)));
+     TEST_ASSERT_NULL(p2sh_parse(sh, "echo $(pwd)"));
+     TEST_ASSERT_EQUAL_INT(-1, p2sh_chdir(sh, "missing"));
+     p2sh_free(sh);
+     close(fd);
+
+     snprintf(path, sizeof(path), "%s/a.txt", dir);
+     unlink(path);
+     snprintf(path, sizeof(path), "%s/b.txt", dir);
+     unlink(path);
+     snprintf(path, sizeof(path), "%s/c.log", dir);
+     unlink(path);
+     snprintf(path, sizeof(path), "%s/out", dir);
+     unlink(path);
+     rmdir(dir);
+}
+
+void test_limit_rlimits(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     sh.memo.fd = -1;
+     setenv("MY_CGROUP", "", 1);
+
+     //without a cgroup -m falls back to RLIMIT_AS, -t is always RLIMIT_CPU
+     struct pipeline *pl = sh_parse(&sh, "echo $(limit -m 64M -t 5 sh -c 'ulimit -v; ulimit -t')");
+     TEST_ASSERT_NOT_NULL(pl);
+     TEST_ASSERT_EQUAL_STRING("65536", pl->stages[0].argv[1]);
+     TEST_ASSERT_EQUAL_STRING("5", pl->stages[0].argv[2]);
+     pipeline_free(pl);
+
+     char line[32];
+     strcpy(line, "limit -m 10Q true");
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, line));
+     strcpy(line, "limit -t 5");
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, line));
+
+     //a cgroup that can't take the limits fails the command and leaves nothing behind
+     char dir[] = "/tmp/p2shell-cgXXXXXX";
+     TEST_ASSERT_NOT_NULL(mkdtemp(dir));
+     setenv("MY_CGROUP", dir, 1);
+     strcpy(line, "limit -p 10 true");
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+     TEST_ASSERT_EQUAL_INT(0, rmdir(dir));
+     unsetenv("MY_CGROUP");
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_sh_run_line_status(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     char line[32];
+     strcpy(line, "  false  ");
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+     strcpy(line, "   ");
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+     strcpy(line, "true |");
+     TEST_ASSERT_EQUAL_INT(2, sh_run_line(&sh, line));
+     strcpy(line, "thisdoesnotexist");
+     TEST_ASSERT_EQUAL_INT(127, sh_run_line(&sh, line));
+     TEST_ASSERT_EQUAL_INT(127, sh.last_status);
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_builtin_find(void)
+{
+     const char *names[] = { "exit", "cd", "history", "parallel", "jobs", "fg", "bg", "hash" };
+     for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+          const struct builtin *b = builtin_find(names[i]);
+          TEST_ASSERT_NOT_NULL(b);
+          TEST_ASSERT_EQUAL_STRING(names[i], b->name);
+     }
+     TEST_ASSERT_TRUE(builtin_find("cd")->flags & BUILTIN_PARENT);
+     TEST_ASSERT_TRUE(builtin_find("parallel")->flags & BUILTIN_FORKS);
+     TEST_ASSERT_NULL(builtin_find("ls"));
+     TEST_ASSERT_NULL(builtin_find(""));
+     TEST_ASSERT_NULL(builtin_find("exi"));
+     TEST_ASSERT_NULL(builtin_find("exits"));
+     TEST_ASSERT_NULL(builtin_find("historyhistory"));
+}
+
+void test_do_builtin_status(void)
+{
+     struct shell sh = {0};
+     jobs_init(&sh);
+     char line[32];
+     strcpy(line, "cd /thisdoesnotexist");
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+     strcpy(line, "hash -r");
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     strcpy(line, "fg %9");
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+void test_time_prefix_and_stats(void)
+{
+     struct pipeline *pl = pipeline_parse("time ls -l | wc");
+     TEST_ASSERT_TRUE(pl->timed);
+     TEST_ASSERT_EQUAL_STRING("ls", pl->stages[0].argv[0]);
+     TEST_ASSERT_EQUAL_STRING("wc", pl->stages[1].argv[0]);
+     pipeline_free(pl);
+     pl = pipeline_parse("time");
+     TEST_ASSERT_FALSE(pl->timed);
+     TEST_ASSERT_EQUAL_STRING("time", pl->stages[0].argv[0]);
+     pipeline_free(pl);
+
+     struct shell sh = {0};
+     jobs_init(&sh);
+     int fds[2];
+     TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+     sh.stats = true;
+     sh.stats_fd = fds[1];
+     char line[32];
+     strcpy(line, "false");
+     TEST_ASSERT_EQUAL_INT(1, sh_run_line(&sh, line));
+     strcpy(line, "hash -r");
+     TEST_ASSERT_EQUAL_INT(0, sh_run_line(&sh, line));
+     close(fds[1]);
+
+     char buf[1024] = {0};
+     TEST_ASSERT_TRUE(read(fds[0], buf, sizeof(buf) - 1) > 0);
+     close(fds[0]);
+     TEST_ASSERT_EQUAL_INT(0, strncmp(buf, "stats status=1 ", 15));
+     TEST_ASSERT_NOT_NULL(strstr(buf, " cmd=false\nstats status=0 "));
+     TEST_ASSERT_NOT_NULL(strstr(buf, " cmd=hash -r\n"));
+     jobs_destroy(&sh);
+     path_cache_destroy(&sh.path_cache);
+}
+
+#ifdef SH_TRACE
+void test_trace_dump(void)
+{
+     char path[] = "/tmp/test-trace-XXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+
+     trace_span("test span", 1000, 3500);
+     TEST_ASSERT_EQUAL_INT(0, trace_dump(path));
+     //earlier tests traced too so read the whole file
+     FILE *in = fopen(path, "r");
+     TEST_ASSERT_NOT_NULL(in);
+     fseek(in, 0, SEEK_END);
+     long size = ftell(in);
+     rewind(in);
+     char *buf = calloc(size + 1, 1);
+     size_t n = fread(buf, 1, size, in);
+     fclose(in);
+     unlink(path);
+     TEST_ASSERT_EQUAL_UINT(size, n);
+     TEST_ASSERT_EQUAL_INT(0, strncmp(buf, "{\"displayTimeUnit\"", 18));
+     TEST_ASSERT_NOT_NULL(strstr(buf, "\"name\":\"test span\",\"cat\":\"shell\",\"ph\":\"X\",\"ts\":1.000,\"dur\":2.500"));
+     free(buf);
+}
+#endif
+
+void test_hist_caps(void)
+{
+     struct history h;
+     hist_init(&h, 100, 12, NULL, false);
+     TEST_ASSERT_EQUAL_INT(0, hist_add(&h, "aaaa"));
+     TEST_ASSERT_EQUAL_INT(0, hist_add(&h, "bbbb"));
+     TEST_ASSERT_EQUAL_INT(0, hist_add(&h, "cccc"));
+     //15 bytes including NULs is over the cap so the oldest goes
+     TEST_ASSERT_EQUAL_UINT(2, h.count);
+     TEST_ASSERT_EQUAL_STRING("bbbb", hist_get(&h, 0));
+     TEST_ASSERT_EQUAL_STRING("cccc", hist_get(&h, 1));
+     TEST_ASSERT_NULL(hist_get(&h, 2));
+     hist_destroy(&h);
+
+     hist_init(&h, 3, 1 << 20, NULL, false);
+     char line[16];
+     for (int i = 0; i < 200; i++) {
+          snprintf(line, sizeof(line), "cmd %d", i);
+          hist_add(&h, line);
+     }
+     TEST_ASSERT_EQUAL_UINT(3, h.count);
+     TEST_ASSERT_EQUAL_UINT(197, h.base);
+     TEST_ASSERT_EQUAL_STRING("cmd 197", hist_get(&h, 0));
+     TEST_ASSERT_EQUAL_STRING("cmd 199", hist_get(&h, 2));
+     hist_destroy(&h);
+}
+
+void test_hist_file_tail(void)
+{
+     char path[] = "/tmp/test-hist-XXXXXX";
+     int fd = mkstemp(path);
+     TEST_ASSERT_TRUE(fd >= 0);
+     close(fd);
+
+     struct history h;
+     hist_init(&h, 100, 1 << 20, path, false);
+     hist_add(&h, "one");
+     hist_add(&h, "two");
+     hist_add(&h, "three");
+     hist_destroy(&h);
+
+     //a smaller cap only loads the newest entries from the file
+     hist_init(&h, 2, 1 << 20, path, false);
+     TEST_ASSERT_EQUAL_STRING("two", hist_get(&h, 0));
+     TEST_ASSERT_EQUAL_STRING("three", hist_get(&h, 1));
+     hist_add(&h, "four");
+     hist_destroy(&h);
+
+     hist_init(&h, 100, 1 << 20, path, false);
+     TEST_ASSERT_EQUAL_STRING("one", hist_get(&h, 0));
+     TEST_ASSERT_EQUAL_STRING("four", hist_get(&h, 3));
+     TEST_ASSERT_EQUAL_UINT(4, h.count);
+     hist_destroy(&h);
+
+     //appends past twice the byte cap rewrite the file from memory
+     hist_init(&h, 100, 32, path, false);
+     for (int i = 0; i < 50; i++) {
+          hist_add(&h, "echo compact");
+     }
+     TEST_ASSERT_TRUE(h.file_bytes <= 64);
+     hist_destroy(&h);
+     struct stat st;
+     TEST_ASSERT_EQUAL_INT(0, stat(path, &st));
+     TEST_ASSERT_TRUE(st.st_size <= 64);
+
+     //the rewrite keeps what another shell appended, stays private and
+     //the other shell follows it to the new file
+     mode_t mask = umask(022);
+     TEST_ASSERT_EQUAL_INT(0, truncate(path, 0));
+     struct history other;
+     hist_init(&h, 100, 32, path, false);
+     hist_init(&other, 100, 1 << 20, path, false);
+     for (int i = 0; i < 4; i++) {
+          hist_add(&h, "echo compact");
+     }
+     hist_add(&other, "echo other");
+     hist_add(&h, "echo compact");
+     hist_add(&other, "echo last");
+     hist_destroy(&h);
+     hist_destroy(&other);
+     umask(mask);
+     TEST_ASSERT_EQUAL_INT(0, stat(path, &st));
+     TEST_ASSERT_EQUAL_INT(0, st.st_mode & 077);
+     char buf[128] = {0};
+     fd = open(path, O_RDONLY);
+     TEST_ASSERT_TRUE(read(fd, buf, sizeof(buf) - 1) > 0);
+     close(fd);
+     TEST_ASSERT_EQUAL_STRING("echo other\necho compact\necho last\n", buf);
+     unlink(path);
+}
+
+void test_parse_adversarial(void)
+{
+     //a word in a MiB of blanks on either side
+     size_t pad = 1 << 20;
+     char *line = malloc(2 * pad + 5);
+     TEST_ASSERT_NOT_NULL(line);
+     memset(line, ' ', 2 * pad + 4);
+     memcpy(line + pad, "echo", 4);
+     line[2 * pad + 4] = '\0';
+     TEST_ASSERT_EQUAL_STRING("echo", trim_white(line));
+     char **argv = cmd_parse(line);
+     TEST_ASSERT_TRUE(argv);
+     TEST_ASSERT_EQUAL_STRING("echo", argv[0]);
+     TEST_ASSERT_NULL(argv[1]);
+     cmd_free(argv);
+     free(line);
+
+     //one word short of the ARG_MAX limit parses, at it the line is refused
+     long arg_max = sysconf(_SC_ARG_MAX);
+     line = malloc(2 * arg_max + 1);
+     TEST_ASSERT_NOT_NULL(line);
+     for (long i = 0; i < arg_max - 2; i++) {
+          line[2 * i] = 'a';
+          line[2 * i + 1] = ' ';
+     }
+     line[2 * (arg_max - 2)] = '\0';
+     argv = cmd_parse(line);
+     TEST_ASSERT_TRUE(argv);
+     TEST_ASSERT_EQUAL_STRING("a", argv[arg_max - 3]);
+     TEST_ASSERT_NULL(argv[arg_max - 2]);
+     cmd_free(argv);
+     strcpy(line + 2 * (arg_max - 2), "a");
+     TEST_ASSERT_NULL(cmd_parse(line));
+     free(line);
+}
+
 int main(void) {
   UNITY_BEGIN();
   RUN_TEST(test_cmd_parse);
@@ -251,6 +1694,46 @@ int main(void) {
   RUN_TEST(test_trim_white_newlines_tabs);
   RUN_TEST(test_get_prompt_undefined);
   RUN_TEST(test_ch_dir_non_existent);
+  RUN_TEST(test_cmd_parse_many_args);
+  RUN_TEST(test_cmd_parse_tabs);
+  RUN_TEST(test_cmd_parse_quotes_and_vars);
+  RUN_TEST(test_sh_spawn_backends);
+  RUN_TEST(test_spawn_backend_parse);
+  RUN_TEST(test_path_lookup_caches);
+  RUN_TEST(test_path_lookup_path_change);
+  RUN_TEST(test_path_forget_keeps_others);
+  RUN_TEST(test_pipeline_parse_stages);
+  RUN_TEST(test_pipeline_parse_errors);
+  RUN_TEST(test_pipeline_run_status);
+  RUN_TEST(test_pipeline_builtin_stages);
+  RUN_TEST(test_sh_parse_command_substitution);
+  RUN_TEST(test_memo_replay);
+  RUN_TEST(test_peer_run_prefixes);
+  RUN_TEST(test_pipeline_parse_redirects);
+  RUN_TEST(test_redirect_run);
+  RUN_TEST(test_pipeline_parse_background);
+  RUN_TEST(test_job_background_then_foreground);
+  RUN_TEST(test_event_loop_jobs);
+  RUN_TEST(test_job_output_ring);
+  RUN_TEST(test_prompt_template);
+  RUN_TEST(test_dirs_cd_and_stack);
+  RUN_TEST(test_glob_expand_words);
+  RUN_TEST(test_complete_word_index);
+  RUN_TEST(test_parallel_run_failures);
+  RUN_TEST(test_sh_run_script);
+  RUN_TEST(test_sh_run_script_cache);
+  RUN_TEST(test_embed_threads);
+  RUN_TEST(test_limit_rlimits);
+  RUN_TEST(test_sh_run_line_status);
+  RUN_TEST(test_builtin_find);
+  RUN_TEST(test_do_builtin_status);
+  RUN_TEST(test_time_prefix_and_stats);
+#ifdef SH_TRACE
+  RUN_TEST(test_trace_dump);
+#endif
+  RUN_TEST(test_hist_caps);
+  RUN_TEST(test_hist_file_tail);
+  RUN_TEST(test_parse_adversarial);
   
 
   return UNITY_END();
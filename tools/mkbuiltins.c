@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/lab.h"
+
+/*
+ * Generates the perfect hash header for the built in command table. It
+ * reads the same src/builtins.def the shell is built from, then searches
+ * for the smallest power of two table and a seed for builtin_hash that put
+ * every name in its own slot.
+ *
+ * usage: mkbuiltins > builtins-hash.h
+ */
+
+static const char *names[] = {
+#define BUILTIN(name, fn, flags) #name,
+#include "../src/builtins.def"
+#undef BUILTIN
+};
+
+#define NNAMES (sizeof(names) / sizeof(names[0]))
+#define MAX_SEEDS 1000000u
+
+// true if seed puts every name in its own slot of a table with size slots
+static bool try_seed(unsigned seed, size_t size, int *slots) {
+    for (size_t i = 0; i < size; i++) {
+        slots[i] = -1;
+    }
+    for (size_t i = 0; i < NNAMES; i++) {
+        size_t s = builtin_hash(names[i], strlen(names[i]), seed) & (size - 1);
+        if (slots[s] >= 0) {
+            return false;
+        }
+        slots[s] = (int)i;
+    }
+    return true;
+}
+
+int main(void) {
+    size_t maxlen = 0;
+    for (size_t i = 0; i < NNAMES; i++) {
+        size_t len = strlen(names[i]);
+        maxlen = len > maxlen ? len : maxlen;
+    }
+
+    // at least half the slots stay empty so most misses stop at the slot lookup
+    size_t size = 1;
+    while (size < 2 * NNAMES) {
+        size *= 2;
+    }
+
+    // a bigger table makes a seed easier to find, stop well before it gets silly
+    for (; size <= 64 * NNAMES; size *= 2) {
+        int *slots = malloc(size * sizeof(int));
+        if (!slots) {
+            return 1;
+        }
+        for (unsigned seed = 0; seed < MAX_SEEDS; seed++) {
+            if (!try_seed(seed, size, slots)) {
+                continue;
+            }
+
+            printf("/* generated by tools/mkbuiltins.c from src/builtins.def, do not edit */\n");
+            printf("#define BUILTIN_SEED %uu\n", seed);
+            printf("#define BUILTIN_SLOTS %zu\n", size);
+            printf("#define BUILTIN_MAXLEN %zu\n", maxlen);
+            printf("// index into the table plus one, 0 is an empty slot\n");
+            printf("static const unsigned char builtin_slots[BUILTIN_SLOTS] = {");
+            for (size_t s = 0; s < size; s++) {
+                printf("%s%d", s == 0 ? "\n    " : s % 16 ? ", " : ",\n    ", slots[s] + 1);
+            }
+            printf("\n};\n");
+            free(slots);
+            return 0;
+        }
+        free(slots);
+    }
+
+    fprintf(stderr, "mkbuiltins: no perfect hash found, is a name listed twice?\n");
+    return 1;
+}